@@ -34,6 +34,9 @@
 #include "mech.h"
 #include "sdk-aes.h"
 #include "c_string.h"
+#include "c_stdlib.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
 
 /* ----- AES ---------------------------------------------------------- */
 
@@ -129,3 +132,201 @@ const crypto_mech_t *crypto_encryption_mech (const char *name)
   }
   return 0;
 }
+
+
+/* ----- streaming ciphers -------------------------------------------- */
+
+enum { MODE_CBC, MODE_CTR, MODE_GCM };
+
+static const struct
+{
+  const char *name;
+  uint8_t mode;
+} cipher_mechs[] =
+{
+  { "AES-CBC",  MODE_CBC },
+  { "AES-CTR",  MODE_CTR },
+  { "AES-GCM",  MODE_GCM }
+};
+
+struct crypto_cipher
+{
+  uint8_t mode;
+  bool decrypt;
+  bool done;
+  uint8_t held;                             // bytes pending in block[]
+  size_t nc_off;                            // CTR keystream offset
+  uint8_t iv[CRYPTO_CIPHER_BLOCKSIZE];      // CBC chaining value, CTR counter
+  uint8_t stream[CRYPTO_CIPHER_BLOCKSIZE];  // CTR keystream block
+  uint8_t block[CRYPTO_CIPHER_BLOCKSIZE];   // held back partial block
+  union
+  {
+    mbedtls_aes_context aes;
+    mbedtls_gcm_context gcm;
+  } u;
+};
+
+
+crypto_cipher_t *crypto_cipher_create (const char *name, const char *key, size_t keylen, const char *iv, size_t ivlen, const char *aad, size_t aadlen, bool decrypt)
+{
+  int mode = -1;
+  size_t i;
+  for (i = 0; i < sizeof (cipher_mechs) / sizeof (cipher_mechs[0]); ++i)
+    if (strcasecmp (name, cipher_mechs[i].name) == 0)
+      mode = cipher_mechs[i].mode;
+
+  if (mode < 0 || (keylen != 16 && keylen != 24 && keylen != 32))
+    return 0;
+  if (mode == MODE_GCM && ivlen == 0)
+    return 0;
+
+  crypto_cipher_t *c = (crypto_cipher_t *)c_zalloc (sizeof (crypto_cipher_t));
+  if (!c)
+    return 0;
+  c->mode = mode;
+  c->decrypt = decrypt;
+
+  int err;
+  if (mode == MODE_GCM)
+  {
+    mbedtls_gcm_init (&c->u.gcm);
+    err = mbedtls_gcm_setkey (&c->u.gcm, MBEDTLS_CIPHER_ID_AES, (const unsigned char *)key, keylen * 8) ||
+          mbedtls_gcm_starts (&c->u.gcm, decrypt ? MBEDTLS_GCM_DECRYPT : MBEDTLS_GCM_ENCRYPT,
+                              (const unsigned char *)iv, ivlen, (const unsigned char *)aad, aadlen);
+  }
+  else
+  {
+    mbedtls_aes_init (&c->u.aes);
+    // CTR always runs the block cipher forwards
+    if (mode == MODE_CBC && decrypt)
+      err = mbedtls_aes_setkey_dec (&c->u.aes, (const unsigned char *)key, keylen * 8);
+    else
+      err = mbedtls_aes_setkey_enc (&c->u.aes, (const unsigned char *)key, keylen * 8);
+    c_memcpy (c->iv, iv, ivlen < CRYPTO_CIPHER_BLOCKSIZE ? ivlen : CRYPTO_CIPHER_BLOCKSIZE);
+  }
+
+  if (err)
+  {
+    crypto_cipher_destroy (c);
+    return 0;
+  }
+  return c;
+}
+
+
+static int cipher_blocks (crypto_cipher_t *c, const uint8_t *in, size_t len, uint8_t *out)
+{
+  if (c->mode == MODE_GCM)
+    return mbedtls_gcm_update (&c->u.gcm, len, in, out);
+  else
+    return mbedtls_aes_crypt_cbc (&c->u.aes, c->decrypt ? MBEDTLS_AES_DECRYPT : MBEDTLS_AES_ENCRYPT,
+                                  len, c->iv, in, out);
+}
+
+
+int crypto_cipher_update (crypto_cipher_t *c, const uint8_t *in, size_t len, uint8_t *out)
+{
+  if (c->done)
+    return -1;
+
+  if (c->mode == MODE_CTR)
+    return mbedtls_aes_crypt_ctr (&c->u.aes, len, &c->nc_off, c->iv, c->stream, in, out) ? -1 : (int)len;
+
+  int n = 0;
+  if (c->held)
+  {
+    size_t take = CRYPTO_CIPHER_BLOCKSIZE - c->held;
+    if (take > len)
+      take = len;
+    c_memcpy (c->block + c->held, in, take);
+    c->held += take;
+    in += take;
+    len -= take;
+    if (c->held < CRYPTO_CIPHER_BLOCKSIZE)
+      return 0;
+    if (cipher_blocks (c, c->block, CRYPTO_CIPHER_BLOCKSIZE, out) != 0)
+      return -1;
+    c->held = 0;
+    out += CRYPTO_CIPHER_BLOCKSIZE;
+    n += CRYPTO_CIPHER_BLOCKSIZE;
+  }
+
+  size_t full = len & ~(CRYPTO_CIPHER_BLOCKSIZE - 1);
+  if (full)
+  {
+    if (cipher_blocks (c, in, full, out) != 0)
+      return -1;
+    in += full;
+    len -= full;
+    n += full;
+  }
+
+  c_memcpy (c->block, in, len);
+  c->held = len;
+  return n;
+}
+
+
+int crypto_cipher_finalize (crypto_cipher_t *c, uint8_t *out, uint8_t *tag)
+{
+  if (c->done)
+    return -1;
+  c->done = true;
+
+  int n = c->held;
+  switch (c->mode)
+  {
+    case MODE_CBC:
+      if (n == 0)
+        return 0;
+      if (c->decrypt)
+        return -1; // truncated cipher text
+      c_memset (c->block + n, 0, CRYPTO_CIPHER_BLOCKSIZE - n);
+      return cipher_blocks (c, c->block, CRYPTO_CIPHER_BLOCKSIZE, out) ? -1 : CRYPTO_CIPHER_BLOCKSIZE;
+
+    case MODE_GCM:
+    {
+      uint8_t check[CRYPTO_CIPHER_TAGSIZE];
+      if (n && mbedtls_gcm_update (&c->u.gcm, n, c->block, out) != 0)
+        return -1;
+      if (mbedtls_gcm_finish (&c->u.gcm, c->decrypt ? check : tag, CRYPTO_CIPHER_TAGSIZE) != 0)
+        return -1;
+      if (c->decrypt)
+      {
+        // constant time compare
+        uint8_t diff = 0;
+        int i;
+        for (i = 0; i < CRYPTO_CIPHER_TAGSIZE; ++i)
+          diff |= check[i] ^ tag[i];
+        if (diff)
+          return -1;
+      }
+      return n;
+    }
+
+    default:
+      return 0;
+  }
+}
+
+
+bool crypto_cipher_has_tag (const crypto_cipher_t *c)
+{
+  return c->mode == MODE_GCM;
+}
+
+
+bool crypto_cipher_is_decrypt (const crypto_cipher_t *c)
+{
+  return c->decrypt;
+}
+
+
+void crypto_cipher_destroy (crypto_cipher_t *c)
+{
+  if (c->mode == MODE_GCM)
+    mbedtls_gcm_free (&c->u.gcm);
+  else
+    mbedtls_aes_free (&c->u.aes);
+  c_free (c);
+}
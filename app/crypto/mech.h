@@ -27,4 +27,49 @@ typedef struct
 
 const crypto_mech_t *crypto_encryption_mech (const char *name);
 
+
+/* ----- streaming ciphers -------------------------------------------- */
+
+#define CRYPTO_CIPHER_BLOCKSIZE 16
+#define CRYPTO_CIPHER_TAGSIZE   16
+
+typedef struct crypto_cipher crypto_cipher_t;
+
+/**
+ * Creates a streaming cipher context for one of "AES-CBC", "AES-CTR" or
+ * "AES-GCM". The key may be 16, 24 or 32 bytes. Returns NULL on unknown
+ * mech, bad key or out of memory.
+ */
+crypto_cipher_t *crypto_cipher_create (const char *name, const char *key, size_t keylen, const char *iv, size_t ivlen, const char *aad, size_t aadlen, bool decrypt);
+
+/**
+ * Processes the next chunk of data. The output buffer must have room for
+ * len + CRYPTO_CIPHER_BLOCKSIZE - 1 bytes, as block modes hold back any
+ * partial block until more data or the finalize call arrives.
+ * Returns the number of bytes written to out, or -1 on error.
+ */
+int crypto_cipher_update (crypto_cipher_t *c, const uint8_t *in, size_t len, uint8_t *out);
+
+/**
+ * Flushes the held back data (zero padded in CBC mode, matching
+ * crypto_encryption_mech) into out, which must hold CRYPTO_CIPHER_BLOCKSIZE
+ * bytes. In GCM mode the authentication tag is written to (encrypt) or
+ * checked against (decrypt) tag, which is ignored for the other modes.
+ * Returns the number of bytes written to out, or -1 on error or failed
+ * authentication.
+ */
+int crypto_cipher_finalize (crypto_cipher_t *c, uint8_t *out, uint8_t *tag);
+
+/**
+ * Returns true if the cipher produces/consumes an authentication tag.
+ */
+bool crypto_cipher_has_tag (const crypto_cipher_t *c);
+
+/**
+ * Returns true if the cipher was created for decryption.
+ */
+bool crypto_cipher_is_decrypt (const crypto_cipher_t *c);
+
+void crypto_cipher_destroy (crypto_cipher_t *c);
+
 #endif
@@ -7,68 +7,166 @@
  *
  * Modification history:
  *     2014/3/12, v1.0 create this file.
+ *     Bit timing derived from the CPU cycle counter for 100 kHz - 1 MHz
+ *     operation, clock stretching and bus statistics.
 *******************************************************************************/
 #include "ets_sys.h"
 #include "osapi.h"
 #include "gpio.h"
+#include "user_interface.h"
 
 #include "driver/i2c_master.h"
 
 #include "pin_map.h"
-
-LOCAL uint8 m_nLastSDA;
-LOCAL uint8 m_nLastSCL;
+#include "rom.h"
 
 LOCAL uint8 pinSDA = 2;
 LOCAL uint8 pinSCL = 15;
 
+LOCAL uint32 maskSDA = 1 << 2;
+LOCAL uint32 maskSCL = 1 << 15;
+
+LOCAL uint32 i2c_speed = I2C_MASTER_SPEED_DEFAULT;
+LOCAL uint32 i2c_half_cycles;   // CPU cycles per half SCL period
+LOCAL uint32 i2c_stretch_max;   // CPU cycles before clock stretching times out
+LOCAL uint32 i2c_tick;          // deadline of the current half period
+LOCAL uint8  i2c_cpu_shift;     // normalizes cycle counts to 80 MHz
+
+LOCAL i2c_master_stats_t i2c_stats;
+
+#define SDA_HIGH() GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, maskSDA)
+#define SDA_LOW()  GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, maskSDA)
+#define SCL_HIGH() GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, maskSCL)
+#define SCL_LOW()  GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, maskSCL)
+#define SDA_READ() ((GPIO_REG_READ(GPIO_IN_ADDRESS) & maskSDA) != 0)
+#define SCL_READ() ((GPIO_REG_READ(GPIO_IN_ADDRESS) & maskSCL) != 0)
+
 /******************************************************************************
- * FunctionName : i2c_master_setDC
+ * FunctionName : i2c_master_half
  * Description  : Internal used function -
- *                    set i2c SDA and SCL bit value for half clk cycle
- * Parameters   : uint8 SDA
- *                uint8 SCL
+ *                    wait until the end of the current half clk cycle
+ *                    the deadline advances by a fixed amount of cycles so that
+ *                    code overhead does not add up over the transfer
+ * Parameters   : NONE
  * Returns      : NONE
 *******************************************************************************/
-LOCAL void ICACHE_FLASH_ATTR
-i2c_master_setDC(uint8 SDA, uint8 SCL)
+static inline void ICACHE_RAM_ATTR
+i2c_master_half(void)
 {
-    uint8 sclLevel;
-
-    SDA	&= 0x01;
-    SCL	&= 0x01;
-    m_nLastSDA = SDA;
-    m_nLastSCL = SCL;
-
-    if ((0 == SDA) && (0 == SCL)) {
-        I2C_MASTER_SDA_LOW_SCL_LOW();
-    } else if ((0 == SDA) && (1 == SCL)) {
-        I2C_MASTER_SDA_LOW_SCL_HIGH();
-    } else if ((1 == SDA) && (0 == SCL)) {
-        I2C_MASTER_SDA_HIGH_SCL_LOW();
-    } else {
-        I2C_MASTER_SDA_HIGH_SCL_HIGH();
-    }
-    if(1 == SCL) {
-        do {
-            sclLevel = GPIO_INPUT_GET(GPIO_ID_PIN(I2C_MASTER_SCL_GPIO));
-        } while(sclLevel == 0);
+    i2c_tick += i2c_half_cycles;
+    while ((sint32)(xthal_get_ccount() - i2c_tick) < 0);
+}
+
+/******************************************************************************
+ * FunctionName : i2c_master_scl_release
+ * Description  : Internal used function -
+ *                    release SCL and wait for a stretching slave
+ * Parameters   : NONE
+ * Returns      : NONE
+*******************************************************************************/
+static inline void ICACHE_RAM_ATTR
+i2c_master_scl_release(void)
+{
+    SCL_HIGH();
+    if (!SCL_READ()) {
+        uint32 start = xthal_get_ccount();
+        uint32 now = start;
+
+        while (!SCL_READ()) {
+            now = xthal_get_ccount();
+            if (now - start > i2c_stretch_max) {
+                i2c_stats.timeouts++;
+                break;
+            }
+        }
+        i2c_stats.stretch_cycles += (now - start) >> i2c_cpu_shift;
+        // the high period starts when the slave released the line
+        i2c_tick = now;
     }
 }
 
 /******************************************************************************
- * FunctionName : i2c_master_getDC
+ * FunctionName : i2c_master_write_bit
+ * Description  : Internal used function -
+ *                    clock out one bit, SCL is low on entry and exit
+ * Parameters   : uint8 bit
+ * Returns      : NONE
+*******************************************************************************/
+LOCAL void ICACHE_RAM_ATTR
+i2c_master_write_bit(uint8 bit)
+{
+    if (bit)
+        SDA_HIGH();
+    else
+        SDA_LOW();
+    i2c_master_half();   // sda bit, scl 0
+    i2c_master_scl_release();
+    i2c_master_half();   // sda bit, scl 1
+    SCL_LOW();
+}
+
+/******************************************************************************
+ * FunctionName : i2c_master_read_bit
  * Description  : Internal used function -
- *                    get i2c SDA bit value
+ *                    clock in one bit, SCL is low on entry and exit
  * Parameters   : NONE
  * Returns      : uint8 - SDA bit value
 *******************************************************************************/
-LOCAL uint8 ICACHE_FLASH_ATTR
-i2c_master_getDC(void)
+LOCAL uint8 ICACHE_RAM_ATTR
+i2c_master_read_bit(void)
 {
-    uint8 sda_out;
-    sda_out = GPIO_INPUT_GET(GPIO_ID_PIN(I2C_MASTER_SDA_GPIO));
-    return sda_out;
+    uint8 bit;
+
+    SDA_HIGH();
+    i2c_master_half();   // sda released, scl 0
+    i2c_master_scl_release();
+    i2c_master_half();   // sda released, scl 1
+    bit = SDA_READ();
+    SCL_LOW();
+    return bit;
+}
+
+/******************************************************************************
+ * FunctionName : i2c_master_set_speed
+ * Description  : set the SCL frequency, the bit timing is recalculated for
+ *                the current CPU clock with every start condition
+ * Parameters   : uint32 speed - SCL frequency in Hz
+ * Returns      : uint32 - selected SCL frequency
+*******************************************************************************/
+uint32 ICACHE_FLASH_ATTR
+i2c_master_set_speed(uint32 speed)
+{
+    if (speed < I2C_MASTER_SPEED_MIN)
+        speed = I2C_MASTER_SPEED_MIN;
+    if (speed > I2C_MASTER_SPEED_MAX)
+        speed = I2C_MASTER_SPEED_MAX;
+    i2c_speed = speed;
+    return speed;
+}
+
+/******************************************************************************
+ * FunctionName : i2c_master_get_stats
+ * Description  : copy the bus statistics
+ * Parameters   : i2c_master_stats_t *stats - destination
+ *                bool reset - clear the statistics afterwards
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+i2c_master_get_stats(i2c_master_stats_t *stats, bool reset)
+{
+    os_memcpy(stats, &i2c_stats, sizeof(i2c_stats));
+    if (reset)
+        os_memset(&i2c_stats, 0, sizeof(i2c_stats));
+}
+
+LOCAL void ICACHE_FLASH_ATTR
+i2c_master_update_timing(void)
+{
+    uint32 cpu_hz = system_get_cpu_freq() * 1000000;
+
+    i2c_half_cycles = cpu_hz / (2 * i2c_speed);
+    i2c_stretch_max = I2C_MASTER_STRETCH_TIMEOUT_US * system_get_cpu_freq();
+    i2c_cpu_shift = system_get_cpu_freq() > 80 ? 1 : 0;
 }
 
 /******************************************************************************
@@ -82,21 +180,19 @@ i2c_master_init(void)
 {
     uint8 i;
 
-    i2c_master_setDC(1, 0);
-    i2c_master_wait(5);
+    i2c_master_update_timing();
+    i2c_tick = xthal_get_ccount();
 
     // when SCL = 0, toggle SDA to clear up
-    i2c_master_setDC(0, 0) ;
-    i2c_master_wait(5);
-    i2c_master_setDC(1, 0) ;
-    i2c_master_wait(5);
-
-    // set data_cnt to max value
-    for (i = 0; i < 28; i++) {
-        i2c_master_setDC(1, 0);
-        i2c_master_wait(5);	// sda 1, scl 0
-        i2c_master_setDC(1, 1);
-        i2c_master_wait(5);	// sda 1, scl 1
+    SCL_LOW();
+    SDA_LOW();
+    i2c_master_half();
+    SDA_HIGH();
+    i2c_master_half();
+
+    // clock out any byte a slave might still be sending
+    for (i = 0; i < 9; i++) {
+        i2c_master_read_bit();
     }
 
     // reset all
@@ -124,6 +220,8 @@ i2c_master_gpio_init(uint8 sda, uint8 scl)
 {
     pinSDA = pin_num[sda];
     pinSCL = pin_num[scl];
+    maskSDA = 1 << pinSDA;
+    maskSCL = 1 << pinSCL;
 
     ETS_GPIO_INTR_DISABLE() ;
 //    ETS_INTR_LOCK();
@@ -146,19 +244,25 @@ i2c_master_gpio_init(uint8 sda, uint8 scl)
 
 /******************************************************************************
  * FunctionName : i2c_master_start
- * Description  : set i2c to send state
+ * Description  : set i2c to send state, issues a repeated start if the bus
+ *                is already owned
  * Parameters   : NONE
  * Returns      : NONE
 *******************************************************************************/
 void ICACHE_FLASH_ATTR
 i2c_master_start(void)
 {
-    i2c_master_setDC(1, m_nLastSCL);
-    i2c_master_wait(5);
-    i2c_master_setDC(1, 1);
-    i2c_master_wait(5);	// sda 1, scl 1
-    i2c_master_setDC(0, 1);
-    i2c_master_wait(5);	// sda 0, scl 1
+    i2c_master_update_timing();
+    i2c_tick = xthal_get_ccount();
+
+    SDA_HIGH();
+    i2c_master_half();
+    i2c_master_scl_release();
+    i2c_master_half();	// sda 1, scl 1
+    SDA_LOW();
+    i2c_master_half();	// sda 0, scl 1
+    SCL_LOW();
+    i2c_stats.starts++;
 }
 
 /******************************************************************************
@@ -170,14 +274,14 @@ i2c_master_start(void)
 void ICACHE_FLASH_ATTR
 i2c_master_stop(void)
 {
-    i2c_master_wait(5);
-
-    i2c_master_setDC(0, m_nLastSCL);
-    i2c_master_wait(5);	// sda 0
-    i2c_master_setDC(0, 1);
-    i2c_master_wait(5);	// sda 0, scl 1
-    i2c_master_setDC(1, 1);
-    i2c_master_wait(5);	// sda 1, scl 1
+    i2c_tick = xthal_get_ccount();
+    SCL_LOW();
+    SDA_LOW();
+    i2c_master_half();	// sda 0, scl 0
+    i2c_master_scl_release();
+    i2c_master_half();	// sda 0, scl 1
+    SDA_HIGH();
+    i2c_master_half();	// sda 1, scl 1
 }
 
 /******************************************************************************
@@ -186,19 +290,12 @@ i2c_master_stop(void)
  * Parameters   : uint8 level - 0 or 1
  * Returns      : NONE
 *******************************************************************************/
-void ICACHE_FLASH_ATTR
+void ICACHE_RAM_ATTR
 i2c_master_setAck(uint8 level)
 {
-    i2c_master_setDC(m_nLastSDA, 0);
-    i2c_master_wait(5);
-    i2c_master_setDC(level, 0);
-    i2c_master_wait(5);	// sda level, scl 0
-    i2c_master_setDC(level, 1);
-    i2c_master_wait(8);	// sda level, scl 1
-    i2c_master_setDC(level, 0);
-    i2c_master_wait(5);	// sda level, scl 0
-    i2c_master_setDC(1, 0);
-    i2c_master_wait(5);
+    i2c_tick = xthal_get_ccount();
+    i2c_master_write_bit(level);
+    SDA_HIGH();
 }
 
 /******************************************************************************
@@ -207,22 +304,15 @@ i2c_master_setAck(uint8 level)
  * Parameters   : NONE
  * Returns      : uint8 - ack value, 0 or 1
 *******************************************************************************/
-uint8 ICACHE_FLASH_ATTR
+uint8 ICACHE_RAM_ATTR
 i2c_master_getAck(void)
 {
     uint8 retVal;
-    i2c_master_setDC(m_nLastSDA, 0);
-    i2c_master_wait(5);
-    i2c_master_setDC(1, 0);
-    i2c_master_wait(5);
-    i2c_master_setDC(1, 1);
-    i2c_master_wait(5);
-
-    retVal = i2c_master_getDC();
-    i2c_master_wait(5);
-    i2c_master_setDC(1, 0);
-    i2c_master_wait(5);
 
+    i2c_tick = xthal_get_ccount();
+    retVal = i2c_master_read_bit();
+    if (retVal)
+        i2c_stats.nacks++;
     return retVal;
 }
 
@@ -271,37 +361,21 @@ i2c_master_send_nack(void)
  * Parameters   : NONE
  * Returns      : uint8 - readed value
 *******************************************************************************/
-uint8 ICACHE_FLASH_ATTR
+uint8 ICACHE_RAM_ATTR
 i2c_master_readByte(void)
 {
     uint8 retVal = 0;
-    uint8 k, i;
-
-    i2c_master_wait(5);
-    i2c_master_setDC(m_nLastSDA, 0);
-    i2c_master_wait(5);	// sda 1, scl 0
+    uint8 i;
+    uint32 start = xthal_get_ccount();
 
+    i2c_tick = start;
     for (i = 0; i < 8; i++) {
-        i2c_master_wait(5);
-        i2c_master_setDC(1, 0);
-        i2c_master_wait(5);	// sda 1, scl 0
-        i2c_master_setDC(1, 1);
-        i2c_master_wait(5);	// sda 1, scl 1
-
-        k = i2c_master_getDC();
-        i2c_master_wait(5);
-
-        if (i == 7) {
-            i2c_master_wait(3);   ////
-        }
-
-        k <<= (7 - i);
-        retVal |= k;
+        retVal = (retVal << 1) | i2c_master_read_bit();
     }
 
-    i2c_master_setDC(1, 0);
-    i2c_master_wait(5);	// sda 1, scl 0
-
+    i2c_stats.bytes++;
+    i2c_stats.bits += 8;
+    i2c_stats.bit_cycles += (xthal_get_ccount() - start) >> i2c_cpu_shift;
     return retVal;
 }
 
@@ -311,29 +385,19 @@ i2c_master_readByte(void)
  * Parameters   : uint8 wrdata - write value
  * Returns      : NONE
 *******************************************************************************/
-void ICACHE_FLASH_ATTR
+void ICACHE_RAM_ATTR
 i2c_master_writeByte(uint8 wrdata)
 {
-    uint8 dat;
     sint8 i;
+    uint32 start = xthal_get_ccount();
 
-    i2c_master_wait(5);
-
-    i2c_master_setDC(m_nLastSDA, 0);
-    i2c_master_wait(5);
-
+    i2c_tick = start;
     for (i = 7; i >= 0; i--) {
-        dat = wrdata >> i;
-        i2c_master_setDC(dat, 0);
-        i2c_master_wait(5);
-        i2c_master_setDC(dat, 1);
-        i2c_master_wait(5);
-
-        if (i == 0) {
-            i2c_master_wait(3);   ////
-        }
-
-        i2c_master_setDC(dat, 0);
-        i2c_master_wait(5);
+        i2c_master_write_bit(wrdata >> i & 1);
     }
+    SDA_HIGH();
+
+    i2c_stats.bytes++;
+    i2c_stats.bits += 8;
+    i2c_stats.bit_cycles += (xthal_get_ccount() - start) >> i2c_cpu_shift;
 }
@@ -17,6 +17,7 @@
 #include "hw_timer.h"
 
 #include "user_interface.h"
+#include "task/task.h"
 #include "driver/pwm.h"
 
 // #define PWM_DBG os_printf
@@ -35,13 +36,18 @@
 #define PWM_DBG_PIN_LOW()
 #endif
 
-LOCAL struct pwm_single_param pwm_single_toggle[2][PWM_CHANNEL + 1];
+// Each channel has an edge where it is switched on and one where it is
+// switched off, plus the start of the period
+#define PWM_EDGES (2 * PWM_CHANNEL + 1)
+
+LOCAL struct pwm_single_param pwm_single_toggle[2][PWM_EDGES];
 LOCAL struct pwm_single_param *pwm_single;
 
 LOCAL struct pwm_param pwm;
+LOCAL struct pwm_fade_param pwm_fades[PWM_CHANNEL];
 
 // LOCAL uint8 pwm_out_io_num[PWM_CHANNEL] = {PWM_0_OUT_IO_NUM, PWM_1_OUT_IO_NUM, PWM_2_OUT_IO_NUM};
-LOCAL int8 pwm_out_io_num[PWM_CHANNEL] = {-1, -1, -1, -1, -1, -1};
+LOCAL int8 pwm_out_io_num[PWM_CHANNEL] = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
 
 LOCAL uint8 pwm_channel_toggle[2];
 LOCAL uint8 *pwm_channel;
@@ -61,6 +67,14 @@ LOCAL uint16 pwm_gpio = 0;
 
 LOCAL uint8 pwm_channel_num = 0;
 
+// The interrupt handler counts the time of each period while a fade is
+// running, and posts the fade task whenever a tick has passed.
+LOCAL volatile uint8 pwm_fade_active = 0;
+LOCAL volatile uint8 pwm_fade_posted = 0;
+LOCAL uint32 pwm_fade_elapsed = 0;
+LOCAL task_handle_t pwm_fade_task;
+LOCAL pwm_fade_cb pwm_fade_done;
+
 LOCAL void ICACHE_RAM_ATTR pwm_tim1_intr_handler(os_param_t p);
 #define TIMER_OWNER ((os_param_t) 'P')
 
@@ -89,82 +103,110 @@ pwm_insert_sort(struct pwm_single_param pwm[], uint8 n)
     }
 }
 
+LOCAL uint8 ICACHE_FLASH_ATTR
+pwm_add_edge(struct pwm_single_param *local_single, uint8 n, uint32 us, uint16 set, uint16 clear)
+{
+    local_single[n].h_time = US_TO_RTC_TIMER_TICKS(us);
+    local_single[n].gpio_set = set;
+    local_single[n].gpio_clear = clear;
+    return n + 1;
+}
+
 // Returns FALSE if we cannot start
 bool ICACHE_FLASH_ATTR
 pwm_start(void)
 {
-    uint8 i, j;
+    uint8 i, j, n = 0;
+    uint16 high = 0;
     PWM_DBG("--Function pwm_start() is called\n");
     PWM_DBG("pwm_gpio:%x,pwm_channel_num:%d\n",pwm_gpio,pwm_channel_num);
     PWM_DBG("pwm_out_io_num[0]:%d,[1]:%d,[2]:%d\n",pwm_out_io_num[0],pwm_out_io_num[1],pwm_out_io_num[2]);
     PWM_DBG("pwm.period:%d,pwm.duty[0]:%d,[1]:%d,[2]:%d\n",pwm.period,pwm.duty[0],pwm.duty[1],pwm.duty[2]);
 
-    // First we need to make sure that the interrupt handler is running
-    // out of the same set of params as we expect
-    while (!pwm_timer_down && pwm_toggle != pwm_current_toggle) {
-      os_delay_us(100);
-    }
-    if (pwm_timer_down) {
-      pwm_toggle = pwm_current_toggle;
-    }
+    // Withdraw an update which the interrupt handler has not picked up yet.
+    // It then carries on with the params it is using, and the other set is
+    // ours to fill in, so there is no need to wait for a period to end.
+    ets_intr_lock();
+    pwm_toggle = pwm_current_toggle;
+    ets_intr_unlock();
 
     uint8_t new_toggle = pwm_toggle ^ 0x01;
 
     struct pwm_single_param *local_single = pwm_single_toggle[new_toggle];
     uint8 *local_channel = &pwm_channel_toggle[new_toggle];
 
-    // step 1: init PWM_CHANNEL+1 channels param
+    // step 1: an edge where each channel is switched on and one where it is
+    // switched off, shifted by its phase. Channels which are on at the start
+    // of the period are switched on there instead.
     for (i = 0; i < pwm_channel_num; i++) {
-        uint32 us = pwm.period * pwm.duty[i] / PWM_DEPTH;
-        local_single[i].h_time = US_TO_RTC_TIMER_TICKS(us);
-        PWM_DBG("i:%d us:%d ht:%d\n",i,us,local_single[i].h_time);
-        local_single[i].gpio_set = 0;
-        local_single[i].gpio_clear = 1 << pin_num[pwm_out_io_num[i]];
+        uint16 mask = 1 << pin_num[pwm_out_io_num[i]];
+        uint32 on = pwm.period * pwm.phase[i] / PWM_DEPTH;
+        uint32 h = pwm.period * pwm.duty[i] / PWM_DEPTH;
+        uint32 off;
+
+        if (h == 0) {
+            continue;
+        }
+        if (pwm.duty[i] >= PWM_DEPTH) {
+            high |= mask;
+            continue;
+        }
+        if (on >= pwm.period) {
+            on -= pwm.period;
+        }
+        off = on + h;
+        if (off >= pwm.period) {
+            off -= pwm.period;
+        }
+        if (on == 0 || (off != 0 && off < on)) {
+            high |= mask;
+        }
+        if (on != 0) {
+            n = pwm_add_edge(local_single, n, on, mask, 0);
+        }
+        if (off != 0) {
+            n = pwm_add_edge(local_single, n, off, 0, mask);
+        }
     }
+    PWM_DBG("edges:%d high:%x\n",n,high);
 
-    local_single[pwm_channel_num].h_time = US_TO_RTC_TIMER_TICKS(pwm.period);
-    local_single[pwm_channel_num].gpio_set = pwm_gpio;
-    local_single[pwm_channel_num].gpio_clear = 0;
-    PWM_DBG("i:%d period:%d ht:%d\n",pwm_channel_num,pwm.period,local_single[pwm_channel_num].h_time);
     // step 2: sort, small to big
-    pwm_insert_sort(local_single, pwm_channel_num + 1);
+    pwm_insert_sort(local_single, n);
 
-    *local_channel = pwm_channel_num + 1;
-    PWM_DBG("1channel:%d,single[0]:%d,[1]:%d,[2]:%d,[3]:%d\n",*local_channel,local_single[0].h_time,local_single[1].h_time,local_single[2].h_time,local_single[3].h_time);
-    // step 3: combine same duty channels (or nearly the same duty). If there is
-    // under 2 us between pwm outputs, then treat them as the same.
-    for (i = pwm_channel_num; i > 0; i--) {
+    // step 3: combine edges which are (nearly) at the same time. If there is
+    // under 2 us between them, then treat them as the same. A channel which
+    // would be switched on and off at once keeps its level.
+    for (i = n - 1; n > 0 && i > 0; i--) {
         if (local_single[i].h_time <= local_single[i - 1].h_time + US_TO_RTC_TIMER_TICKS(2)) {
+            uint16 both;
+
             local_single[i - 1].gpio_set |= local_single[i].gpio_set;
             local_single[i - 1].gpio_clear |= local_single[i].gpio_clear;
+            both = local_single[i - 1].gpio_set & local_single[i - 1].gpio_clear;
+            local_single[i - 1].gpio_set &= ~both;
+            local_single[i - 1].gpio_clear &= ~both;
 
-            for (j = i + 1; j < *local_channel; j++) {
+            for (j = i + 1; j < n; j++) {
                 os_memcpy(&local_single[j - 1], &local_single[j], sizeof(struct pwm_single_param));
             }
-
-            (*local_channel)--;
+            n--;
         }
     }
-    PWM_DBG("2channel:%d,single[0]:%d,[1]:%d,[2]:%d,[3]:%d\n",*local_channel,local_single[0].h_time,local_single[1].h_time,local_single[2].h_time,local_single[3].h_time);
-    // step 4: cacl delt time
-    for (i = *local_channel - 1; i > 0; i--) {
-        local_single[i].h_time -= local_single[i - 1].h_time;
+    // edges just before the end of the period are overridden by its start
+    while (n > 0 && local_single[n - 1].h_time + US_TO_RTC_TIMER_TICKS(2) >= US_TO_RTC_TIMER_TICKS(pwm.period)) {
+        n--;
     }
 
-    // step 5: last channel needs to clean
-    local_single[*local_channel-1].gpio_clear = 0;
-
-    // step 6: if first channel duty is 0, remove it
-    if (local_single[0].h_time == 0) {
-        local_single[*local_channel - 1].gpio_set &= ~local_single[0].gpio_clear;
-        local_single[*local_channel - 1].gpio_clear |= local_single[0].gpio_clear;
-
-        for (i = 1; i < *local_channel; i++) {
-            os_memcpy(&local_single[i - 1], &local_single[i], sizeof(struct pwm_single_param));
-        }
+    // step 4: the start of the period comes last, and sets every output to
+    // its level there
+    n = pwm_add_edge(local_single, n, pwm.period, high, pwm_gpio & ~high);
+    *local_channel = n;
 
-        (*local_channel)--;
+    // step 5: cacl delt time
+    for (i = *local_channel - 1; i > 0; i--) {
+        local_single[i].h_time -= local_single[i - 1].h_time;
     }
+    PWM_DBG("channel:%d,single[0]:%d,[1]:%d,[2]:%d,[3]:%d\n",*local_channel,local_single[0].h_time,local_single[1].h_time,local_single[2].h_time,local_single[3].h_time);
 
     // Make the new ones active
     pwm_toggle = new_toggle;
@@ -173,23 +215,28 @@ pwm_start(void)
     if (pwm_timer_down == 1) {
         pwm_channel = local_channel;
         pwm_single = local_single;
-	pwm_current_toggle = pwm_toggle;
+        pwm_current_toggle = pwm_toggle;
+        pwm_current_channel = 0;
+        pwm_fade_elapsed = 0;
         // start
-        gpio_output_set(local_single[0].gpio_set, local_single[0].gpio_clear, pwm_gpio, 0);
-
-        // yeah, if all channels' duty is 0 or 255, don't need to start timer, otherwise start...
-        if (*local_channel != 1) {
-	  PWM_DBG("Need to setup timer\n");
-	  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, FALSE)) {
-	    return FALSE;
-	  }
-	  pwm_timer_down = 0;
-	  platform_hw_timer_set_func(TIMER_OWNER, pwm_tim1_intr_handler, 0);
-	  platform_hw_timer_arm_ticks(TIMER_OWNER, local_single[0].h_time);
-	} else {
-	  PWM_DBG("Timer left idle\n");
-	  platform_hw_timer_close(TIMER_OWNER);
-	}
+        gpio_output_set(local_single[n - 1].gpio_set, local_single[n - 1].gpio_clear, pwm_gpio, 0);
+
+        // yeah, if all channels' duty is 0 or 1023, don't need to start timer, otherwise
+        // start... unless a fade is going to change that
+        if (*local_channel != 1 || pwm_fade_active) {
+          uint32 first = local_single[0].h_time;
+
+          PWM_DBG("Need to setup timer\n");
+          if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, FALSE)) {
+            return FALSE;
+          }
+          pwm_timer_down = 0;
+          platform_hw_timer_set_func(TIMER_OWNER, pwm_tim1_intr_handler, 0);
+          platform_hw_timer_arm_ticks(TIMER_OWNER, first > US_TO_RTC_TIMER_TICKS(4) ? first : US_TO_RTC_TIMER_TICKS(4));
+        } else {
+          PWM_DBG("Timer left idle\n");
+          platform_hw_timer_close(TIMER_OWNER);
+        }
     } else {
       // ensure that all outputs are outputs
       gpio_output_set(0, 0, pwm_gpio, 0);
@@ -200,11 +247,21 @@ pwm_start(void)
     gpio_output_set(0, 0, 1 << PWM_DBG_PIN, 0);
 #endif
 
-    PWM_DBG("3channel:%d,single[0]:%d,[1]:%d,[2]:%d,[3]:%d\n",*local_channel,local_single[0].h_time,local_single[1].h_time,local_single[2].h_time,local_single[3].h_time);
-
     return TRUE;
 }
 
+LOCAL int ICACHE_FLASH_ATTR
+pwm_index(uint8 channel)
+{
+    uint8 i;
+    for (i = 0; i < pwm_channel_num; i++) {
+        if (pwm_out_io_num[i] == channel) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /******************************************************************************
  * FunctionName : pwm_set_duty
  * Description  : set each channel's duty params
@@ -225,6 +282,7 @@ pwm_set_duty(uint16 duty, uint8 channel)
     if(i==pwm_channel_num)      // non found
         return;
 
+    pwm_fades[channel].active = 0;
     if (duty < 1) {
         pwm.duty[channel] = 0;
     } else if (duty >= PWM_DEPTH) {
@@ -338,7 +396,15 @@ pwm_tim1_intr_handler(os_param_t p)
 
       pwm_current_channel = 0;
 
-      if (*pwm_channel == 1) {
+      if (pwm_fade_active) {
+        pwm_fade_elapsed += pwm.period;
+        // if the task queue is full, try again on the next period
+        if (pwm_fade_elapsed >= PWM_FADE_TICK_US && !pwm_fade_posted &&
+            task_post_high(pwm_fade_task, 0)) {
+          pwm_fade_elapsed = 0;
+          pwm_fade_posted = 1;
+        }
+      } else if (*pwm_channel == 1) {
 	pwm_timer_down = 1;
 	break;
       }
@@ -393,6 +459,8 @@ pwm_init(uint16 freq, uint16 *duty)
         // pwm_gpio |= (1 << pwm_out_io_num[i]);
         pwm_gpio = 0;
         pwm.duty[i] = 0;
+        pwm.phase[i] = 0;
+        pwm_fades[i].active = 0;
     }
 
     pwm_set_freq(500, 0);
@@ -416,6 +484,8 @@ pwm_add(uint8 channel){
         if(pwm_out_io_num[i] == -1){ // empty exist
             pwm_out_io_num[i] = channel;
             pwm.duty[i] = 0;
+            pwm.phase[i] = 0;
+            pwm_fades[i].active = 0;
             pwm_gpio |= (1 << pin_num[channel]);
             PIN_FUNC_SELECT(pin_mux[channel], pin_func[channel]);
             GPIO_REG_WRITE(GPIO_PIN_ADDR(GPIO_ID_PIN(pin_num[channel])), GPIO_REG_READ(GPIO_PIN_ADDR(GPIO_ID_PIN(pin_num[channel]))) & (~ GPIO_PIN_PAD_DRIVER_SET(GPIO_PAD_DRIVER_ENABLE))); //disable open drain;
@@ -440,9 +510,13 @@ pwm_delete(uint8 channel){
             for(j=i;j<pwm_channel_num-1;j++){
                 pwm_out_io_num[j] = pwm_out_io_num[j+1];
                 pwm.duty[j] = pwm.duty[j+1];
+                pwm.phase[j] = pwm.phase[j+1];
+                pwm_fades[j] = pwm_fades[j+1];
             }
             pwm_out_io_num[pwm_channel_num-1] = -1;
             pwm.duty[pwm_channel_num-1] = 0;
+            pwm.phase[pwm_channel_num-1] = 0;
+            pwm_fades[pwm_channel_num-1].active = 0;
             pwm_channel_num--;
             return true;
         }
@@ -464,3 +538,159 @@ pwm_exist(uint8 channel){
     }
     return false;
 }
+
+/******************************************************************************
+ * FunctionName : pwm_set_phase
+ * Description  : delay the start of a channel's high time, so that not all
+ *                outputs switch at once
+ * Parameters   : uint16 phase  : 0 ~ PWM_DEPTH, in the same unit as the duty
+ *                uint8 channel : channel index
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+pwm_set_phase(uint16 phase, uint8 channel)
+{
+    int i = pwm_index(channel);
+
+    if (i < 0)
+        return;
+    pwm.phase[i] = phase > PWM_DEPTH ? PWM_DEPTH : phase;
+}
+
+uint16 ICACHE_FLASH_ATTR
+pwm_get_phase(uint8 channel)
+{
+    int i = pwm_index(channel);
+
+    return i < 0 ? 0 : pwm.phase[i];
+}
+
+// Maps the progress of a fade onto its curve, both 0 ~ 65536
+LOCAL uint32 ICACHE_FLASH_ATTR
+pwm_ease(uint8 curve, uint32 p)
+{
+    uint32 q;
+
+    switch (curve) {
+    case PWM_FADE_EASE_IN:
+        return p * p >> 16;
+    case PWM_FADE_EASE_OUT:
+        q = 65536 - p;
+        return 65536 - (uint32)((uint64)q * q >> 16);
+    case PWM_FADE_EASE_IN_OUT:
+        q = p * p >> 16;
+        return (uint32)((uint64)q * (3 * 65536 - 2 * p) >> 16);
+    default:
+        return p;
+    }
+}
+
+/******************************************************************************
+ * FunctionName : pwm_fade_step
+ * Description  : task posted by the interrupt handler each PWM_FADE_TICK_US,
+ *                moves all fading channels along their curves
+*******************************************************************************/
+LOCAL void ICACHE_FLASH_ATTR
+pwm_fade_step(task_param_t param, uint8 prio)
+{
+    uint32 now = system_get_time();
+    uint16 done = 0;
+    uint8 i, active = 0, changed = 0;
+
+    (void)param;
+    (void)prio;
+    pwm_fade_posted = 0;
+
+    for (i = 0; i < pwm_channel_num; i++) {
+        struct pwm_fade_param *f = &pwm_fades[i];
+        uint32 elapsed = now - f->start;
+        uint16 duty;
+
+        if (!f->active) {
+            continue;
+        }
+        if (elapsed >= f->duration) {
+            duty = f->to;
+            f->active = 0;
+            done |= 1 << i;
+        } else {
+            uint32 p = (uint32)(((uint64)elapsed << 16) / f->duration);
+            duty = f->from + ((int32)f->to - (int32)f->from) * (int32)pwm_ease(f->curve, p) / 65536;
+            active = 1;
+        }
+        if (duty != pwm.duty[i]) {
+            pwm.duty[i] = duty;
+            changed = 1;
+        }
+    }
+
+    pwm_fade_active = active;
+    if (changed) {
+        pwm_start();
+    }
+    if (!done || !pwm_fade_done) {
+        return;
+    }
+    // a callback may close a channel, which renumbers the others
+    uint8 pins[PWM_CHANNEL], n = 0;
+    for (i = 0; i < pwm_channel_num; i++) {
+        if (done & (1 << i)) {
+            pins[n++] = pwm_out_io_num[i];
+        }
+    }
+    for (i = 0; i < n; i++) {
+        pwm_fade_done(pins[i]);
+    }
+}
+
+/******************************************************************************
+ * FunctionName : pwm_fade
+ * Description  : move a channel's duty to a new value over time, along one of
+ *                the PWM_FADE_ curves. Setting the duty directly stops it.
+ * Parameters   : uint16 duty   : 0 ~ PWM_DEPTH
+ *                uint32 ms     : duration of the fade
+ *                uint8 curve   : PWM_FADE_LINEAR etc.
+ *                uint8 channel : channel index
+ * Returns      : FALSE if the channel does not exist, or the timer is in use
+*******************************************************************************/
+bool ICACHE_FLASH_ATTR
+pwm_fade(uint16 duty, uint32 ms, uint8 curve, uint8 channel)
+{
+    int i = pwm_index(channel);
+    struct pwm_fade_param *f;
+
+    if (i < 0)
+        return FALSE;
+    if (!pwm_fade_task)
+        pwm_fade_task = task_get_id(pwm_fade_step);
+
+    f = &pwm_fades[i];
+    f->from = pwm.duty[i];
+    f->to = duty > PWM_DEPTH ? PWM_DEPTH : duty;
+    f->start = system_get_time();
+    f->duration = ms * 1000;
+    f->curve = curve;
+    f->active = 1;
+    pwm_fade_active = 1;
+
+    // a running timer picks the fade up at the next tick
+    if (pwm_timer_down && !pwm_start()) {
+        f->active = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+bool ICACHE_FLASH_ATTR
+pwm_fading(uint8 channel)
+{
+    int i = pwm_index(channel);
+
+    return i >= 0 && pwm_fades[i].active;
+}
+
+void ICACHE_FLASH_ATTR
+pwm_fade_set_cb(pwm_fade_cb cb)
+{
+    pwm_fade_done = cb;
+}
@@ -1,4 +1,7 @@
 #include "driver/spi.h"
+#include "user_config.h"
+#include "gpio.h"
+#include "task/task.h"
 
 typedef union {
     uint32 word[2];
@@ -7,6 +10,34 @@ typedef union {
 
 static uint32_t spi_clkdiv[2];
 
+#define SPI_INTR_STATUS_REG 0x3ff00020
+#define SPI_INTR_STATUS_SPI  BIT4
+#define SPI_INTR_STATUS_HSPI BIT7
+
+#define SPI_QUEUE_CHUNK 64
+
+typedef struct {
+    spi_trans_desc_t *head, *tail;   // pending descriptors, head is on the bus
+    spi_trans_desc_t *done;          // completed descriptors waiting for their callback
+    uint16 chunk;                    // length of the chunk currently on the bus
+    volatile uint8 busy;
+    volatile uint8 lost;             // a completion post failed, the poll timer delivers
+} spi_queue_t;
+
+static spi_queue_t spi_queue[2];
+static task_handle_t spi_queue_task_id;
+static os_timer_t spi_queue_timer;
+static uint8 spi_queue_polling;
+static uint8 spi_queue_isr_attached;
+
+// wait until neither the transaction queue nor a single transaction occupy the bus
+static inline void spi_mast_wait_idle(uint8 spi_no)
+{
+    while (spi_queue[spi_no].busy);
+    while(READ_PERI_REG(SPI_CMD(spi_no)) & SPI_USR);
+}
+
+
 
 /******************************************************************************
  * FunctionName : spi_lcd_mode_init
@@ -181,7 +212,7 @@ void spi_mast_blkset(uint8 spi_no, size_t bitlen, const uint8 *data)
 {
     size_t aligned_len = bitlen >> 3;
 
-    while(READ_PERI_REG(SPI_CMD(spi_no)) & SPI_USR);
+    spi_mast_wait_idle(spi_no);
 
     if (aligned_len % 4) {
         // length for memcpy needs to be aligned to uint32 bounday
@@ -203,7 +234,7 @@ void spi_mast_blkget(uint8 spi_no, size_t bitlen, uint8 *data)
 {
     size_t aligned_len = bitlen >> 3;
 
-    while(READ_PERI_REG(SPI_CMD(spi_no)) & SPI_USR);
+    spi_mast_wait_idle(spi_no);
 
     if (aligned_len % 4) {
         // length for memcpy needs to be aligned to uint32 bounday
@@ -247,7 +278,7 @@ void spi_mast_set_mosi(uint8 spi_no, uint16 offset, uint8 bitlen, uint32 data)
         return; // out of range
     }
 
-    while(READ_PERI_REG(SPI_CMD(spi_no)) & SPI_USR);
+    spi_mast_wait_idle(spi_no);
 
     // transfer Wn to buf
     spi_buf.word[1] = READ_PERI_REG(SPI_W0(spi_no) + wn*4);
@@ -292,7 +323,7 @@ uint32 spi_mast_get_miso(uint8 spi_no, uint16 offset, uint8 bitlen)
     if (wn > 15)
         return 0; // out of range
 
-    while(READ_PERI_REG(SPI_CMD(spi_no)) & SPI_USR);
+    spi_mast_wait_idle(spi_no);
 
     // transfer Wn to buf
     spi_buf.word[1] = READ_PERI_REG(SPI_W0(spi_no) + wn*4);
@@ -309,26 +340,14 @@ uint32 spi_mast_get_miso(uint8 spi_no, uint16 offset, uint8 bitlen)
 }
 
 /******************************************************************************
- * FunctionName : spi_mast_transaction
- * Description  : Start a transaction and wait for completion.
- * Parameters   :   uint8  spi_no       - SPI module number, Only "SPI" and "HSPI" are valid
- *                  uint8  cmd_bitlen   - Valid number of bits in cmd_data.
- *                  uint16 cmd_data     - Command data.
- *                  uint8  addr_bitlen  - Valid number of bits in addr_data.
- *                  uint32 addr_data    - Address data.
- *                  uint16 mosi_bitlen  - Valid number of bits in MOSI buffer.
- *                  uint8  dummy_bitlen - Number of dummy cycles.
- *                  sint16 miso_bitlen  - number of bits to be captured in MISO buffer.
- *                                        negative value activates full-duplex mode.
+ * FunctionName : spi_mast_setup
+ * Description  : Program the user registers for a transaction without starting it.
+ *                Callable from interrupt context, the bus must be idle.
+ * Parameters   : see spi_mast_transaction
 *******************************************************************************/
-void spi_mast_transaction(uint8 spi_no, uint8 cmd_bitlen, uint16 cmd_data, uint8 addr_bitlen, uint32 addr_data,
-                          uint16 mosi_bitlen, uint8 dummy_bitlen, sint16 miso_bitlen)
+static void ICACHE_RAM_ATTR spi_mast_setup(uint8 spi_no, uint8 cmd_bitlen, uint16 cmd_data, uint8 addr_bitlen, uint32 addr_data,
+                                           uint16 mosi_bitlen, uint8 dummy_bitlen, sint16 miso_bitlen)
 {
-    if (spi_no > 1)
-        return; // handle invalid input number
-
-    while(READ_PERI_REG(SPI_CMD(spi_no)) & SPI_USR);
-
     // default disable COMMAND, ADDR, MOSI, DUMMY, MISO, and DOUTDIN (aka full-duplex)
     CLEAR_PERI_REG_MASK(SPI_USER(spi_no), SPI_USR_COMMAND|SPI_USR_ADDR|SPI_USR_MOSI|SPI_USR_DUMMY|SPI_USR_MISO|SPI_DOUTDIN);
     // default set bit lengths
@@ -369,6 +388,30 @@ void spi_mast_transaction(uint8 spi_no, uint8 cmd_bitlen, uint16 cmd_data, uint8
     {
         SET_PERI_REG_MASK(SPI_USER(spi_no), SPI_DOUTDIN);
     }
+}
+
+/******************************************************************************
+ * FunctionName : spi_mast_transaction
+ * Description  : Start a transaction and wait for completion.
+ * Parameters   :   uint8  spi_no       - SPI module number, Only "SPI" and "HSPI" are valid
+ *                  uint8  cmd_bitlen   - Valid number of bits in cmd_data.
+ *                  uint16 cmd_data     - Command data.
+ *                  uint8  addr_bitlen  - Valid number of bits in addr_data.
+ *                  uint32 addr_data    - Address data.
+ *                  uint16 mosi_bitlen  - Valid number of bits in MOSI buffer.
+ *                  uint8  dummy_bitlen - Number of dummy cycles.
+ *                  sint16 miso_bitlen  - number of bits to be captured in MISO buffer.
+ *                                        negative value activates full-duplex mode.
+*******************************************************************************/
+void spi_mast_transaction(uint8 spi_no, uint8 cmd_bitlen, uint16 cmd_data, uint8 addr_bitlen, uint32 addr_data,
+                          uint16 mosi_bitlen, uint8 dummy_bitlen, sint16 miso_bitlen)
+{
+    if (spi_no > 1)
+        return; // handle invalid input number
+
+    spi_mast_wait_idle(spi_no);
+
+    spi_mast_setup(spi_no, cmd_bitlen, cmd_data, addr_bitlen, addr_data, mosi_bitlen, dummy_bitlen, miso_bitlen);
 
     // start transaction
     SET_PERI_REG_MASK(SPI_CMD(spi_no), SPI_USR);
@@ -377,6 +420,275 @@ void spi_mast_transaction(uint8 spi_no, uint8 cmd_bitlen, uint16 cmd_data, uint8
 }
 
 
+/* =============================================================================================
+ * Queued transactions
+ *
+ * Descriptors are chained per bus and executed back to back from the transaction-done
+ * interrupt. The data phase of each descriptor is cut into chunks of the 64 byte W0-W15
+ * buffer, cmd/addr/dummy phases are only sent with the first chunk. Completed descriptors
+ * are handed to a task which runs their callbacks outside of interrupt context.
+ * =============================================================================================
+ */
+
+// copy from an arbitrarily aligned buffer with word accesses only
+static void ICACHE_RAM_ATTR spi_queue_load(uint8 spi_no, const uint8 *src, uint16 len)
+{
+    uint32 reg = SPI_W0(spi_no);
+    uint16 i;
+
+    for (i = 0; i < len; i += 4, reg += 4) {
+        uint32 word = src[i];
+        if (i+1 < len) word |= src[i+1] << 8;
+        if (i+2 < len) word |= src[i+2] << 16;
+        if (i+3 < len) word |= (uint32)src[i+3] << 24;
+        WRITE_PERI_REG(reg, word);
+    }
+}
+
+static void ICACHE_RAM_ATTR spi_queue_fill(uint8 spi_no, uint16 len)
+{
+    uint32 reg = SPI_W0(spi_no);
+    uint16 i;
+
+    for (i = 0; i < len; i += 4, reg += 4) {
+        WRITE_PERI_REG(reg, 0xffffffff);
+    }
+}
+
+static void ICACHE_RAM_ATTR spi_queue_unload(uint8 spi_no, uint8 *dst, uint16 len)
+{
+    uint32 reg = SPI_W0(spi_no);
+    uint16 i;
+
+    for (i = 0; i < len; i += 4, reg += 4) {
+        uint32 word = READ_PERI_REG(reg);
+        dst[i] = word;
+        if (i+1 < len) dst[i+1] = word >> 8;
+        if (i+2 < len) dst[i+2] = word >> 16;
+        if (i+3 < len) dst[i+3] = word >> 24;
+    }
+}
+
+static void ICACHE_RAM_ATTR spi_queue_start_chunk(uint8 spi_no, spi_queue_t *q)
+{
+    spi_trans_desc_t *desc = q->head;
+    size_t remain = desc->len - desc->done;
+    uint16 chunk = remain > SPI_QUEUE_CHUNK ? SPI_QUEUE_CHUNK : remain;
+    uint16 bits = chunk * 8;
+    sint16 miso_bits = 0;
+
+    if (!(desc->flags & SPI_TRANS_STARTED)) {
+        desc->flags |= SPI_TRANS_STARTED;
+        if (desc->cs_mask)
+            GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, desc->cs_mask);
+    }
+
+    if (chunk > 0) {
+        if (desc->tx)
+            spi_queue_load(spi_no, desc->tx + desc->done, chunk);
+        else
+            spi_queue_fill(spi_no, chunk);
+        if (desc->rx)
+            miso_bits = -bits;
+    }
+
+    if (desc->done == 0)
+        spi_mast_setup(spi_no, desc->cmd_bitlen, desc->cmd_data, desc->addr_bitlen, desc->addr_data,
+                       bits, desc->dummy_bitlen, miso_bits);
+    else
+        spi_mast_setup(spi_no, 0, 0, 0, 0, bits, 0, miso_bits);
+
+    q->chunk = chunk;
+    SET_PERI_REG_MASK(SPI_CMD(spi_no), SPI_USR);
+}
+
+// advance the queue after the chunk on the bus has completed
+static void ICACHE_RAM_ATTR spi_queue_step(uint8 spi_no)
+{
+    spi_queue_t *q = &spi_queue[spi_no];
+    spi_trans_desc_t *desc = q->head;
+
+    if (q->chunk > 0 && desc->rx)
+        spi_queue_unload(spi_no, desc->rx + desc->done, q->chunk);
+    desc->done += q->chunk;
+    q->chunk = 0;
+
+    if (desc->done < desc->len) {
+        spi_queue_start_chunk(spi_no, q);
+        return;
+    }
+
+    // descriptor finished
+    if (desc->cs_mask && !(desc->flags & SPI_TRANS_CS_KEEP))
+        GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, desc->cs_mask);
+    q->head = desc->next;
+    if (!q->head)
+        q->tail = NULL;
+
+    if (desc->cb) {
+        desc->next = q->done;
+        q->done = desc;
+        // a non-empty done list already has its post outstanding, unless that one failed
+        if ((!desc->next || q->lost) && !task_post_medium(spi_queue_task_id, spi_no))
+            q->lost = 1;
+    }
+
+    if (q->head) {
+        spi_queue_start_chunk(spi_no, q);
+    } else {
+        CLEAR_PERI_REG_MASK(SPI_SLAVE(spi_no), SPI_TRANS_DONE_EN);
+        q->busy = 0;
+    }
+}
+
+static void ICACHE_RAM_ATTR spi_queue_isr(void *arg)
+{
+    uint32 status = READ_PERI_REG(SPI_INTR_STATUS_REG);
+
+    if ((status & SPI_INTR_STATUS_HSPI) &&
+        (READ_PERI_REG(SPI_SLAVE(SPI_HSPI)) & SPI_TRANS_DONE)) {
+        CLEAR_PERI_REG_MASK(SPI_SLAVE(SPI_HSPI), SPI_TRANS_DONE);
+        if (spi_queue[SPI_HSPI].busy)
+            spi_queue_step(SPI_HSPI);
+    }
+}
+
+static void spi_queue_task(task_param_t param, uint8 prio)
+{
+    spi_queue_t *q = &spi_queue[param];
+    spi_trans_desc_t *done, *next;
+
+    // detach the list of completed descriptors, restoring submission order
+    ETS_SPI_INTR_DISABLE();
+    done = q->done;
+    q->done = NULL;
+    q->lost = 0;
+    ETS_SPI_INTR_ENABLE();
+
+    for (next = NULL; done; ) {
+        spi_trans_desc_t *d = done;
+        done = d->next;
+        d->next = next;
+        next = d;
+    }
+
+    while (next) {
+        spi_trans_desc_t *d = next;
+        next = d->next;
+        d->next = NULL;
+        d->cb(d);
+    }
+}
+
+// Runs while descriptors are outstanding, so that completions whose post
+// failed are still delivered even if nothing else happens on the bus
+static void spi_queue_poll(void *arg)
+{
+    spi_queue_t *q = &spi_queue[SPI_HSPI];
+
+    if (q->lost)
+        spi_queue_task(SPI_HSPI, 0);
+    if (!q->head && !q->done) {
+        os_timer_disarm(&spi_queue_timer);
+        spi_queue_polling = 0;
+    }
+}
+
+/******************************************************************************
+ * FunctionName : spi_queue_submit
+ * Description  : Append a chain of descriptors to the transaction queue.
+ *                The chain is linked via desc->next and must stay valid until
+ *                its last callback has been invoked. Only HSPI is supported
+ *                since SPI is shared with the flash chip.
+ * Parameters   : uint8 spi_no - SPI module number, only "HSPI" is valid
+ *                spi_trans_desc_t *desc - first descriptor of the chain
+ * Returns      : 1 on success, 0 otherwise
+*******************************************************************************/
+int spi_queue_submit(uint8 spi_no, spi_trans_desc_t *desc)
+{
+    spi_queue_t *q;
+    spi_trans_desc_t *last;
+
+    if (spi_no != SPI_HSPI || !desc)
+        return 0;
+
+    q = &spi_queue[spi_no];
+
+    if (!spi_queue_isr_attached) {
+        spi_queue_task_id = task_get_id(spi_queue_task);
+        ETS_SPI_INTR_ATTACH(spi_queue_isr, NULL);
+        spi_queue_isr_attached = 1;
+    }
+
+    for (last = desc; ; last = last->next) {
+        last->done = 0;
+        last->flags &= ~SPI_TRANS_STARTED;
+        if (!last->next)
+            break;
+    }
+
+    ETS_SPI_INTR_DISABLE();
+    if (q->tail)
+        q->tail->next = desc;
+    else
+        q->head = desc;
+    q->tail = last;
+
+    if (!q->busy) {
+        // let a synchronous transaction drain before taking over the bus
+        while(READ_PERI_REG(SPI_CMD(spi_no)) & SPI_USR);
+        CLEAR_PERI_REG_MASK(SPI_SLAVE(spi_no), SPI_TRANS_DONE);
+        SET_PERI_REG_MASK(SPI_SLAVE(spi_no), SPI_TRANS_DONE_EN);
+        q->busy = 1;
+        spi_queue_start_chunk(spi_no, q);
+    }
+    ETS_SPI_INTR_ENABLE();
+
+    if (!spi_queue_polling) {
+        os_timer_setfn(&spi_queue_timer, spi_queue_poll, NULL);
+        os_timer_arm(&spi_queue_timer, 20, 1);
+        spi_queue_polling = 1;
+    }
+
+    return 1;
+}
+
+/******************************************************************************
+ * FunctionName : spi_queue_pending
+ * Description  : Number of descriptors not yet completed on the bus
+ * Parameters   : uint8 spi_no - SPI module number
+*******************************************************************************/
+uint32 spi_queue_pending(uint8 spi_no)
+{
+    spi_trans_desc_t *desc;
+    uint32 n = 0;
+
+    if (spi_no > 1)
+        return 0;
+
+    ETS_SPI_INTR_DISABLE();
+    for (desc = spi_queue[spi_no].head; desc; desc = desc->next)
+        n++;
+    ETS_SPI_INTR_ENABLE();
+
+    return n;
+}
+
+/******************************************************************************
+ * FunctionName : spi_queue_wait
+ * Description  : Block until the queue has drained, e.g. before synchronous
+ *                access to the bus. Callbacks are not run by this function.
+ * Parameters   : uint8 spi_no - SPI module number
+*******************************************************************************/
+void spi_queue_wait(uint8 spi_no)
+{
+    if (spi_no > 1)
+        return;
+
+    spi_mast_wait_idle(spi_no);
+}
+
+
 /******************************************************************************
  * FunctionName : spi_byte_write_espslave
  * Description  : SPI master 1 byte transmission function for esp8266 slave,
@@ -0,0 +1,623 @@
+/*
+ * HTTP server core, see httpd.h
+ *
+ * Each connection walks through: collecting a request, waiting for the
+ * handler's response, queueing the response body (streamed from VFS or
+ * from constant data as send buffer space comes free), and then either
+ * back to collecting or a lingering close. Connections are only torn
+ * down at the end of an lwIP callback (settle()), never underneath a
+ * handler.
+ */
+#include "c_types.h"
+#include "c_string.h"
+#include "c_stdlib.h"
+#include "c_stdio.h"
+#include "osapi.h"
+#include "lwip/tcp.h"
+#include "vfs.h"
+#include "httpd.h"
+
+// lwIP polls every 500ms times this
+#define HTTPD_POLL_INTERVAL 4
+// A closing connection is aborted if the client has not closed by then, ~3s
+#define HTTPD_LINGER_POLLS  6
+
+#define KEEPALIVE_POLLS (HTTPD_KEEPALIVE_SECS * 2 / HTTPD_POLL_INTERVAL)
+
+struct httpd_server {
+  struct tcp_pcb *pcb;
+  httpd_request_fn on_request;
+  httpd_close_fn on_close;
+  void *arg;
+  httpd_conn *conns;
+  uint8_t nconns;
+  uint8_t max_conns;
+  char chunk[TCP_MSS];      // file reads, copied by tcp_write straight away
+};
+
+struct httpd_conn {
+  httpd_conn *next;
+  httpd_server *srv;
+  struct tcp_pcb *pcb;
+  void *user;
+  char *buf;                // received data, NUL terminated
+  uint16_t len;
+  uint16_t used;            // length of the request being answered
+  int fd;                   // file being streamed, or 0
+  const char *data;         // or constant data being streamed
+  char *owned;              // heap copy of a body too big for the send buffer
+  uint32_t remain;          // body bytes not yet queued
+  uint8_t busy;             // a request is being answered
+  uint8_t in_handler;
+  uint8_t keep_alive;
+  uint8_t overflow;         // request larger than HTTPD_MAX_REQUEST
+  uint8_t idle;             // polls without any traffic
+  uint8_t closing;
+  uint8_t dead;
+};
+
+static const char gzip_encoding[] = "Content-Encoding: gzip\r\n";
+
+static int prefix_nocase( const char *s, const char *prefix )
+{
+  for( ; *prefix; s++, prefix++ ){
+    char a = *s, b = *prefix;
+    if( a >= 'A' && a <= 'Z' ) a += 'a' - 'A';
+    if( b >= 'A' && b <= 'Z' ) b += 'a' - 'A';
+    if( a != b )
+      return 0;
+  }
+  return 1;
+}
+
+static const char *find_header( const char *headers, const char *name )
+{
+  size_t n = c_strlen(name);
+  const char *line;
+
+  for( line = headers; line && *line; line = c_strstr(line, "\r\n"), line = line ? line + 2 : NULL ){
+    if( prefix_nocase(line, name) && line[n] == ':' ){
+      line += n + 1;
+      while( *line == ' ' )
+        line++;
+      return line;
+    }
+  }
+  return NULL;
+}
+
+// Parses a Content-Length value, -1 if it is not a plain decimal number
+static sint32_t parse_length( const char *p )
+{
+  sint32_t len = 0;
+
+  if( *p < '0' || *p > '9' )
+    return -1;
+  for( ; *p >= '0' && *p <= '9'; p++ ){
+    if( len > (0x7fffffff - 9) / 10 )
+      return -1;
+    len = len * 10 + (*p - '0');
+  }
+  while( *p == ' ' )
+    p++;
+  return (*p == '\r' || *p == 0) ? len : -1;
+}
+
+const char *httpd_header( const httpd_request *req, const char *name )
+{
+  return find_header(req->headers, name);
+}
+
+void httpd_set_user( httpd_conn *conn, void *user )
+{
+  conn->user = user;
+}
+
+void *httpd_get_user( httpd_conn *conn )
+{
+  return conn->user;
+}
+
+/* --- connection teardown ------------------------------------------------- */
+
+/*
+ * Closing a connection from our side would leave it in TIME_WAIT, and
+ * with the handful of PCBs there are that soon starves new clients. So
+ * the client is left to close first, with a hard abort as a deadline.
+ */
+static err_t linger_abort( void *arg, struct tcp_pcb *pcb )
+{
+  (void)arg;
+  tcp_poll(pcb, 0, 0);
+  tcp_abort(pcb);
+  return ERR_ABRT;
+}
+
+static err_t linger_recv( void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err )
+{
+  (void)arg; (void)err;
+  if( p ){
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+  }
+  else{
+    tcp_recv(pcb, 0);
+    tcp_poll(pcb, 0, 0);
+    tcp_close(pcb);
+  }
+  return ERR_OK;
+}
+
+static void linger_close( struct tcp_pcb *pcb )
+{
+  tcp_arg(pcb, 0);
+  tcp_err(pcb, 0);
+  tcp_sent(pcb, 0);
+  tcp_recv(pcb, linger_recv);
+  tcp_poll(pcb, linger_abort, HTTPD_LINGER_POLLS);
+}
+
+// Forgets the connection; the PCB, if any, is left to the caller
+static void conn_free( httpd_conn *c )
+{
+  httpd_server *srv = c->srv;
+  httpd_conn **pc;
+
+  for( pc = &srv->conns; *pc; pc = &(*pc)->next ){
+    if( *pc == c ){
+      *pc = c->next;
+      srv->nconns--;
+      break;
+    }
+  }
+  if( srv->on_close )
+    srv->on_close(c, srv->arg);
+  if( c->fd )
+    vfs_close(c->fd);
+  c_free(c->owned);
+  c_free(c->buf);
+  c_free(c);
+}
+
+static void conn_abort( httpd_conn *c )
+{
+  struct tcp_pcb *pcb = c->pcb;
+
+  conn_free(c);
+  if( pcb ){
+    tcp_arg(pcb, 0);
+    tcp_abort(pcb);
+  }
+}
+
+/* --- responses ----------------------------------------------------------- */
+
+static void consume( httpd_conn *c )
+{
+  c->len -= c->used;
+  os_memmove(c->buf, c->buf + c->used, c->len);
+  c->buf[c->len] = 0;
+  c->used = 0;
+}
+
+static void finish( httpd_conn *c )
+{
+  if( c->fd ){
+    vfs_close(c->fd);
+    c->fd = 0;
+  }
+  c_free(c->owned);
+  c->owned = NULL;
+  c->data = NULL;
+  if( !c->keep_alive ){
+    c->closing = 1;
+    return;
+  }
+  c->busy = 0;
+  c->idle = 0;
+  if( !c->in_handler )
+    consume(c);
+}
+
+// Queues as much of the body as the send buffer takes
+static void stream( httpd_conn *c )
+{
+  struct tcp_pcb *pcb = c->pcb;
+  err_t err;
+
+  while( c->remain ){
+    u16_t n = tcp_sndbuf(pcb);
+    if( n == 0 )
+      break;
+    if( n > c->remain )
+      n = c->remain;
+    if( c->fd ){
+      if( n > TCP_MSS )
+        n = TCP_MSS;
+      sint32_t got = vfs_read(c->fd, c->srv->chunk, n);
+      if( got <= 0 ){
+        // the file shrank under us, the promised length can not be met
+        c->dead = 1;
+        return;
+      }
+      n = got;
+      err = tcp_write(pcb, c->srv->chunk, n, TCP_WRITE_FLAG_COPY);
+      if( err == ERR_MEM )
+        vfs_lseek(c->fd, -got, VFS_SEEK_CUR);
+    }
+    else{
+      // a heap copy goes away in finish(), before it has been acknowledged
+      err = tcp_write(pcb, c->data, n, c->owned ? TCP_WRITE_FLAG_COPY : 0);
+      if( err == ERR_OK )
+        c->data += n;
+    }
+    if( err == ERR_MEM )
+      break;    // out of segments, more room comes with the next ACK
+    if( err != ERR_OK ){
+      c->dead = 1;
+      return;
+    }
+    c->remain -= n;
+  }
+  tcp_output(pcb);
+  if( !c->remain )
+    finish(c);
+}
+
+static int send_head( httpd_conn *c, const char *status, const char *ctype, int gzip, const char *headers, size_t len )
+{
+  static const char fmt[] = "HTTP/1.1 %s\r\nContent-Length: %d\r\nConnection: %s\r\n%s%s%s%s%s\r\n";
+  if( !ctype ) ctype = "";
+  if( !headers ) headers = "";
+  char buf[sizeof(fmt) + c_strlen(status) + c_strlen(ctype) + c_strlen(headers) + sizeof(gzip_encoding) + 40];
+  int n = c_sprintf(buf, fmt, status, (int)len, c->keep_alive ? "keep-alive" : "close",
+                    *ctype ? "Content-Type: " : "", ctype, *ctype ? "\r\n" : "",
+                    gzip ? gzip_encoding : "", headers);
+
+  if( !c->busy || c->remain || tcp_write(c->pcb, buf, n, TCP_WRITE_FLAG_COPY) != ERR_OK ){
+    c->dead = 1;
+    return -1;
+  }
+  return 0;
+}
+
+static err_t settle( httpd_conn *c );
+
+// Completes a response started by send_head(). A response which is not a
+// direct answer from the handler has to settle the connection itself.
+static int start_body( httpd_conn *c, size_t len )
+{
+  int ret;
+
+  c->remain = len;
+  if( !c->dead )
+    stream(c);
+  ret = c->dead ? -1 : 0;
+  if( !c->in_handler )
+    settle(c);
+  return ret;
+}
+
+int httpd_send( httpd_conn *conn, const char *status, const char *headers, const char *body, size_t len )
+{
+  if( send_head(conn, status, NULL, 0, headers, len) == 0 && len ){
+    if( len <= tcp_sndbuf(conn->pcb) ){
+      if( tcp_write(conn->pcb, body, len, TCP_WRITE_FLAG_COPY) != ERR_OK )
+        conn->dead = 1;
+      len = 0;
+    }
+    else if( (conn->owned = c_malloc(len)) != NULL ){
+      c_memcpy(conn->owned, body, len);
+      conn->data = conn->owned;
+    }
+    else
+      conn->dead = 1;
+  }
+  return start_body(conn, len);
+}
+
+int httpd_send_static( httpd_conn *conn, const char *ctype, const char *headers, const char *data, size_t len )
+{
+  int gzip = len >= 2 && data[0] == 0x1f && data[1] == (char)0x8b;
+
+  if( send_head(conn, "200 OK", ctype, gzip, headers, len) == 0 )
+    conn->data = data;
+  return start_body(conn, len);
+}
+
+int httpd_send_file( httpd_conn *conn, const char *name, const char *ctype, const char *headers )
+{
+  size_t n = c_strlen(name);
+  char gzname[n + 4];
+  char magic[2] = { 0, 0 };
+  uint32_t len;
+  int fd;
+
+  c_memcpy(gzname, name, n);
+  c_memcpy(gzname + n, ".gz", 4);
+  if( !(fd = vfs_open(gzname, "r")) && !(fd = vfs_open(name, "r")) )
+    return 1;
+
+  // a gzipped file may also have been uploaded under the plain name
+  len = vfs_size(fd);
+  vfs_read(fd, magic, 2);
+  vfs_lseek(fd, 0, VFS_SEEK_SET);
+
+  if( send_head(conn, "200 OK", ctype, magic[0] == 0x1f && magic[1] == (char)0x8b, headers, len) == 0 )
+    conn->fd = fd;
+  else
+    vfs_close(fd);
+  return start_body(conn, len);
+}
+
+/* --- requests ------------------------------------------------------------ */
+
+// Answers and then closes; the caller settles the connection
+static void reply_error( httpd_conn *c, const char *status )
+{
+  c->keep_alive = 0;
+  c->in_handler = 1;
+  httpd_send(c, status, NULL, NULL, 0);
+  c->in_handler = 0;
+}
+
+static void process( httpd_conn *c )
+{
+  httpd_server *srv = c->srv;
+  httpd_request req;
+  char *end, *p;
+  uint32_t head, body;
+  sint32_t len;
+
+  while( !c->busy && !c->closing && !c->dead && c->len ){
+    // don't start on the next response before most of the last has gone
+    if( tcp_sndbuf(c->pcb) < TCP_MSS )
+      return;
+
+    end = c_strstr(c->buf, "\r\n\r\n");
+    if( !end ){
+      if( c->overflow || c->len >= HTTPD_MAX_REQUEST )
+        goto too_large;
+      return;
+    }
+    head = end - c->buf + 4;
+    end[2] = 0;
+    p = (char *)find_header(c->buf, "Content-Length");
+    len = p ? parse_length(p) : 0;
+    if( len < 0 ){
+      c->busy = 1;
+      reply_error(c, "400 Bad request");
+      return;
+    }
+    body = len;
+    if( head > HTTPD_MAX_REQUEST || body > HTTPD_MAX_REQUEST - head )
+      goto too_large;
+    if( c->len < head + body ){
+      end[2] = '\r';
+      return;
+    }
+
+    c->busy = 1;
+    c->used = head + body;
+    c_memset(&req, 0, sizeof(req));
+    req.body = c->buf + head;
+    req.body_len = body;
+
+    // request line
+    p = c_strstr(c->buf, "\r\n");
+    *p = 0;
+    req.headers = p + 2;
+    req.method = c->buf;
+    if( !(p = c_strchr(c->buf, ' ')) ){
+      reply_error(c, "400 Bad request");
+      return;
+    }
+    *p++ = 0;
+    req.path = p;
+    if( (p = c_strchr(p, ' ')) != NULL )
+      *p++ = 0;
+    // HTTP/1.1 keeps the connection unless told otherwise, 1.0 the reverse
+    {
+      const char *conn = httpd_header(&req, "Connection");
+      if( p && c_strncmp(p, "HTTP/1.1", 8) == 0 )
+        c->keep_alive = !conn || !prefix_nocase(conn, "close");
+      else
+        c->keep_alive = conn && prefix_nocase(conn, "keep-alive");
+    }
+    if( (p = c_strchr(req.path, '?')) != NULL ){
+      *p++ = 0;
+      req.query = p;
+    }
+    else
+      req.query = "";
+
+    c->in_handler = 1;
+    srv->on_request(c, &req, srv->arg);
+    c->in_handler = 0;
+    if( !c->busy )
+      consume(c);
+  }
+  return;
+
+too_large:
+  c->busy = 1;
+  reply_error(c, "413 Request too large");
+}
+
+// Called at the end of every lwIP callback for the connection; this is
+// where a connection which is done is released
+static err_t settle( httpd_conn *c )
+{
+  struct tcp_pcb *pcb = c->pcb;
+
+  process(c);
+  if( c->dead ){
+    conn_abort(c);
+    return ERR_ABRT;
+  }
+  if( c->closing ){
+    conn_free(c);
+    linger_close(pcb);
+  }
+  return ERR_OK;
+}
+
+static err_t conn_recv( void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err )
+{
+  httpd_conn *c = arg;
+
+  if( !c || !p || err != ERR_OK ){
+    // the client has closed its side, nothing more can be answered
+    if( p )
+      pbuf_free(p);
+    tcp_arg(pcb, 0);
+    tcp_recv(pcb, 0);
+    tcp_sent(pcb, 0);
+    tcp_poll(pcb, 0, 0);
+    tcp_err(pcb, 0);
+    if( c )
+      conn_free(c);
+    if( tcp_close(pcb) != ERR_OK ){
+      tcp_abort(pcb);
+      return ERR_ABRT;
+    }
+    return ERR_OK;
+  }
+
+  uint16_t room = HTTPD_MAX_REQUEST - c->len;
+  uint16_t n = p->tot_len < room ? p->tot_len : room;
+  if( n < p->tot_len )
+    c->overflow = 1;
+  if( n ){
+    char *buf = c_realloc(c->buf, c->len + n + 1);
+    if( !buf ){
+      pbuf_free(p);
+      conn_abort(c);
+      return ERR_ABRT;
+    }
+    c->buf = buf;
+    pbuf_copy_partial(p, c->buf + c->len, n, 0);
+    c->len += n;
+    c->buf[c->len] = 0;
+  }
+  tcp_recved(pcb, p->tot_len);
+  pbuf_free(p);
+  c->idle = 0;
+  return settle(c);
+}
+
+static err_t conn_sent( void *arg, struct tcp_pcb *pcb, u16_t len )
+{
+  httpd_conn *c = arg;
+
+  (void)pcb; (void)len;
+  if( !c )
+    return ERR_OK;
+  c->idle = 0;
+  if( c->remain )
+    stream(c);
+  return settle(c);
+}
+
+static err_t conn_poll( void *arg, struct tcp_pcb *pcb )
+{
+  httpd_conn *c = arg;
+
+  if( !c ){
+    tcp_abort(pcb);
+    return ERR_ABRT;
+  }
+  if( c->remain )
+    stream(c);
+  else if( !c->busy && ++c->idle >= KEEPALIVE_POLLS )
+    c->closing = 1;
+  return settle(c);
+}
+
+static void conn_err( void *arg, err_t err )
+{
+  httpd_conn *c = arg;
+
+  (void)err;
+  if( c ){
+    c->pcb = NULL;    // already freed by lwIP
+    conn_free(c);
+  }
+}
+
+// Makes room for a new client by dropping one waiting on keep-alive
+static int drop_idle( httpd_server *srv )
+{
+  httpd_conn *c;
+
+  for( c = srv->conns; c; c = c->next ){
+    if( !c->busy && !c->len ){
+      conn_abort(c);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static err_t srv_accept( void *arg, struct tcp_pcb *pcb, err_t err )
+{
+  httpd_server *srv = arg;
+  httpd_conn *c;
+
+  if( err != ERR_OK || !srv )
+    return ERR_VAL;
+  tcp_accepted(srv->pcb);
+  if( (srv->nconns >= srv->max_conns && !drop_idle(srv))
+      || !(c = c_zalloc(sizeof(httpd_conn))) ){
+    tcp_abort(pcb);
+    return ERR_ABRT;
+  }
+  c->srv = srv;
+  c->pcb = pcb;
+  c->next = srv->conns;
+  srv->conns = c;
+  srv->nconns++;
+
+  tcp_arg(pcb, c);
+  tcp_recv(pcb, conn_recv);
+  tcp_sent(pcb, conn_sent);
+  tcp_err(pcb, conn_err);
+  tcp_poll(pcb, conn_poll, HTTPD_POLL_INTERVAL);
+  tcp_nagle_disable(pcb);
+  return ERR_OK;
+}
+
+httpd_server *httpd_start( uint16_t port, uint8_t max_conns, httpd_request_fn on_request, httpd_close_fn on_close, void *arg )
+{
+  httpd_server *srv = c_zalloc(sizeof(httpd_server));
+  struct tcp_pcb *pcb;
+
+  if( !srv )
+    return NULL;
+  if( !(pcb = tcp_new()) ){
+    c_free(srv);
+    return NULL;
+  }
+  if( tcp_bind(pcb, IP_ADDR_ANY, port) != ERR_OK || !(srv->pcb = tcp_listen(pcb)) ){
+    tcp_close(pcb);   // not freed by a failing tcp_listen
+    c_free(srv);
+    return NULL;
+  }
+  srv->on_request = on_request;
+  srv->on_close = on_close;
+  srv->arg = arg;
+  srv->max_conns = max_conns;
+  tcp_arg(srv->pcb, srv);
+  tcp_accept(srv->pcb, srv_accept);
+  return srv;
+}
+
+void httpd_stop( httpd_server *srv )
+{
+  if( !srv )
+    return;
+  tcp_close(srv->pcb);   // cannot fail for listening sockets
+  while( srv->conns )
+    conn_abort(srv->conns);
+  c_free(srv);
+}
@@ -0,0 +1,69 @@
+#ifndef __HTTPD_H__
+#define __HTTPD_H__
+
+#include "c_types.h"
+
+/*
+ * A small HTTP/1.1 server on the raw lwIP TCP API.
+ *
+ * Requests are collected per connection and handed to a single handler
+ * callback once complete. The handler answers with one of the httpd_send_*
+ * functions, either right away or later (e.g. from a scan callback), after
+ * which the connection either waits for the next request (keep-alive) or
+ * is closed. Files are streamed from VFS in send buffer sized chunks, and
+ * constant data is sent without copying it, so the size of a response is
+ * not limited by the heap.
+ */
+
+// Largest request head plus body that is accepted
+#ifndef HTTPD_MAX_REQUEST
+#define HTTPD_MAX_REQUEST 2048
+#endif
+
+// Seconds an idle keep-alive connection is held open
+#ifndef HTTPD_KEEPALIVE_SECS
+#define HTTPD_KEEPALIVE_SECS 10
+#endif
+
+typedef struct httpd_server httpd_server;
+typedef struct httpd_conn httpd_conn;
+
+typedef struct {
+  const char *method;
+  const char *path;         // without the query
+  const char *query;        // text after the '?', or ""
+  const char *headers;      // the header lines, each ending with \r\n
+  const char *body;
+  uint16_t body_len;
+} httpd_request;
+
+// Called for each request. The response may be sent later, as long as the
+// connection has not been reported closed to httpd_close_fn in the meantime.
+typedef void (*httpd_request_fn)( httpd_conn *conn, const httpd_request *req, void *arg );
+// Called when a connection goes away, e.g. to drop a deferred response
+typedef void (*httpd_close_fn)( httpd_conn *conn, void *arg );
+
+httpd_server *httpd_start( uint16_t port, uint8_t max_conns, httpd_request_fn on_request, httpd_close_fn on_close, void *arg );
+void httpd_stop( httpd_server *srv );
+
+// Returns the value of a request header, which runs up to the next \r\n
+const char *httpd_header( const httpd_request *req, const char *name );
+
+// Per connection pointer for the owner of the server
+void httpd_set_user( httpd_conn *conn, void *user );
+void *httpd_get_user( httpd_conn *conn );
+
+/*
+ * Responses. status is the status line without the protocol, e.g. "200 OK",
+ * and headers any extra header lines, each ending with \r\n, or NULL.
+ * Content-Length and Connection are added here. All return 0 on success;
+ * on failure the connection is dropped.
+ */
+int httpd_send( httpd_conn *conn, const char *status, const char *headers, const char *body, size_t len );
+// data must stay valid until the connection is closed; it is sent with
+// Content-Encoding: gzip if it starts with the gzip magic
+int httpd_send_static( httpd_conn *conn, const char *ctype, const char *headers, const char *data, size_t len );
+// Prefers name.gz over name. Returns 1 without sending anything if neither exists.
+int httpd_send_file( httpd_conn *conn, const char *name, const char *ctype, const char *headers );
+
+#endif
@@ -53,7 +53,28 @@
 #define I2C_MASTER_SDA_LOW_SCL_LOW()  \
     gpio_output_set(0, 1<<I2C_MASTER_SDA_GPIO | 1<<I2C_MASTER_SCL_GPIO, 1<<I2C_MASTER_SDA_GPIO | 1<<I2C_MASTER_SCL_GPIO, 0)
 
+// SCL frequency limits in Hz
+#define I2C_MASTER_SPEED_MIN      10000
+#define I2C_MASTER_SPEED_DEFAULT  100000
+#define I2C_MASTER_SPEED_MAX      1000000
+
+// give up waiting for a slave which stretches the clock after this time
+#define I2C_MASTER_STRETCH_TIMEOUT_US 10000
+
+// bus statistics, cycle counts are normalized to 80 MHz (12.5 ns units)
+typedef struct {
+    uint32 starts;          // start and repeated start conditions
+    uint32 bytes;           // data and address bytes transferred
+    uint32 bits;            // clocked bits, excluding ack bits
+    uint32 bit_cycles;      // time spent clocking those bits
+    uint32 stretch_cycles;  // time SCL was held low by slaves
+    uint32 nacks;           // not acknowledged bytes
+    uint32 timeouts;        // clock stretching timeouts
+} i2c_master_stats_t;
+
 void i2c_master_gpio_init(uint8 sda, uint8 scl);
+uint32 i2c_master_set_speed(uint32 speed);
+void i2c_master_get_stats(i2c_master_stats_t *stats, bool reset);
 void i2c_master_init(void);
 
 #define i2c_master_wait    os_delay_us
@@ -1,7 +1,7 @@
 #ifndef __PWM_H__
 #define __PWM_H__
 
-#define PWM_CHANNEL 6
+#define PWM_CHANNEL 12
 
 struct pwm_single_param {
 	uint16 gpio_set;
@@ -13,6 +13,16 @@ struct pwm_param {
     uint32 period;
     uint16 freq;
     uint16  duty[PWM_CHANNEL];
+    uint16  phase[PWM_CHANNEL];
+};
+
+struct pwm_fade_param {
+    uint32 start;
+    uint32 duration;
+    uint16 from;
+    uint16 to;
+    uint8 curve;
+    uint8 active;
 };
 
 #define PWM_DEPTH 1023
@@ -20,6 +30,16 @@ struct pwm_param {
 
 #define PWM_1S 1000000
 
+// Fades are advanced once this much time has passed in PWM periods
+#define PWM_FADE_TICK_US 10000
+
+#define PWM_FADE_LINEAR      0
+#define PWM_FADE_EASE_IN     1
+#define PWM_FADE_EASE_OUT    2
+#define PWM_FADE_EASE_IN_OUT 3
+
+typedef void (*pwm_fade_cb)(uint8 channel);
+
 // #define PWM_0_OUT_IO_MUX PERIPHS_IO_MUX_MTMS_U
 // #define PWM_0_OUT_IO_NUM 14
 // #define PWM_0_OUT_IO_FUNC  FUNC_GPIO14
@@ -42,5 +62,11 @@ uint16 pwm_get_freq(uint8 channel);
 bool pwm_add(uint8 channel);
 bool pwm_delete(uint8 channel);
 bool pwm_exist(uint8 channel);
+
+void pwm_set_phase(uint16 phase, uint8 channel);
+uint16 pwm_get_phase(uint8 channel);
+bool pwm_fade(uint16 duty, uint32 ms, uint8 curve, uint8 channel);
+bool pwm_fading(uint8 channel);
+void pwm_fade_set_cb(pwm_fade_cb cb);
 #endif
 
@@ -36,6 +36,34 @@ uint32 spi_mast_get_miso(uint8 spi_no, uint16 offset, uint8 bitlen);
 void spi_mast_transaction(uint8 spi_no, uint8 cmd_bitlen, uint16 cmd_data, uint8 addr_bitlen, uint32 addr_data,
                           uint16 mosi_bitlen, uint8 dummy_bitlen, sint16 miso_bitlen);
 
+// queued transactions
+#define SPI_TRANS_CS_KEEP   0x01   // leave CS asserted after this descriptor
+#define SPI_TRANS_STARTED   0x80   // internal: descriptor is on the bus
+
+struct spi_trans_desc;
+typedef void (*spi_trans_cb_t)(struct spi_trans_desc *desc);
+
+typedef struct spi_trans_desc {
+    struct spi_trans_desc *next;
+    uint32 cs_mask;         // GPIO bit mask of a software CS line, 0 to use the hardware CS
+    uint16 cmd_data;
+    uint8  cmd_bitlen;
+    uint8  addr_bitlen;
+    uint32 addr_data;
+    uint8  dummy_bitlen;
+    uint8  flags;
+    const uint8 *tx;        // data phase MOSI bytes, NULL sends 0xff
+    uint8 *rx;              // data phase MISO bytes, NULL for half-duplex writes
+    size_t len;             // data phase length in bytes
+    size_t done;            // bytes transferred so far
+    spi_trans_cb_t cb;      // invoked in task context once the descriptor completed
+    void *arg;
+} spi_trans_desc_t;
+
+int spi_queue_submit(uint8 spi_no, spi_trans_desc_t *desc);
+uint32 spi_queue_pending(uint8 spi_no);
+void spi_queue_wait(uint8 spi_no);
+
 //transmit data to esp8266 slave buffer,which needs 16bit transmission ,
 //first byte is master command 0x04, second byte is master data
 void spi_byte_write_espslave(uint8 spi_no,uint8 data);
@@ -0,0 +1,61 @@
+#ifndef __HEAP_PROFILE_H__
+#define __HEAP_PROFILE_H__
+
+#include "user_config.h"
+
+#ifdef HEAP_PROFILE
+
+#include "c_types.h"
+
+// Number of live blocks which can be tracked, a power of 2. Each costs 8 bytes.
+#ifndef HEAP_PROFILE_BLOCKS
+#define HEAP_PROFILE_BLOCKS 512
+#endif
+
+// Number of distinct allocation sites, a power of 2 no bigger than 128
+#ifndef HEAP_PROFILE_SITES
+#define HEAP_PROFILE_SITES  64
+#endif
+
+#define HEAP_PROFILE_NAMELEN 16
+
+// Free block histogram buckets: [16,32), [32,64), ... [32768,inf)
+#define HEAP_PROFILE_HIST   12
+#define HEAP_PROFILE_MINBLOCK 16
+
+typedef struct {
+  char name[HEAP_PROFILE_NAMELEN];  // basename of the C file or Lua chunk
+  uint16_t line;
+  uint8_t lua;                      // site is a line of Lua code
+  uint32_t live;                    // bytes currently allocated
+  uint32_t peak;                    // highest value of live
+  uint32_t blocks;                  // blocks currently allocated
+  uint32_t allocs;                  // allocations made since the last reset
+} heap_profile_site_t;
+
+typedef struct {
+  uint32_t free;                    // as reported by the SDK
+  uint32_t largest;                 // largest block that can be allocated
+  uint32_t blocks;                  // free blocks found of at least HEAP_PROFILE_MINBLOCK
+  uint32_t hist[HEAP_PROFILE_HIST];
+  uint32_t tracked;                 // live blocks known to the profiler
+  uint32_t untracked;               // allocations missed as the block table was full
+} heap_profile_frag_t;
+
+// Every call site gets its own copy of the file name in flash, as the SDK's
+// MEMLEAK_DEBUG does, so that a site can be identified by its address.
+#define HEAP_PROFILE_SITE \
+  ({ static const char heap_profile_file[] ICACHE_RODATA_ATTR __attribute__((aligned(4))) = __FILE__; heap_profile_file; }), __LINE__
+
+void *heap_profile_alloc( size_t size, bool zero, const char *file, unsigned line );
+void *heap_profile_realloc( void *ptr, size_t size, const char *file, unsigned line );
+void *heap_profile_lua_realloc( void *ptr, size_t size, const char *source, unsigned line );
+void heap_profile_free( void *ptr );
+
+int heap_profile_get_site( unsigned idx, heap_profile_site_t *site );
+void heap_profile_reset( void );
+void heap_profile_fragmentation( heap_profile_frag_t *frag );
+
+#endif
+
+#endif
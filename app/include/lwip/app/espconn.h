@@ -681,6 +681,34 @@ extern bool espconn_secure_set_size(uint8 level, uint16 size);
 
 extern sint16 espconn_secure_get_size(uint8 level);
 
+/******************************************************************************
+ * FunctionName : espconn_secure_set_max_fragment_length
+ * Description  : set the maximum fragment length (RFC 6066) the client asks
+ *                               the server for in new connections
+ * Parameters   : level -- only 1: client
+ *                               length -- 512, 1024, 2048 or 4096, 0 to not ask
+ * Returns      : true or false
+*******************************************************************************/
+
+extern bool espconn_secure_set_max_fragment_length(uint8 level, uint16 length);
+
+typedef struct _espconn_secure_buffer {
+	struct espconn *pespconn;
+	uint16 in_size;         // bytes currently allocated for incoming records
+	uint16 out_size;        // bytes currently allocated for outgoing records
+	uint16 max_frag_len;    // negotiated maximum fragment length, 0 if none
+} espconn_secure_buffer;
+
+/******************************************************************************
+ * FunctionName : espconn_secure_get_buffer_info
+ * Description  : get the record buffer sizes of the open secure connections
+ * Parameters   : info -- array to fill in
+ *                               max -- number of entries in info
+ * Returns      : number of entries filled in
+*******************************************************************************/
+
+extern uint8 espconn_secure_get_buffer_info(espconn_secure_buffer *info, uint8 max);
+
 /******************************************************************************
  * FunctionName : espconn_secure_ca_enable
  * Description  : enable the certificate authenticate and set the flash sector
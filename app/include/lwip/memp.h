@@ -83,10 +83,31 @@ extern const u32_t memp_sizes[MEMP_MAX];
 
 #include "mem.h"
 
+#if MEMP_PREALLOC
+
+/** Usage of a preallocated pool */
+struct memp_pool_stats {
+  u16_t size;       /* of an element */
+  u16_t num;        /* elements preallocated */
+  u16_t used;       /* elements in use */
+  u16_t max;        /* highest value of used */
+  u32_t fallback;   /* elements taken from the heap as the pool was empty */
+  u32_t failed;     /* allocations that failed on the heap as well */
+};
+
+void  memp_init(void)ICACHE_FLASH_ATTR;
+void *memp_malloc(memp_t type)ICACHE_FLASH_ATTR;
+void  memp_free(memp_t type, void *mem)ICACHE_FLASH_ATTR;
+const char *memp_pool_stats(memp_t type, struct memp_pool_stats *stats, int reset)ICACHE_FLASH_ATTR;
+
+#else /* MEMP_PREALLOC */
+
 #define memp_init()
 #define memp_malloc(type)     mem_malloc(memp_sizes[type])
 #define memp_free(type, mem)  mem_free(mem)
 
+#endif /* MEMP_PREALLOC */
+
 #else /* MEMP_MEM_MALLOC */
 
 #if MEM_USE_POOLS
@@ -109,6 +109,37 @@
 #define MEMP_MEM_MALLOC                 1
 #endif
 
+/**
+ * MEMP_PREALLOC==1: With MEMP_MEM_MALLOC, keep preallocated pools for the
+ * busiest memp types. The pools are taken from the heap once, in memp_init(),
+ * while it is still unfragmented; when a pool runs out, further elements come
+ * from the heap as before. Usage counters are kept per pool, see net.stats().
+ */
+#ifndef MEMP_PREALLOC
+#define MEMP_PREALLOC                   0
+#endif
+
+/**
+ * MEMP_PREALLOC_xxx: the number of elements preallocated for each pool.
+ * The ESP8266 driver receives into PBUF_REF pbufs, so the PBUF_POOL pool
+ * is only used by code that asks for PBUF_POOL pbufs explicitly.
+ */
+#ifndef MEMP_PREALLOC_PBUF
+#define MEMP_PREALLOC_PBUF              8
+#endif
+#ifndef MEMP_PREALLOC_PBUF_POOL
+#define MEMP_PREALLOC_PBUF_POOL         0
+#endif
+#ifndef MEMP_PREALLOC_TCP_SEG
+#define MEMP_PREALLOC_TCP_SEG           16
+#endif
+#ifndef MEMP_PREALLOC_TCP_PCB
+#define MEMP_PREALLOC_TCP_PCB           5
+#endif
+#ifndef MEMP_PREALLOC_UDP_PCB
+#define MEMP_PREALLOC_UDP_PCB           4
+#endif
+
 /**
  * MEM_ALIGNMENT: should be set to the alignment of the CPU
  *    4 byte alignment -> #define MEM_ALIGNMENT 4
@@ -1235,6 +1235,22 @@
  */
 #define MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
 
+/**
+ * \def MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+ *
+ * Allocate the record buffers on demand. The incoming buffer grows when a
+ * record larger than it arrives and the outgoing buffer when a larger record
+ * is written, up to MBEDTLS_SSL_IN_CONTENT_LEN and MBEDTLS_SSL_OUT_CONTENT_LEN
+ * respectively. Between records both are cut back to
+ * MBEDTLS_SSL_IDLE_CONTENT_LEN.
+ *
+ * This saves most of the buffer memory of idle connections, at the cost of
+ * a reallocation around each large record.
+ *
+ * Uncomment this macro to enable variable length record buffers
+ */
+//#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+
 /**
  * \def MBEDTLS_SSL_PROTO_SSL3
  *
@@ -223,6 +223,31 @@
 #define MBEDTLS_SSL_MAX_CONTENT_LEN         16384   /**< Size of the input / output buffer */
 #endif
 
+/*
+ * Maximum length of incoming and outgoing records, if they differ.
+ * Outgoing records are cut to MBEDTLS_SSL_OUT_CONTENT_LEN, but the
+ * handshake messages we send (notably our own certificate chain) must fit
+ * in it as well. The peer has to be told about a smaller incoming limit
+ * with the Max Fragment Length extension.
+ */
+#if !defined(MBEDTLS_SSL_IN_CONTENT_LEN)
+#define MBEDTLS_SSL_IN_CONTENT_LEN          MBEDTLS_SSL_MAX_CONTENT_LEN
+#endif
+
+#if !defined(MBEDTLS_SSL_OUT_CONTENT_LEN)
+#define MBEDTLS_SSL_OUT_CONTENT_LEN         MBEDTLS_SSL_MAX_CONTENT_LEN
+#endif
+
+/*
+ * With MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH, both buffers are cut back to
+ * hold records of this size while the connection is idle, and grown again
+ * for larger records. The outgoing buffer is kept at full size during the
+ * handshake.
+ */
+#if !defined(MBEDTLS_SSL_IDLE_CONTENT_LEN)
+#define MBEDTLS_SSL_IDLE_CONTENT_LEN        512
+#endif
+
 /* \} name SECTION: Module settings */
 
 /*
@@ -833,6 +858,7 @@ struct mbedtls_ssl_context
     int in_msgtype;             /*!< record header: message type      */
     size_t in_msglen;           /*!< record header: message length    */
     size_t in_left;             /*!< amount of data read so far       */
+    size_t in_buf_len;          /*!< allocated size of in_buf         */
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     uint16_t in_epoch;          /*!< DTLS epoch for incoming records  */
     size_t next_record_offset;  /*!< offset of the next record in datagram
@@ -863,6 +889,7 @@ struct mbedtls_ssl_context
     int out_msgtype;            /*!< record header: message type      */
     size_t out_msglen;          /*!< record header: message length    */
     size_t out_left;            /*!< amount of data not yet written   */
+    size_t out_buf_len;         /*!< allocated size of out_buf        */
 
 #if defined(MBEDTLS_ZLIB_SUPPORT)
     unsigned char *compress_buf;        /*!<  zlib data buffer        */
@@ -167,6 +167,23 @@
 #define MBEDTLS_SSL_BUFFER_LEN  \
     ( ( MBEDTLS_SSL_HEADER_LEN ) + ( MBEDTLS_SSL_PAYLOAD_LEN ) )
 
+/* Buffer size needed for records with up to len bytes of content */
+#define MBEDTLS_SSL_BUFFER_LEN_FOR( len )                           \
+    ( MBEDTLS_SSL_HEADER_LEN + ( len )                              \
+                        + MBEDTLS_SSL_COMPRESSION_ADD               \
+                        + MBEDTLS_MAX_IV_LENGTH                     \
+                        + MBEDTLS_SSL_MAC_ADD                       \
+                        + MBEDTLS_SSL_PADDING_ADD                   \
+                        )
+
+#define MBEDTLS_SSL_IN_BUFFER_LEN   MBEDTLS_SSL_BUFFER_LEN_FOR( MBEDTLS_SSL_IN_CONTENT_LEN )
+#define MBEDTLS_SSL_OUT_BUFFER_LEN  MBEDTLS_SSL_BUFFER_LEN_FOR( MBEDTLS_SSL_OUT_CONTENT_LEN )
+
+#if MBEDTLS_SSL_IN_CONTENT_LEN > MBEDTLS_SSL_MAX_CONTENT_LEN || \
+    MBEDTLS_SSL_OUT_CONTENT_LEN > MBEDTLS_SSL_MAX_CONTENT_LEN
+#error Bad configuration - record content larger than MBEDTLS_SSL_MAX_CONTENT_LEN.
+#endif
+
 /*
  * TLS extension flags (for extensions with outgoing ServerHello content
  * that need it (e.g. for RENEGOTIATION_INFO the server already knows because
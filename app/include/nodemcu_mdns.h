@@ -9,8 +9,30 @@ struct nodemcu_mdns_info {
 	const char *txt_data[10];
 };
 
+#define NODEMCU_MDNS_NAME_LEN 64
+#define NODEMCU_MDNS_DATA_LEN 96
+
+/* A record in the query cache */
+struct nodemcu_mdns_rr {
+	char name[NODEMCU_MDNS_NAME_LEN];	/* dotted, e.g. "fishtank.local" */
+	uint16 type;
+	uint16 port;				/* SRV only */
+	uint32 ttl;
+	uint32 expires;				/* seconds since boot */
+	uint8 len;
+	uint8 data[NODEMCU_MDNS_DATA_LEN];	/* A: address, PTR and SRV: dotted target name
+						   with the terminating 0, TXT: the raw strings */
+};
+
+/* Called when answers have been added to the cache */
+typedef void (*nodemcu_mdns_answer_fn)(void);
+
 void nodemcu_mdns_close(void);
 bool nodemcu_mdns_init(struct nodemcu_mdns_info *);
 
+bool nodemcu_mdns_query(const char *name, uint16 type, nodemcu_mdns_answer_fn fn);
+/* Iterates over the unexpired records of a name and type, start with prev NULL */
+const struct nodemcu_mdns_rr *nodemcu_mdns_lookup(const char *name, uint16 type, const struct nodemcu_mdns_rr *prev);
+
 
 #endif
@@ -44,7 +44,7 @@
 // 4: Reload value for (10). Needs to be applied by the firmware in the real boot (rtc_restart_samples_to_take())
 //
 // 5: FIFO location. First FIFO address in bits 0:7, first non-FIFO address in bits 8:15.
-//                   Number of tag spaces in bits 16:23
+//                   Number of tag spaces in bits 16:23, storage format in bits 24:31
 // 6: Number of samples in FIFO.
 // 7: FIFO tail (where next sample will be written. Increments by 1 for each sample)
 // 8: FIFO head (where next sample will be read. Increments by 1 for each sample)
@@ -53,6 +53,9 @@
 // 10: FIFO tail timestamp. Used and maintained when adding things to the FIFO. This is the timestamp of the
 //    most recent sample to have been added. I.e. a new sample's delta-t is calculated relative to this
 // (9/10) are meaningless when (3) is zero
+// 11: FIFO head delta-t. Packed format only, the most recent non-zero delta-t pulled off
+// 12: FIFO tail delta-t. Packed format only, the most recent non-zero delta-t added
+// 13-15: Flash log head, tail and count, for modules which spill the FIFO to flash
 //
 
 #define RTC_FIFO_BASE          10
@@ -72,6 +75,11 @@
 #define RTC_FIFOHEAD_POS       (RTC_FIFO_BASE+8)
 #define RTC_FIFOTAIL_T_POS     (RTC_FIFO_BASE+9)
 #define RTC_FIFOHEAD_T_POS     (RTC_FIFO_BASE+10)
+#define RTC_FIFOHEAD_DT_POS    (RTC_FIFO_BASE+11)
+#define RTC_FIFOTAIL_DT_POS    (RTC_FIFO_BASE+12)
+#define RTC_SPILLHEAD_POS      (RTC_FIFO_BASE+13)
+#define RTC_SPILLTAIL_POS      (RTC_FIFO_BASE+14)
+#define RTC_SPILLCOUNT_POS     (RTC_FIFO_BASE+15)
 
 // 32-127: FIFO space. Consisting of a number of tag spaces (see 4), followed by data entries.
 //     Data entries consist of:
@@ -80,6 +88,24 @@
 //     Bits 16:24  -> delta-t in seconds from previous entry
 //     Bits 0:15   -> sample value
 
+// Packed format: the tag spaces are followed by the value of each tag at the head and
+//     at the tail (bits 0:28 value, bits 29:31 decimals), two blocks of tag spaces each.
+//     The rest is a ring of bytes, head and tail are byte offsets into it. Each sample is
+//     a header byte, optionally followed by delta-t and value varints:
+//     Bits 0:3    -> tag index. 0-15
+//     Bits 4:5    -> delta-t. 0: same time, 1: same delta-t as the previous non-zero one,
+//                    2: zigzag varint follows
+//     Bits 6:7    -> value. 0: unchanged, 1: +1, 2: -1, 3: varint follows, holding the
+//                    zigzag delta in bits 3:31 and the decimals in bits 0:2
+//     Values are 29 bit signed, and deltas are taken from the previous sample of the same tag.
+
+#define RTC_FIFO_FORMAT_FIXED  0
+#define RTC_FIFO_FORMAT_PACKED 1
+
+#define RTC_FIFO_VALUE_MASK    0x1fffffff
+#define RTC_FIFO_MAX_RECORD    11
+#define RTC_FIFO_MAX_TAGS      16
+
 #define RTC_DEFAULT_FIFO_START 32
 #define RTC_DEFAULT_FIFO_END  128
 #define RTC_DEFAULT_TAGCOUNT    5
@@ -97,7 +123,17 @@ typedef struct
   uint32_t tag;
 } sample_t;
 
+// Read position of a packed FIFO
+typedef struct
+{
+  uint32_t pos;
+  uint32_t timestamp;
+  uint32_t deltat;
+  uint32_t state[RTC_FIFO_MAX_TAGS];
+} rtc_fifo_cursor_t;
+
 static inline void rtc_fifo_clear_content(void);
+static inline int8_t rtc_fifo_pop_sample(sample_t* dst);
 
 static inline uint32_t rtc_fifo_get_tail(void)
 {
@@ -166,14 +202,55 @@ static inline uint32_t rtc_fifo_get_last(void)
   return (rtc_mem_read(RTC_FIFOLOC_POS)>>8)&0xff;
 }
 
+static inline uint32_t rtc_fifo_get_format(void)
+{
+  return (rtc_mem_read(RTC_FIFOLOC_POS)>>24)&0xff;
+}
+
+static inline uint8_t rtc_fifo_is_packed(void)
+{
+  return rtc_fifo_get_format()==RTC_FIFO_FORMAT_PACKED;
+}
+
+// Number of slots taken by tag names, and the tag states of a packed FIFO
+static inline uint32_t rtc_fifo_get_tagspace(void)
+{
+  uint32_t count=rtc_fifo_get_tagcount();
+  return rtc_fifo_is_packed() ? 3*count : count;
+}
+
 static inline uint32_t rtc_fifo_get_first(void)
+{
+  return rtc_fifo_get_tagpos()+rtc_fifo_get_tagspace();
+}
+
+// Size of the byte ring of a packed FIFO
+static inline uint32_t rtc_fifo_get_size(void)
+{
+  return (rtc_fifo_get_last()-rtc_fifo_get_first())*4;
+}
+
+static inline uint32_t rtc_fifo_get_head_state_pos(void)
 {
   return rtc_fifo_get_tagpos()+rtc_fifo_get_tagcount();
 }
 
+static inline uint32_t rtc_fifo_get_tail_state_pos(void)
+{
+  return rtc_fifo_get_tagpos()+2*rtc_fifo_get_tagcount();
+}
+
+// Keeps the storage format
 static inline void rtc_fifo_put_loc(uint32_t first, uint32_t last, uint32_t tagcount)
 {
-  rtc_mem_write(RTC_FIFOLOC_POS,first+(last<<8)+(tagcount<<16));
+  uint32_t format=rtc_mem_read(RTC_FIFOLOC_POS)&0xff000000;
+  rtc_mem_write(RTC_FIFOLOC_POS,first+(last<<8)+(tagcount<<16)+format);
+}
+
+static inline void rtc_fifo_put_format(uint32_t format)
+{
+  uint32_t loc=rtc_mem_read(RTC_FIFOLOC_POS)&0x00ffffff;
+  rtc_mem_write(RTC_FIFOLOC_POS,loc+(format<<24));
 }
 
 static inline uint32_t rtc_fifo_normalise_index(uint32_t index)
@@ -250,6 +327,133 @@ static inline void rtc_fifo_fill_sample(sample_t* dst, uint32_t entry, uint32_t
   dst->tag=rtc_fifo_get_tag_from_entry(entry);
 }
 
+static inline uint32_t rtc_fifo_zigzag(int32_t val)
+{
+  return ((uint32_t)val<<1)^(uint32_t)(val>>31);
+}
+
+static inline int32_t rtc_fifo_unzigzag(uint32_t val)
+{
+  return (int32_t)((val>>1)^(0-(val&1)));
+}
+
+static inline int32_t rtc_fifo_sign_extend(uint32_t val)
+{
+  return ((int32_t)(val<<3))>>3;
+}
+
+static inline uint32_t rtc_fifo_read_byte(uint32_t first, uint32_t size, uint32_t* pos)
+{
+  uint32_t at=*pos;
+  *pos=(at+1==size) ? 0 : at+1;
+  return (rtc_mem_read(first+(at>>2))>>((at&3)*8))&0xff;
+}
+
+static inline void rtc_fifo_write_byte(uint32_t first, uint32_t size, uint32_t* pos, uint32_t val)
+{
+  uint32_t at=*pos;
+  uint32_t shift=(at&3)*8;
+  uint32_t word=rtc_mem_read(first+(at>>2));
+  rtc_mem_write(first+(at>>2),(word&~(0xffu<<shift))|((val&0xff)<<shift));
+  *pos=(at+1==size) ? 0 : at+1;
+}
+
+static inline uint32_t rtc_fifo_read_varint(uint32_t first, uint32_t size, uint32_t* pos)
+{
+  uint32_t val=0,shift=0,b;
+  do
+  {
+    b=rtc_fifo_read_byte(first,size,pos);
+    val|=(b&0x7f)<<shift;
+    shift+=7;
+  } while ((b&0x80) && shift<35);
+  return val;
+}
+
+static inline uint32_t rtc_fifo_put_varint(uint8_t* dst, uint32_t val)
+{
+  uint32_t n=0;
+  while (val>=0x80)
+  {
+    dst[n++]=val|0x80;
+    val>>=7;
+  }
+  dst[n++]=val;
+  return n;
+}
+
+static inline void rtc_fifo_load_cursor(rtc_fifo_cursor_t* c)
+{
+  uint32_t states_at=rtc_fifo_get_head_state_pos();
+  uint32_t count=rtc_fifo_get_tagcount();
+  uint32_t i;
+
+  c->pos=rtc_fifo_get_head();
+  c->timestamp=rtc_fifo_get_head_t();
+  c->deltat=rtc_mem_read(RTC_FIFOHEAD_DT_POS);
+  for (i=0;i<count && i<RTC_FIFO_MAX_TAGS;i++)
+    c->state[i]=rtc_mem_read(states_at+i);
+}
+
+// Decodes the sample at the cursor and moves past it, returns the tag index
+static inline uint32_t rtc_fifo_decode_sample(rtc_fifo_cursor_t* c, sample_t* dst)
+{
+  uint32_t first=rtc_fifo_get_first();
+  uint32_t size=rtc_fifo_get_size();
+  uint32_t hdr=rtc_fifo_read_byte(first,size,&c->pos);
+  uint32_t index=hdr&0x0f;
+  uint32_t state=c->state[index];
+  uint32_t val;
+
+  switch ((hdr>>4)&0x03)
+  {
+    case 1:
+      c->timestamp+=c->deltat;
+      break;
+    case 2:
+      val=rtc_fifo_unzigzag(rtc_fifo_read_varint(first,size,&c->pos));
+      c->timestamp+=val;
+      if (val)
+        c->deltat=val;
+      break;
+  }
+  switch (hdr>>6)
+  {
+    case 1:
+      state=(state&~RTC_FIFO_VALUE_MASK)|((state+1)&RTC_FIFO_VALUE_MASK);
+      break;
+    case 2:
+      state=(state&~RTC_FIFO_VALUE_MASK)|((state-1)&RTC_FIFO_VALUE_MASK);
+      break;
+    case 3:
+      val=rtc_fifo_read_varint(first,size,&c->pos);
+      state=((val&0x07)<<29)|((state+rtc_fifo_unzigzag(val>>3))&RTC_FIFO_VALUE_MASK);
+      break;
+  }
+  c->state[index]=state;
+
+  dst->timestamp=c->timestamp;
+  dst->value=rtc_fifo_sign_extend(state&RTC_FIFO_VALUE_MASK);
+  dst->decimals=state>>29;
+  dst->tag=rtc_mem_read(rtc_fifo_get_tagpos()+index);
+  return index;
+}
+
+static inline int8_t rtc_fifo_pop_packed(sample_t* dst)
+{
+  rtc_fifo_cursor_t c;
+  uint32_t index;
+
+  rtc_fifo_load_cursor(&c);
+  index=rtc_fifo_decode_sample(&c,dst);
+
+  rtc_fifo_put_head(c.pos);
+  rtc_fifo_put_head_t(c.timestamp);
+  rtc_mem_write(RTC_FIFOHEAD_DT_POS,c.deltat);
+  rtc_mem_write(rtc_fifo_get_head_state_pos()+index,c.state[index]);
+  rtc_fifo_decrement_count();
+  return 1;
+}
 
 // returns 1 if sample popped, 0 if not
 static inline int8_t rtc_fifo_pop_sample(sample_t* dst)
@@ -258,6 +462,8 @@ static inline int8_t rtc_fifo_pop_sample(sample_t* dst)
 
   if (count==0)
     return 0;
+  if (rtc_fifo_is_packed())
+    return rtc_fifo_pop_packed(dst);
   uint32_t head=rtc_fifo_get_head();
   uint32_t timestamp=rtc_fifo_get_head_t();
   uint32_t entry=rtc_mem_read(head);
@@ -277,6 +483,15 @@ static inline int8_t rtc_fifo_peek_sample(sample_t* dst, uint32_t from_top)
 {
   if (rtc_fifo_get_count()<=from_top)
     return 0;
+  if (rtc_fifo_is_packed())
+  {
+    rtc_fifo_cursor_t c;
+    rtc_fifo_load_cursor(&c);
+    do
+      rtc_fifo_decode_sample(&c,dst);
+    while (from_top--);
+    return 1;
+  }
   uint32_t head=rtc_fifo_get_head();
   uint32_t entry=rtc_mem_read(head);
   uint32_t timestamp=rtc_fifo_get_head_t();
@@ -299,6 +514,13 @@ static inline void rtc_fifo_drop_samples(uint32_t from_top)
 
   if (count<=from_top)
     from_top=count;
+  if (rtc_fifo_is_packed())
+  {
+    sample_t dummy;
+    while (from_top--)
+      rtc_fifo_pop_packed(&dummy);
+    return;
+  }
   uint32_t head=rtc_fifo_get_head();
   uint32_t head_t=rtc_fifo_get_head_t();
 
@@ -348,8 +570,103 @@ static uint32_t rtc_fifo_construct_entry(uint32_t val, uint32_t tagindex, uint32
          ((decimals & 0x7)<<25) + ((tagindex & 0xf)<<28);
 }
 
+// Frees the oldest sample. If RTC_FIFO_SPILL is defined, it is first given the chance
+// to move samples elsewhere, and is expected to return the number of samples it moved.
+static inline void rtc_fifo_make_room(void)
+{
+  sample_t dummy;
+#ifdef RTC_FIFO_SPILL
+  if (RTC_FIFO_SPILL())
+    return;
+#endif
+  rtc_fifo_pop_sample(&dummy);
+}
+
+static inline void rtc_fifo_store_packed(const sample_t* s)
+{
+  uint8_t rec[RTC_FIFO_MAX_RECORD];
+  uint32_t n=1,hdr,used;
+  int32_t tagindex=rtc_fifo_find_tag_index(s->tag);
+
+  if (tagindex<0)
+  { // Out of tag spaces, start over
+    rtc_fifo_clear_content();
+    tagindex=rtc_fifo_find_tag_index(s->tag);
+    if (tagindex<0)
+      return;
+  }
+  if (rtc_fifo_get_count()==0)
+  {
+    rtc_fifo_put_head_t(s->timestamp);
+    rtc_fifo_put_tail_t(s->timestamp);
+    rtc_mem_write(RTC_FIFOHEAD_DT_POS,rtc_mem_read(RTC_FIFOTAIL_DT_POS));
+  }
+
+  uint32_t deltat=s->timestamp-rtc_fifo_get_tail_t();
+  uint32_t last_dt=rtc_mem_read(RTC_FIFOTAIL_DT_POS);
+  hdr=tagindex;
+  if (deltat!=0 && deltat==last_dt)
+    hdr|=1<<4;
+  else if (deltat!=0)
+  {
+    hdr|=2<<4;
+    n+=rtc_fifo_put_varint(rec+n,rtc_fifo_zigzag(deltat));
+    last_dt=deltat;
+  }
+
+  uint32_t state_pos=rtc_fifo_get_tail_state_pos()+tagindex;
+  uint32_t state=rtc_mem_read(state_pos);
+  uint32_t next=((s->decimals&0x07)<<29)|(s->value&RTC_FIFO_VALUE_MASK);
+  int32_t delta=rtc_fifo_sign_extend(next-state);
+  if ((next>>29)==(state>>29) && delta==1)
+    hdr|=1<<6;
+  else if ((next>>29)==(state>>29) && delta==-1)
+    hdr|=2<<6;
+  else if (next!=state)
+  {
+    hdr|=3<<6;
+    n+=rtc_fifo_put_varint(rec+n,(rtc_fifo_zigzag(delta)<<3)|(s->decimals&0x07));
+  }
+  rec[0]=hdr;
+
+  uint32_t first=rtc_fifo_get_first();
+  uint32_t size=rtc_fifo_get_size();
+  if (size<RTC_FIFO_MAX_RECORD)
+    return;
+  for (;;)
+  {
+    uint32_t head=rtc_fifo_get_head();
+    uint32_t tail=rtc_fifo_get_tail();
+    if (rtc_fifo_get_count()==0)
+      used=0;
+    else if (tail>head)
+      used=tail-head;
+    else
+      used=size-head+tail;
+    if (size-used>=n)
+      break;
+    rtc_fifo_make_room();
+  }
+
+  uint32_t tail=rtc_fifo_get_tail();
+  uint32_t i;
+  for (i=0;i<n;i++)
+    rtc_fifo_write_byte(first,size,&tail,rec[i]);
+  rtc_fifo_put_tail(tail);
+  rtc_fifo_put_tail_t(s->timestamp);
+  rtc_mem_write(RTC_FIFOTAIL_DT_POS,last_dt);
+  rtc_mem_write(state_pos,next);
+  rtc_fifo_increment_count();
+}
+
 static inline void rtc_fifo_store_sample(const sample_t* s)
 {
+  if (rtc_fifo_is_packed())
+  {
+    rtc_fifo_store_packed(s);
+    return;
+  }
+
   uint32_t head=rtc_fifo_get_head();
   uint32_t tail=rtc_fifo_get_tail();
   uint32_t count=rtc_fifo_get_count();
@@ -381,8 +698,8 @@ static inline void rtc_fifo_store_sample(const sample_t* s)
 
   if (head==tail && count>0)
   { // Full! Need to remove a sample
-    sample_t dummy;
-    rtc_fifo_pop_sample(&dummy);
+    rtc_fifo_make_room();
+    tail=rtc_fifo_get_tail();
   }
 
   rtc_mem_write(tail++,rtc_fifo_construct_entry(s->value,tagindex,s->decimals,deltat));
@@ -421,22 +738,25 @@ static inline uint32_t rtc_fifo_get_divisor(const sample_t* s)
   return div;
 }
 
+// Clears the tag states of a packed FIFO too
 static inline void rtc_fifo_clear_tags(void)
 {
   uint32_t tags_at=rtc_fifo_get_tagpos();
-  uint32_t count=rtc_fifo_get_tagcount();
+  uint32_t count=rtc_fifo_get_tagspace();
   while (count--)
     rtc_mem_write(tags_at++,0);
 }
 
 static inline void rtc_fifo_clear_content(void)
 {
-  uint32_t first=rtc_fifo_get_first();
+  uint32_t first=rtc_fifo_is_packed() ? 0 : rtc_fifo_get_first();
   rtc_fifo_put_tail(first);
   rtc_fifo_put_head(first);
   rtc_fifo_put_count(0);
   rtc_fifo_put_tail_t(0);
   rtc_fifo_put_head_t(0);
+  rtc_mem_write(RTC_FIFOTAIL_DT_POS,0);
+  rtc_mem_write(RTC_FIFOHEAD_DT_POS,0);
   rtc_fifo_clear_tags();
 }
 
@@ -478,13 +798,22 @@ static inline void rtc_fifo_deep_sleep_until_sample(uint32_t min_sleep_us)
   RTCTIME_SLEEP_ALIGNED(align,min_sleep_us);
 }
 
-static inline void rtc_fifo_prepare(uint32_t samples_per_boot, uint32_t us_per_sample, uint32_t tagcount)
+static inline void rtc_fifo_prepare_format(uint32_t samples_per_boot, uint32_t us_per_sample, uint32_t tagcount, uint32_t format)
 {
   rtc_mem_write(RTC_SAMPLESPERBOOT_POS,samples_per_boot);
   rtc_mem_write(RTC_ALIGNMENT_POS,us_per_sample);
+  rtc_mem_write(RTC_SPILLHEAD_POS,0);
+  rtc_mem_write(RTC_SPILLTAIL_POS,0);
+  rtc_mem_write(RTC_SPILLCOUNT_POS,0);
 
   rtc_put_samples_to_take(0);
+  rtc_fifo_put_format(format);
   rtc_fifo_init_default(tagcount);
   rtc_fifo_set_magic();
 }
+
+static inline void rtc_fifo_prepare(uint32_t samples_per_boot, uint32_t us_per_sample, uint32_t tagcount)
+{
+  rtc_fifo_prepare_format(samples_per_boot,us_per_sample,tagcount,RTC_FIFO_FORMAT_FIXED);
+}
 #endif
@@ -109,6 +109,7 @@ struct ssl_packet{
 	uint16 buffer_size;
 	ssl_sector cert_ca_sector;
 	ssl_sector cert_req_sector;
+	uint8 mfl_code;
 };
 
 typedef struct _ssl_opt {
@@ -141,6 +142,21 @@ enum {
 #define MBEDTLS_SSL_PLAIN_ADD	TCP_MSS
 #define FLASH_SECTOR_SIZE		4096
 
+/* RFC 6066 max_fragment_length that clients ask servers for */
+#if !defined(SSL_MAX_FRAGMENT_LENGTH) || SSL_MAX_FRAGMENT_LENGTH == 0
+#define SSL_MAX_FRAG_LEN_CODE	MBEDTLS_SSL_MAX_FRAG_LEN_NONE
+#elif SSL_MAX_FRAGMENT_LENGTH == 512
+#define SSL_MAX_FRAG_LEN_CODE	MBEDTLS_SSL_MAX_FRAG_LEN_512
+#elif SSL_MAX_FRAGMENT_LENGTH == 1024
+#define SSL_MAX_FRAG_LEN_CODE	MBEDTLS_SSL_MAX_FRAG_LEN_1024
+#elif SSL_MAX_FRAGMENT_LENGTH == 2048
+#define SSL_MAX_FRAG_LEN_CODE	MBEDTLS_SSL_MAX_FRAG_LEN_2048
+#elif SSL_MAX_FRAGMENT_LENGTH == 4096
+#define SSL_MAX_FRAG_LEN_CODE	MBEDTLS_SSL_MAX_FRAG_LEN_4096
+#else
+#error "SSL_MAX_FRAGMENT_LENGTH must be 0, 512, 1024, 2048 or 4096"
+#endif
+
 extern ssl_opt ssl_option;
 
 typedef struct{
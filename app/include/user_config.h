@@ -27,6 +27,10 @@ extern void luaL_assertfail(const char *file, int line, const char *message);
 #define COAP_DEBUG
 #endif /* DEVELOP_VERSION */
 
+// This records every heap block with the C or Lua line which allocated it, and
+// adds node.heapstats(). It costs about 7K of RAM and slows down allocations.
+// #define HEAP_PROFILE
+
 #define BIT_RATE_DEFAULT BIT_RATE_115200
 
 // This enables automatic baud rate detection at startup
@@ -62,6 +66,16 @@ extern void luaL_assertfail(const char *file, int line, const char *message);
 // SSL buffer size used only for espconn-layer secure connections.
 // See https://github.com/nodemcu/nodemcu-firmware/issues/1457 for conversation details.
 #define SSL_BUFFER_SIZE 5120
+// The following are opt-in RAM savings, all off by default.
+// Largest record sent, this has to hold the client certificate chain if
+// tls.cert.auth() is used. Defaults to SSL_BUFFER_SIZE.
+//#define SSL_OUT_BUFFER_SIZE 2048
+// The record buffers shrink to this size between records and grow again,
+// with a reallocation, for larger ones. Keeps them at full size if undefined.
+//#define SSL_IDLE_BUFFER_SIZE 512
+// Maximum fragment length (RFC 6066) asked from servers, one of 512, 1024,
+// 2048 or 4096, or 0 to not ask. Servers are free to ignore it.
+//#define SSL_MAX_FRAGMENT_LENGTH 4096
 
 //#define CLIENT_SSL_ENABLE
 //#define MD2_ENABLE
@@ -89,6 +103,21 @@ extern void luaL_assertfail(const char *file, int line, const char *message);
 // (minus the 16k parameter space). THis is useful for certain OTA scenarios
 // #define SPIFFS_SIZE_1M_BOUNDARY
 
+// Uncomment to reserve a Lua Flash Store of this size (a multiple of 4K) in
+// the firmware image. Modules loaded into it with node.flashreload() execute
+// directly from flash and are found by require() before SPIFFS.
+// #define LUA_FLASH_STORE 0x10000
+
+// Uncomment to reserve this much flash (a multiple of 4K, at least 8K) for
+// the rtcfifo module. A full RTC FIFO is then moved there rather than losing
+// its oldest samples, and rtcfifo.pop() reads it back first.
+// #define RTCFIFO_FLASH_LOG 0x4000
+
+// Uncomment to reserve this much flash (a multiple of 4K) for the bloom
+// module. bloom.load(file, true) copies a saved filter there and checks it
+// in place, without holding it in RAM.
+// #define BLOOM_FLASH_SIZE 0x10000
+
 #define LUA_NUMBER_INTEGRAL
 
 #define READLINE_INTERVAL 80
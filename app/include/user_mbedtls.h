@@ -304,6 +304,17 @@ extern unsigned int max_content_len;
 #define MBEDTLS_SSL_MAX_CONTENT_LEN             SSL_BUFFER_SIZE /**< Maxium fragment length in bytes, determines the size of each of the two internal I/O buffers */
 #endif
 
+// our own records are at most a TCP segment once the handshake is done, so
+// the output buffer only needs to hold the handshake messages we send
+#if defined(SSL_OUT_BUFFER_SIZE) && SSL_OUT_BUFFER_SIZE < SSL_BUFFER_SIZE
+#define MBEDTLS_SSL_OUT_CONTENT_LEN             SSL_OUT_BUFFER_SIZE
+#endif
+
+#ifdef SSL_IDLE_BUFFER_SIZE
+#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+#define MBEDTLS_SSL_IDLE_CONTENT_LEN            SSL_IDLE_BUFFER_SIZE
+#endif
+
 //#define MBEDTLS_SSL_DEFAULT_TICKET_LIFETIME     86400 /**< Lifetime of session tickets (if enabled) */
 //#define MBEDTLS_PSK_MAX_LEN               32 /**< Max size of TLS pre-shared keys, in bytes (default 256 bits) */
 //#define MBEDTLS_SSL_COOKIE_TIMEOUT        60 /**< Default expiration delay of DTLS cookies, in seconds if HAVE_TIME, or in number of cookies issued */
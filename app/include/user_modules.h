@@ -27,6 +27,7 @@
 //#define LUA_USE_MODULES_BMP085
 //#define LUA_USE_MODULES_BME280
 //#define LUA_USE_MODULES_BME680
+//#define LUA_USE_MODULES_BYTEARR
 //#define LUA_USE_MODULES_COAP
 //#define LUA_USE_MODULES_COLOR_UTILS
 //#define LUA_USE_MODULES_CRON
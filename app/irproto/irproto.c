@@ -24,13 +24,16 @@ int ir_set_writer( setup_carrier setup, irmark mark, irspace space )
   return 0;
 }
 
-irsender irproto_encode_map[] = {
-  NULL,
-  ir_send_nec
+const irsender irproto_encode_map[IRPROTO_MAX] = {
+  [IRPROTO_NEC]     = ir_send_nec,
+  [IRPROTO_SAMSUNG] = ir_send_samsung,
 };
-irproto irproto_decode_map[] = {
-  NULL,
-  ir_recv_nec
+const irdecoder irproto_decode_map[IRPROTO_MAX] = {
+  [IRPROTO_NEC]     = ir_recv_nec,
+  [IRPROTO_RC5]     = ir_recv_rc5,
+  [IRPROTO_RC6]     = ir_recv_rc6,
+  [IRPROTO_SONY]    = ir_recv_sony,
+  [IRPROTO_SAMSUNG] = ir_recv_samsung,
 };
 
 //**************************************
@@ -45,24 +48,19 @@ irproto irproto_decode_map[] = {
 #define LOGIC_B0_SPACE (1120 - LOGICAL_MARK)
 #define LOGIC_B1_SPACE (2250 - LOGICAL_MARK)
 
-#define UNCERTAIN_PULSE_TIME (ACCEPTABLE_BIAS+AGC_MARK+AGC_SPACE)
-
 #define u32_byte_reverse(c) ( ((c) & 0x000000FFU) << 24 |	\
 			      ((c) & 0x0000FF00U) << 8 |	\
 			      ((c) & 0x00FF0000U) >> 8 |	\
 			      ((c) & 0xFF000000U) >> 24 ) 
 
-// state
-enum{
-  AGC_EXPECT,
-  AGC_GOES,
-  LOGICAL_EXPECT,
-  LOGICAL_GOES,
-  EOP_EXPECT,
-  EOP_GOES
-};
-
-#define match( t, expect, next ) ( (abs((t)-(expect)) < ACCEPTABLE_BIAS) ? (next) : IRPROTO_STATE_ERROR )
+// A pulse is accepted within 25% of its nominal length, but never tighter
+// than ACCEPTABLE_BIAS, as the receivers stretch the marks by up to 100us
+static int near( uint32 t, uint32 expect )
+{
+  uint32 bias = expect / 4;
+  if( bias < ACCEPTABLE_BIAS ) bias = ACCEPTABLE_BIAS;
+  return t + bias > expect && t < expect + bias;
+}
 
 static uint32 reverse_per_byte( uint32 c )
 {
@@ -83,42 +81,158 @@ static uint32 reverse_per_byte( uint32 c )
 // example 48989587,9107,4495,614,553,613,549,616,551,613,552,613,552,612,554,612,553,612,552,613,1665,585,1665,586,1664,587,1638,611,1640,611,1664,585,1639,611,1665,586,1664,586,554,611,553,613,1664,586,1664,587,552,613,551,614,553,612,552,614,1664,586,1664,587,552,613,553,612,1640,611,1640,611,1640,609,39669,9121,2221,611
 // example 12608055,9122,4496,613,552,615,551,614,553,612,551,615,552,614,552,614,552,614,550,616,1664,586,1664,588,1640,610,1664,587,1664,587,1640,611,1638,613,1640,611,1664,587,1639,612,1664,587,552,613,552,614,552,614,1664,587,552,613,553,613,553,613,552,613,1665,587,1664,586,1639,613,551,613,1643,610
 // example 57419939,9117,4498,612,553,613,551,614,555,611,552,613,552,614,553,612,553,613,551,613,1642,610,1640,611,1641,609,1641,610,1638,613,1665,586,1664,587,1640,610,1665,586,552,614,1663,587,552,613,553,613,554,611,1664,587,551,613,554,612,1665,586,553,613,1664,587,1664,586,1642,609,553,612,1664,586
-uint32 ir_recv_nec(uint32 state, uint32 level, uint32 usec, uint32_t *data, int8_t *len, int8_t *ready)
+// Pulse distance coding shared by NEC and Samsung: a header, 32 bits LSB
+// first whose value is carried by the length of the space, and a stop mark
+static int recv_pulse_distance( const uint16_t *t, int n, uint32 hmark, uint32 hspace, uint32_t *code )
 {
-  *ready = 0;
-  if( usec > UNCERTAIN_PULSE_TIME ) {
-    return AGC_EXPECT;
+  uint32_t v = 0;
+  int i;
+
+  if( n != 67 || !near(t[0], hmark) || !near(t[1], hspace) )
+    return -1;
+  for( i = 0; i < 32; i++ ){
+    if( !near(t[2 + 2*i], LOGICAL_MARK) )
+      return -1;
+    if( near(t[3 + 2*i], LOGIC_B1_SPACE) )
+      v |= (uint32_t)1 << i;
+    else if( !near(t[3 + 2*i], LOGIC_B0_SPACE) )
+      return -1;
   }
+  if( !near(t[66], LOGICAL_MARK) )
+    return -1;
+  *code = v;
+  return 4;
+}
 
-  if( state == AGC_EXPECT )
-    return match( usec, AGC_MARK, AGC_GOES );
-  else if( state == AGC_GOES ){
-    if( match( usec, AGC_SPACE, LOGICAL_EXPECT ) == LOGICAL_EXPECT ){
-      *data = 0;
-      *len = 0;
-    }
-    return LOGICAL_EXPECT;
+int ir_recv_nec( const uint16_t *t, int n, uint32_t *code )
+{
+  // a held key sends a bare header with a short space every 110ms
+  if( n == 3 && near(t[0], AGC_MARK) && near(t[1], AGC_REPEAT_SPACE) && near(t[2], LOGICAL_MARK) )
+    return 0;
+  return recv_pulse_distance( t, n, AGC_MARK, AGC_SPACE, code );
+}
+
+// Samsung differs from NEC only in its 4.5ms header mark
+#define SAMSUNG_HEADER 4500
+
+int ir_recv_samsung( const uint16_t *t, int n, uint32_t *code )
+{
+  return recv_pulse_distance( t, n, SAMSUNG_HEADER, SAMSUNG_HEADER, code );
+}
+
+//**************************************
+// see https://www.sbprojects.net/knowledge/ir/sirc.php
+// Sony SIRC is pulse width coded, 7 command bits followed by 5, 8 or 13
+// address bits, LSB first. The last bit is not followed by a space.
+#define SONY_UNIT 600
+
+int ir_recv_sony( const uint16_t *t, int n, uint32_t *code )
+{
+  int bits = (n - 1) / 2, i;
+  uint32_t v = 0;
+
+  if( (bits != 12 && bits != 15 && bits != 20) || !near(t[0], 4*SONY_UNIT) || !near(t[1], SONY_UNIT) )
+    return -1;
+  for( i = 0; i < bits; i++ ){
+    if( near(t[2 + 2*i], 2*SONY_UNIT) )
+      v |= (uint32_t)1 << i;
+    else if( !near(t[2 + 2*i], SONY_UNIT) )
+      return -1;
+    if( i < bits - 1 && !near(t[3 + 2*i], SONY_UNIT) )
+      return -1;
   }
-  else if( state == LOGICAL_EXPECT )
-    return match( usec, LOGICAL_MARK, LOGICAL_GOES );
-  else if( state == LOGICAL_GOES ){
-    if( match(usec, LOGIC_B0_SPACE, 1) == 1 )
-      *data &= ~(((uint32_t)1)<<(*len));
-    else if( match(usec, LOGIC_B1_SPACE, 1) == 1 )
-      *data |= (1<<(*len));
-    else return IRPROTO_STATE_ERROR;
-    
-    (*len)++;
-    return ( *len == 32 ) ? EOP_EXPECT : LOGICAL_EXPECT;
+  // command, address, extended
+  if( bits == 20 ){
+    *code = (v & 0x7f) | ((v >> 7) & 0x1f) << 8 | (v >> 12) << 16;
+    return 3;
   }
-  else if( state == EOP_EXPECT ){
-    *ready = 1;
-    return match( usec, LOGICAL_MARK, EOP_GOES );
+  *code = (v & 0x7f) | (v >> 7) << 8;
+  return 2;
+}
+
+//**************************************
+// Bi-phase coded protocols. The frame is first expanded into a sequence of
+// half bit levels (1 for a mark), taking the spaces before the first and
+// after the last mark from the idle line.
+#define MAX_HALVES 48
+
+// Expands t[] into h[], starting at h[pos]; returns the number of halves
+// filled in or -1 on a pulse which is not a multiple of unit up to maxrun
+static int expand_halves( const uint16_t *t, int n, uint32 unit, int maxrun, uint8_t *h, int pos, int len )
+{
+  int i, k;
+
+  for( i = 0; i < n; i++ ){
+    for( k = 1; k <= maxrun && !near(t[i], k*unit); k++ )
+      ;
+    if( k > maxrun || pos + k > len )
+      return -1;
+    while( k-- > 0 )
+      h[pos++] = !(i & 1);
   }
-  else return IRPROTO_STATE_ERROR;
+  while( pos < len )
+    h[pos++] = 0;
+  return pos;
 }
 
-int ir_send_nec( uint32_t code )
+// see https://www.sbprojects.net/knowledge/ir/rc5.php
+// 14 bits MSB first: 2 start bits, toggle, 5 address and 6 command bits; a
+// one is a space followed by a mark. An inverted second start bit is the
+// 7th command bit of RC5X.
+#define RC5_HALF 889
+
+int ir_recv_rc5( const uint16_t *t, int n, uint32_t *code )
+{
+  uint8_t h[28];
+  uint32_t v = 0;
+  int i;
+
+  h[0] = 0;
+  if( expand_halves( t, n, RC5_HALF, 2, h, 1, 28 ) < 0 )
+    return -1;
+  for( i = 0; i < 28; i += 2 ){
+    if( h[i] == h[i + 1] )
+      return -1;
+    v = (v << 1) | h[i + 1];
+  }
+  // command, address, toggle
+  *code = ((v & 0x3f) | (~v & 0x1000) >> 6) | ((v >> 6) & 0x1f) << 8 | ((v >> 11) & 1) << 16;
+  return 3;
+}
+
+// see https://www.sbprojects.net/knowledge/ir/rc6.php
+// Mode 0 only: a 6T mark and 2T space leader, a start bit, 3 mode bits, a
+// toggle bit of double width, 8 address and 8 command bits MSB first; a one
+// is a mark followed by a space.
+#define RC6_UNIT 444
+#define RC6_HALVES (2 + 3*2 + 4 + 16*2)
+
+int ir_recv_rc6( const uint16_t *t, int n, uint32_t *code )
+{
+  uint8_t h[RC6_HALVES];
+  uint32_t v = 0;
+  int i;
+
+  if( n < 3 || !near(t[0], 6*RC6_UNIT) || !near(t[1], 2*RC6_UNIT) )
+    return -1;
+  if( expand_halves( t + 2, n - 2, RC6_UNIT, 3, h, 0, RC6_HALVES ) < 0 )
+    return -1;
+  // start bit 1 and mode 0
+  if( !h[0] || h[1] || h[2] || !h[3] || h[4] || !h[5] || h[6] || !h[7] )
+    return -1;
+  if( h[8] != h[9] || h[10] != h[11] || h[8] == h[10] )
+    return -1;
+  for( i = 12; i < RC6_HALVES; i += 2 ){
+    if( h[i] == h[i + 1] )
+      return -1;
+    v = (v << 1) | h[i];
+  }
+  // command, address, toggle
+  *code = (v & 0xff) | (v >> 8) << 8 | (uint32_t)h[8] << 16;
+  return 3;
+}
+
+static int send_pulse_distance( uint32_t code, uint32 hmark )
 {
   if( engine == NULL ) return -1;
 
@@ -133,7 +247,7 @@ int ir_send_nec( uint32_t code )
   
   // AGC
   dummy();
-  MARK( AGC_MARK );
+  MARK( hmark );
   SPACE( AGC_SPACE );
   for( ; mask > 0; mask >>= 1 ){
     MARK( LOGICAL_MARK );
@@ -143,3 +257,30 @@ int ir_send_nec( uint32_t code )
   dummy();
   return 0;
 }
+
+int ir_send_nec( uint32_t code )
+{
+  return send_pulse_distance( code, AGC_MARK );
+}
+
+int ir_send_samsung( uint32_t code )
+{
+  return send_pulse_distance( code, SAMSUNG_HEADER );
+}
+
+int ir_send_raw( uint32 hz, const uint16_t *durations, int n )
+{
+  int i;
+
+  if( engine == NULL ) return -1;
+  engine->setup( hz, 4 );
+  dummy();
+  for( i = 0; i < n; i++ ){
+    if( i & 1 )
+      engine->space( durations[i] );
+    else
+      engine->mark( durations[i] );
+  }
+  dummy();
+  return 0;
+}
@@ -445,53 +445,52 @@ LUALIB_API const char *luaL_findtable (lua_State *L, int idx,
 */
 
 
-#define bufflen(B)	((B)->p - (B)->buffer)
-#define bufffree(B)	((size_t)(LUAL_BUFFERSIZE - bufflen(B)))
+#define bufflen(B)	((size_t)((B)->p - (B)->b))
+#define bufffree(B)	((B)->size - bufflen(B))
 
-#define LIMIT	(LUA_MINSTACK/2)
 
-
-static int emptybuffer (luaL_Buffer *B) {
-  size_t l = bufflen(B);
-  if (l == 0) return 0;  /* put nothing on stack */
-  else {
-    lua_pushlstring(B->L, B->buffer, l);
-    B->p = B->buffer;
-    B->lvl++;
-    return 1;
-  }
-}
-
-
-static void adjuststack (luaL_Buffer *B) {
-  if (B->lvl > 1) {
-    lua_State *L = B->L;
-    int toget = 1;  /* number of levels to concat */
-    size_t toplen = lua_strlen(L, -1);
-    do {
-      size_t l = lua_strlen(L, -(toget+1));
-      if (B->lvl - toget + 1 >= LIMIT || toplen > l) {
-        toplen += l;
-        toget++;
-      }
-      else break;
-    } while (toget < B->lvl);
-    lua_concat(L, toget);
-    B->lvl = B->lvl - toget + 1;
-  }
+/*
+** Makes room for at least `need' more bytes. The contents move to a new
+** block on the stack at least twice the size of the old one, so a string of
+** n bytes is built with O(n) copying and without interning any intermediate
+** strings. The new block is placed `above' values below the stack top; the
+** old block is just dropped, leaving it to the collector, which also takes
+** care of the block if an error is thrown while the buffer is in use.
+*/
+static void growbuffer (luaL_Buffer *B, size_t need, int above) {
+  lua_State *L = B->L;
+  size_t len = bufflen(B);
+  size_t size = B->size * 2;
+  char *b;
+  if (need > MAX_SIZET - len)
+    luaL_error(L, "buffer too large");
+  if (size - len < need)
+    size = len + need;
+  b = (char *)lua_newuserdata(L, size);
+  c_memcpy(b, B->b, len);
+  if (B->lvl)
+    lua_replace(L, -(above+2));  /* replace the old block */
+  else if (above)
+    lua_insert(L, -(above+1));
+  B->lvl = 1;
+  B->b = b;
+  B->p = b + len;
+  B->size = size;
 }
 
 
 LUALIB_API char *luaL_prepbuffer (luaL_Buffer *B) {
-  if (emptybuffer(B))
-    adjuststack(B);
-  return B->buffer;
+  if (bufffree(B) < LUAL_BUFFERSIZE)
+    growbuffer(B, LUAL_BUFFERSIZE, 0);
+  return B->p;
 }
 
 
 LUALIB_API void luaL_addlstring (luaL_Buffer *B, const char *s, size_t l) {
-  while (l--)
-    luaL_addchar(B, *s++);
+  if (l > bufffree(B))
+    growbuffer(B, l, 0);
+  c_memcpy(B->p, s, l);
+  B->p += l;
 }
 
 
@@ -501,9 +500,13 @@ LUALIB_API void luaL_addstring (luaL_Buffer *B, const char *s) {
 
 
 LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
-  emptybuffer(B);
-  lua_concat(B->L, B->lvl);
-  B->lvl = 1;
+  lua_State *L = B->L;
+  lua_pushlstring(L, B->b, bufflen(B));
+  if (B->lvl)
+    lua_remove(L, -2);  /* drop the block */
+  B->lvl = 0;
+  B->p = B->b = B->buffer;
+  B->size = LUAL_BUFFERSIZE;
 }
 
 
@@ -511,23 +514,18 @@ LUALIB_API void luaL_addvalue (luaL_Buffer *B) {
   lua_State *L = B->L;
   size_t vl;
   const char *s = lua_tolstring(L, -1, &vl);
-  if (vl <= bufffree(B)) {  /* fit into buffer? */
-    c_memcpy(B->p, s, vl);  /* put it there */
-    B->p += vl;
-    lua_pop(L, 1);  /* remove from stack */
-  }
-  else {
-    if (emptybuffer(B))
-      lua_insert(L, -2);  /* put buffer before new value */
-    B->lvl++;  /* add new value into B stack */
-    adjuststack(B);
-  }
+  if (vl > bufffree(B))
+    growbuffer(B, vl, 1);  /* keep the value on top */
+  c_memcpy(B->p, s, vl);
+  B->p += vl;
+  lua_pop(L, 1);  /* remove from stack */
 }
 
 
 LUALIB_API void luaL_buffinit (lua_State *L, luaL_Buffer *B) {
   B->L = L;
-  B->p = B->buffer;
+  B->p = B->b = B->buffer;
+  B->size = LUAL_BUFFERSIZE;
   B->lvl = 0;
 }
 
@@ -651,15 +649,23 @@ LUALIB_API int luaL_loadfile (lua_State *L, const char *filename) {
 
 #include C_HEADER_FCNTL
 
+/*
+** Files are read in blocks of LUA_LOADBLOCKSIZE aligned to the file offset,
+** which keeps the reads on flash page boundaries. The block is on the heap,
+** with a LUAL_BUFFERSIZE one on the stack as fallback.
+*/
 typedef struct LoadFSF {
   int extraline;
   int f;
-  char buff[LUAL_BUFFERSIZE];
+  char *buff;
+  size_t size;
+  char sbuff[LUAL_BUFFERSIZE];
 } LoadFSF;
 
 
 static const char *getFSF (lua_State *L, void *ud, size_t *size) {
   LoadFSF *lf = (LoadFSF *)ud;
+  sint32_t n;
   (void)L;
 
   if (L == NULL && size == NULL) // Direct mode check
@@ -672,9 +678,10 @@ static const char *getFSF (lua_State *L, void *ud, size_t *size) {
   }
 
   if (vfs_eof(lf->f)) return NULL;
-  *size = vfs_read(lf->f, lf->buff, sizeof(lf->buff));
-
-  return (*size > 0) ? lf->buff : NULL;
+  n = vfs_read(lf->f, lf->buff, lf->size - (vfs_tell(lf->f) & (lf->size - 1)));
+  if (n <= 0) return NULL;
+  *size = n;
+  return lf->buff;
 }
 
 
@@ -717,8 +724,15 @@ LUALIB_API int luaL_loadfsfile (lua_State *L, const char *filename) {
     lf.extraline = 0;
   }
   vfs_ungetc(c, lf.f);
+  lf.size = LUA_LOADBLOCKSIZE;
+  lf.buff = (char *)c_malloc(lf.size);
+  if (!lf.buff) {
+    lf.size = LUAL_BUFFERSIZE;
+    lf.buff = lf.sbuff;
+  }
   status = lua_load(L, getFSF, &lf, lua_tostring(L, -1));
 
+  if (lf.buff != lf.sbuff) c_free(lf.buff);
   if (filename) vfs_close(lf.f);  /* close file (even in case of errors) */
   lua_remove(L, fnameindex);
   return status;
@@ -780,6 +794,26 @@ static int l_check_memlimit(lua_State *L, size_t needbytes) {
 }
 
 
+#if defined(HEAP_PROFILE) && !defined(LUA_CROSS_COMPILER)
+/*
+** Charge the allocation to the innermost Lua line on the stack, if any.
+** Allocations made by coroutines are charged to the line that resumed them.
+*/
+static void *l_realloc (lua_State *L, void *ptr, size_t nsize) {
+  lua_Debug ar;
+  int level;
+  if (L != NULL) {
+    for (level = 0; level < 3 && lua_getstack(L, level, &ar); level++) {
+      if (lua_getinfo(L, "Sl", &ar) && ar.currentline >= 0)
+        return heap_profile_lua_realloc(ptr, nsize, ar.source, ar.currentline);
+    }
+  }
+  return c_realloc(ptr, nsize);
+}
+#else
+#define l_realloc(L, ptr, nsize) c_realloc(ptr, nsize)
+#endif
+
 static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
   lua_State *L = (lua_State *)ud;
   int mode = L == NULL ? 0 : G(L)->egcmode;
@@ -798,10 +832,10 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
     if(G(L)->memlimit > 0 && (mode & EGC_ON_MEM_LIMIT) && l_check_memlimit(L, nsize - osize))
       return NULL;
   }
-  nptr = (void *)c_realloc(ptr, nsize);
+  nptr = (void *)l_realloc(L, ptr, nsize);
   if (nptr == NULL && L != NULL && (mode & EGC_ON_ALLOC_FAILURE)) {
     luaC_fullgc(L); /* emergency full collection. */
-    nptr = (void *)c_realloc(ptr, nsize); /* try allocation again */
+    nptr = (void *)l_realloc(L, ptr, nsize); /* try allocation again */
   }
   return nptr;
 }
@@ -143,15 +143,23 @@ LUALIB_API void luaL_assertfail(const char *file, int line, const char *message)
 
 
 
+/*
+** The contents start out in `buffer'. Once that fills up they move to a
+** block on the stack (lvl is then 1), which doubles in size as needed.
+** luaL_pushresult drops the block and resets lvl to 0, so the buffer is
+** empty afterwards and may be used again without another luaL_buffinit.
+*/
 typedef struct luaL_Buffer {
   char *p;			/* current position in buffer */
-  int lvl;  /* number of strings in the stack (level) */
+  int lvl;  /* number of values in the stack (level) */
   lua_State *L;
+  char *b;  /* start of the buffer: `buffer' or the block on the stack */
+  size_t size;  /* size of the buffer at `b' */
   char buffer[LUAL_BUFFERSIZE];
 } luaL_Buffer;
 
 #define luaL_addchar(B,c) \
-  ((void)((B)->p < ((B)->buffer+LUAL_BUFFERSIZE) || luaL_prepbuffer(B)), \
+  ((void)((B)->p < ((B)->b+(B)->size) || luaL_prepbuffer(B)), \
    (*(B)->p++ = (char)(c)))
 
 /* compatibility only */
@@ -0,0 +1,435 @@
+/*
+** Lua Flash Store: precompiled Lua modules executed in place from flash
+** See Copyright Notice in lua.h
+**
+** The store is a region reserved inside the mapped irom0 segment. It is
+** filled from a bytecode image built by "luac.cross -f", whose main function
+** has the module names as constants and the modules as nested functions.
+** node.flashreload() undumps the image into RAM and writes the Protos, their
+** arrays and all strings back out as finished objects at their final mapped
+** addresses, so that running a module from the store only allocates its
+** closures on the heap.
+**
+** Objects in the store are black and fixed, so the collector neither
+** traverses nor frees them. Its strings are chained into a hash table of
+** their own, which lstring.c searches before creating a string in RAM, so
+** that every string still exists only once.
+*/
+
+#define lflash_c
+#define LUA_CORE
+#define LUAC_CROSS_FILE
+
+#include "lua.h"
+
+#ifdef LUA_FLASH_STORE
+
+#include C_HEADER_STRING
+
+#include "lauxlib.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "lundump.h"
+#include "lflash.h"
+#include "platform.h"
+#include "vfs.h"
+#include "c_stdlib.h"
+#include "user_interface.h"
+
+#if (LUA_FLASH_STORE % INTERNAL_FLASH_SECTOR_SIZE) != 0
+#error "LUA_FLASH_STORE must be a multiple of the flash sector size"
+#endif
+
+#define LFS_CHUNK         256
+#define LFS_ALIGN         sizeof(L_Umaxalign)
+#define LFS_MARKED        (bitmask(FIXEDBIT) | bitmask(BLACKBIT))
+
+/* Reserves the space in the firmware image; it is only ever accessed through
+ * the linker symbol below, so that the compiler cannot fold its contents. */
+const char lua_flash_store_space[LUA_FLASH_STORE]
+  __attribute__((used, aligned(INTERNAL_FLASH_SECTOR_SIZE), section(".lfs.reserved"))) = { 0 };
+extern const char lua_flash_store_reserved[];
+#define flash_region lua_flash_store_reserved
+
+#define flash_header ((const lfs_header_t *)flash_region)
+
+/* set while node.flashreload() replaces the store */
+static int lfs_disabled;
+
+static int lfs_valid (void) {
+  return !lfs_disabled && flash_header->magic == LFS_MAGIC;
+}
+
+/*
+** Find a string in the store; called by lstring.c before it creates a new
+** string, with the hash already computed.
+*/
+LUAI_FUNC TString *luaN_findstr (const char *str, size_t l, unsigned int h) {
+  GCObject *o;
+  if (!lfs_valid())
+    return NULL;
+  for (o = obj2gco(flash_header->strt[lmod(h, flash_header->strtsize)]);
+       o != NULL;
+       o = o->gch.next) {
+    TString *ts = rawgco2ts(o);
+    if (ts->tsv.hash == h && ts->tsv.len == l && c_memcmp(str, getstr(ts), l) == 0)
+      return ts;
+  }
+  return NULL;
+}
+
+/*
+** Push a closure for the module 'name'. Returns 0 and pushes nothing if the
+** store does not contain it.
+*/
+LUAI_FUNC int luaN_pushfunc (lua_State *L, const char *name) {
+  const Proto *index;
+  int i;
+  if (!lfs_valid())
+    return 0;
+  index = flash_header->index;
+  for (i = 0; i < index->sizek && i < index->sizep; i++) {
+    if (ttisstring(&index->k[i]) && c_strcmp(svalue(&index->k[i]), name) == 0) {
+      Closure *cl = luaF_newLclosure(L, 0, hvalue(gt(L)));
+      cl->l.p = index->p[i];
+      setclvalue(L, L->top, cl);
+      incr_top(L);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+** Lua: func = node.flashindex(name)
+**      names, used, size, offset = node.flashindex()
+*/
+LUAI_FUNC int luaN_flashindex (lua_State *L) {
+  int i;
+  if (!lua_isnoneornil(L, 1)) {
+    if (!luaN_pushfunc(L, luaL_checkstring(L, 1)))
+      lua_pushnil(L);
+    return 1;
+  }
+  if (lfs_valid()) {
+    const Proto *index = flash_header->index;
+    lua_createtable(L, index->sizep, 0);
+    for (i = 0; i < index->sizek && i < index->sizep; i++) {
+      if (ttisstring(&index->k[i])) {
+        setsvalue2s(L, L->top, rawtsvalue(&index->k[i]));
+        incr_top(L);
+        lua_rawseti(L, -2, i + 1);
+      }
+    }
+    lua_pushinteger(L, flash_header->size);
+  } else {
+    lua_pushnil(L);
+    lua_pushinteger(L, 0);
+  }
+  lua_pushinteger(L, LUA_FLASH_STORE);
+  lua_pushinteger(L, platform_flash_mapped2phys((uint32_t)flash_region));
+  return 4;
+}
+
+/*
+** The image is laid out twice with the same code: first as a dry run, while
+** the old store is still intact and Lua may allocate, to size it and place
+** the strings, and then for real once the region has been erased.
+*/
+typedef struct {
+  lua_State *L;
+  const char *fn;
+  Table *strs;          /* string -> number and number -> string */
+  int nstr;
+  uint32_t *saddr;      /* where each string goes */
+  uint32_t *snext;      /* the next string in the same hash chain */
+  uint32_t *strt;       /* heads of the hash chains */
+  uint32_t strtsize;
+  uint32_t strtaddr;
+  Proto *index;
+  uint32_t phys;        /* flash offset of the region */
+  uint32_t pos;         /* bytes of the region laid out */
+  uint32_t wpos;        /* region offset of buf */
+  uint32_t fill;
+  int dry;
+  int failed;
+  uint32_t buf[LFS_CHUNK / sizeof(uint32_t)];
+} LFSWriter;
+
+static void lfs_flush (LFSWriter *w) {
+  uint32_t n = (w->fill + 3) & ~3;
+  if (n && platform_flash_write(w->buf, w->phys + w->wpos, n) != n)
+    w->failed = 1;
+  w->wpos += w->fill;
+  w->fill = 0;
+}
+
+/* Appends n bytes, or zeros if p is NULL; returns their mapped address */
+static uint32_t lfs_append (LFSWriter *w, const void *p, size_t n) {
+  uint32_t addr = (uint32_t)flash_region + w->pos;
+  const char *s = (const char *)p;
+  w->pos += n;
+  if (w->dry)
+    return addr;
+  while (n) {
+    size_t k = LFS_CHUNK - w->fill;
+    if (k > n)
+      k = n;
+    if (s) {
+      c_memcpy((char *)w->buf + w->fill, s, k);
+      s += k;
+    } else {
+      c_memset((char *)w->buf + w->fill, 0, k);
+    }
+    w->fill += k;
+    n -= k;
+    if (w->fill == LFS_CHUNK)
+      lfs_flush(w);
+  }
+  return addr;
+}
+
+static uint32_t lfs_align (LFSWriter *w) {
+  lfs_append(w, NULL, (LFS_ALIGN - w->pos % LFS_ALIGN) % LFS_ALIGN);
+  return (uint32_t)flash_region + w->pos;
+}
+
+static uint32_t lfs_object (LFSWriter *w, const void *p, size_t n) {
+  lfs_align(w);
+  return lfs_append(w, p, n);
+}
+
+static TString *lfs_str (LFSWriter *w, TString *ts) {
+  if (ts == NULL)
+    return NULL;
+  return (TString *)w->saddr[(int)nvalue(luaH_getstr(w->strs, ts))];
+}
+
+static void lfs_writestrings (LFSWriter *w) {
+  int i;
+  w->strtaddr = lfs_object(w, w->strt, w->strtsize * sizeof(uint32_t));
+  for (i = 0; i < w->nstr; i++) {
+    TString *ts = rawtsvalue(luaH_getnum(w->strs, i));
+    TString h = *ts;
+    h.tsv.next = (GCObject *)w->snext[i];
+    h.tsv.marked = LFS_MARKED;
+    w->saddr[i] = lfs_object(w, &h, sizeof(h));
+    lfs_append(w, getstr(ts), ts->tsv.len + 1);
+  }
+}
+
+/* Children are written before their parent, which then knows their address */
+static Proto *lfs_writeproto (LFSWriter *w, const Proto *f) {
+  Proto p = *f;
+  int i;
+
+  p.next = NULL;
+  p.gclist = NULL;
+  p.marked = LFS_MARKED | bitmask(READONLYBIT);
+  p.p = NULL;
+  if (f->sizep) {
+    Proto **children = (Proto **)c_malloc(f->sizep * sizeof(Proto *));
+    if (!children) {
+      w->failed = 1;
+      return NULL;
+    }
+    for (i = 0; i < f->sizep; i++)
+      children[i] = lfs_writeproto(w, f->p[i]);
+    p.p = (Proto **)lfs_object(w, children, f->sizep * sizeof(Proto *));
+    c_free(children);
+  }
+  p.k = NULL;
+  if (f->sizek) {
+    p.k = (TValue *)lfs_align(w);
+    for (i = 0; i < f->sizek; i++) {
+      TValue k = f->k[i];
+      if (ttisstring(&k))
+        setsvalue(w->L, &k, lfs_str(w, rawtsvalue(&k)));
+      lfs_append(w, &k, sizeof(k));
+    }
+  }
+  p.code = (Instruction *)lfs_object(w, f->code, f->sizecode * sizeof(Instruction));
+#ifdef LUA_OPTIMIZE_DEBUG
+  if (f->packedlineinfo)
+    p.packedlineinfo = (unsigned char *)lfs_object(w, f->packedlineinfo,
+                         c_strlen(cast(char *, f->packedlineinfo)) + 1);
+#else
+  if (f->lineinfo)
+    p.lineinfo = (int *)lfs_object(w, f->lineinfo, f->sizelineinfo * sizeof(int));
+#endif
+  p.locvars = NULL;
+  if (f->sizelocvars) {
+    p.locvars = (LocVar *)lfs_align(w);
+    for (i = 0; i < f->sizelocvars; i++) {
+      LocVar v = f->locvars[i];
+      v.varname = lfs_str(w, v.varname);
+      lfs_append(w, &v, sizeof(v));
+    }
+  }
+  p.upvalues = NULL;
+  if (f->sizeupvalues) {
+    p.upvalues = (TString **)lfs_align(w);
+    for (i = 0; i < f->sizeupvalues; i++) {
+      TString *ts = lfs_str(w, f->upvalues[i]);
+      lfs_append(w, &ts, sizeof(ts));
+    }
+  }
+  p.source = lfs_str(w, f->source);
+  return (Proto *)lfs_object(w, &p, sizeof(p));
+}
+
+static void lfs_addstr (LFSWriter *w, TString *ts) {
+  lua_State *L = w->L;
+  if (ts == NULL || !ttisnil(luaH_getstr(w->strs, ts)))
+    return;
+  setsvalue2s(L, L->top, ts);
+  incr_top(L);
+  lua_pushinteger(L, w->nstr);
+  lua_rawset(L, -3);
+  lua_pushinteger(L, w->nstr++);
+  setsvalue2s(L, L->top, ts);
+  incr_top(L);
+  lua_rawset(L, -3);
+}
+
+static void lfs_addstrings (LFSWriter *w, const Proto *f) {
+  int i;
+  lfs_addstr(w, f->source);
+  for (i = 0; i < f->sizek; i++)
+    if (ttisstring(&f->k[i]))
+      lfs_addstr(w, rawtsvalue(&f->k[i]));
+  for (i = 0; i < f->sizeupvalues; i++)
+    lfs_addstr(w, f->upvalues[i]);
+  for (i = 0; i < f->sizelocvars; i++)
+    lfs_addstr(w, f->locvars[i].varname);
+  for (i = 0; i < f->sizep; i++)
+    lfs_addstrings(w, f->p[i]);
+}
+
+/*
+** Loads the image and lays it out without touching the flash. Runs
+** protected, and leaves the index function and the string map on the stack.
+*/
+static int lfs_prepare (lua_State *L) {
+  LFSWriter *w = (LFSWriter *)lua_touserdata(L, 1);
+  char h[LUAC_HEADERSIZE];
+  char buf[LUAC_HEADERSIZE];
+  const Proto *index;
+  uint32_t i, b;
+  int fd;
+
+  fd = vfs_open(w->fn, "r");
+  if (!fd)
+    return luaL_error(L, "cannot open %s", w->fn);
+  luaU_header(h);
+  if (vfs_read(fd, buf, LUAC_HEADERSIZE) != LUAC_HEADERSIZE ||
+      c_memcmp(buf, h, LUAC_HEADERSIZE) != 0) {
+    vfs_close(fd);
+    return luaL_error(L, "image not built for this firmware");
+  }
+  vfs_close(fd);
+
+  /* the new image must not refer to strings of the old one */
+  lfs_disabled = 1;
+  if (luaL_loadfsfile(L, w->fn) != 0)
+    return lua_error(L);
+  index = clvalue(L->top - 1)->l.p;
+
+  lua_newtable(L);
+  w->strs = hvalue(L->top - 1);
+  lfs_addstrings(w, index);
+
+  for (w->strtsize = 1; w->strtsize < (uint32_t)w->nstr; w->strtsize <<= 1) ;
+  w->saddr = (uint32_t *)c_malloc(w->nstr * sizeof(uint32_t));
+  w->snext = (uint32_t *)c_malloc(w->nstr * sizeof(uint32_t));
+  w->strt = (uint32_t *)c_zalloc(w->strtsize * sizeof(uint32_t));
+  if (!w->saddr || !w->snext || !w->strt)
+    return luaL_error(L, "not enough memory");
+
+  w->dry = 1;
+  w->pos = sizeof(lfs_header_t);
+  lfs_writestrings(w);
+  for (i = 0; i < (uint32_t)w->nstr; i++) {
+    b = lmod(rawtsvalue(luaH_getnum(w->strs, i))->tsv.hash, w->strtsize);
+    w->snext[i] = w->strt[b];
+    w->strt[b] = w->saddr[i];
+  }
+  lfs_writeproto(w, index);
+  if (w->failed)
+    return luaL_error(L, "not enough memory");
+  if (w->pos > LUA_FLASH_STORE)
+    return luaL_error(L, "image too big");
+  return 2;
+}
+
+static void lfs_free (LFSWriter *w) {
+  c_free(w->saddr);
+  c_free(w->snext);
+  c_free(w->strt);
+}
+
+/*
+** Lua: node.flashreload(imagefile)
+** Writes the image to the store and restarts; returns an error message,
+** leaving the store as it was, if the image cannot be used.
+*/
+LUAI_FUNC int luaN_flashreload (lua_State *L) {
+  LFSWriter w;
+  lfs_header_t hdr;
+  int i;
+
+  c_memset(&w, 0, sizeof(w));
+  w.L = L;
+  w.fn = luaL_checkstring(L, 1);
+  w.phys = platform_flash_mapped2phys((uint32_t)flash_region);
+
+  lua_pushcfunction(L, lfs_prepare);
+  lua_pushlightuserdata(L, &w);
+  if (lua_pcall(L, 1, 2, 0) != 0) {
+    lfs_disabled = 0;
+    lfs_free(&w);
+    return 1;  /* error message */
+  }
+
+  /* Live objects may refer to the old store, so once it is erased nothing
+   * may allocate or collect until the restart has happened. */
+  lua_gc(L, LUA_GCSTOP, 0);
+  for (i = 0; i < LUA_FLASH_STORE / INTERNAL_FLASH_SECTOR_SIZE; i++)
+    platform_flash_erase_sector(w.phys / INTERNAL_FLASH_SECTOR_SIZE + i);
+
+  w.dry = 0;
+  w.pos = w.wpos = sizeof(lfs_header_t);
+  lfs_writestrings(&w);
+  w.index = lfs_writeproto(&w, clvalue(L->top - 2)->l.p);
+  lfs_flush(&w);
+
+  /* the header is written last, so an interrupted reload leaves no image */
+  if (!w.failed) {
+    c_memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = LFS_MAGIC;
+    hdr.size = w.pos - sizeof(hdr);
+    hdr.index = w.index;
+    hdr.strt = (TString **)w.strtaddr;
+    hdr.strtsize = w.strtsize;
+    platform_flash_write(&hdr, w.phys, sizeof(hdr));
+  }
+  lfs_free(&w);
+
+  /* Lua must not run on the rewritten store, so wait here for the reset.
+   * Should the SDK not get round to it, the watchdog will once no longer fed. */
+  system_restart();
+  {
+    uint32_t start = system_get_time();
+    while (system_get_time() - start < 1000000)
+      system_soft_wdt_feed();
+    while (1) {}
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,32 @@
+/*
+** Lua Flash Store: precompiled Lua modules executed in place from flash
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lflash_h
+#define lflash_h
+
+#include "lua.h"
+
+#ifdef LUA_FLASH_STORE
+
+#define LFS_MAGIC       0x3253464CU   /* "LFS2" little endian */
+
+/* Header at the start of the reserved flash region, the objects follow */
+typedef struct {
+  unsigned int magic;
+  unsigned int size;                  /* bytes in use after the header */
+  struct Proto *index;                /* module names in k, modules in p */
+  union TString **strt;               /* string hash chains */
+  unsigned int strtsize;              /* a power of 2 */
+  unsigned int reserved[3];
+} lfs_header_t;
+
+LUAI_FUNC union TString *luaN_findstr (const char *str, size_t l, unsigned int h);
+LUAI_FUNC int luaN_pushfunc (lua_State *L, const char *name);
+LUAI_FUNC int luaN_flashindex (lua_State *L);
+LUAI_FUNC int luaN_flashreload (lua_State *L);
+
+#endif
+
+#endif
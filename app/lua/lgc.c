@@ -37,7 +37,9 @@
 #define white2gray(x)	reset2bits((x)->gch.marked, WHITE0BIT, WHITE1BIT)
 #define black2gray(x)	resetbit((x)->gch.marked, BLACKBIT)
 
-#define stringmark(s)	reset2bits((s)->tsv.marked, WHITE0BIT, WHITE1BIT)
+/* only white strings are written, the ones in the Lua Flash Store never are */
+#define stringmark(s)	{ if (iswhite(obj2gco(s))) \
+                            reset2bits((s)->tsv.marked, WHITE0BIT, WHITE1BIT); }
 
 
 #define isfinalized(u)		testbit((u)->marked, FINALIZEDBIT)
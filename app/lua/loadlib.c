@@ -20,11 +20,20 @@
 
 #ifndef LUA_CROSS_COMPILER
 #include "vfs.h"
+#include "user_interface.h"
+#define ll_time()	system_get_time()
+#define ll_freeheap()	system_get_free_heap_size()
+#else
+#define ll_time()	0
+#define ll_freeheap()	(~0u)
 #endif
 
 #include "lauxlib.h"
 #include "lualib.h"
 #include "lrotable.h"
+#if defined(LUA_FLASH_STORE) && !defined(LUA_CROSS_COMPILER)
+#include "lflash.h"
+#endif
 
 /* prefix for open functions in C libraries */
 #define LUA_POF		"luaopen_"
@@ -458,19 +467,157 @@ static int loader_preload (lua_State *L) {
 }
 
 
+#if defined(LUA_FLASH_STORE) && !defined(LUA_CROSS_COMPILER)
+static int loader_LFS (lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  if (!luaN_pushfunc(L, name))  /* not found? */
+    lua_pushfstring(L, "\n\tno module " LUA_QS " in LFS", name);
+  return 1;
+}
+#endif
+
+
 static const int sentinel_ = 0;
 #define sentinel	((void *)&sentinel_)
 
 
+/*
+** {======================================================
+** Module cache: load statistics and eviction of volatile modules
+** =======================================================
+*/
+
+
+static unsigned use_seq;  /* ticks on every require of a volatile module */
+
+
+static int heapbytes (lua_State *L) {
+  return lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+
+/* records the use of a volatile module in package.volatile[name] */
+static void touch (lua_State *L, const char *name) {
+  lua_getfield(L, LUA_ENVIRONINDEX, "volatile");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, name);
+    if (lua_toboolean(L, -1)) {
+      lua_pushinteger(L, ++use_seq);
+      lua_setfield(L, -3, name);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+
+/* records the cost of loading a module, if package.loadstats is a table */
+static void setstats (lua_State *L, const char *name, unsigned load,
+                      unsigned run, int heap) {
+  int loads;
+  lua_getfield(L, LUA_ENVIRONINDEX, "loadstats");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, name);
+    if (!lua_istable(L, -1)) {
+      lua_pop(L, 1);
+      lua_createtable(L, 0, 4);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, -3, name);
+    }
+    lua_getfield(L, -1, "loads");
+    loads = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    lua_pushinteger(L, loads + 1);
+    lua_setfield(L, -2, "loads");
+    lua_pushinteger(L, load);
+    lua_setfield(L, -2, "load");
+    lua_pushinteger(L, run);
+    lua_setfield(L, -2, "run");
+    lua_pushinteger(L, heap);
+    lua_setfield(L, -2, "heap");
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+
+/*
+** Drops the least recently required volatile module from package.loaded,
+** so that it can be collected once nothing else refers to it and is loaded
+** again by the next require. Returns 0 if there was none to drop.
+*/
+static int evictone (lua_State *L) {
+  int top = lua_gettop(L);
+  int found = 0;
+  lua_Number best = 0;
+  lua_getfield(L, LUA_ENVIRONINDEX, "volatile");  /* at top+1 */
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");  /* at top+2 */
+  lua_pushnil(L);  /* name of the module to drop, at top+3 */
+  if (lua_istable(L, top + 1) && lua_istable(L, top + 2)) {
+    lua_pushnil(L);
+    while (lua_next(L, top + 1)) {
+      if (lua_type(L, -2) == LUA_TSTRING && lua_toboolean(L, -1)) {
+        /* modules that were never required count as least recent */
+        lua_Number used = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 0;
+        lua_pushvalue(L, -2);
+        lua_rawget(L, top + 2);
+        if (lua_toboolean(L, -1) && lua_touserdata(L, -1) != sentinel &&
+            (!found || used < best)) {
+          found = 1;
+          best = used;
+          lua_pushvalue(L, -3);
+          lua_replace(L, top + 3);
+        }
+        lua_pop(L, 1);
+      }
+      lua_pop(L, 1);
+    }
+  }
+  if (found) {
+    lua_pushnil(L);
+    lua_rawset(L, top + 2);  /* _LOADED[name] = nil */
+  }
+  lua_settop(L, top);
+  return found;
+}
+
+
+/* evicts volatile modules while the free heap is below package.minheap */
+static void evictcold (lua_State *L) {
+  unsigned minheap;
+  lua_getfield(L, LUA_ENVIRONINDEX, "minheap");
+  minheap = (unsigned)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  while (minheap && ll_freeheap() < minheap && evictone(L))
+    lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+
+static int ll_evict (lua_State *L) {
+  int max = luaL_optint(L, 1, INT_MAX);
+  int n = 0;
+  while (n < max && evictone(L))
+    n++;
+  if (n)
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 static int ll_require (lua_State *L) {
   const char *name = luaL_checkstring(L, 1);
-  int i;
+  unsigned start, loaded;
+  int heap, i;
   lua_settop(L, 1);  /* _LOADED table will be at index 2 */
   lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
   lua_getfield(L, 2, name);
   if (lua_toboolean(L, -1)) {  /* is it there? */
     if (lua_touserdata(L, -1) == sentinel)  /* check loops */
       luaL_error(L, "loop or previous error loading module " LUA_QS, name);
+    touch(L, name);
     return 1;  /* package is already loaded */
   }
   /* Is this a readonly table? */
@@ -479,7 +626,11 @@ static int ll_require (lua_State *L) {
     lua_pushrotable(L, res);
     return 1;
   }
-  /* else must load it; iterate over available loaders */
+  /* else must load it; make room first if memory is short */
+  evictcold(L);
+  start = ll_time();
+  heap = heapbytes(L);
+  /* iterate over available loaders */
   lua_getfield(L, LUA_ENVIRONINDEX, "loaders");
   if (!lua_istable(L, -1))
     luaL_error(L, LUA_QL("package.loaders") " must be a table");
@@ -498,6 +649,7 @@ static int ll_require (lua_State *L) {
     else
       lua_pop(L, 1);
   }
+  loaded = ll_time();
   lua_pushlightuserdata(L, sentinel);
   lua_setfield(L, 2, name);  /* _LOADED[name] = sentinel */
   lua_pushstring(L, name);  /* pass name as argument to module */
@@ -510,6 +662,8 @@ static int ll_require (lua_State *L) {
     lua_pushvalue(L, -1);  /* extra copy to be returned */
     lua_setfield(L, 2, name);  /* _LOADED[name] = true */
   }
+  setstats(L, name, loaded - start, ll_time() - loaded, heapbytes(L) - heap);
+  touch(L, name);
   return 1;
 }
 
@@ -629,6 +783,7 @@ static void setpath (lua_State *L, const char *fieldname, const char *envname,
 
 
 static const luaL_Reg pk_funcs[] = {
+  {"evict", ll_evict},
   {"loadlib", ll_loadlib},
   {"seeall", ll_seeall},
   {NULL, NULL}
@@ -643,7 +798,11 @@ static const luaL_Reg ll_funcs[] = {
 
 
 static const lua_CFunction loaders[] =
-  {loader_preload, loader_Lua, loader_C, loader_Croot, NULL};
+  {loader_preload,
+#if defined(LUA_FLASH_STORE) && !defined(LUA_CROSS_COMPILER)
+   loader_LFS,
+#endif
+   loader_Lua, loader_C, loader_Croot, NULL};
 
 #if LUA_OPTIMIZE_MEMORY > 0
 #undef MIN_OPT_LEVEL
@@ -693,6 +852,9 @@ LUALIB_API int luaopen_package (lua_State *L) {
   /* set field `preload' */
   lua_newtable(L);
   lua_setfield(L, -2, "preload");
+  /* set field `volatile' */
+  lua_newtable(L);
+  lua_setfield(L, -2, "volatile");
   lua_pushvalue(L, LUA_GLOBALSINDEX);
   luaL_register(L, NULL, ll_funcs);  /* open lib into global table */
   lua_pop(L, 1);
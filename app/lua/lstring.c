@@ -17,6 +17,9 @@
 #include "lobject.h"
 #include "lstate.h"
 #include "lstring.h"
+#if defined(LUA_FLASH_STORE) && !defined(LUA_CROSS_COMPILER)
+#include "lflash.h"
+#endif
 
 #define LUAS_READONLY_STRING      1
 #define LUAS_REGULAR_STRING       0
@@ -88,6 +91,13 @@ static TString *luaS_newlstr_helper (lua_State *L, const char *str, size_t l, in
   size_t l1;
   for (l1=l; l1>=step; l1-=step)  /* compute hash */
     h = h ^ ((h<<5)+(h>>2)+cast(unsigned char, str[l1-1]));
+#if defined(LUA_FLASH_STORE) && !defined(LUA_CROSS_COMPILER)
+  {  /* strings in the flash store must not get a second copy in RAM */
+    TString *ts = luaN_findstr(str, l, h);
+    if (ts != NULL)
+      return ts;
+  }
+#endif
   for (o = G(L)->strt.hash[lmod(h, G(L)->strt.size)];
        o != NULL;
        o = o->gch.next) {
@@ -22,7 +22,10 @@
 #define luaS_newliteral(L, s)  (luaS_newlstr(L, "" s, \
                                   (sizeof(s)/sizeof(char))-1))
 
-#define luaS_fix(s)	l_setbit((s)->tsv.marked, FIXEDBIT)
+/* strings in the Lua Flash Store are fixed already and cannot be written */
+#define luaS_fix(s)	{ TString *s_ = (s); \
+                    if (!testbit(s_->tsv.marked, FIXEDBIT)) \
+                      l_setbit(s_->tsv.marked, FIXEDBIT); }
 #define luaS_readonly(s) l_setbit((s)->tsv.marked, READONLYBIT)
 #define luaS_isreadonly(s) testbit((s)->marked, READONLYBIT)
 
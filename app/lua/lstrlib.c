@@ -16,6 +16,7 @@
 #include "lauxlib.h"
 #include "lualib.h"
 #include "lrotable.h"
+#include "lmem.h"
 
 /* macro to `unsign' a character */
 #define uchar(c)        ((unsigned char)(c))
@@ -753,19 +754,17 @@ static void addintlen (char *form) {
 }
 
 
-static int str_format (lua_State *L) {
+/* formats the arguments after the format string at index `arg' into b */
+static void addformat (lua_State *L, int arg, luaL_Buffer *b) {
   int top = lua_gettop(L);
-  int arg = 1;
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+      luaL_addchar(b, *strfrmt++);
     else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+      luaL_addchar(b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format (`%...') */
       char buff[MAX_ITEM];  /* to store the formatted item */
@@ -795,7 +794,7 @@ static int str_format (lua_State *L) {
         }
 #endif
         case 'q': {
-          addquoted(L, &b, arg);
+          addquoted(L, b, arg);
           continue;  /* skip the 'addsize' at the end */
         }
         case 's': {
@@ -805,7 +804,7 @@ static int str_format (lua_State *L) {
             /* no precision and string is too long to be formatted;
                keep original string */
             lua_pushvalue(L, arg);
-            luaL_addvalue(&b);
+            luaL_addvalue(b);
             continue;  /* skip the `addsize' at the end */
           }
           else {
@@ -814,21 +813,162 @@ static int str_format (lua_State *L) {
           }
         }
         default: {  /* also treat cases `pnLlh' */
-          return luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
-                               LUA_QL("format"), *(strfrmt - 1));
+          luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
+                        LUA_QL("format"), *(strfrmt - 1));
         }
       }
-      luaL_addlstring(&b, buff, c_strlen(buff));
+      luaL_addlstring(b, buff, c_strlen(buff));
     }
   }
+}
+
+
+static int str_format (lua_State *L) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, 1, &b);
   luaL_pushresult(&b);
   return 1;
 }
 
+
+/*
+** {======================================================
+** STRING BUILDER
+** A growable byte buffer in a single heap block, for assembling large
+** strings piecewise without creating a string for every step.
+** =======================================================
+*/
+
+#define LUA_STRBUILDER "SBUILDER"
+
+typedef struct StrBuilder {
+  char *data;
+  size_t len;
+  size_t size;
+} StrBuilder;
+
+
+static StrBuilder *checkbuilder (lua_State *L) {
+  return (StrBuilder *)luaL_checkudata(L, 1, LUA_STRBUILDER);
+}
+
+
+/*
+** Makes room for n more bytes, at least doubling the block if it grows. The
+** block is counted in the collector's totalbytes like any other object.
+*/
+static char *sb_reserve (lua_State *L, StrBuilder *sb, size_t n) {
+  if (n > sb->size - sb->len) {
+    size_t size = sb->size ? sb->size * 2 : LUAL_BUFFERSIZE;
+    if (n > ~(size_t)0 - sb->len)
+      luaL_error(L, "string builder too large");
+    if (size - sb->len < n)
+      size = sb->len + n;
+    /* throws if out of memory */
+    sb->data = (char *)luaM_realloc_(L, sb->data, sb->size, size);
+    sb->size = size;
+  }
+  return sb->data + sb->len;
+}
+
+
+static void sb_addlstring (lua_State *L, StrBuilder *sb, const char *s, size_t l) {
+  c_memcpy(sb_reserve(L, sb, l), s, l);
+  sb->len += l;
+}
+
+
+static int str_builder (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 1, 0);
+  StrBuilder *sb;
+  luaL_argcheck(L, size >= 0, 1, "must not be negative");
+  sb = (StrBuilder *)lua_newuserdata(L, sizeof(StrBuilder));
+  sb->data = NULL;
+  sb->len = sb->size = 0;
+  luaL_getmetatable(L, LUA_STRBUILDER);
+  lua_setmetatable(L, -2);
+  if (size > 0)
+    sb_reserve(L, sb, size);
+  return 1;
+}
+
+
+static int sb_append (lua_State *L) {
+  StrBuilder *sb = checkbuilder(L);
+  int top = lua_gettop(L);
+  int i;
+  for (i = 2; i <= top; i++) {
+    size_t l;
+    const char *s = luaL_checklstring(L, i, &l);
+    sb_addlstring(L, sb, s, l);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int sb_appendf (lua_State *L) {
+  StrBuilder *sb = checkbuilder(L);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, 2, &b);
+  /* copy straight out of the buffer rather than making a string of it */
+  sb_addlstring(L, sb, b.b, b.p - b.b);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int sb_reserve_ (lua_State *L) {
+  StrBuilder *sb = checkbuilder(L);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "must not be negative");
+  sb_reserve(L, sb, n);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int sb_reset (lua_State *L) {
+  StrBuilder *sb = checkbuilder(L);
+  sb->len = 0;
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int sb_tostring (lua_State *L) {
+  StrBuilder *sb = checkbuilder(L);
+  lua_pushlstring(L, sb->data ? sb->data : "", sb->len);
+  return 1;
+}
+
+
+static int sb_len (lua_State *L) {
+  StrBuilder *sb = checkbuilder(L);
+  lua_pushinteger(L, sb->len);
+  return 1;
+}
+
+
+static int sb_gc (lua_State *L) {
+  StrBuilder *sb = checkbuilder(L);
+  if (sb->data) {
+    luaM_freemem(L, sb->data, sb->size);
+    sb->data = NULL;
+    sb->len = sb->size = 0;
+  }
+  return 0;
+}
+
+/* }====================================================== */
+
 #undef MIN_OPT_LEVEL
 #define MIN_OPT_LEVEL 1
 #include "lrodefs.h"
 const LUA_REG_TYPE strlib[] = {
+  {LSTRKEY("builder"), LFUNCVAL(str_builder)},
   {LSTRKEY("byte"), LFUNCVAL(str_byte)},
   {LSTRKEY("char"), LFUNCVAL(str_char)},
   {LSTRKEY("dump"), LFUNCVAL(str_dump)},
@@ -855,6 +995,35 @@ const LUA_REG_TYPE strlib[] = {
 };
 
 
+const LUA_REG_TYPE sblib[] = {
+  {LSTRKEY("append"), LFUNCVAL(sb_append)},
+  {LSTRKEY("appendf"), LFUNCVAL(sb_appendf)},
+  {LSTRKEY("reserve"), LFUNCVAL(sb_reserve_)},
+  {LSTRKEY("reset"), LFUNCVAL(sb_reset)},
+  {LSTRKEY("tostring"), LFUNCVAL(sb_tostring)},
+  {LSTRKEY("__gc"), LFUNCVAL(sb_gc)},
+  {LSTRKEY("__len"), LFUNCVAL(sb_len)},
+  {LSTRKEY("__tostring"), LFUNCVAL(sb_tostring)},
+#if LUA_OPTIMIZE_MEMORY > 0
+  {LSTRKEY("__index"), LROVAL(sblib)},
+#endif
+  {LNILKEY, LNILVAL}
+};
+
+
+static void createbuildermeta (lua_State *L) {
+#if LUA_OPTIMIZE_MEMORY == 0
+  luaL_newmetatable(L, LUA_STRBUILDER);  /* create metatable for builders */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_register(L, NULL, sblib);  /* builder methods */
+#else
+  luaL_rometatable(L, LUA_STRBUILDER, (void*)sblib);
+#endif
+  lua_pop(L, 1);
+}
+
+
 #if LUA_OPTIMIZE_MEMORY != 2
 static void createmetatable (lua_State *L) {
   lua_createtable(L, 0, 1);  /* create metatable for strings */
@@ -872,6 +1041,7 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUALIB_API int luaopen_string (lua_State *L) {
+  createbuildermeta(L);
 #if LUA_OPTIMIZE_MEMORY == 0
   luaL_register(L, LUA_STRLIBNAME, strlib);
 #if defined(LUA_COMPAT_GFIND)
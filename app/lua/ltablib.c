@@ -132,6 +132,17 @@ static int tremove (lua_State *L) {
 }
 
 
+/* creates a table with room for narr array and nrec hash elements */
+static int tcreate (lua_State *L) {
+  int narr = luaL_optint(L, 1, 0);
+  int nrec = luaL_optint(L, 2, 0);
+  luaL_argcheck(L, narr >= 0, 1, "must not be negative");
+  luaL_argcheck(L, nrec >= 0, 2, "must not be negative");
+  lua_createtable(L, narr, nrec);
+  return 1;
+}
+
+
 static void addfield (lua_State *L, luaL_Buffer *b, int i) {
   lua_rawgeti(L, 1, i);
   if (!lua_isstring(L, -1))
@@ -271,6 +282,7 @@ static int sort (lua_State *L) {
 #include "lrodefs.h"
 const LUA_REG_TYPE tab_funcs[] = {
   {LSTRKEY("concat"), LFUNCVAL(tconcat)},
+  {LSTRKEY("create"), LFUNCVAL(tcreate)},
   {LSTRKEY("foreach"), LFUNCVAL(foreach)},
   {LSTRKEY("foreachi"), LFUNCVAL(foreachi)},
   {LSTRKEY("getn"), LFUNCVAL(getn)},
@@ -32,6 +32,7 @@
 static int listing=0;			/* list bytecodes? */
 static int dumping=1;			/* dump bytecodes? */
 static int stripping=0;			/* strip debug information? */
+static int flashing=0;			/* build a Lua Flash Store image? */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* progname=PROGNAME;	/* actual program name */
@@ -59,6 +60,7 @@ static void usage(const char* message)
  "usage: %s [options] [filenames].\n"
  "Available options are:\n"
  "  -        process stdin\n"
+ "  -f       output a flash image indexed by module name\n"
  "  -l       list\n"
  "  -o name  output to file " LUA_QL("name") " (default is \"%s\")\n"
  "  -p       parse only\n"
@@ -91,6 +93,8 @@ static int doargs(int argc, char* argv[])
   }
   else if (IS("-"))			/* end of options; use stdin */
    break;
+  else if (IS("-f"))			/* flash image */
+   flashing=1;
   else if (IS("-l"))			/* list */
    ++listing;
   else if (IS("-o"))			/* output file */
@@ -178,6 +182,39 @@ static const Proto* combine(lua_State* L, int n)
  }
 }
 
+/*
+** The LFS index function has one nested function per input file and a
+** constant with the module name (basename without extension) at the same
+** position; the firmware looks modules up by name through this table.
+*/
+static const Proto* flashindex(lua_State* L, int n, char** names)
+{
+ int i;
+ Proto* f=luaF_newproto(L);
+ setptvalue2s(L,L->top,f); incr_top(L);
+ f->source=luaS_newliteral(L,"=(LFS)");
+ f->maxstacksize=1;
+ f->code=luaM_newvector(L,1,Instruction);
+ f->sizecode=1;
+ f->code[0]=CREATE_ABC(OP_RETURN,0,1,0);
+ f->p=luaM_newvector(L,n,Proto*);
+ f->sizep=n;
+ f->k=luaM_newvector(L,n,TValue);
+ for (i=0; i<n; i++) setnilvalue(&f->k[i]);
+ f->sizek=n;
+ for (i=0; i<n; i++)
+ {
+  const char* name=names[i];
+  const char* base=strrchr(name,'/');
+  const char* dot;
+  if (base!=NULL) name=base+1;
+  dot=strrchr(name,'.');
+  f->p[i]=toproto(L,i-n-1);
+  setsvalue2n(L,&f->k[i],luaS_newlstr(L,name,dot ? (size_t)(dot-name) : strlen(name)));
+ }
+ return f;
+}
+
 static int writer(lua_State* L, const void* p, size_t size, void* u)
 {
  UNUSED(L);
@@ -202,7 +239,14 @@ static int pmain(lua_State* L)
   const char* filename=IS("-") ? NULL : argv[i];
   if (luaL_loadfile(L,filename)!=0) fatal(lua_tostring(L,-1));
  }
- f=combine(L,argc);
+ if (flashing)
+ {
+  for (i=0; i<argc; i++)
+   if (IS("-")) fatal(LUA_QL("-f") " cannot read stdin");
+  f=flashindex(L,argc,argv);
+ }
+ else
+  f=combine(L,argc);
  if (listing) luaU_print(f,listing>1);
  if (dumping)
  {
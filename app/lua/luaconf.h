@@ -558,6 +558,12 @@ extern int readline4lua(const char *prompt, char *buffer, int length);
 */
 #define LUAL_BUFFERSIZE		256
 
+/*
+@@ LUA_LOADBLOCKSIZE is the size of the blocks luaL_loadfsfile reads.
+** It must be a power of 2 and at least LUAL_BUFFERSIZE.
+*/
+#define LUA_LOADBLOCKSIZE	1024
+
 /* }================================================================== */
 
 
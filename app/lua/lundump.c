@@ -29,6 +29,9 @@ typedef struct {
  int numsize;
  int toflt;
  size_t total;
+#ifdef LUA_OPTIMIZE_DEBUG
+ int strip;		/* node.stripdebug level applied while loading */
+#endif
 } LoadState;
 
 #ifdef LUAC_TRUST_BINARIES
@@ -177,6 +180,16 @@ static TString* LoadString(LoadState* S)
  }
 }
 
+#ifdef LUA_OPTIMIZE_DEBUG
+static void SkipString(LoadState* S)
+{
+ int32_t size;
+ LoadVar(S,size);
+ if (size)
+  LoadBlock(S,NULL,size);
+}
+#endif
+
 static void LoadCode(LoadState* S, Proto* f)
 {
  int n=LoadInt(S);
@@ -237,6 +250,10 @@ static void LoadDebug(LoadState* S, Proto* f)
  Align4(S);
 
 #ifdef LUA_OPTIMIZE_DEBUG
+ if (n && S->strip > 2 && !luaZ_direct_mode(S->Z)) {
+   LoadBlock(S,NULL,n);  /* drop line info, it costs no RAM in direct mode */
+   n=0;
+ }
  if(n) {
    if (!luaZ_direct_mode(S->Z)) {
      f->packedlineinfo=luaM_newvector(S->L,n,unsigned char);
@@ -259,6 +276,16 @@ static void LoadDebug(LoadState* S, Proto* f)
  f->sizelineinfo=n;
  #endif
  n=LoadInt(S);
+#ifdef LUA_OPTIMIZE_DEBUG
+ if (S->strip > 1) {  /* skip local names without allocating them */
+  for (i=0; i<n; i++) {
+   SkipString(S);
+   LoadInt(S);
+   LoadInt(S);
+  }
+  n=0;
+ }
+#endif
  f->locvars=luaM_newvector(S->L,n,LocVar);
  f->sizelocvars=n;
  for (i=0; i<n; i++) f->locvars[i].varname=NULL;
@@ -269,6 +296,13 @@ static void LoadDebug(LoadState* S, Proto* f)
   f->locvars[i].endpc=LoadInt(S);
  }
  n=LoadInt(S);
+#ifdef LUA_OPTIMIZE_DEBUG
+ if (S->strip > 1) {  /* and upvalue names */
+  for (i=0; i<n; i++)
+   SkipString(S);
+  n=0;
+ }
+#endif
  f->upvalues=luaM_newvector(S->L,n,TString*);
  f->sizeupvalues=n;
  for (i=0; i<n; i++) f->upvalues[i]=NULL;
@@ -327,6 +361,13 @@ Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
  S.L=L;
  S.Z=Z;
  S.b=buff;
+#ifdef LUA_OPTIMIZE_DEBUG
+ /* only strip if a level has been set explicitly by node.stripdebug() */
+ lua_pushlightuserdata(L, &luaG_stripdebug);
+ lua_gettable(L, LUA_REGISTRYINDEX);
+ S.strip = lua_isnil(L, -1) ? 1 : lua_tointeger(L, -1);
+ lua_pop(L, 1);
+#endif
  LoadHeader(&S);
  S.total=0;
  return LoadFunction(&S,luaS_newliteral(L,"=?"));
@@ -471,6 +471,138 @@ memp_free(memp_t type, void *mem)
 }
 
 #endif /* MEMP_MEM_MALLOC */
+
+#if MEMP_MEM_MALLOC && MEMP_PREALLOC
+
+/* Preallocated pools in front of the heap. Each pool is one heap block,
+ * allocated at boot, carved into a free list of elements. Elements freed
+ * back are recognised by their address, so that the heap fallback needs
+ * no bookkeeping of its own. Interrupts are locked while a free list is
+ * touched, as mem_malloc() does for the heap. */
+
+struct memp_elem {
+  struct memp_elem *next;
+};
+
+struct memp_pool {
+  struct memp_elem *free;
+  u8_t *start, *end;
+  struct memp_pool_stats stats;
+};
+
+static const u16_t memp_prealloc[MEMP_MAX] = {
+  [MEMP_PBUF]      = MEMP_PREALLOC_PBUF,
+  [MEMP_PBUF_POOL] = MEMP_PREALLOC_PBUF_POOL,
+  [MEMP_TCP_SEG]   = MEMP_PREALLOC_TCP_SEG,
+  [MEMP_TCP_PCB]   = MEMP_PREALLOC_TCP_PCB,
+  [MEMP_UDP_PCB]   = MEMP_PREALLOC_UDP_PCB,
+};
+
+static const char * const memp_pool_names[MEMP_MAX] = {
+  [MEMP_PBUF]      = "pbuf",
+  [MEMP_PBUF_POOL] = "pbuf_pool",
+  [MEMP_TCP_SEG]   = "tcp_seg",
+  [MEMP_TCP_PCB]   = "tcp_pcb",
+  [MEMP_UDP_PCB]   = "udp_pcb",
+};
+
+static struct memp_pool memp_pools[MEMP_MAX];
+
+void
+memp_init(void)
+{
+  struct memp_pool *pool;
+  struct memp_elem *e;
+  u16_t i, j;
+
+  for (i = 0; i < MEMP_MAX; i++) {
+    pool = &memp_pools[i];
+    pool->stats.size = memp_sizes[i];
+    if (!memp_prealloc[i] || pool->start)
+      continue;
+    pool->start = (u8_t *)mem_malloc(memp_prealloc[i] * memp_sizes[i]);
+    if (!pool->start)
+      continue;
+    pool->end = pool->start + memp_prealloc[i] * memp_sizes[i];
+    pool->stats.num = memp_prealloc[i];
+    for (j = 0; j < memp_prealloc[i]; j++) {
+      e = (struct memp_elem *)(void *)(pool->start + j * memp_sizes[i]);
+      e->next = pool->free;
+      pool->free = e;
+    }
+  }
+}
+
+void *
+memp_malloc(memp_t type)
+{
+  struct memp_pool *pool;
+  struct memp_elem *e;
+  void *mem;
+
+  LWIP_ERROR("memp_malloc: type < MEMP_MAX", (type < MEMP_MAX), return NULL;);
+  pool = &memp_pools[type];
+
+  ETS_INTR_LOCK();
+  e = pool->free;
+  if (e) {
+    pool->free = e->next;
+    if (++pool->stats.used > pool->stats.max)
+      pool->stats.max = pool->stats.used;
+  }
+  ETS_INTR_UNLOCK();
+  if (e)
+    return e;
+
+  mem = mem_malloc(memp_sizes[type]);
+  if (pool->stats.num) {
+    if (mem)
+      pool->stats.fallback++;
+    else
+      pool->stats.failed++;
+  }
+  return mem;
+}
+
+void
+memp_free(memp_t type, void *mem)
+{
+  struct memp_pool *pool = &memp_pools[type];
+  struct memp_elem *e = (struct memp_elem *)mem;
+
+  if (mem == NULL)
+    return;
+  if ((u8_t *)mem < pool->start || (u8_t *)mem >= pool->end) {
+    mem_free(mem);
+    return;
+  }
+  ETS_INTR_LOCK();
+  e->next = pool->free;
+  pool->free = e;
+  pool->stats.used--;
+  ETS_INTR_UNLOCK();
+}
+
+/* Returns the name of a preallocated pool and its usage, or NULL if the
+ * type has no pool. reset sets the high water mark back to the current use
+ * and clears the fallback counters. */
+const char *
+memp_pool_stats(memp_t type, struct memp_pool_stats *stats, int reset)
+{
+  struct memp_pool *pool;
+
+  if (type >= MEMP_MAX || !memp_pool_names[type])
+    return NULL;
+  pool = &memp_pools[type];
+  *stats = pool->stats;
+  if (reset) {
+    pool->stats.max = pool->stats.used;
+    pool->stats.fallback = pool->stats.failed = 0;
+  }
+  return memp_pool_names[type];
+}
+
+#endif /* MEMP_MEM_MALLOC && MEMP_PREALLOC */
 #if 0
 void memp_dump(void)
 {
@@ -315,7 +315,7 @@ static void mbedtls_msg_server_step(pmbedtls_msg msg)
 #if defined(ESP8266_PLATFORM)
     if (msg->quiet && msg->ssl.out_buf)
     {
-        mbedtls_zeroize(msg->ssl.out_buf, MBEDTLS_SSL_OUTBUFFER_LEN);
+        mbedtls_zeroize(msg->ssl.out_buf, msg->ssl.out_buf_len);
         os_free(msg->ssl.out_buf);
         msg->ssl.out_buf = NULL;
     }
@@ -349,7 +349,7 @@ static void mbedtls_msg_free(pmbedtls_msg *msg)
 #if defined(ESP8266_PLATFORM)
     if ((*msg)->quiet && (*msg)->ssl.out_buf)
     {
-        mbedtls_zeroize((*msg)->ssl.out_buf, MBEDTLS_SSL_OUTBUFFER_LEN);
+        mbedtls_zeroize((*msg)->ssl.out_buf, (*msg)->ssl.out_buf_len);
         os_free((*msg)->ssl.out_buf);
         (*msg)->ssl.out_buf = NULL;
     }
@@ -498,6 +498,7 @@ static int mbedtls_hanshake_finished(mbedtls_msg *msg)
 
 	ssl->out_buf = (unsigned char*)os_zalloc(len);
 	lwIP_REQUIRE_ACTION(ssl->out_buf, exit, ret = MBEDTLS_ERR_SSL_ALLOC_FAILED);
+    ssl->out_buf_len = len;
     
     ssl->out_ctr = ssl->out_buf;
     ssl->out_hdr = ssl->out_buf +  8;
@@ -528,12 +529,15 @@ static void mbedtls_handshake_succ(mbedtls_ssl_context *ssl)
 		ssl->session_negotiate = NULL;
     }
 
-    if( ssl->session )
+    /*the session stays in use by the record layer, only drop the peer's certificate*/
+#if defined(MBEDTLS_X509_CRT_PARSE_C)
+    if( ssl->session && ssl->session->peer_cert )
     {
-        mbedtls_ssl_session_free( ssl->session );
-        os_free( ssl->session );
-		ssl->session = NULL;
+        mbedtls_x509_crt_free( ssl->session->peer_cert );
+        os_free( ssl->session->peer_cert );
+		ssl->session->peer_cert = NULL;
     }
+#endif
 
 #if defined(MBEDTLS_X509_CRT_PARSE_C)
     if( ssl->hostname != NULL )
@@ -808,6 +812,13 @@ static bool mbedtls_msg_config(mbedtls_msg *msg)
 	}
 	mbedtls_ssl_conf_rng(&msg->conf, mbedtls_ctr_drbg_random, &msg->ctr_drbg);
 	mbedtls_ssl_conf_dbg(&msg->conf, mbedtls_dbg, NULL);
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+	/*Ask the server for smaller records, so that the input buffer stays small*/
+	if (auth_type == MBEDTLS_SSL_IS_CLIENT){
+		ret = mbedtls_ssl_conf_max_frag_len(&msg->conf, ssl_option.client.mfl_code);
+		lwIP_REQUIRE_NOERROR(ret, exit);
+	}
+#endif
 	
 	ret = mbedtls_ssl_setup(&msg->ssl, &msg->conf);
 	lwIP_REQUIRE_NOERROR(ret, exit);
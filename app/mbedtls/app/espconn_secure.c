@@ -39,9 +39,11 @@ static const char mem_debug_file[] ICACHE_RODATA_ATTR = __FILE__;
 
 #include "sys/espconn_mbedtls.h"
 
+extern espconn_msg *plink_active;
+
 ssl_opt ssl_option = {
-		{NULL, ESPCONN_SECURE_DEFAULT_SIZE, 0, false, 0, false},
-		{NULL, ESPCONN_SECURE_DEFAULT_SIZE, 0, false, 0, false},
+		{NULL, ESPCONN_SECURE_DEFAULT_SIZE, 0, false, 0, false, MBEDTLS_SSL_MAX_FRAG_LEN_NONE},
+		{NULL, ESPCONN_SECURE_DEFAULT_SIZE, 0, false, 0, false, SSL_MAX_FRAG_LEN_CODE},
 		0
 };
 
@@ -219,6 +221,61 @@ sint16 ICACHE_FLASH_ATTR espconn_secure_get_size(uint8 level)
 	return max_content_len;
 }
 
+/******************************************************************************
+ * FunctionName : espconn_secure_set_max_fragment_length
+ * Description  : set the maximum fragment length (RFC 6066) the client asks
+ * 				  the server for in new connections
+ * Parameters   : level -- only 1: client
+ * 				  length -- 512, 1024, 2048 or 4096, 0 to not ask
+ * Returns      : true or false
+*******************************************************************************/
+bool ICACHE_FLASH_ATTR espconn_secure_set_max_fragment_length(uint8 level, uint16 length)
+{
+	uint8 code = MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+
+	if (level != ESPCONN_CLIENT)
+		return false;
+
+	if (length != 0) {
+		for (code = MBEDTLS_SSL_MAX_FRAG_LEN_512; code < MBEDTLS_SSL_MAX_FRAG_LEN_INVALID; code++)
+			if (length == (256 << code))
+				break;
+		if (code == MBEDTLS_SSL_MAX_FRAG_LEN_INVALID)
+			return false;
+	}
+
+	ssl_option.client.mfl_code = code;
+	return true;
+}
+
+/******************************************************************************
+ * FunctionName : espconn_secure_get_buffer_info
+ * Description  : get the record buffer sizes of the open secure connections
+ * Parameters   : info -- array to fill in
+ * 				  max -- number of entries in info
+ * Returns      : number of entries filled in
+*******************************************************************************/
+uint8 ICACHE_FLASH_ATTR espconn_secure_get_buffer_info(espconn_secure_buffer *info, uint8 max)
+{
+	espconn_msg *plist = NULL;
+	pmbedtls_msg msg = NULL;
+	uint8 count = 0;
+
+	for (plist = plink_active; plist != NULL && count < max; plist = plist->pnext) {
+		if (plist->pssl == NULL)
+			continue;
+		msg = plist->pssl;
+		info[count].pespconn = plist->pespconn;
+		info[count].in_size = msg->ssl.in_buf_len;
+		info[count].out_size = msg->ssl.out_buf_len;
+		info[count].max_frag_len = 0;
+		if (msg->ssl.session != NULL && msg->ssl.session->mfl_code != MBEDTLS_SSL_MAX_FRAG_LEN_NONE)
+			info[count].max_frag_len = 256 << msg->ssl.session->mfl_code;
+		count++;
+	}
+	return count;
+}
+
 /******************************************************************************
  * FunctionName : espconn_secure_ca_enable
  * Description  : enable the certificate authenticate and set the flash sector
@@ -1282,11 +1282,11 @@ static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
     MBEDTLS_SSL_DEBUG_BUF( 4, "before encrypt: output payload",
                       ssl->out_msg, ssl->out_msglen );
 
-    if( ssl->out_msglen > MBEDTLS_SSL_MAX_CONTENT_LEN )
+    if( ssl->out_msglen > MBEDTLS_SSL_OUT_CONTENT_LEN )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "Record content %u too large, maximum %d",
                                     (unsigned) ssl->out_msglen,
-                                    MBEDTLS_SSL_MAX_CONTENT_LEN ) );
+                                    MBEDTLS_SSL_OUT_CONTENT_LEN ) );
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
     }
 
@@ -1891,14 +1891,14 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
              * Padding is guaranteed to be incorrect if:
              *   1. padlen >= ssl->in_msglen
              *
-             *   2. padding_idx >= MBEDTLS_SSL_MAX_CONTENT_LEN +
+             *   2. padding_idx >= MBEDTLS_SSL_IN_CONTENT_LEN +
              *                     ssl->transform_in->maclen
              *
              * In both cases we reset padding_idx to a safe value (0) to
              * prevent out-of-buffer reads.
              */
             correct &= ( ssl->in_msglen >= padlen + 1 );
-            correct &= ( padding_idx < MBEDTLS_SSL_MAX_CONTENT_LEN +
+            correct &= ( padding_idx < MBEDTLS_SSL_IN_CONTENT_LEN +
                                        ssl->transform_in->maclen );
 
             padding_idx *= correct;
@@ -2211,6 +2211,127 @@ static int ssl_resend_hello_request( mbedtls_ssl_context *ssl )
 #endif
 #endif /* MBEDTLS_SSL_SRV_C && MBEDTLS_SSL_RENEGOTIATION */
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+#if MBEDTLS_SSL_IDLE_CONTENT_LEN > MBEDTLS_SSL_IN_CONTENT_LEN || \
+    MBEDTLS_SSL_IDLE_CONTENT_LEN > MBEDTLS_SSL_OUT_CONTENT_LEN
+#error "MBEDTLS_SSL_IDLE_CONTENT_LEN larger than the record buffers"
+#endif
+
+#define SSL_IDLE_BUFFER_LEN  MBEDTLS_SSL_BUFFER_LEN_FOR( MBEDTLS_SSL_IDLE_CONTENT_LEN )
+
+#define SSL_REBASE( p, from, to )   ( (p) = (to) + ( (p) - (from) ) )
+
+/*
+ * Move a record buffer to a fresh allocation of len bytes, keeping its
+ * first used bytes. The old buffer is wiped before it is freed.
+ */
+static unsigned char *ssl_move_buffer( unsigned char *buf, size_t buf_len,
+                                       size_t len, size_t used )
+{
+    unsigned char *p;
+
+    if( ( p = mbedtls_calloc( 1, len ) ) == NULL )
+        return( NULL );
+
+    memcpy( p, buf, used < buf_len ? used : buf_len );
+    mbedtls_zeroize( buf, buf_len );
+    mbedtls_free( buf );
+
+    return( p );
+}
+
+/*
+ * Resize the input buffer, but never below what it currently holds: the
+ * incoming counter, a partly read record and unconsumed content.
+ */
+static int ssl_resize_in_buf( mbedtls_ssl_context *ssl, size_t len )
+{
+    unsigned char *old = ssl->in_buf;
+    size_t used = ssl->in_hdr - old + ssl->in_left;
+
+    if( (size_t)( ssl->in_msg - old ) + ssl->in_msglen > used )
+        used = ssl->in_msg - old + ssl->in_msglen;
+    if( used > ssl->in_buf_len )
+        used = ssl->in_buf_len;
+    if( len < used )
+        len = used;
+    if( len == ssl->in_buf_len )
+        return( 0 );
+
+    if( ( ssl->in_buf = ssl_move_buffer( old, ssl->in_buf_len, len, used ) ) == NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc(%d bytes) failed", len ) );
+        ssl->in_buf = old;
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+    }
+    ssl->in_buf_len = len;
+
+    SSL_REBASE( ssl->in_ctr, old, ssl->in_buf );
+    SSL_REBASE( ssl->in_hdr, old, ssl->in_buf );
+    SSL_REBASE( ssl->in_len, old, ssl->in_buf );
+    SSL_REBASE( ssl->in_iv,  old, ssl->in_buf );
+    SSL_REBASE( ssl->in_msg, old, ssl->in_buf );
+    if( ssl->in_offt != NULL )
+        SSL_REBASE( ssl->in_offt, old, ssl->in_buf );
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "input buffer resized to %d bytes", len ) );
+
+    return( 0 );
+}
+
+/*
+ * Resize the output buffer, keeping the outgoing counter and any record
+ * that is not completely written yet.
+ */
+static int ssl_resize_out_buf( mbedtls_ssl_context *ssl, size_t len )
+{
+    unsigned char *old = ssl->out_buf;
+    size_t used = ssl->out_msg - old;
+
+    if( ssl->out_left != 0 )
+        used = ssl->out_hdr - old + mbedtls_ssl_hdr_len( ssl ) + ssl->out_msglen;
+    if( used > ssl->out_buf_len )
+        used = ssl->out_buf_len;
+    if( len < used )
+        len = used;
+    if( len == ssl->out_buf_len )
+        return( 0 );
+
+    if( ( ssl->out_buf = ssl_move_buffer( old, ssl->out_buf_len, len, used ) ) == NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc(%d bytes) failed", len ) );
+        ssl->out_buf = old;
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+    }
+    ssl->out_buf_len = len;
+
+    SSL_REBASE( ssl->out_ctr, old, ssl->out_buf );
+    SSL_REBASE( ssl->out_hdr, old, ssl->out_buf );
+    SSL_REBASE( ssl->out_len, old, ssl->out_buf );
+    SSL_REBASE( ssl->out_iv,  old, ssl->out_buf );
+    SSL_REBASE( ssl->out_msg, old, ssl->out_buf );
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "output buffer resized to %d bytes", len ) );
+
+    return( 0 );
+}
+
+/*
+ * Cut both buffers back to the idle size where nothing is pending in them.
+ * The output buffer keeps its full size until the handshake is over, since
+ * handshake messages are composed in place. If the smaller allocation
+ * fails, the larger buffer simply stays.
+ */
+static void ssl_shrink_buffers( mbedtls_ssl_context *ssl )
+{
+    if( ssl->in_left == 0 && ssl->in_offt == NULL )
+        (void) ssl_resize_in_buf( ssl, SSL_IDLE_BUFFER_LEN );
+
+    if( ssl->state == MBEDTLS_SSL_HANDSHAKE_OVER && ssl->out_left == 0 )
+        (void) ssl_resize_out_buf( ssl, SSL_IDLE_BUFFER_LEN );
+}
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+
 /*
  * Fill the input message buffer by appending data to it.
  * The amount of data already fetched is in ssl->in_left.
@@ -2240,7 +2361,23 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
     }
 
-    if( nb_want > MBEDTLS_SSL_BUFFER_LEN - (size_t)( ssl->in_hdr - ssl->in_buf ) )
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    /*
+     * Grow the buffer for a large record. Leave room for the padding check
+     * in ssl_decrypt_buf(), which always looks at 256 bytes past the data.
+     */
+    if( nb_want + MBEDTLS_SSL_PADDING_ADD >
+        ssl->in_buf_len - (size_t)( ssl->in_hdr - ssl->in_buf ) )
+    {
+        len = ( ssl->in_hdr - ssl->in_buf ) + nb_want + MBEDTLS_SSL_PADDING_ADD;
+
+        if( ( ret = ssl_resize_in_buf( ssl, len < MBEDTLS_SSL_IN_BUFFER_LEN ?
+                                            len : MBEDTLS_SSL_IN_BUFFER_LEN ) ) != 0 )
+            return( ret );
+    }
+#endif
+
+    if( nb_want > ssl->in_buf_len - (size_t)( ssl->in_hdr - ssl->in_buf ) )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "requesting more data than fits" ) );
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
@@ -2323,7 +2460,7 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
             ret = MBEDTLS_ERR_SSL_TIMEOUT;
         else
         {
-            len = MBEDTLS_SSL_BUFFER_LEN - ( ssl->in_hdr - ssl->in_buf );
+            len = ssl->in_buf_len - ( ssl->in_hdr - ssl->in_buf );
 
             if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER )
                 timeout = ssl->handshake->retransmit_timeout;
@@ -2761,12 +2898,12 @@ int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
         if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
         {
             /* Make room for the additional DTLS fields */
-            if( MBEDTLS_SSL_MAX_CONTENT_LEN - ssl->out_msglen < 8 )
+            if( MBEDTLS_SSL_OUT_CONTENT_LEN - ssl->out_msglen < 8 )
             {
                 MBEDTLS_SSL_DEBUG_MSG( 1, ( "DTLS handshake message too large: "
                               "size %u, maximum %u",
                                (unsigned) ( ssl->in_hslen - 4 ),
-                               (unsigned) ( MBEDTLS_SSL_MAX_CONTENT_LEN - 12 ) ) );
+                               (unsigned) ( MBEDTLS_SSL_OUT_CONTENT_LEN - 12 ) ) );
                 return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
             }
 
@@ -2979,7 +3116,7 @@ static int ssl_reassemble_dtls_handshake( mbedtls_ssl_context *ssl )
         MBEDTLS_SSL_DEBUG_MSG( 2, ( "initialize reassembly, total length = %d",
                             msg_len ) );
 
-        if( ssl->in_hslen > MBEDTLS_SSL_MAX_CONTENT_LEN )
+        if( ssl->in_hslen > MBEDTLS_SSL_IN_CONTENT_LEN )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "handshake message too large" ) );
             return( MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE );
@@ -3083,7 +3220,7 @@ static int ssl_reassemble_dtls_handshake( mbedtls_ssl_context *ssl )
         ssl->next_record_offset = new_remain - ssl->in_hdr;
         ssl->in_left = ssl->next_record_offset + remain_len;
 
-        if( ssl->in_left > MBEDTLS_SSL_BUFFER_LEN -
+        if( ssl->in_left > ssl->in_buf_len -
                            (size_t)( ssl->in_hdr - ssl->in_buf ) )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "reassembled message too large for buffer" ) );
@@ -3457,7 +3594,7 @@ static int ssl_handle_possible_reconnect( mbedtls_ssl_context *ssl )
             ssl->conf->p_cookie,
             ssl->cli_id, ssl->cli_id_len,
             ssl->in_buf, ssl->in_left,
-            ssl->out_buf, MBEDTLS_SSL_MAX_CONTENT_LEN, &len );
+            ssl->out_buf, ssl->out_buf_len, &len );
 
     MBEDTLS_SSL_DEBUG_RET( 2, "ssl_check_dtls_clihlo_cookie", ret );
 
@@ -3554,7 +3691,7 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
     }
 
     /* Check length against the size of our buffer */
-    if( ssl->in_msglen > MBEDTLS_SSL_BUFFER_LEN
+    if( ssl->in_msglen > MBEDTLS_SSL_IN_BUFFER_LEN
                          - (size_t)( ssl->in_msg - ssl->in_buf ) )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad message length" ) );
@@ -3565,7 +3702,7 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
     if( ssl->transform_in == NULL )
     {
         if( ssl->in_msglen < 1 ||
-            ssl->in_msglen > MBEDTLS_SSL_MAX_CONTENT_LEN )
+            ssl->in_msglen > MBEDTLS_SSL_IN_CONTENT_LEN )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad message length" ) );
             return( MBEDTLS_ERR_SSL_INVALID_RECORD );
@@ -3581,7 +3718,7 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
 
 #if defined(MBEDTLS_SSL_PROTO_SSL3)
         if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_0 &&
-            ssl->in_msglen > ssl->transform_in->minlen + MBEDTLS_SSL_MAX_CONTENT_LEN )
+            ssl->in_msglen > ssl->transform_in->minlen + MBEDTLS_SSL_IN_CONTENT_LEN )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad message length" ) );
             return( MBEDTLS_ERR_SSL_INVALID_RECORD );
@@ -3594,7 +3731,7 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
          */
         if( ssl->minor_ver >= MBEDTLS_SSL_MINOR_VERSION_1 &&
             ssl->in_msglen > ssl->transform_in->minlen +
-                             MBEDTLS_SSL_MAX_CONTENT_LEN + 256 )
+                             MBEDTLS_SSL_IN_CONTENT_LEN + 256 )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad message length" ) );
             return( MBEDTLS_ERR_SSL_INVALID_RECORD );
@@ -3718,7 +3855,7 @@ static int ssl_prepare_record_content( mbedtls_ssl_context *ssl )
         MBEDTLS_SSL_DEBUG_BUF( 4, "input payload after decrypt",
                        ssl->in_msg, ssl->in_msglen );
 
-        if( ssl->in_msglen > MBEDTLS_SSL_MAX_CONTENT_LEN )
+        if( ssl->in_msglen > MBEDTLS_SSL_IN_CONTENT_LEN )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad message length" ) );
             return( MBEDTLS_ERR_SSL_INVALID_RECORD );
@@ -3906,6 +4043,10 @@ int mbedtls_ssl_read_record_layer( mbedtls_ssl_context *ssl )
 
     /* Need to fetch a new record */
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    ssl_shrink_buffers( ssl );
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
 read_record_header:
 #endif
@@ -4311,10 +4452,10 @@ int mbedtls_ssl_write_certificate( mbedtls_ssl_context *ssl )
     while( crt != NULL )
     {
         n = crt->raw.len;
-        if( n > MBEDTLS_SSL_MAX_CONTENT_LEN - 3 - i )
+        if( n > MBEDTLS_SSL_OUT_CONTENT_LEN - 3 - i )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "certificate too large, %d > %d",
-                           i + 3 + n, MBEDTLS_SSL_MAX_CONTENT_LEN ) );
+                           i + 3 + n, MBEDTLS_SSL_OUT_CONTENT_LEN ) );
             return( MBEDTLS_ERR_SSL_CERTIFICATE_TOO_LARGE );
         }
 
@@ -5648,21 +5789,28 @@ int mbedtls_ssl_setup( mbedtls_ssl_context *ssl,
                        const mbedtls_ssl_config *conf )
 {
     int ret;
-    const size_t len = MBEDTLS_SSL_BUFFER_LEN;
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    const size_t in_len = SSL_IDLE_BUFFER_LEN;
+#else
+    const size_t in_len = MBEDTLS_SSL_IN_BUFFER_LEN;
+#endif
+    const size_t out_len = MBEDTLS_SSL_OUT_BUFFER_LEN;
 
     ssl->conf = conf;
 
     /*
      * Prepare base structures
      */
-    if( ( ssl-> in_buf = mbedtls_calloc( 1, len ) ) == NULL ||
-        ( ssl->out_buf = mbedtls_calloc( 1, len ) ) == NULL )
+    if( ( ssl-> in_buf = mbedtls_calloc( 1, in_len ) ) == NULL ||
+        ( ssl->out_buf = mbedtls_calloc( 1, out_len ) ) == NULL )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc(%d bytes) failed", len ) );
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc(%d bytes) failed", in_len + out_len ) );
         mbedtls_free( ssl->in_buf );
         ssl->in_buf = NULL;
         return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
     }
+    ssl->in_buf_len = in_len;
+    ssl->out_buf_len = out_len;
 
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     if( conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
@@ -5759,9 +5907,9 @@ static int ssl_session_reset_int( mbedtls_ssl_context *ssl, int partial )
     ssl->transform_in = NULL;
     ssl->transform_out = NULL;
 
-    memset( ssl->out_buf, 0, MBEDTLS_SSL_BUFFER_LEN );
+    memset( ssl->out_buf, 0, ssl->out_buf_len );
     if( partial == 0 )
-        memset( ssl->in_buf, 0, MBEDTLS_SSL_BUFFER_LEN );
+        memset( ssl->in_buf, 0, ssl->in_buf_len );
 
 #if defined(MBEDTLS_SSL_HW_RECORD_ACCEL)
     if( mbedtls_ssl_hw_record_reset != NULL )
@@ -6583,6 +6731,12 @@ size_t mbedtls_ssl_get_max_frag_len( const mbedtls_ssl_context *ssl )
         max_len = mfl_code_to_length[ssl->session_out->mfl_code];
     }
 
+    /*
+     * Never emit more than the output buffer holds
+     */
+    if( max_len > MBEDTLS_SSL_OUT_CONTENT_LEN )
+        max_len = MBEDTLS_SSL_OUT_CONTENT_LEN;
+
     return max_len;
 }
 #endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
@@ -6622,6 +6776,12 @@ int mbedtls_ssl_handshake_step( mbedtls_ssl_context *ssl )
     if( ssl == NULL || ssl->conf == NULL )
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    /* Handshake messages are written in place and may take the whole buffer */
+    if( ( ret = ssl_resize_out_buf( ssl, MBEDTLS_SSL_OUT_BUFFER_LEN ) ) != 0 )
+        return( ret );
+#endif
+
 #if defined(MBEDTLS_SSL_CLI_C)
     if( ssl->conf->endpoint == MBEDTLS_SSL_IS_CLIENT )
         ret = mbedtls_ssl_handshake_client_step( ssl );
@@ -6654,6 +6814,11 @@ int mbedtls_ssl_handshake( mbedtls_ssl_context *ssl )
             break;
     }
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    if( ret == 0 )
+        ssl_shrink_buffers( ssl );
+#endif
+
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= handshake" ) );
 
     return( ret );
@@ -7146,7 +7311,7 @@ static int ssl_write_real( mbedtls_ssl_context *ssl,
 #if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
     size_t max_len = mbedtls_ssl_get_max_frag_len( ssl );
 #else
-    size_t max_len = MBEDTLS_SSL_MAX_CONTENT_LEN;
+    size_t max_len = MBEDTLS_SSL_OUT_CONTENT_LEN;
 #endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
     if( len > max_len )
     {
@@ -7173,6 +7338,19 @@ static int ssl_write_real( mbedtls_ssl_context *ssl,
     }
     else
     {
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+        size_t need = ( ssl->out_msg - ssl->out_buf ) + len
+                      + MBEDTLS_SSL_COMPRESSION_ADD
+                      + MBEDTLS_SSL_MAC_ADD
+                      + MBEDTLS_SSL_PADDING_ADD;
+
+        if( need > ssl->out_buf_len &&
+            ( ret = ssl_resize_out_buf( ssl, need ) ) != 0 )
+        {
+            return( ret );
+        }
+#endif
+
         ssl->out_msglen  = len;
         ssl->out_msgtype = MBEDTLS_SSL_MSG_APPLICATION_DATA;
         memcpy( ssl->out_msg, buf, len );
@@ -7184,6 +7362,10 @@ static int ssl_write_real( mbedtls_ssl_context *ssl,
         }
     }
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    ssl_shrink_buffers( ssl );
+#endif
+
     return( (int) len );
 }
 
@@ -7437,13 +7619,13 @@ void mbedtls_ssl_free( mbedtls_ssl_context *ssl )
 
     if( ssl->out_buf != NULL )
     {
-        mbedtls_zeroize( ssl->out_buf, MBEDTLS_SSL_BUFFER_LEN );
+        mbedtls_zeroize( ssl->out_buf, ssl->out_buf_len );
         mbedtls_free( ssl->out_buf );
     }
 
     if( ssl->in_buf != NULL )
     {
-        mbedtls_zeroize( ssl->in_buf, MBEDTLS_SSL_BUFFER_LEN );
+        mbedtls_zeroize( ssl->in_buf, ssl->in_buf_len );
         mbedtls_free( ssl->in_buf );
     }
 
@@ -3,16 +3,284 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "platform.h"
+#include "hw_timer.h"
+#include "task/task.h"
 
 #include "c_types.h"
+#include "c_stdlib.h"
+#include "c_string.h"
 #include "user_interface.h"
+#include "bytearr.h"
+
+/*
+ * Continuous sampling
+ *
+ * The FRC1 timer samples the ADC at a fixed rate. Raw samples are averaged
+ * in groups of `decimate` in the interrupt and the results go into a ring
+ * of two blocks. Whenever a block is complete a task takes it out, applies
+ * the moving average, gathers the statistics and hands it to Lua. If Lua
+ * falls behind by more than a block, new samples are dropped and counted.
+ */
+#define ADC_STREAM_MAX_RATE     2000    // system_adc_read() takes most of 100us, leave WiFi its share
+#define ADC_STREAM_MAX_BLOCK    1024
+#define ADC_STREAM_MAX_DECIMATE 256
+#define ADC_STREAM_MAX_AVERAGE  32
+
+static const os_param_t TIMER_OWNER = 0x61646373; // "adcs"
+
+typedef struct {
+  uint16_t *ring;               // 2 * block samples
+  uint16_t *out;                // block being delivered
+  uint16_t *window;             // moving average history
+  uint16_t block, head, tail, count;
+  uint16_t decimate, nacc, average, wpos, wfill;
+  uint32_t acc, wsum;
+  uint32_t overruns;
+  uint16_t last;                // latest raw sample, for adc.read()
+  uint8_t  posted, stats, as_string;
+  int cb_ref;
+} adc_stream_t;
+
+static adc_stream_t *stream;
+static task_handle_t stream_task;
+
+static void ICACHE_RAM_ATTR adc_stream_isr( os_param_t arg )
+{
+  adc_stream_t *s = (adc_stream_t *)arg;
+  uint16_t v = system_adc_read();
+
+  s->last = v;
+  s->acc += v;
+  if (++s->nacc < s->decimate)
+    return;
+  v = s->acc / s->decimate;
+  s->acc = 0;
+  s->nacc = 0;
+
+  if (s->count == 2 * s->block) {
+    s->overruns++;
+  } else {
+    s->ring[s->head] = v;
+    if (++s->head == 2 * s->block)
+      s->head = 0;
+    s->count++;
+  }
+  // a failed post is retried with the next sample
+  if (s->count >= s->block && !s->posted)
+    s->posted = task_post_high(stream_task, (task_param_t)s) ? 1 : 0;
+}
+
+static uint32_t isqrt( uint64_t v )
+{
+  uint64_t r = 0, bit = (uint64_t)1 << 62;
+
+  while (bit > v)
+    bit >>= 2;
+  while (bit) {
+    if (v >= r + bit) {
+      v -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return r;
+}
+
+static void adc_stream_free( adc_stream_t *s )
+{
+  c_free(s->window);
+  c_free(s->out);
+  c_free(s->ring);
+  c_free(s);
+}
+
+static void adc_stream_stop( lua_State *L )
+{
+  adc_stream_t *s = stream;
+
+  if (!s)
+    return;
+  platform_hw_timer_close(TIMER_OWNER);
+  stream = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, s->cb_ref);
+  adc_stream_free(s);
+}
+
+static void adc_stream_deliver( task_param_t param, uint8 prio )
+{
+  adc_stream_t *s = (adc_stream_t *)param;
+  lua_State *L = lua_getstate();
+
+  while (s == stream && s->count >= s->block) {
+    uint16_t i, min = 0xffff, max = 0;
+    uint32_t overruns;
+    uint64_t sum = 0, sumsq = 0;
+    int nargs = 2;
+
+    for (i = 0; i < s->block; i++) {
+      uint16_t v = s->ring[s->tail];
+      if (++s->tail == 2 * s->block)
+        s->tail = 0;
+      if (s->average > 1) {
+        s->wsum += v;
+        if (s->wfill == s->average)
+          s->wsum -= s->window[s->wpos];
+        else
+          s->wfill++;
+        s->window[s->wpos] = v;
+        if (++s->wpos == s->average)
+          s->wpos = 0;
+        v = s->wsum / s->wfill;
+      }
+      s->out[i] = v;
+      if (s->stats) {
+        if (v < min) min = v;
+        if (v > max) max = v;
+        sum += v;
+        sumsq += (uint32_t)v * v;
+      }
+    }
+
+    ets_intr_lock();
+    s->count -= s->block;
+    overruns = s->overruns;
+    s->overruns = 0;
+    ets_intr_unlock();
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->cb_ref);
+    if (s->as_string)
+      lua_pushlstring(L, (const char *)s->out, s->block * sizeof(uint16_t));
+    else if (!bytearr_push(L, s->out, s->block * sizeof(uint16_t))) {
+      // out of memory, the block is lost like an overrun
+      lua_pop(L, 1);
+      ets_intr_lock();
+      s->overruns += overruns + s->block;
+      ets_intr_unlock();
+      continue;
+    }
+    lua_pushinteger(L, overruns);
+    if (s->stats) {
+      uint64_t n = s->block;
+      lua_createtable(L, 0, 4);
+      lua_pushinteger(L, min);
+      lua_setfield(L, -2, "min");
+      lua_pushinteger(L, max);
+      lua_setfield(L, -2, "max");
+      lua_pushinteger(L, (sum + n / 2) / n);
+      lua_setfield(L, -2, "mean");
+      // standard deviation, i.e. the rms of the signal less its mean
+      lua_pushinteger(L, isqrt((n * sumsq - sum * sum) / (n * n)));
+      lua_setfield(L, -2, "rms");
+      nargs++;
+    }
+    lua_call(L, nargs, 0);
+  }
+  // the callback may have stopped this stream and started another one
+  if (s == stream) {
+    ets_intr_lock();
+    s->posted = s->count >= s->block;
+    ets_intr_unlock();
+    if (s->posted && !task_post_high(stream_task, (task_param_t)s))
+      s->posted = 0;
+  }
+}
+
+static int opt_int( lua_State *L, const char *key, int def, int min, int max )
+{
+  int v;
+
+  lua_getfield(L, 1, key);
+  v = luaL_optinteger(L, -1, def);
+  lua_pop(L, 1);
+  if (v < min || v > max)
+    return luaL_error(L, "%s must be %d..%d", key, min, max);
+  return v;
+}
+
+// Lua: adc.start({rate=, block=, decimate=, average=, stats=, format=}, function(data, overruns, stats) end)
+static int adc_start( lua_State *L )
+{
+  adc_stream_t *s;
+  int rate, block, decimate, average, stats, as_string;
+  const char *format;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (lua_type(L, 2) != LUA_TFUNCTION && lua_type(L, 2) != LUA_TLIGHTFUNCTION)
+    return luaL_argerror(L, 2, "function expected");
+  if (stream)
+    return luaL_error(L, "already sampling");
+
+  lua_getfield(L, 1, "rate");
+  rate = luaL_checkinteger(L, -1);
+  lua_pop(L, 1);
+  if (rate < 1 || rate > ADC_STREAM_MAX_RATE)
+    return luaL_error(L, "rate must be 1..%d", ADC_STREAM_MAX_RATE);
+  block = opt_int(L, "block", 128, 1, ADC_STREAM_MAX_BLOCK);
+  decimate = opt_int(L, "decimate", 1, 1, ADC_STREAM_MAX_DECIMATE);
+  average = opt_int(L, "average", 1, 1, ADC_STREAM_MAX_AVERAGE);
+  lua_getfield(L, 1, "stats");
+  stats = lua_toboolean(L, -1);
+  lua_getfield(L, 1, "format");
+  format = luaL_optstring(L, -1, "string");
+  as_string = c_strcmp(format, "string") == 0;
+#ifdef LUA_USE_MODULES_BYTEARR
+  if (!as_string && c_strcmp(format, "bytearr") != 0)
+    return luaL_error(L, "format must be \"string\" or \"bytearr\"");
+#else
+  if (!as_string)
+    return luaL_error(L, "format must be \"string\"");
+#endif
+  lua_pop(L, 2);
+
+  s = (adc_stream_t *)c_zalloc(sizeof(adc_stream_t));
+  if (s) {
+    s->ring = (uint16_t *)c_malloc(2 * block * sizeof(uint16_t));
+    s->out = (uint16_t *)c_malloc(block * sizeof(uint16_t));
+    if (average > 1)
+      s->window = (uint16_t *)c_malloc(average * sizeof(uint16_t));
+  }
+  if (!s || !s->ring || !s->out || (average > 1 && !s->window)) {
+    if (s)
+      adc_stream_free(s);
+    return luaL_error(L, "out of memory");
+  }
+  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, TRUE)) {
+    adc_stream_free(s);
+    return luaL_error(L, "hardware timer in use");
+  }
+
+  s->block = block;
+  s->decimate = decimate;
+  s->average = average;
+  s->stats = stats;
+  s->as_string = as_string;
+  lua_pushvalue(L, 2);
+  s->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  s->last = system_adc_read();
+  stream = s;
+  if (!stream_task)
+    stream_task = task_get_id(adc_stream_deliver);
+  platform_hw_timer_set_func(TIMER_OWNER, adc_stream_isr, (os_param_t)s);
+  platform_hw_timer_arm_ticks(TIMER_OWNER, US_TO_RTC_TIMER_TICKS(1000000) / rate);
+  return 0;
+}
+
+// Lua: adc.stop()
+static int adc_stop( lua_State *L )
+{
+  adc_stream_stop(L);
+  return 0;
+}
 
 // Lua: read(id) , return system adc
 static int adc_sample( lua_State* L )
 {
   unsigned id = luaL_checkinteger( L, 1 );
   MOD_CHECK_ID( adc, id );
-  unsigned val = 0xFFFF & system_adc_read();
+  // the sampling interrupt owns the ADC while it runs
+  unsigned val = stream ? stream->last : 0xFFFF & system_adc_read();
   lua_pushinteger( L, val );
   return 1; 
 }
@@ -65,6 +333,8 @@ static const LUA_REG_TYPE adc_map[] = {
   { LSTRKEY( "read" ),      LFUNCVAL( adc_sample ) },
   { LSTRKEY( "readvdd33" ), LFUNCVAL( adc_readvdd33 ) },
   { LSTRKEY( "force_init_mode" ), LFUNCVAL( adc_init107 ) },
+  { LSTRKEY( "start" ),     LFUNCVAL( adc_start ) },
+  { LSTRKEY( "stop" ),      LFUNCVAL( adc_stop ) },
   { LSTRKEY( "INIT_ADC" ),  LNUMVAL( 0x00 ) },
   { LSTRKEY( "INIT_VDD33" ),LNUMVAL( 0xff ) },
   { LNILKEY, LNILVAL }
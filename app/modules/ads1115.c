@@ -135,25 +135,16 @@ static int ads1115_lua_readoutdone(void * param);
 static int ads1115_lua_register(lua_State *L, uint8_t chip_id);
 
 static uint8_t write_reg(uint8_t ads_addr, uint8_t reg, uint16_t config) {
-    platform_i2c_send_start(ads1115_i2c_id);
-    platform_i2c_send_address(ads1115_i2c_id, ads_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
-    platform_i2c_send_byte(ads1115_i2c_id, reg);
-    platform_i2c_send_byte(ads1115_i2c_id, (uint8_t)(config >> 8));
-    platform_i2c_send_byte(ads1115_i2c_id, (uint8_t)(config & 0xFF));
-    platform_i2c_send_stop(ads1115_i2c_id);
+    uint8_t buf[2] = { (uint8_t)(config >> 8), (uint8_t)(config & 0xFF) };
+    return platform_i2c_write_reg(ads1115_i2c_id, ads_addr, reg, buf, 2);
 }
 
+// returns 0xFFFF, what an idle bus reads, if the device does not answer
 static uint16_t read_reg(uint8_t ads_addr, uint8_t reg) {
-    platform_i2c_send_start(ads1115_i2c_id);
-    platform_i2c_send_address(ads1115_i2c_id, ads_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
-    platform_i2c_send_byte(ads1115_i2c_id, reg);
-    platform_i2c_send_stop(ads1115_i2c_id);
-    platform_i2c_send_start(ads1115_i2c_id);
-    platform_i2c_send_address(ads1115_i2c_id, ads_addr, PLATFORM_I2C_DIRECTION_RECEIVER);
-    uint16_t buf = (platform_i2c_recv_byte(ads1115_i2c_id, 1) << 8);
-    buf += platform_i2c_recv_byte(ads1115_i2c_id, 0);
-    platform_i2c_send_stop(ads1115_i2c_id);
-    return buf;
+    uint8_t buf[2];
+    if (platform_i2c_read_reg(ads1115_i2c_id, ads_addr, reg, buf, 2) != PLATFORM_OK)
+        return 0xFFFF;
+    return (buf[0] << 8) | buf[1];
 }
 
 // convert ADC value to voltage corresponding to PGA settings
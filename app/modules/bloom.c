@@ -6,21 +6,127 @@
 
 #include "module.h"
 #include "lauxlib.h"
+#include "platform.h"
 #include "c_types.h"
+#include "vfs.h"
 #include "../crypto/sha2.h"
 
 #if defined(LUA_USE_MODULES_BLOOM) && !defined(SHA2_ENABLE)
 #error Must have SHA2_ENABLE set for BLOOM module
 #endif
 
+#define BLOOM_SHA256   0
+#define BLOOM_MURMUR3  1
+
+#define BLOOM_MAX_FNS  15
+#define BLOOM_MAGIC    0x314d4c42   // "BLM1"
+
+#define OP_CHECK  0
+#define OP_ADD    1
+#define OP_REMOVE 2
+
 typedef struct {
   uint8 fns;
-  uint16 size;
-  uint32 occupancy;
-  uint32 buf[];
+  uint8 hash;
+  uint8 counting;               // 4 bit counters rather than bits
+  uint8 mapped;                 // buf is in the flash region
+  uint32 size;                  // in words
+  uint32 occupancy;             // cells that are not zero
+  uint32 gen;                   // flash_gen when mapped
+  uint32 *buf;
+  uint32 data[];
 } bloom_t;
 
-static bool add_or_check(const uint8 *buf, size_t len, bloom_t *filter, bool add) {
+// Header of saved filters, followed by the size words of the filter
+typedef struct {
+  uint32 magic;
+  uint8 fns, hash, counting, reserved;
+  uint32 size;
+  uint32 occupancy;
+} bloom_file_t;
+
+#ifdef BLOOM_FLASH_SIZE
+/*
+ * A saved filter can be copied to a region reserved in the firmware image
+ * and used from there through the flash cache, without taking any RAM.
+ * The region is rewritten only when a different filter is loaded, and
+ * filters mapped before that stop working.
+ */
+#if (BLOOM_FLASH_SIZE % INTERNAL_FLASH_SECTOR_SIZE) != 0
+#error "BLOOM_FLASH_SIZE must be a multiple of the flash sector size"
+#endif
+
+/* Reserves the region in the firmware image; accessed through the linker symbol only */
+const char bloom_flash_space[BLOOM_FLASH_SIZE]
+  __attribute__((used, aligned(INTERNAL_FLASH_SECTOR_SIZE), section(".bloom.reserved"))) = { 0 };
+extern const uint32 bloom_flash_reserved[];
+
+static uint32 flash_gen;
+#endif
+
+static inline uint32 cells(const bloom_t *filter) {
+  return filter->counting ? filter->size << 3 : filter->size << 5;
+}
+
+static inline uint32 rotl32(uint32 x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+static uint32 murmur3_32(const uint8 *key, size_t len, uint32 seed) {
+  uint32 h = seed;
+  uint32 k;
+  size_t i;
+
+  for (i = len >> 2; i; i--, key += 4) {
+    k = key[0] | (key[1] << 8) | (key[2] << 16) | ((uint32) key[3] << 24);
+    k *= 0xcc9e2d51;
+    k = rotl32(k, 15);
+    k *= 0x1b873593;
+    h ^= k;
+    h = rotl32(h, 13);
+    h = h * 5 + 0xe6546b64;
+  }
+
+  k = 0;
+  switch (len & 3) {
+    case 3: k ^= key[2] << 16;
+    case 2: k ^= key[1] << 8;
+    case 1: k ^= key[0];
+      k *= 0xcc9e2d51;
+      k = rotl32(k, 15);
+      k *= 0x1b873593;
+      h ^= k;
+  }
+
+  h ^= len;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static void hash_cells(const uint8 *buf, size_t len, const bloom_t *filter, uint32 *idx) {
+  uint32 n = cells(filter);
+  int i;
+
+  if (filter->hash == BLOOM_MURMUR3) {
+    // Kirsch-Mitzenmacher: two hashes combined give all the functions,
+    // a non-zero step keeps the probes from collapsing onto one cell
+    uint32 h1 = murmur3_32(buf, len, 0);
+    uint32 step = n > 1 ? murmur3_32(buf, len, h1) % (n - 1) + 1 : 0;
+    uint32 val = h1 % n;
+    for (i = 0; i < filter->fns; i++) {
+      idx[i] = val;
+      val += step;
+      if (val >= n) {
+        val -= n;
+      }
+    }
+    return;
+  }
+
   SHA256_CTX ctx;
   SHA256_Init(&ctx);
   SHA256_Update(&ctx, buf, len);
@@ -28,57 +134,147 @@ static bool add_or_check(const uint8 *buf, size_t len, bloom_t *filter, bool add
   char hash[32];
   SHA256_Final(hash, &ctx);
 
-  int i;
-  uint32 bits = filter->size << 5;
   uint8 *h = hash;
-  bool prev = true;
   int hstep = filter->fns > 10 ? 2 : 3;
   for (i = 0; i < filter->fns; i++) {
     uint32 val = (((h[0] << 8) + h[1]) << 8) + h[2];
     h += hstep;
-    val = val % bits;
+    idx[i] = val % n;
+  }
+}
 
-    uint32 offset = val >> 5;
-    uint32 bit = 1 << (val & 31);
+static inline uint32 get_cell(const bloom_t *filter, uint32 val) {
+  if (filter->counting) {
+    return (filter->buf[val >> 3] >> ((val & 7) << 2)) & 15;
+  }
+  return filter->buf[val >> 5] & (1u << (val & 31));
+}
 
-    if (!(filter->buf[offset] & bit)) {
+static void add_cell(bloom_t *filter, uint32 val) {
+  if (filter->counting) {
+    uint32 shift = (val & 7) << 2;
+    uint32 c = (filter->buf[val >> 3] >> shift) & 15;
+    if (c == 0) {
+      filter->occupancy++;
+    }
+    if (c < 15) {
+      filter->buf[val >> 3] += 1 << shift;
+    }
+  } else if (!get_cell(filter, val)) {
+    filter->buf[val >> 5] |= 1u << (val & 31);
+    filter->occupancy++;
+  }
+}
+
+static void remove_cell(bloom_t *filter, uint32 val) {
+  uint32 shift = (val & 7) << 2;
+  uint32 c = (filter->buf[val >> 3] >> shift) & 15;
+
+  // a saturated counter no longer knows how many adds it has seen
+  if (c > 0 && c < 15) {
+    filter->buf[val >> 3] -= 1 << shift;
+    if (c == 1) {
+      filter->occupancy--;
+    }
+  }
+}
+
+static bool add_or_check(const uint8 *buf, size_t len, bloom_t *filter, int op) {
+  uint32 idx[BLOOM_MAX_FNS];
+  int i;
+  bool prev = true;
+
+  hash_cells(buf, len, filter, idx);
+
+  for (i = 0; i < filter->fns; i++) {
+    if (!get_cell(filter, idx[i])) {
       prev = false;
-      if (add) {
-        filter->buf[offset] |= bit;
-        filter->occupancy++;
-      } else {
-        break;
-      }
+      break;
+    }
+  }
+
+  if (op == OP_ADD) {
+    for (i = 0; i < filter->fns; i++) {
+      add_cell(filter, idx[i]);
+    }
+  } else if (op == OP_REMOVE && prev) {
+    for (i = 0; i < filter->fns; i++) {
+      remove_cell(filter, idx[i]);
     }
   }
 
   return prev;
 }
 
-static int bloom_filter_check(lua_State *L) {
+static bloom_t *check_filter(lua_State *L, bool write) {
   bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
+
+  if (filter->mapped) {
+    if (write) {
+      luaL_error(L, "filter is read only");
+    }
+#ifdef BLOOM_FLASH_SIZE
+    if (filter->gen != flash_gen) {
+      luaL_error(L, "filter has been replaced in flash");
+    }
+#endif
+  }
+  return filter;
+}
+
+// Applies op to a string, or to each string of an array giving an array of results
+static int filter_op(lua_State *L, bloom_t *filter, int op) {
   size_t length;
-  const uint8 *buffer = (uint8 *) luaL_checklstring(L, 2, &length);
+  const uint8 *buffer;
+
+  if (lua_istable(L, 2)) {
+    int i, n = lua_objlen(L, 2);
 
-  bool rc = add_or_check(buffer, length, filter, false);
+    lua_createtable(L, n, 0);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, 2, i);
+      buffer = (uint8 *) lua_tolstring(L, -1, &length);
+      if (!buffer) {
+        return luaL_error(L, "item %d is not a string", i);
+      }
+      lua_pushboolean(L, add_or_check(buffer, length, filter, op));
+      lua_rawseti(L, -3, i);
+      lua_pop(L, 1);
+    }
+    return 1;
+  }
+
+  buffer = (uint8 *) luaL_checklstring(L, 2, &length);
+
+  bool rc = add_or_check(buffer, length, filter, op);
 
   lua_pushboolean(L, rc);
   return 1;
 }
 
+static int bloom_filter_check(lua_State *L) {
+  bloom_t *filter = check_filter(L, false);
+
+  return filter_op(L, filter, OP_CHECK);
+}
+
 static int bloom_filter_add(lua_State *L) {
-  bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
-  size_t length;
-  const uint8 *buffer = (uint8 *) luaL_checklstring(L, 2, &length);
+  bloom_t *filter = check_filter(L, true);
+
+  return filter_op(L, filter, OP_ADD);
+}
 
-  bool rc = add_or_check(buffer, length, filter, true);
+static int bloom_filter_remove(lua_State *L) {
+  bloom_t *filter = check_filter(L, true);
 
-  lua_pushboolean(L, rc);
-  return 1;
+  if (!filter->counting) {
+    return luaL_error(L, "not a counting filter");
+  }
+  return filter_op(L, filter, OP_REMOVE);
 }
 
 static int bloom_filter_reset(lua_State *L) {
-  bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
+  bloom_t *filter = check_filter(L, true);
 
   memset(filter->buf, 0, filter->size << 2);
   filter->occupancy = 0;
@@ -87,16 +283,17 @@ static int bloom_filter_reset(lua_State *L) {
 }
 
 static int bloom_filter_info(lua_State *L) {
-  bloom_t *filter = (bloom_t *)luaL_checkudata(L, 1, "bloom.filter");
+  bloom_t *filter = check_filter(L, false);
+  uint32 n = cells(filter);
 
-  lua_pushinteger(L, filter->size << 5);
+  lua_pushinteger(L, n);
   lua_pushinteger(L, filter->fns);
   lua_pushinteger(L, filter->occupancy);
 
   // Now calculate the chance that a FP will be returned
   uint64 prob = 1000000;
   if (filter->occupancy > 0) {
-    unsigned int ratio = (filter->size << 5) / filter->occupancy;
+    unsigned int ratio = n / filter->occupancy;
     int i;
 
     prob = ratio;
@@ -107,7 +304,7 @@ static int bloom_filter_info(lua_State *L) {
 
     if (prob < 1000000) {
       // try again with some scaling
-      unsigned int ratio256 = (filter->size << 13) / filter->occupancy;
+      uint64 ratio256 = ((uint64) n << 8) / filter->occupancy;
 
       uint64 prob256 = ratio256;
 
@@ -124,9 +321,187 @@ static int bloom_filter_info(lua_State *L) {
   return 4;
 }
 
+// Copies len bytes from src to a file, in word reads so that src may be in flash
+static bool write_words(int fd, const uint32 *src, uint32 len) {
+  uint32 chunk[64];
+
+  while (len) {
+    uint32 n = len > sizeof(chunk) ? sizeof(chunk) : len;
+    uint32 i;
+    for (i = 0; i < n >> 2; i++) {
+      chunk[i] = src[i];
+    }
+    if (vfs_write(fd, chunk, n) != n) {
+      return false;
+    }
+    src += n >> 2;
+    len -= n;
+  }
+  return true;
+}
+
+static int bloom_filter_save(lua_State *L) {
+  bloom_t *filter = check_filter(L, false);
+  const char *fname = luaL_checkstring(L, 2);
+  bloom_file_t hdr = { BLOOM_MAGIC, filter->fns, filter->hash, filter->counting, 0,
+                       filter->size, filter->occupancy };
+
+  int fd = vfs_open(fname, "w");
+  if (!fd) {
+    return luaL_error(L, "cannot open %s", fname);
+  }
+  bool ok = vfs_write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+            write_words(fd, filter->buf, filter->size << 2);
+  vfs_close(fd);
+  if (!ok) {
+    return luaL_error(L, "write error");
+  }
+  return 0;
+}
+
+static bloom_t *new_filter(lua_State *L, uint32 data_size) {
+  bloom_t *filter = (bloom_t *) lua_newuserdata(L, sizeof(bloom_t) + data_size);
+  //
+  // Associate its metatable
+  luaL_getmetatable(L, "bloom.filter");
+  lua_setmetatable(L, -2);
+
+  memset(filter, 0, sizeof(bloom_t) + data_size);
+  filter->buf = filter->data;
+  return filter;
+}
+
+#ifdef BLOOM_FLASH_SIZE
+// Copies the open file to the flash region, unless it is already there
+static const char *map_file(int fd, uint32 len) {
+  uint32 chunk[64];
+  uint32 base = platform_flash_mapped2phys((uint32) bloom_flash_reserved);
+  uint32 offs, i, n;
+
+  if (len > BLOOM_FLASH_SIZE) {
+    return "filter too large for the flash region";
+  }
+
+  for (offs = 0; offs < len; offs += n) {
+    n = len - offs > sizeof(chunk) ? sizeof(chunk) : len - offs;
+    if (vfs_read(fd, chunk, n) != n) {
+      return "read error";
+    }
+    for (i = 0; i < n >> 2; i++) {
+      if (chunk[i] != bloom_flash_reserved[(offs >> 2) + i]) {
+        break;
+      }
+    }
+    if (i < n >> 2) {
+      break;
+    }
+  }
+  if (offs >= len) {
+    return NULL;
+  }
+
+  flash_gen++;
+  vfs_lseek(fd, 0, VFS_SEEK_SET);
+  for (offs = 0; offs < len; offs += INTERNAL_FLASH_SECTOR_SIZE) {
+    if (platform_flash_erase_sector((base + offs) / INTERNAL_FLASH_SECTOR_SIZE) != PLATFORM_OK) {
+      return "flash erase error";
+    }
+  }
+  for (offs = 0; offs < len; offs += n) {
+    n = len - offs > sizeof(chunk) ? sizeof(chunk) : len - offs;
+    if (vfs_read(fd, chunk, n) != n) {
+      return "read error";
+    }
+    if (platform_s_flash_write(chunk, base + offs, n) != n) {
+      return "flash write error";
+    }
+  }
+  return NULL;
+}
+#endif
+
+// Lua: bloom.load(filename[, mapped])
+static int bloom_load(lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  bool mapped = lua_toboolean(L, 2);
+  const char *err = NULL;
+  bloom_file_t hdr;
+  bloom_t *filter;
+
+#ifndef BLOOM_FLASH_SIZE
+  if (mapped) {
+    return luaL_error(L, "no flash region, see BLOOM_FLASH_SIZE");
+  }
+#endif
+
+  int fd = vfs_open(fname, "r");
+  if (!fd) {
+    return luaL_error(L, "cannot open %s", fname);
+  }
+  if (vfs_read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != BLOOM_MAGIC ||
+      hdr.fns < 1 || hdr.fns > BLOOM_MAX_FNS || hdr.hash > BLOOM_MURMUR3 ||
+      hdr.counting > 1 || hdr.size == 0 || hdr.size > 0x10000000) {
+    vfs_close(fd);
+    return luaL_error(L, "not a bloom filter");
+  }
+
+#ifdef BLOOM_FLASH_SIZE
+  if (mapped) {
+    vfs_lseek(fd, 0, VFS_SEEK_SET);
+    err = map_file(fd, sizeof(hdr) + (hdr.size << 2));
+    vfs_close(fd);
+    if (err) {
+      return luaL_error(L, err);
+    }
+    filter = new_filter(L, 0);
+    filter->buf = (uint32 *) bloom_flash_reserved + sizeof(hdr) / 4;
+    filter->mapped = 1;
+    filter->gen = flash_gen;
+  } else
+#endif
+  {
+    // allocating may raise an error, so not with the file open
+    vfs_close(fd);
+    filter = new_filter(L, hdr.size << 2);
+    fd = vfs_open(fname, "r");
+    if (!fd || vfs_lseek(fd, sizeof(hdr), VFS_SEEK_SET) != sizeof(hdr) ||
+        vfs_read(fd, filter->buf, hdr.size << 2) != (hdr.size << 2)) {
+      err = "read error";
+    }
+    if (fd) {
+      vfs_close(fd);
+    }
+    if (err) {
+      return luaL_error(L, err);
+    }
+  }
+
+  filter->fns = hdr.fns;
+  filter->hash = hdr.hash;
+  filter->counting = hdr.counting;
+  filter->size = hdr.size;
+  filter->occupancy = hdr.occupancy;
+
+  return 1;
+}
+
+// Lua: bloom.create(elements, errorrate[, {hash=, counting=}])
 static int bloom_create(lua_State *L) {
   int items = luaL_checkinteger(L, 1);
   int error = luaL_checkinteger(L, 2);
+  int hash = BLOOM_SHA256;
+  bool counting = false;
+
+  if (lua_istable(L, 3)) {
+    lua_getfield(L, 3, "hash");
+    hash = luaL_optinteger(L, -1, BLOOM_SHA256);
+    lua_getfield(L, 3, "counting");
+    counting = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+    if (hash != BLOOM_SHA256 && hash != BLOOM_MURMUR3) {
+      return luaL_error(L, "unknown hash");
+    }
+  }
 
   int n = error;
   int logp = 0;
@@ -144,7 +519,8 @@ static int bloom_create(lua_State *L) {
     bits = 256;
   }
 
-  int size = bits >> 3;
+  // a counting filter has a 4 bit counter in place of each bit
+  int size = counting ? bits >> 1 : bits >> 3;
 
   int fns = bits / items;
   fns = (fns >> 1) + fns / 6;
@@ -152,19 +528,15 @@ static int bloom_create(lua_State *L) {
   if (fns < 2) {
     fns = 2;
   }
-  if (fns > 15) {
-    fns = 15;
+  if (fns > BLOOM_MAX_FNS) {
+    fns = BLOOM_MAX_FNS;
   }
 
-  bloom_t *filter = (bloom_t *) lua_newuserdata(L, sizeof(bloom_t) + size);
-  //
-  // Associate its metatable
-  luaL_getmetatable(L, "bloom.filter");
-  lua_setmetatable(L, -2);
-
-  memset(filter, 0, sizeof(bloom_t) + size);
+  bloom_t *filter = new_filter(L, size);
   filter->size = size >> 2;
   filter->fns = fns;
+  filter->hash = hash;
+  filter->counting = counting;
 
   return 1;
 }
@@ -172,8 +544,10 @@ static int bloom_create(lua_State *L) {
 static const LUA_REG_TYPE bloom_filter_map[] = {
   { LSTRKEY( "add" ),                   LFUNCVAL( bloom_filter_add ) },
   { LSTRKEY( "check" ),                 LFUNCVAL( bloom_filter_check ) },
+  { LSTRKEY( "remove" ),                LFUNCVAL( bloom_filter_remove ) },
   { LSTRKEY( "reset" ),                 LFUNCVAL( bloom_filter_reset ) },
   { LSTRKEY( "info" ),                  LFUNCVAL( bloom_filter_info ) },
+  { LSTRKEY( "save" ),                  LFUNCVAL( bloom_filter_save ) },
   { LSTRKEY( "__index" ),               LROVAL( bloom_filter_map ) },
   { LNILKEY, LNILVAL }
 };
@@ -181,6 +555,9 @@ static const LUA_REG_TYPE bloom_filter_map[] = {
 // Module function map
 static const LUA_REG_TYPE bloom_map[] = {
   { LSTRKEY( "create" ),   LFUNCVAL( bloom_create ) },
+  { LSTRKEY( "load" ),     LFUNCVAL( bloom_load ) },
+  { LSTRKEY( "SHA256" ),   LNUMVAL( BLOOM_SHA256 ) },
+  { LSTRKEY( "MURMUR3" ),  LNUMVAL( BLOOM_MURMUR3 ) },
   { LNILKEY, LNILVAL }
 };
 
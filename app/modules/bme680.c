@@ -36,34 +36,19 @@ static double bme680_hc = 1.0;
 
 // return 0 if good
 static int r8u_n(uint8_t reg, int n, uint8_t *buff) {
-	int i;
-
-	platform_i2c_send_start(bme680_i2c_id);
-	platform_i2c_send_address(bme680_i2c_id, bme680_i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
-	platform_i2c_send_byte(bme680_i2c_id, reg);
-//	platform_i2c_send_stop(bme680_i2c_id);	// doco says not needed
-
-	platform_i2c_send_start(bme680_i2c_id);
-	platform_i2c_send_address(bme680_i2c_id, bme680_i2c_addr, PLATFORM_I2C_DIRECTION_RECEIVER);
-
-	while (n-- > 0)
-		*buff++ = platform_i2c_recv_byte(bme680_i2c_id, n > 0);
-	platform_i2c_send_stop(bme680_i2c_id);
-
-	return 0;
+	return platform_i2c_read_reg(bme680_i2c_id, bme680_i2c_addr, reg, buff, n) == PLATFORM_OK ? 0 : 1;
 }
 
-static uint8_t w8u(uint8_t reg, uint8_t val) {
-	platform_i2c_send_start(bme680_i2c_id);
-	platform_i2c_send_address(bme680_i2c_id, bme680_i2c_addr, PLATFORM_I2C_DIRECTION_TRANSMITTER);
-	platform_i2c_send_byte(bme680_i2c_id, reg);
-	platform_i2c_send_byte(bme680_i2c_id, val);
-	platform_i2c_send_stop(bme680_i2c_id);
+// return 0 if good
+static int w8u(uint8_t reg, uint8_t val) {
+	return platform_i2c_write_reg(bme680_i2c_id, bme680_i2c_addr, reg, &val, 1) == PLATFORM_OK ? 0 : 1;
 }
 
+// reads 0xFF, like an idle bus, if the device does not answer
 static uint8_t r8u(uint8_t reg) {
 	uint8_t ret[1];
-	r8u_n(reg, 1, ret);
+	if (r8u_n(reg, 1, ret))
+		return 0xFF;
 	return ret[0];
 }
 
@@ -320,14 +305,21 @@ static int bme680_lua_setup(lua_State* L) {
 		}
 	}
 
-	uint8_t chipid = r8u(BME680_CHIP_ID_ADDR);
+	uint8_t chipid;
+	if (r8u_n(BME680_CHIP_ID_ADDR, 1, &chipid) || chipid != BME680_CHIP_ID) {
+		NODE_DBG("No BME680 found\n");
+		return 0;
+	}
 	NODE_DBG("chip_id: %x\n", chipid);
 
 #define r16uLE_buf(reg)	(uint16_t)(((uint16_t)reg[1] << 8) | (uint16_t)reg[0])
 #define r16sLE_buf(reg)	 (int16_t)(r16uLE_buf(reg))
 	uint8_t	buff[BME680_COEFF_SIZE], *reg;
-	r8u_n(BME680_COEFF_ADDR1, BME680_COEFF_ADDR1_LEN, buff);
-  r8u_n(BME680_COEFF_ADDR2, BME680_COEFF_ADDR2_LEN, &buff[BME680_COEFF_ADDR1_LEN]);
+	if (r8u_n(BME680_COEFF_ADDR1, BME680_COEFF_ADDR1_LEN, buff) ||
+	    r8u_n(BME680_COEFF_ADDR2, BME680_COEFF_ADDR2_LEN, &buff[BME680_COEFF_ADDR1_LEN])) {
+		NODE_DBG("Reading the calibration failed\n");
+		return 0;
+	}
 
 	reg = buff + 1; 
 	bme680_data.par_t2 = r16sLE_buf(reg); reg+=2; // #define BME680_T3_REG		(3)
@@ -388,17 +380,21 @@ static int bme680_lua_setup(lua_State* L) {
     NODE_DBG("mode: %x\nhumidity oss: %x\nconfig: %x\n", bme680_mode, os_hum, filter);
     
     heatr_dur = (!lua_isnumber(L, 5)?DEFAULT_HEATER_DUR:(luaL_checkinteger(L, 5))); // 5-th parameter: heater duration
-    w8u(BME680_GAS_WAIT0_ADDR, calc_heater_dur(heatr_dur));
-    w8u(BME680_RES_HEAT0_ADDR, calc_heater_res((!lua_isnumber(L, 4)?DEFAULT_HEATER_TEMP:(luaL_checkinteger(L, 4))))); // 4-th parameter: heater temperature
+    int err = w8u(BME680_GAS_WAIT0_ADDR, calc_heater_dur(heatr_dur));
+    err |= w8u(BME680_RES_HEAT0_ADDR, calc_heater_res((!lua_isnumber(L, 4)?DEFAULT_HEATER_TEMP:(luaL_checkinteger(L, 4))))); // 4-th parameter: heater temperature
   
-    w8u(BME680_CONF_ODR_FILT_ADDR, BME680_SET_BITS_POS_0(r8u(BME680_CONF_ODR_FILT_ADDR), BME680_FILTER, filter)); // #define BME680_CONF_ODR_FILT_ADDR		UINT8_C(0x75)
+    err |= w8u(BME680_CONF_ODR_FILT_ADDR, BME680_SET_BITS_POS_0(r8u(BME680_CONF_ODR_FILT_ADDR), BME680_FILTER, filter)); // #define BME680_CONF_ODR_FILT_ADDR		UINT8_C(0x75)
     
     // set heater on 
-    w8u(BME680_CONF_HEAT_CTRL_ADDR, BME680_SET_BITS_POS_0(r8u(BME680_CONF_HEAT_CTRL_ADDR), BME680_HCTRL, 1));
+    err |= w8u(BME680_CONF_HEAT_CTRL_ADDR, BME680_SET_BITS_POS_0(r8u(BME680_CONF_HEAT_CTRL_ADDR), BME680_HCTRL, 1));
     
-    w8u(BME680_CONF_T_P_MODE_ADDR, bme680_mode);
-    w8u(BME680_CONF_OS_H_ADDR, BME680_SET_BITS_POS_0(r8u(BME680_CONF_OS_H_ADDR), BME680_OSH, os_hum));
-    w8u(BME680_CONF_ODR_RUN_GAS_NBC_ADDR, 1 << 4 | 0 & bit3);
+    err |= w8u(BME680_CONF_T_P_MODE_ADDR, bme680_mode);
+    err |= w8u(BME680_CONF_OS_H_ADDR, BME680_SET_BITS_POS_0(r8u(BME680_CONF_OS_H_ADDR), BME680_OSH, os_hum));
+    err |= w8u(BME680_CONF_ODR_RUN_GAS_NBC_ADDR, 1 << 4 | 0 & bit3);
+    if (err) {
+      NODE_DBG("Writing the configuration failed\n");
+      return 0;
+    }
   }
   lua_pushinteger(L, 1);
 
@@ -430,8 +426,14 @@ static int bme680_lua_startreadout(lua_State* L) {
 		lua_connected_readout_ref = LUA_NOREF;
 	}
 
-  w8u(BME680_CONF_OS_H_ADDR, os_hum);
-  w8u(BME680_CONF_T_P_MODE_ADDR, (bme680_mode & 0xFC) | BME680_FORCED_MODE);
+  if (w8u(BME680_CONF_OS_H_ADDR, os_hum) ||
+      w8u(BME680_CONF_T_P_MODE_ADDR, (bme680_mode & 0xFC) | BME680_FORCED_MODE)) {
+    if (lua_connected_readout_ref != LUA_NOREF) {
+      luaL_unref(L, LUA_REGISTRYINDEX, lua_connected_readout_ref);
+      lua_connected_readout_ref = LUA_NOREF;
+    }
+    return luaL_error(L, "found no device");
+  }
   
 	NODE_DBG("control old: %x, control: %x, delay: %d\n", bme680_mode, (bme680_mode & 0xFC) | BME680_FORCED_MODE, delay);
 
@@ -459,7 +461,8 @@ static int bme680_lua_read(lua_State* L) {
 	uint32_t qfe;
 	uint8_t calc_qnh = lua_isnumber(L, 1);
 
-	r8u_n(BME680_FIELD0_ADDR, BME680_FIELD_LENGTH, buff);
+	if (r8u_n(BME680_FIELD0_ADDR, BME680_FIELD_LENGTH, buff))
+		return 0;
 
   status = buff[0] & BME680_NEW_DATA_MSK;
 
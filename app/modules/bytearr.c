@@ -7,6 +7,7 @@
 #include "lauxlib.h"
 #include "setjmp.h"
 #include "math.h"
+#include "bytearr.h"
 
 #ifndef BYTEARRAY_RESERVE_SIZE
 #define BYTEARRAY_RESERVE_SIZE 128
@@ -1020,6 +1021,64 @@ static ICACHE_FLASH_ATTR int lbytearr_gc( lua_State *L )
   return 0;
 }
 
+const uint8_t *bytearr_data( lua_State *L, int index, size_t *len )
+{
+  if( !lua_isuserdata(L, index) || !lua_getmetatable(L, index) )
+    return NULL;
+  lua_getfield( L, LUA_REGISTRYINDEX, MODULE_NAME "#mt" );
+  int same = lua_rawequal( L, -1, -2 );
+  lua_pop( L, 2 );
+  if( !same )
+    return NULL;
+
+  Buf *p = lua_tobuffer(L, index);
+  *len = p->length;
+  return p->buffer;
+}
+
+uint8_t *bytearr_reserve( lua_State *L, int index, size_t len )
+{
+  size_t cur;
+  if( !bytearr_data(L, index, &cur) )
+    return NULL;
+
+  Buf *p = lua_tobuffer(L, index);
+  if( p->flag.readonly )
+    return NULL;
+  if( len > p->length ){
+    if( len > getCapacity(p) ){
+      uint8_t *b = realloc( p->buffer, len );
+      if( b == NULL )
+        return NULL;
+      p->buffer = b;
+      p->szbuffer = len;
+    }
+    memset( p->buffer + p->length, 0, len - p->length );
+    p->length = len;
+  }
+  return p->buffer;
+}
+
+int bytearr_push( lua_State *L, const void *data, size_t len )
+{
+  // without its metatable the buffer would never be collected
+  lua_getfield( L, LUA_REGISTRYINDEX, MODULE_NAME "#mt" );
+  int open = lua_istable( L, -1 );
+  lua_pop( L, 1 );
+  if( !open )
+    return 0;
+
+  Buf *p = createBuf( len, getNativeEndian() );
+  if( !p )
+    return 0;
+  if( len ){
+    memcpy( p->buffer, data, len );
+    p->length = len;
+  }
+  lua_pushbuffer( L, p );
+  return 1;
+}
+
 int luaopen_bytearr( lua_State *L )
 {
   luaL_register(L, MODULE_NAME, bytearr_map );
@@ -0,0 +1,25 @@
+#ifndef APP_MODULES_BYTEARR_H_
+#define APP_MODULES_BYTEARR_H_
+
+#include "c_stdint.h"
+#include "c_stddef.h"
+#include "lua.h"
+
+/*
+ * Access to bytearr buffers for other C modules. The bytearr module is only
+ * opened when LUA_USE_MODULES_BYTEARR is defined; without it no value is a
+ * bytearr and none can be created.
+ */
+
+// Returns the contents of the bytearr at index, or NULL if it is not one
+const uint8_t *bytearr_data( lua_State *L, int index, size_t *len );
+
+// Returns the contents for writing, extended with zeros to at least len
+// bytes, or NULL if it is not a bytearr, is read only or cannot grow
+uint8_t *bytearr_reserve( lua_State *L, int index, size_t len );
+
+// Pushes a new bytearr holding a copy of data. Returns 0, with nothing
+// pushed, if the module is not open or the buffer cannot be allocated.
+int bytearr_push( lua_State *L, const void *data, size_t len );
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Common dispatch for Lua callbacks, with run time and start latency
+ * histograms per source. Run times are taken from CCOUNT, which is cheap to
+ * read and precise; start latencies are against system_get_time(), the clock
+ * timers and interrupt time stamps are based on, and which does not wrap
+ * within a minute.
+ */
+#include "callback.h"
+#include "platform.h"
+#include "rom.h"
+#include "c_stdio.h"
+#include "c_string.h"
+#include "user_interface.h"
+
+static cb_source_t *sources;
+static uint32_t budget;
+
+static void hist_add( uint16_t *hist, uint32_t us )
+{
+  unsigned i;
+
+  for (i = 0; i < CB_HIST_BUCKETS - 1 && us >= (CB_HIST_BASE << i); i++)
+    ;
+  if (hist[i] != 0xffff)
+    hist[i]++;
+}
+
+void cb_call( lua_State *L, cb_source_t *src, int nargs, uint32_t due )
+{
+  uint32_t start, run, late = 0;
+
+  if (due) {
+    late = system_get_time() - due;
+    if ((int32_t)late < 0)        // timers may fire slightly early
+      late = 0;
+  }
+
+  start = xthal_get_ccount();
+  lua_call(L, nargs, 0);
+  run = (xthal_get_ccount() - start) / system_get_cpu_freq();
+
+  if (!src->linked) {
+    src->linked = 1;
+    src->next = sources;
+    sources = src;
+  }
+  src->calls++;
+  hist_add(src->run, run);
+  if (run > src->max_run)
+    src->max_run = run;
+  if (due) {
+    hist_add(src->late, late);
+    if (late > src->max_late)
+      src->max_late = late;
+  }
+  if (budget && run > budget) {
+    src->overruns++;
+    dbg_printf("%s callback ran %u us\n", src->name, run);
+  }
+}
+
+cb_source_t *cb_sources( void )
+{
+  return sources;
+}
+
+void cb_reset( void )
+{
+  cb_source_t *src;
+
+  for (src = sources; src; src = src->next) {
+    src->calls = src->overruns = 0;
+    src->max_run = src->max_late = 0;
+    c_memset(src->run, 0, sizeof(src->run));
+    c_memset(src->late, 0, sizeof(src->late));
+  }
+}
+
+void cb_set_budget( uint32_t us )
+{
+  budget = us;
+}
+
+uint32_t cb_get_budget( void )
+{
+  return budget;
+}
@@ -0,0 +1,45 @@
+#ifndef APP_MODULES_CALLBACK_H_
+#define APP_MODULES_CALLBACK_H_
+
+#include "lua.h"
+#include "c_types.h"
+
+/*
+ * Common dispatch for Lua callbacks. For each source (usually a module) it
+ * measures how late callbacks start against the time they were due and how
+ * long they run, and warns about callbacks that run longer than a budget.
+ */
+
+// Histogram buckets: bucket 0 counts times below CB_HIST_BASE us, bucket n
+// those below CB_HIST_BASE << n, and the last bucket everything longer.
+#define CB_HIST_BUCKETS 11
+#define CB_HIST_BASE    16
+
+typedef struct cb_source {
+  const char *name;
+  struct cb_source *next;
+  uint8_t linked;
+  uint32_t calls;
+  uint32_t overruns;        // calls that ran longer than the budget
+  uint32_t max_run;         // us
+  uint32_t max_late;        // us
+  uint16_t run[CB_HIST_BUCKETS];
+  uint16_t late[CB_HIST_BUCKETS];
+} cb_source_t;
+
+#define CB_SOURCE(name) { name }
+
+// Calls the function below the nargs arguments on top of the stack, as
+// lua_call(L, nargs, 0). due is the system_get_time() at which the callback
+// should have started, or 0 if there is no such time.
+void cb_call( lua_State *L, cb_source_t *src, int nargs, uint32_t due );
+
+// Sources that have dispatched at least one callback
+cb_source_t *cb_sources( void );
+void cb_reset( void );
+
+// Run time in us above which a callback is reported, 0 for none
+void cb_set_budget( uint32_t us );
+uint32_t cb_get_budget( void );
+
+#endif
@@ -1,3 +1,4 @@
+#ifndef COLOR_UTILS_NO_INCLUDE
 #include "module.h"
 #include "lauxlib.h"
 #include "lmem.h"
@@ -7,6 +8,8 @@
 #include "c_string.h"
 #include "user_interface.h"
 #include "osapi.h"
+#include "ws2812.h"
+#endif
 
 #include "color_utils.h"
 
@@ -18,15 +21,62 @@
 
 #define CANARY_VALUE 0x37383132
 
+// x / 60 for x up to 15300
+#define DIV60(x) (((uint32_t)(x) * 69906) >> 22)
+
+// (1 << 24) / d + 1, which makes (a * RECIP[d]) >> 24 equal a / d for
+// a < (1 << 24) / d. Words, so that reads from flash are fast.
+static const uint32_t RECIP[256] = {
+  0x0000000, 0x1000001, 0x0800001, 0x0555556, 0x0400001, 0x0333334, 0x02aaaab, 0x024924a,
+  0x0200001, 0x01c71c8, 0x019999a, 0x01745d2, 0x0155556, 0x013b13c, 0x0124925, 0x0111112,
+  0x0100001, 0x00f0f10, 0x00e38e4, 0x00d7944, 0x00ccccd, 0x00c30c4, 0x00ba2e9, 0x00b2165,
+  0x00aaaab, 0x00a3d71, 0x009d89e, 0x0097b43, 0x0092493, 0x008d3dd, 0x0088889, 0x0084211,
+  0x0080001, 0x007c1f1, 0x0078788, 0x0075076, 0x0071c72, 0x006eb3f, 0x006bca2, 0x006906a,
+  0x0066667, 0x0063e71, 0x0061862, 0x005f418, 0x005d175, 0x005b05c, 0x00590b3, 0x0057263,
+  0x0055556, 0x0053979, 0x0051eb9, 0x0050506, 0x004ec4f, 0x004d488, 0x004bda2, 0x004a791,
+  0x004924a, 0x0047dc2, 0x00469ef, 0x00456c8, 0x0044445, 0x004325d, 0x0042109, 0x0041042,
+  0x0040001, 0x003f040, 0x003e0f9, 0x003d227, 0x003c3c4, 0x003b5cd, 0x003a83b, 0x0039b0b,
+  0x0038e39, 0x00381c1, 0x00375a0, 0x00369d1, 0x0035e51, 0x003531e, 0x0034835, 0x0033d92,
+  0x0033334, 0x0032917, 0x0031f39, 0x0031598, 0x0030c31, 0x0030304, 0x002fa0c, 0x002f14a,
+  0x002e8bb, 0x002e05d, 0x002d82e, 0x002d02e, 0x002c85a, 0x002c0b1, 0x002b932, 0x002b1db,
+  0x002aaab, 0x002a3a1, 0x0029cbd, 0x00295fb, 0x0028f5d, 0x00288e0, 0x0028283, 0x0027c46,
+  0x0027628, 0x0027028, 0x0026a44, 0x002647d, 0x0025ed1, 0x0025940, 0x00253c9, 0x0024e6b,
+  0x0024925, 0x00243f7, 0x0023ee1, 0x00239e1, 0x00234f8, 0x0023024, 0x0022b64, 0x00226ba,
+  0x0022223, 0x0021d9f, 0x002192f, 0x00214d1, 0x0021085, 0x0020c4a, 0x0020821, 0x0020409,
+  0x0020001, 0x001fc08, 0x001f820, 0x001f447, 0x001f07d, 0x001ecc1, 0x001e914, 0x001e574,
+  0x001e1e2, 0x001de5e, 0x001dae7, 0x001d77c, 0x001d41e, 0x001d0cc, 0x001cd86, 0x001ca4c,
+  0x001c71d, 0x001c3f9, 0x001c0e1, 0x001bdd3, 0x001bad0, 0x001b7d7, 0x001b4e9, 0x001b204,
+  0x001af29, 0x001ac58, 0x001a98f, 0x001a6d1, 0x001a41b, 0x001a16e, 0x0019ec9, 0x0019c2e,
+  0x001999a, 0x001970f, 0x001948c, 0x0019210, 0x0018f9d, 0x0018d31, 0x0018acc, 0x001886f,
+  0x0018619, 0x00183ca, 0x0018182, 0x0017f41, 0x0017d06, 0x0017ad3, 0x00178a5, 0x001767e,
+  0x001745e, 0x0017243, 0x001702f, 0x0016e20, 0x0016c17, 0x0016a14, 0x0016817, 0x001661f,
+  0x001642d, 0x0016240, 0x0016059, 0x0015e76, 0x0015c99, 0x0015ac1, 0x00158ee, 0x001571f,
+  0x0015556, 0x0015391, 0x00151d1, 0x0015016, 0x0014e5f, 0x0014cac, 0x0014afe, 0x0014954,
+  0x00147af, 0x001460d, 0x0014470, 0x00142d7, 0x0014142, 0x0013fb1, 0x0013e23, 0x0013c9a,
+  0x0013b14, 0x0013992, 0x0013814, 0x0013699, 0x0013522, 0x00133af, 0x001323f, 0x00130d2,
+  0x0012f69, 0x0012e03, 0x0012ca0, 0x0012b41, 0x00129e5, 0x001288c, 0x0012736, 0x00125e3,
+  0x0012493, 0x0012346, 0x00121fc, 0x00120b5, 0x0011f71, 0x0011e2f, 0x0011cf1, 0x0011bb5,
+  0x0011a7c, 0x0011946, 0x0011812, 0x00116e1, 0x00115b2, 0x0011486, 0x001135d, 0x0011236,
+  0x0011112, 0x0010ff0, 0x0010ed0, 0x0010db3, 0x0010c98, 0x0010b7f, 0x0010a69, 0x0010954,
+  0x0010843, 0x0010733, 0x0010625, 0x001051a, 0x0010411, 0x001030a, 0x0010205, 0x0010102,
+};
+
+// Levels of the temporal dither, spread evenly over 16 frames
+static const uint32_t DITHER[16] = {
+  8, 136, 72, 200, 40, 168, 104, 232, 24, 152, 88, 216, 56, 184, 120, 248
+};
 
 // convert hsv to grb value
 uint32_t hsv2grb(uint16_t hue, uint8_t sat, uint8_t val)
 {
-  uint16_t H_accent = (hue % 360) / 60;
+  if (hue >= 360)
+    hue %= 360;
+  uint16_t H_accent = DIV60(hue);
+  uint16_t frac = hue - H_accent * 60;
   uint16_t bottom = ((255 - sat) * val)>>8;
   uint16_t top = val;
-  uint8_t rising  = ((top-bottom)  *(hue%60   )  )  /  60  +  bottom;
-  uint8_t falling = ((top-bottom)  *(60-hue%60)  )  /  60  +  bottom;
+  uint8_t rising  = DIV60((top-bottom) * frac) + bottom;
+  uint8_t falling = DIV60((top-bottom) * (60-frac)) + bottom;
 
   uint8_t r;
   uint8_t g;
@@ -108,14 +158,23 @@ uint32_t grb2hsv(uint8_t g, uint8_t r, uint8_t b) {
         hue = -1;          /* undefined */
         saturation = 0;
     } else {
-        int h;
-
-        if(r == M)
-            h = ((g-b)*60) / delta;
-        else if(g == M)
-            h = ((b-r)*60) / delta + 120;
-        else /*if(b == M)*/
-            h = ((r-g)*60) / delta + 240;
+        int h, d;
+
+        // the difference is at most delta, which keeps the reciprocal exact
+        if(r == M) {
+            d = g-b;
+            h = 0;
+        } else if(g == M) {
+            d = b-r;
+            h = 120;
+        } else /*if(b == M)*/ {
+            d = r-g;
+            h = 240;
+        }
+        if (d < 0)
+            h -= (-d * 60 * RECIP[delta]) >> 24;
+        else
+            h += (d * 60 * RECIP[delta]) >> 24;
 
         if(h < 0)
             h += 360;
@@ -126,7 +185,7 @@ uint32_t grb2hsv(uint8_t g, uint8_t r, uint8_t b) {
          * tolerated mismatches as possible in RGB -> HSV -> RGB conversion.
          * (See the unit test at the bottom of this file.)
          */
-        saturation = (256*delta-8) / M;
+        saturation = ((256*delta-8) * RECIP[M]) >> 24;
     }
     value = M;
 
@@ -144,6 +203,65 @@ uint32_t color_wheel(uint16_t pos) {
   return hsv2grb(pos, 255, 255);
 }
 
+void hsv2grb_buffer(uint8_t *dst, uint8_t colors, const uint8_t *hsv, int n)
+{
+  while (n-- > 0) {
+    // 45 / 32 is 360 / 256
+    uint32_t grb = hsv2grb((hsv[0] * 45) >> 5, hsv[1], hsv[2]);
+    uint8_t g = grb >> 16;
+    uint8_t r = grb >> 8;
+    uint8_t b = grb;
+
+    if (colors == 4) {
+      uint8_t w = min3(g, r, b);
+      *dst++ = g - w;
+      *dst++ = r - w;
+      *dst++ = b - w;
+      *dst++ = w;
+    } else {
+      *dst++ = g;
+      *dst++ = r;
+      *dst++ = b;
+    }
+    hsv += 3;
+  }
+}
+
+void cu_correction_init(cu_correction *c, uint16_t gamma, uint8_t brightness, uint8_t dither)
+{
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    double level = gamma == 100 ? i / 255.0 : pow(i / 255.0, gamma / 100.0);
+    c->lut[i] = (uint16_t)(level * brightness * 256 + 0.5);
+  }
+  c->dither = dither;
+  c->frame = 0;
+}
+
+void cu_correct(cu_correction *c, uint8_t *dst, const uint8_t *src, int n, uint8_t colors)
+{
+  const uint16_t *lut = c->lut;
+  uint8_t frame = c->frame;
+  int i, j;
+
+  if (!c->dither) {
+    for (i = n * colors; i > 0; i--)
+      *dst++ = (lut[*src++] + 128) >> 8;
+    return;
+  }
+  // neighbouring pixels are out of phase, so that the strip as a
+  // whole does not flicker
+  for (i = 0; i < n; i++) {
+    uint32_t d = DITHER[(frame + i) & 15];
+    for (j = 0; j < colors; j++)
+      *dst++ = (lut[*src++] + d) >> 8;
+  }
+  c->frame = frame + 1;
+}
+
+#ifndef COLOR_UTILS_NO_INCLUDE
+
 
 // convert hsv to grb value
 static int cu_hsv2grb(lua_State *L) {
@@ -217,7 +335,7 @@ static int cu_grb2hsv(lua_State *L) {
   const int r = luaL_checkint(L, 2);
   const int b = luaL_checkint(L, 3);
 
-  luaL_argcheck(L, g == r && g == b, 1, "greyscale value cannot be converted to hsv");
+  luaL_argcheck(L, !(g == r && g == b), 1, "greyscale value cannot be converted to hsv");
 
   uint32_t hsv = grb2hsv(g, r, b);
 
@@ -234,13 +352,76 @@ static int cu_grb2hsv(lua_State *L) {
 }
 
 
+// convert a buffer of hsv values into a ws2812 buffer
+static int cu_hsv2grb_buffer(lua_State *L) {
+  ws2812_buffer *hsv = (ws2812_buffer*)luaL_checkudata(L, 1, "ws2812.buffer");
+  ws2812_buffer *dst = (ws2812_buffer*)luaL_checkudata(L, 2, "ws2812.buffer");
+  cu_correction *c = lua_isnoneornil(L, 3) ? NULL : (cu_correction*)luaL_checkudata(L, 3, "color_utils.correction");
+
+  luaL_argcheck(L, hsv->colorsPerLed == 3, 1, "should have 3 colors per led");
+  luaL_argcheck(L, dst->size == hsv->size && dst->colorsPerLed >= 3 && dst->colorsPerLed <= 4, 2, "does not match");
+
+  hsv2grb_buffer(dst->values, dst->colorsPerLed, hsv->values, hsv->size);
+  if (c) {
+    cu_correct(c, dst->values, dst->values, dst->size, dst->colorsPerLed);
+  }
+
+  return 0;
+}
+
+// create a gamma and brightness correction table
+static int cu_correction_new(lua_State *L) {
+  const int gamma = luaL_optint(L, 1, 100);
+  const int brightness = luaL_optint(L, 2, 255);
+  const int dither = lua_toboolean(L, 3);
+
+  luaL_argcheck(L, gamma >= 10 && gamma <= 500, 1, "should be 10-500");
+  luaL_argcheck(L, brightness >= 0 && brightness <= 255, 2, "should be 0-255");
+
+  cu_correction *c = (cu_correction*)lua_newuserdata(L, sizeof(cu_correction));
+  cu_correction_init(c, gamma, brightness, dither);
+  luaL_getmetatable(L, "color_utils.correction");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
+// correction:apply(src [, dst])
+static int cu_correction_apply(lua_State *L) {
+  cu_correction *c = (cu_correction*)luaL_checkudata(L, 1, "color_utils.correction");
+  ws2812_buffer *src = (ws2812_buffer*)luaL_checkudata(L, 2, "ws2812.buffer");
+  ws2812_buffer *dst = lua_isnoneornil(L, 3) ? src : (ws2812_buffer*)luaL_checkudata(L, 3, "ws2812.buffer");
+
+  luaL_argcheck(L, dst->size == src->size && dst->colorsPerLed == src->colorsPerLed, 3, "does not match");
+
+  cu_correct(c, dst->values, src->values, src->size, src->colorsPerLed);
+
+  return 0;
+}
+
+
+static const LUA_REG_TYPE color_utils_correction_map[] =
+{
+  { LSTRKEY( "apply" ),         LFUNCVAL( cu_correction_apply )},
+  { LSTRKEY( "__index" ),       LROVAL( color_utils_correction_map )},
+  { LNILKEY, LNILVAL}
+};
+
 static const LUA_REG_TYPE color_utils_map[] =
 {
   { LSTRKEY( "hsv2grb" ),       LFUNCVAL( cu_hsv2grb )},
   { LSTRKEY( "hsv2grbw" ),      LFUNCVAL( cu_hsv2grbw )},
   { LSTRKEY( "colorWheel" ),    LFUNCVAL( cu_color_wheel )},
   { LSTRKEY( "grb2hsv" ),       LFUNCVAL( cu_grb2hsv )},
+  { LSTRKEY( "hsv2grbBuffer" ), LFUNCVAL( cu_hsv2grb_buffer )},
+  { LSTRKEY( "correction" ),    LFUNCVAL( cu_correction_new )},
   { LNILKEY, LNILVAL}
 };
 
-NODEMCU_MODULE(COLOR_UTILS, "color_utils", color_utils_map, NULL);
+int luaopen_color_utils(lua_State *L) {
+  luaL_rometatable(L, "color_utils.correction", (void *)color_utils_correction_map);
+  return 0;
+}
+
+NODEMCU_MODULE(COLOR_UTILS, "color_utils", color_utils_map, luaopen_color_utils);
+#endif
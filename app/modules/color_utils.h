@@ -1,6 +1,7 @@
 #ifndef APP_MODULES_COLOR_UTILS_H_
 #define APP_MODULES_COLOR_UTILS_H_
 
+#ifndef COLOR_UTILS_NO_INCLUDE
 #include "module.h"
 #include "lauxlib.h"
 #include "lmem.h"
@@ -10,6 +11,7 @@
 #include "c_string.h"
 #include "user_interface.h"
 #include "osapi.h"
+#endif
 
 /**
 * Convert hsv to grb
@@ -35,5 +37,33 @@ uint32_t grb2hsv(uint8_t g, uint8_t r, uint8_t b);
 */
 uint32_t color_wheel(uint16_t degree);
 
+/**
+* Convert n pixels of hsv to grb, or to grbw if colors is 4.
+* Each pixel of hsv is three bytes, the hue being scaled to 0-255
+* for the full circle.
+*/
+void hsv2grb_buffer(uint8_t *dst, uint8_t colors, const uint8_t *hsv, int n);
+
+/**
+* A gamma and brightness correction table. The levels are kept
+* with 8 bits of fraction, which temporal dithering turns into
+* visible steps by spreading them over consecutive frames.
+*/
+typedef struct {
+  uint16_t lut[256];
+  uint8_t dither;
+  uint8_t frame;
+} cu_correction;
+
+/**
+* gamma is in hundredths (220 for 2.2), brightness is 0-255
+*/
+void cu_correction_init(cu_correction *c, uint16_t gamma, uint8_t brightness, uint8_t dither);
+/**
+* Correct n pixels from src into dst, which may be the same buffer.
+* With dithering each call is taken to be one frame.
+*/
+void cu_correct(cu_correction *c, uint8_t *dst, const uint8_t *src, int n, uint8_t colors);
+
 
 #endif /* APP_MODULES_COLOR_UTILS_H_ */
@@ -402,6 +402,224 @@ static int lcrypto_decrypt (lua_State *L)
   return crypto_encdec (L, false);
 }
 
+/* General usage for streaming ciphers:
+ * cipher = crypto.new_cipher("AES-CBC", key, iv)
+ * out1 = cipher:update("Data")
+ * out2 = cipher:update("Data2")
+ * out3, tag = cipher:finalize()
+ */
+
+typedef struct {
+  crypto_cipher_t *cipher;
+} cipher_user_datum_t;
+
+/* crypto.new_cipher("MECHTYPE", "KEY", "IV" [, decrypt [, "AAD"]]) */
+static int crypto_new_cipher (lua_State *L)
+{
+  const char *name = luaL_checkstring (L, 1);
+  size_t klen;
+  const char *key = luaL_checklstring (L, 2, &klen);
+  size_t ivlen;
+  const char *iv = luaL_optlstring (L, 3, "", &ivlen);
+  bool decrypt = lua_toboolean (L, 4);
+  size_t aadlen;
+  const char *aad = luaL_optlstring (L, 5, "", &aadlen);
+
+  cipher_user_datum_t *cudat = (cipher_user_datum_t *)lua_newuserdata(L, sizeof(cipher_user_datum_t));
+  cudat->cipher = NULL;
+  luaL_getmetatable(L, "crypto.cipher");
+  lua_setmetatable(L, -2);
+
+  cudat->cipher = crypto_cipher_create (name, key, klen, iv, ivlen, aad, aadlen, decrypt);
+  if (!cudat->cipher)
+    return luaL_error (L, "crypto init failed");
+
+  return 1;
+}
+
+static crypto_cipher_t *get_cipher (lua_State *L)
+{
+  cipher_user_datum_t *cudat = (cipher_user_datum_t *)luaL_checkudata(L, 1, "crypto.cipher");
+  if (!cudat->cipher)
+    luaL_error (L, "cipher finalized");
+  return cudat->cipher;
+}
+
+/* Called as object, params:
+   1 - userdata "this"
+   2 - next chunk of data
+   Returns the data processed so far, which may be shorter than the input */
+static int crypto_cipher_lupdate (lua_State *L)
+{
+  crypto_cipher_t *c = get_cipher (L);
+  size_t len;
+  const uint8_t *data = (const uint8_t *)luaL_checklstring (L, 2, &len);
+
+  // leave room for a held back block in each output chunk
+  const size_t chunk = LUAL_BUFFERSIZE - (CRYPTO_CIPHER_BLOCKSIZE - 1);
+  luaL_Buffer b;
+  luaL_buffinit (L, &b);
+  while (len)
+  {
+    size_t n = len > chunk ? chunk : len;
+    int out = crypto_cipher_update (c, data, n, (uint8_t *)luaL_prepbuffer (&b));
+    if (out < 0)
+      return luaL_error (L, "crypto op failed");
+    luaL_addsize (&b, out);
+    data += n;
+    len -= n;
+  }
+  luaL_pushresult (&b);
+  return 1;
+}
+
+/* Called as object, params:
+   1 - userdata "this"
+   2 - expected tag when decrypting in GCM mode
+   Returns the remaining data, plus the tag when encrypting in GCM mode */
+static int crypto_cipher_lfinalize (lua_State *L)
+{
+  crypto_cipher_t *c = get_cipher (L);
+  cipher_user_datum_t *cudat = (cipher_user_datum_t *)lua_touserdata (L, 1);
+  uint8_t out[CRYPTO_CIPHER_BLOCKSIZE];
+  uint8_t tag[CRYPTO_CIPHER_TAGSIZE];
+  bool want_tag = crypto_cipher_has_tag (c) && !crypto_cipher_is_decrypt (c);
+
+  if (crypto_cipher_has_tag (c) && crypto_cipher_is_decrypt (c))
+  {
+    size_t tlen;
+    if (lua_type (L, 2) != LUA_TSTRING)
+      return luaL_argerror (L, 2, "tag expected");
+    const char *expect = lua_tolstring (L, 2, &tlen);
+    luaL_argcheck (L, tlen == CRYPTO_CIPHER_TAGSIZE, 2, "bad tag length");
+    c_memcpy (tag, expect, CRYPTO_CIPHER_TAGSIZE);
+  }
+
+  int n = crypto_cipher_finalize (c, out, tag);
+  crypto_cipher_destroy (c);
+  cudat->cipher = NULL;
+  if (n < 0)
+    return luaL_error (L, "crypto op failed");
+
+  lua_pushlstring (L, (const char *)out, n);
+  if (want_tag)
+  {
+    lua_pushlstring (L, (const char *)tag, sizeof (tag));
+    return 2;
+  }
+  return 1;
+}
+
+/* Frees the cipher state if the object was never finalized */
+static int crypto_cipher_gcdelete (lua_State *L)
+{
+  cipher_user_datum_t *cudat = (cipher_user_datum_t *)luaL_checkudata(L, 1, "crypto.cipher");
+  if (cudat->cipher)
+    crypto_cipher_destroy (cudat->cipher);
+  cudat->cipher = NULL;
+  return 0;
+}
+
+#define CRYPTO_FILE_CHUNK 512
+
+/* crypto.fencrypt("MECHTYPE", "KEY", "IV", infile, outfile [, "AAD"])
+ * crypto.fdecrypt("MECHTYPE", "KEY", "IV", infile, outfile [, tag [, "AAD"]])
+ */
+static int crypto_fencdec (lua_State *L, bool enc)
+{
+  const char *name = luaL_checkstring (L, 1);
+  size_t klen;
+  const char *key = luaL_checklstring (L, 2, &klen);
+  size_t ivlen;
+  const char *iv = luaL_optlstring (L, 3, "", &ivlen);
+  const char *infile = luaL_checkstring (L, 4);
+  const char *outfile = luaL_checkstring (L, 5);
+  int aadidx = enc ? 6 : 7;
+  size_t aadlen;
+  const char *aad = luaL_optlstring (L, aadidx, "", &aadlen);
+  uint8_t tag[CRYPTO_CIPHER_TAGSIZE];
+
+  crypto_cipher_t *c = crypto_cipher_create (name, key, klen, iv, ivlen, aad, aadlen, !enc);
+  if (!c)
+    return luaL_error (L, "crypto init failed");
+
+  if (!enc && crypto_cipher_has_tag (c))
+  {
+    size_t tlen;
+    const char *expect = lua_tolstring (L, 6, &tlen);
+    if (!expect || tlen != CRYPTO_CIPHER_TAGSIZE)
+    {
+      crypto_cipher_destroy (c);
+      return luaL_argerror (L, 6, "bad tag length");
+    }
+    c_memcpy (tag, expect, CRYPTO_CIPHER_TAGSIZE);
+  }
+
+  uint8_t *inbuf = (uint8_t *)c_malloc (2 * CRYPTO_FILE_CHUNK + CRYPTO_CIPHER_BLOCKSIZE);
+  if (!inbuf)
+  {
+    crypto_cipher_destroy (c);
+    return bad_mem (L);
+  }
+  uint8_t *outbuf = inbuf + CRYPTO_FILE_CHUNK;
+
+  int in_fd = vfs_open (infile, "r");
+  int out_fd = in_fd ? vfs_open (outfile, "w") : 0;
+  int n = -1;
+  if (out_fd)
+  {
+    sint32_t got;
+    while ((got = vfs_read (in_fd, inbuf, CRYPTO_FILE_CHUNK)) > 0)
+    {
+      n = crypto_cipher_update (c, inbuf, got, outbuf);
+      if (n > 0 && vfs_write (out_fd, outbuf, n) != n)
+        n = -1;
+      if (n < 0)
+        break;
+    }
+    if (got == 0)
+    {
+      n = crypto_cipher_finalize (c, outbuf, tag);
+      if (n > 0 && vfs_write (out_fd, outbuf, n) != n)
+        n = -1;
+    }
+    else
+      n = -1;
+    vfs_close (out_fd);
+  }
+  if (in_fd)
+    vfs_close (in_fd);
+
+  bool want_tag = enc && crypto_cipher_has_tag (c);
+  crypto_cipher_destroy (c);
+  c_free (inbuf);
+
+  if (!in_fd || !out_fd)
+    return bad_file (L);
+  if (n < 0)
+  {
+    // never leave partial or unauthenticated plain text behind
+    vfs_remove (outfile);
+    return luaL_error (L, "crypto op failed");
+  }
+
+  if (want_tag)
+    lua_pushlstring (L, (const char *)tag, sizeof (tag));
+  else
+    lua_pushboolean (L, true);
+  return 1;
+}
+
+static int lcrypto_fencrypt (lua_State *L)
+{
+  return crypto_fencdec (L, true);
+}
+
+static int lcrypto_fdecrypt (lua_State *L)
+{
+  return crypto_fencdec (L, false);
+}
+
 // Hash function map
 static const LUA_REG_TYPE crypto_hash_map[] = {
   { LSTRKEY( "update" ),  LFUNCVAL( crypto_hash_update ) },
@@ -411,6 +629,15 @@ static const LUA_REG_TYPE crypto_hash_map[] = {
   { LNILKEY, LNILVAL }
 };
 
+// Cipher function map
+static const LUA_REG_TYPE crypto_cipher_map[] = {
+  { LSTRKEY( "update" ),    LFUNCVAL( crypto_cipher_lupdate ) },
+  { LSTRKEY( "finalize" ),  LFUNCVAL( crypto_cipher_lfinalize ) },
+  { LSTRKEY( "__gc" ),      LFUNCVAL( crypto_cipher_gcdelete ) },
+  { LSTRKEY( "__index" ),   LROVAL( crypto_cipher_map ) },
+  { LNILKEY, LNILVAL }
+};
+
 
 // Module function map
 static const LUA_REG_TYPE crypto_map[] = {
@@ -425,12 +652,16 @@ static const LUA_REG_TYPE crypto_map[] = {
   { LSTRKEY( "new_hmac"   ),   LFUNCVAL( crypto_new_hmac ) },
   { LSTRKEY( "encrypt" ),  LFUNCVAL( lcrypto_encrypt ) },
   { LSTRKEY( "decrypt" ),  LFUNCVAL( lcrypto_decrypt ) },
+  { LSTRKEY( "new_cipher" ),  LFUNCVAL( crypto_new_cipher ) },
+  { LSTRKEY( "fencrypt" ), LFUNCVAL( lcrypto_fencrypt ) },
+  { LSTRKEY( "fdecrypt" ), LFUNCVAL( lcrypto_fdecrypt ) },
   { LNILKEY, LNILVAL }
 };
 
 int luaopen_crypto ( lua_State *L )
 {
   luaL_rometatable(L, "crypto.hash", (void *)crypto_hash_map);  // create metatable for crypto.hash
+  luaL_rometatable(L, "crypto.cipher", (void *)crypto_cipher_map);  // create metatable for crypto.cipher
   return 0;
 }
 
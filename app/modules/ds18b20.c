@@ -11,6 +11,9 @@
 #include "driver/onewire.h"
 #include "c_stdio.h"
 #include "c_stdlib.h"
+#include "c_string.h"
+#include "user_interface.h"
+#include "task/task.h"
 
 //***************************************************************************
 // OW ROM COMMANDS
@@ -285,8 +288,272 @@ static int ds18b20_lua_readoutdone(void) {
 	ds18b20_timer_ref = LUA_NOREF;
 }
 
+//***************************************************************************
+// Multi-bus scheduler
+//
+// All buses get a Skip ROM + Convert T back to back, then a single timer
+// covers the conversion time of the slowest bus. The scratchpads are read
+// one bus per task invocation so the watchdog and WiFi stack get to run
+// in between.
+//***************************************************************************
+
+#define DS18B20_SCHED_MAX_BUSES			(8)
+#define DS18B20_SCHED_FAMILY			(0x28)		// other 1-wire devices are skipped
+
+typedef struct {
+	uint8_t rom[8];
+	int16_t raw;
+	uint8_t res;
+	uint8_t ok;
+} ds18b20_sched_dev_t;
+
+typedef struct {
+	uint8_t pin;
+	uint8_t res;								// highest resolution seen on this bus
+	uint16_t ndev;
+	ds18b20_sched_dev_t *dev;
+	uint32_t errors;
+	uint32_t search_us;
+	uint32_t convert_us;
+	uint32_t read_us;
+} ds18b20_sched_bus_t;
+
+static ds18b20_sched_bus_t ds18b20_sched_bus[DS18B20_SCHED_MAX_BUSES];
+static uint8_t ds18b20_sched_nbus;
+static uint8_t ds18b20_sched_busy;
+static uint32_t ds18b20_sched_start;
+static int ds18b20_sched_ref = LUA_NOREF;
+static os_timer_t ds18b20_sched_timer;
+static task_handle_t ds18b20_sched_task_id;
+
+static uint32_t ds18b20_conv_ms(uint8_t res) {
+	// 93.75ms at 9 bit, doubling per extra bit, plus some margin
+	if (res < 9)
+		res = 9;
+	else if (res > 12)
+		res = 12;
+	return (760 >> (12 - res));
+}
+
+static void ds18b20_sched_search(ds18b20_sched_bus_t *bus) {
+	uint32_t start = system_get_time();
+	uint8_t rom[8];
+
+	c_free(bus->dev);
+	bus->dev = NULL;
+	bus->ndev = 0;
+
+	onewire_reset_search(bus->pin);
+	while (onewire_search(bus->pin, rom)) {
+		if (onewire_crc8(rom, 7) != rom[7]) {
+			bus->errors++;
+			continue;
+		}
+		if (rom[0] != DS18B20_SCHED_FAMILY)
+			continue;
+		ds18b20_sched_dev_t *dev = (ds18b20_sched_dev_t *)c_realloc(bus->dev, (bus->ndev + 1) * sizeof(ds18b20_sched_dev_t));
+		if (!dev)
+			break;
+		bus->dev = dev;
+		c_memset(&dev[bus->ndev], 0, sizeof(ds18b20_sched_dev_t));
+		c_memcpy(dev[bus->ndev].rom, rom, 8);
+		bus->ndev++;
+	}
+	bus->search_us = system_get_time() - start;
+}
+
+static void ds18b20_sched_read_bus(ds18b20_sched_bus_t *bus) {
+	uint32_t start = system_get_time();
+	uint8_t scratchpad[9];
+	uint16_t i;
+	uint8_t res = 0;
+
+	for (i = 0; i < bus->ndev; i++) {
+		ds18b20_sched_dev_t *dev = &bus->dev[i];
+
+		dev->ok = 0;
+		if (!onewire_reset(bus->pin)) {
+			bus->errors++;
+			continue;
+		}
+		onewire_select(bus->pin, dev->rom);
+		onewire_write(bus->pin, DS18B20_FUNC_SCRATCH_READ, 0);
+		onewire_read_bytes(bus->pin, scratchpad, 9);
+
+		if (onewire_crc8(scratchpad, 8) != scratchpad[8]) {
+			bus->errors++;
+			continue;
+		}
+		dev->raw = (int16_t)((scratchpad[1] << 8) | scratchpad[0]);
+		dev->res = ((scratchpad[4] >> 5) & 0x03) + 9;
+		dev->ok = 1;
+		if (dev->res > res)
+			res = dev->res;
+	}
+	// keep the previous conversion time if no device could be read
+	if (res)
+		bus->res = res;
+	bus->read_us = system_get_time() - start;
+}
+
+static void ds18b20_sched_report(void) {
+	lua_State *L = lua_getstate();
+	uint8_t b;
+	uint16_t i;
+	int n = 0;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ds18b20_sched_ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, ds18b20_sched_ref);
+	ds18b20_sched_ref = LUA_NOREF;
+	ds18b20_sched_busy = 0;
+
+	lua_newtable(L);
+	for (b = 0; b < ds18b20_sched_nbus; b++) {
+		ds18b20_sched_bus_t *bus = &ds18b20_sched_bus[b];
+		for (i = 0; i < bus->ndev; i++) {
+			ds18b20_sched_dev_t *dev = &bus->dev[i];
+			if (!dev->ok)
+				continue;
+			lua_createtable(L, 0, 5);
+			lua_pushinteger(L, bus->pin);
+			lua_setfield(L, -2, "pin");
+			lua_pushfstring(L, "%d:%d:%d:%d:%d:%d:%d:%d", dev->rom[0], dev->rom[1], dev->rom[2], dev->rom[3], dev->rom[4], dev->rom[5], dev->rom[6], dev->rom[7]);
+			lua_setfield(L, -2, "rom");
+			lua_pushinteger(L, dev->res);
+			lua_setfield(L, -2, "res");
+			lua_pushnumber(L, (double)dev->raw / 16);
+			lua_setfield(L, -2, "temp");
+			lua_pushinteger(L, (dev->raw & 0x0F) * 1000 / 16);
+			lua_setfield(L, -2, "temp_dec");
+			lua_rawseti(L, -2, ++n);
+		}
+	}
+
+	lua_createtable(L, 0, ds18b20_sched_nbus);
+	for (b = 0; b < ds18b20_sched_nbus; b++) {
+		ds18b20_sched_bus_t *bus = &ds18b20_sched_bus[b];
+		lua_createtable(L, 0, 5);
+		lua_pushinteger(L, bus->ndev);
+		lua_setfield(L, -2, "devices");
+		lua_pushinteger(L, bus->errors);
+		lua_setfield(L, -2, "errors");
+		lua_pushinteger(L, bus->search_us);
+		lua_setfield(L, -2, "search_us");
+		lua_pushinteger(L, bus->convert_us);
+		lua_setfield(L, -2, "convert_us");
+		lua_pushinteger(L, bus->read_us);
+		lua_setfield(L, -2, "read_us");
+		lua_rawseti(L, -2, bus->pin);
+	}
+	lua_pushinteger(L, system_get_time() - ds18b20_sched_start);
+	lua_setfield(L, -2, "round_us");
+
+	if (lua_pcall(L, 2, 0, 0)) {
+		// report the callback error instead of panicking from the task
+		c_printf("ds18b20: %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+static void ds18b20_sched_task(task_param_t param, uint8_t prio) {
+	(void)prio;
+	while (param < ds18b20_sched_nbus) {
+		ds18b20_sched_read_bus(&ds18b20_sched_bus[param++]);
+		// with the task queue full, carry on with the next bus right here
+		if (task_post_low(ds18b20_sched_task_id, param))
+			return;
+	}
+	ds18b20_sched_report();
+}
+
+static void ds18b20_sched_timer_cb(void *arg) {
+	(void)arg;
+	// retry shortly rather than leaving the round busy for good
+	if (!task_post_low(ds18b20_sched_task_id, 0))
+		os_timer_arm(&ds18b20_sched_timer, 1, 0);
+}
+
+// Converts and reads all sensors on several buses in one round
+// Lua: ds18b20.sample({PIN1, PIN2, ...}, function(RESULTS, STATS) end[, RESCAN])
+static int ds18b20_lua_sample(lua_State *L) {
+	uint8_t pins[DS18B20_SCHED_MAX_BUSES];
+	uint8_t npins, b, i;
+	uint32_t wait_ms = 0;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_argcheck(L, (lua_type(L, 2) == LUA_TFUNCTION || lua_type(L, 2) == LUA_TLIGHTFUNCTION), 2, "Must be function");
+	int rescan = lua_toboolean(L, 3);
+
+	if (ds18b20_sched_busy)
+		return luaL_error(L, "sampling in progress");
+
+	size_t len = lua_objlen(L, 1);
+	if (len == 0 || len > DS18B20_SCHED_MAX_BUSES)
+		return luaL_error(L, "wrong arg range");
+	npins = len;
+	for (i = 0; i < npins; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		lua_Integer pin = luaL_checkinteger(L, -1);
+		lua_pop(L, 1);
+		MOD_CHECK_ID(ow, pin);
+		pins[i] = pin;
+	}
+
+	// (re)configure the bus list, keeping known devices of unchanged pins
+	for (i = 0; i < npins; i++) {
+		if (i < ds18b20_sched_nbus && ds18b20_sched_bus[i].pin == pins[i])
+			continue;
+		c_free(ds18b20_sched_bus[i].dev);
+		c_memset(&ds18b20_sched_bus[i], 0, sizeof(ds18b20_sched_bus_t));
+		ds18b20_sched_bus[i].pin = pins[i];
+		ds18b20_sched_bus[i].res = 12;
+		onewire_init(pins[i]);
+		ds18b20_sched_search(&ds18b20_sched_bus[i]);
+	}
+	for (b = npins; b < ds18b20_sched_nbus; b++) {
+		c_free(ds18b20_sched_bus[b].dev);
+		c_memset(&ds18b20_sched_bus[b], 0, sizeof(ds18b20_sched_bus_t));
+	}
+	ds18b20_sched_nbus = npins;
+
+	if (!ds18b20_sched_task_id)
+		ds18b20_sched_task_id = task_get_id(ds18b20_sched_task);
+
+	lua_pushvalue(L, 2);
+	ds18b20_sched_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	ds18b20_sched_busy = 1;
+	ds18b20_sched_start = system_get_time();
+
+	// issue Convert T to every bus back to back, conversions run concurrently
+	for (b = 0; b < ds18b20_sched_nbus; b++) {
+		ds18b20_sched_bus_t *bus = &ds18b20_sched_bus[b];
+		uint32_t start = system_get_time();
+
+		if (rescan)
+			ds18b20_sched_search(bus);
+		bus->convert_us = 0;
+		if (!onewire_reset(bus->pin)) {
+			bus->errors++;
+			continue;
+		}
+		onewire_write(bus->pin, DS18B20_ROM_SKIP, 0);
+		onewire_write(bus->pin, DS18B20_FUNC_CONVERT, 1);
+		bus->convert_us = system_get_time() - start;
+
+		if (ds18b20_conv_ms(bus->res) > wait_ms)
+			wait_ms = ds18b20_conv_ms(bus->res);
+	}
+
+	os_timer_disarm(&ds18b20_sched_timer);
+	os_timer_setfn(&ds18b20_sched_timer, ds18b20_sched_timer_cb, NULL);
+	os_timer_arm(&ds18b20_sched_timer, wait_ms ? wait_ms : 1, 0);
+
+	return 0;
+}
+
 static const LUA_REG_TYPE ds18b20_map[] = {
 	{	LSTRKEY( "read" ),				LFUNCVAL(ds18b20_lua_read)		},
+	{	LSTRKEY( "sample" ),			LFUNCVAL(ds18b20_lua_sample)	},
 	{	LSTRKEY( "setting" ),			LFUNCVAL(ds18b20_lua_setting)	},
 	{	LSTRKEY( "setup" ),				LFUNCVAL(ds18b20_lua_setup)		},
 	{	LNILKEY, LNILVAL												}
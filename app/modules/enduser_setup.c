@@ -46,8 +46,8 @@
 #include "espconn.h"
 #include "lwip/tcp.h"
 #include "lwip/pbuf.h"
-#include "vfs.h"
 #include "task/task.h"
+#include "httpd.h"
 
 /* Set this to 1 to generate debug messages. Uses debug callback provided by Lua. Example: enduser_setup.start(successFn, print, print) */ 
 #define ENDUSER_SETUP_DEBUG_ENABLE 0
@@ -88,34 +88,32 @@ static const char dns_body[]   = { 0x00, 0x01, 0x00, 0x01,
 /*        DNS Answer Part          |LBL OFFS|  |  TYPE  |  |  CLASS |  |         TTL        |  | RD LEN | */
                                    0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x78, 0x00, 0x04 };
 
-static const char http_html_gz_filename[] = "enduser_setup.html.gz";
 static const char http_html_filename[] = "enduser_setup.html";
-static const char http_header_200[] = "HTTP/1.1 200 OK\r\nCache-control:no-cache\r\nConnection:close\r\nContent-Type:text/html\r\n"; /* Note single \r\n here! */
-static const char http_header_204[] = "HTTP/1.1 204 No Content\r\nContent-Length:0\r\nConnection:close\r\n\r\n";
-static const char http_header_302[] = "HTTP/1.1 302 Moved\r\nLocation: /\r\nContent-Length:0\r\nConnection:close\r\n\r\n";
-static const char http_header_400[] = "HTTP/1.1 400 Bad request\r\nContent-Length:0\r\nConnection:close\r\n\r\n";
-static const char http_header_404[] = "HTTP/1.1 404 Not found\r\nContent-Length:0\r\nConnection:close\r\n\r\n";
-static const char http_header_405[] = "HTTP/1.1 405 Method Not Allowed\r\nContent-Length:0\r\nConnection:close\r\n\r\n";
-static const char http_header_500[] = "HTTP/1.1 500 Internal Error\r\nContent-Length:0\r\nConnection:close\r\n\r\n";
-
-static const char http_header_content_len_fmt[] = "Content-length:%5d\r\n\r\n";
-static const char http_html_gzip_contentencoding[] = "Content-Encoding: gzip\r\n";
+static const char http_no_cache[] = "Cache-control:no-cache\r\n";
+static const char http_status_200[] = "200 OK";
+static const char http_status_204[] = "204 No Content";
+static const char http_status_302[] = "302 Moved";
+static const char http_status_400[] = "400 Bad request";
+static const char http_status_404[] = "404 Not found";
+static const char http_status_405[] = "405 Method Not Allowed";
+static const char http_status_500[] = "500 Internal Error";
+
+/* Enough for the captive portal probes of a phone and a browser or two */
+#define ENDUSER_SETUP_HTTP_MAX_CONNS 4
 
 /* Externally defined: static const char http_html_backup[] = ... */
 #include "eus/http_html_backup.def"
 
 typedef struct scan_listener
 {
-  struct tcp_pcb *conn;
+  httpd_conn *conn;
   struct scan_listener *next;
 } scan_listener_t;
 
 typedef struct
 {
   struct espconn *espconn_dns_udp;
-  struct tcp_pcb *http_pcb;
-  char *http_payload_data;
-  uint32_t http_payload_len;
+  httpd_server *httpd;
   os_timer_t check_station_timer;
   os_timer_t shutdown_timer;
   int lua_connected_cb_ref;
@@ -127,11 +125,13 @@ typedef struct
   uint8_t callbackDone;
   uint8_t lastStationStatus;
   uint8_t connecting;
+  uint8_t in_route;
 } enduser_setup_state_t;
 
 static enduser_setup_state_t *state;
 
 static bool manual = false;
+static int routes_ref = LUA_NOREF;
 static task_handle_t do_station_cfg_handle;
 
 static int enduser_setup_manual(lua_State* L);
@@ -322,73 +322,6 @@ static void enduser_setup_check_station(void *p)
 }
 
 
-/* --- Connection closing handling ----------------------------------------- */
-
-/* It is far more memory efficient to let the other end close the connection
- * first and respond to that, than us initiating the closing. The latter
- * seems to leave the pcb in a fin_wait state for a long time, which can
- * starve us of memory over time.
- *
- * By instead using the poll function to schedule a hard abort a few seconds
- * from now we achieve a deadline close. The downside is a (very) slight
- * risk of dropping the connection early, but in this application that's
- * hidden by the retries on the JavaScript side anyway.
- */
-
-
-/* Callback on timeout to hard-close a connection */
-static err_t force_abort (void *arg, struct tcp_pcb *pcb)
-{
-  ENDUSER_SETUP_DEBUG("force_abort");
-    
-  (void)arg;
-  tcp_poll (pcb, 0, 0);
-  tcp_abort (pcb);
-  return ERR_ABRT;
-}
-
-/* Callback to detect a remote-close of a connection */
-static err_t handle_remote_close (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
-{
-  ENDUSER_SETUP_DEBUG("handle_remote_close");
-    
-  (void)arg; (void)err;
-  if (p) /* server sent us data, just ACK and move on */
-  {
-    tcp_recved (pcb, p->tot_len);
-    pbuf_free (p);
-  }
-  else /* hey, remote end closed, we can do a soft close safely, yay! */
-  {
-    tcp_recv (pcb, 0);
-    tcp_poll (pcb, 0, 0);
-    tcp_close (pcb);
-  }
-  return ERR_OK;
-}
-
-/* Set up a deferred close of a connection, as discussed above. */
-static inline void deferred_close (struct tcp_pcb *pcb)
-{
-  ENDUSER_SETUP_DEBUG("deferred_close");
-    
-  tcp_poll (pcb, force_abort, 15); /* ~3sec from now */
-  tcp_recv (pcb, handle_remote_close);
-  tcp_sent (pcb, 0);
-}
-
-/* Convenience function to queue up a close-after-send.  */
-static err_t close_once_sent (void *arg, struct tcp_pcb *pcb, u16_t len)
-{
-  ENDUSER_SETUP_DEBUG("close_once_sent");
-
-  (void)arg; (void)len;
-  deferred_close (pcb);
-  return ERR_OK;
-}
-
-/* ------------------------------------------------------------------------- */
-
 /**
  * Search String
  *
@@ -409,134 +342,6 @@ static int enduser_setup_srch_str(const char *str, const char *srch_str)
   }
 }
 
-/**
- * Load HTTP Payload
- *
- * @return - 0 iff payload loaded successfully
- *           1 iff backup html was loaded
- *           2 iff out of memory
- */
-static int enduser_setup_http_load_payload(void)
-{
-  ENDUSER_SETUP_DEBUG("enduser_setup_http_load_payload");
-
-  int err = VFS_RES_ERR;
-  int err2 = VFS_RES_ERR;
-  int file_len = 0;
-
-  /* Try to open enduser_setup.html.gz from SPIFFS first */
-  int f = vfs_open(http_html_gz_filename, "r");
-
-  if (f) 
-  {
-      err = vfs_lseek(f, 0, VFS_SEEK_END);
-      file_len = (int) vfs_tell(f);
-      err2 = vfs_lseek(f, 0, VFS_SEEK_SET);
-  }
-
-  if (!f || err == VFS_RES_ERR || err2 == VFS_RES_ERR)
-  {
-    if (f) 
-    {
-      vfs_close(f);
-    }
-
-    /* If that didn't work, try to open enduser_setup.html from SPIFFS */
-    f = vfs_open(http_html_filename, "r");
-
-    if (f) 
-    {
-        err = vfs_lseek(f, 0, VFS_SEEK_END);
-        file_len = (int) vfs_tell(f);
-        err2 = vfs_lseek(f, 0, VFS_SEEK_SET);
-    }
-  }
-
-  char cl_hdr[30];
-  size_t ce_len = 0;
-  
-  c_sprintf(cl_hdr, http_header_content_len_fmt, file_len);
-  size_t cl_len = c_strlen(cl_hdr);
-
-  if (!f || err == VFS_RES_ERR || err2 == VFS_RES_ERR)
-  {
-    ENDUSER_SETUP_DEBUG("Unable to load file enduser_setup.html, loading backup HTML...");
-
-    c_sprintf(cl_hdr, http_header_content_len_fmt, sizeof(http_html_backup));
-    cl_len = c_strlen(cl_hdr);
-    int html_len = LITLEN(http_html_backup);
-
-    if (http_html_backup[0] == 0x1f && http_html_backup[1] == 0x8b)
-    {
-        ce_len = c_strlen(http_html_gzip_contentencoding);
-        html_len = http_html_backup_len; /* Defined in eus/http_html_backup.def by xxd -i */
-        ENDUSER_SETUP_DEBUG("Content is gzipped");
-    }   
-   
-    int payload_len = LITLEN(http_header_200) + cl_len + ce_len + html_len; 
-    state->http_payload_len = payload_len;
-    state->http_payload_data = (char *) c_malloc(payload_len);
-
-    if (state->http_payload_data == NULL)
-    {
-      return 2;
-    }
-
-    int offset = 0;
-    c_memcpy(&(state->http_payload_data[offset]), &(http_header_200), LITLEN(http_header_200));
-    offset += LITLEN(http_header_200);
-
-    if (ce_len > 0)
-    {
-        offset += c_sprintf(state->http_payload_data + offset, http_html_gzip_contentencoding, ce_len);
-    }
-    
-    c_memcpy(&(state->http_payload_data[offset]), &(cl_hdr), cl_len);
-    offset += cl_len;
-    c_memcpy(&(state->http_payload_data[offset]), &(http_html_backup), sizeof(http_html_backup));
-      
-    return 1; 
-  }
-
-  char magic[2];
-  vfs_read(f, magic, 2);
-    
-  if (magic[0] == 0x1f && magic[1] == 0x8b)
-  {
-    ce_len = c_strlen(http_html_gzip_contentencoding);
-    ENDUSER_SETUP_DEBUG("Content is gzipped");
-  }
-  
-  int payload_len = LITLEN(http_header_200) + cl_len + ce_len + file_len;
-  state->http_payload_len = payload_len;
-  state->http_payload_data = (char *) c_malloc(payload_len);
-
-  if (state->http_payload_data == NULL)
-  {
-    return 2;
-  }
-
-  vfs_lseek(f, 0, VFS_SEEK_SET);
-  
-  int offset = 0;
-
-  c_memcpy(&(state->http_payload_data[offset]), &(http_header_200), LITLEN(http_header_200));
-  offset += LITLEN(http_header_200);
-
-  if (ce_len > 0)
-  {
-    offset += c_sprintf(state->http_payload_data + offset, http_html_gzip_contentencoding, ce_len);  
-  }
-  
-  c_memcpy(&(state->http_payload_data[offset]), &(cl_hdr), cl_len);
-  offset += cl_len;
-  vfs_read(f, &(state->http_payload_data[offset]), file_len);
-  vfs_close(f);  
-  
-  return 0;
-}
-
-
 /**
  * De-escape URL data
  *
@@ -633,15 +438,15 @@ static void do_station_cfg (task_param_t param, uint8_t prio)
  *           return 1 iff credentials aren't found
  *           return 2 iff an error occured
  */
-static int enduser_setup_http_handle_credentials(char *data, unsigned short data_len)
+static int enduser_setup_http_handle_credentials(const char *query)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_http_handle_credentials");
 
   state->success = 0;
   state->lastStationStatus = 0;
   
-  char *name_str = (char *) ((uint32_t)strstr(&(data[6]), "wifi_ssid="));
-  char *pwd_str = (char *) ((uint32_t)strstr(&(data[6]), "wifi_password="));
+  const char *name_str = strstr(query, "wifi_ssid=");
+  const char *pwd_str = strstr(query, "wifi_password=");
   if (name_str == NULL || pwd_str == NULL)
   {
     ENDUSER_SETUP_DEBUG("Password or SSID string not found");
@@ -650,15 +455,19 @@ static int enduser_setup_http_handle_credentials(char *data, unsigned short data
 
   int name_field_len = LITLEN("wifi_ssid=");
   int pwd_field_len = LITLEN("wifi_password=");
-  char *name_str_start = name_str + name_field_len;
-  char *pwd_str_start = pwd_str + pwd_field_len;
+  const char *name_str_start = name_str + name_field_len;
+  const char *pwd_str_start = pwd_str + pwd_field_len;
 
-  int name_str_len = enduser_setup_srch_str(name_str_start, "& ");
-  int pwd_str_len = enduser_setup_srch_str(pwd_str_start, "& ");
-  if (name_str_len == -1 || pwd_str_len == -1)
+  /* The last parameter runs to the end of the query */
+  int name_str_len = enduser_setup_srch_str(name_str_start, "&");
+  int pwd_str_len = enduser_setup_srch_str(pwd_str_start, "&");
+  if (name_str_len == -1)
   {
-    ENDUSER_SETUP_DEBUG("Password or SSID HTTP paramter divider not found");
-    return 1;
+    name_str_len = c_strlen(name_str_start);
+  }
+  if (pwd_str_len == -1)
+  {
+    pwd_str_len = c_strlen(pwd_str_start);
   }
 
 
@@ -696,106 +505,25 @@ static int enduser_setup_http_handle_credentials(char *data, unsigned short data
 /**
  * Serve HTML
  *
- * @return - return 0 iff html was served successfully
+ * Streams enduser_setup.html(.gz) from the file system, or else the
+ * built-in page straight from where it is stored.
  */
-static int enduser_setup_http_serve_header(struct tcp_pcb *http_client, const char *header, uint32_t header_len)
-{
-  ENDUSER_SETUP_DEBUG("enduser_setup_http_serve_header");
-  
-  err_t err = tcp_write (http_client, header, header_len, TCP_WRITE_FLAG_COPY);
-  if (err != ERR_OK)
-  {
-    deferred_close (http_client);
-    ENDUSER_SETUP_ERROR("http_serve_header failed on tcp_write", ENDUSER_SETUP_ERR_UNKOWN_ERROR, ENDUSER_SETUP_ERR_NONFATAL);
-  }
-
-  return 0;
-}
-
-
-static err_t streamout_sent (void *arg, struct tcp_pcb *pcb, u16_t len)
-{
-  ENDUSER_SETUP_DEBUG("streamout_sent");
-
-  (void)len;
-  unsigned offs = (unsigned)arg;
-
-  if (!state || !state->http_payload_data)
-  {
-    tcp_abort (pcb);
-    return ERR_ABRT;
-  }
-
-  unsigned wanted_len = state->http_payload_len - offs;
-  unsigned buf_free = tcp_sndbuf (pcb);
-  if (buf_free < wanted_len)
-    wanted_len = buf_free;
-
-  /* no-copy write */
-  err_t err = tcp_write (pcb, state->http_payload_data + offs, wanted_len, 0);
-  if (err != ERR_OK)
-  {
-    ENDUSER_SETUP_DEBUG("streaming out html failed");
-    tcp_abort (pcb);
-    return ERR_ABRT;
-  }
-
-  offs += wanted_len;
-
-  if (offs >= state->http_payload_len)
-  {
-    tcp_sent (pcb, 0);
-    deferred_close (pcb);
-  }
-  else
-    tcp_arg (pcb, (void *)offs);
-
-  return ERR_OK;
-}
-
-
-/**
- * Serve HTML
- *
- * @return - return 0 iff html was served successfully
- */
-static int enduser_setup_http_serve_html(struct tcp_pcb *http_client)
+static void enduser_setup_http_serve_html(httpd_conn *http_client)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_http_serve_html");
 
-  if (state->http_payload_data == NULL)
+  if (httpd_send_file(http_client, http_html_filename, "text/html", http_no_cache) == 1)
   {
-    enduser_setup_http_load_payload();
+    ENDUSER_SETUP_DEBUG("Unable to load file enduser_setup.html, serving backup HTML...");
+    httpd_send_static(http_client, "text/html", http_no_cache, http_html_backup, sizeof(http_html_backup));
   }
-
-  unsigned chunklen = tcp_sndbuf (http_client);
-  tcp_arg (http_client, (void *)chunklen);
-  tcp_recv (http_client, 0); /* avoid confusion about the tcp_arg */
-  tcp_sent (http_client, streamout_sent);
-  /* Begin the no-copy stream-out here */
-  err_t err = tcp_write (http_client, state->http_payload_data, chunklen, 0);
-  if (err != 0)
-  {
-    ENDUSER_SETUP_ERROR("http_serve_html failed. tcp_write failed", ENDUSER_SETUP_ERR_UNKOWN_ERROR, ENDUSER_SETUP_ERR_NONFATAL);
-  }
-
-  return 0;
 }
 
 
-static void enduser_setup_serve_status(struct tcp_pcb *conn)
+static void enduser_setup_serve_status(httpd_conn *conn)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_serve_status");
 
-  const char fmt[] =
-    "HTTP/1.1 200 OK\r\n"
-    "Cache-control:no-cache\r\n"
-    "Connection:close\r\n"
-    "Access-Control-Allow-Origin: *\r\n"  
-    "Content-type:text/plain\r\n"
-    "Content-length: %d\r\n"
-    "\r\n"
-    "%s";
   const char *states[] =
   {
     "Idle.",
@@ -805,6 +533,10 @@ static void enduser_setup_serve_status(struct tcp_pcb *conn)
     "Failed to connect.",
     "Connected to \"%s\" (%s)."
   };
+  const char headers[] =
+    "Cache-control:no-cache\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Content-type:text/plain\r\n";
 
   const size_t num_states = sizeof(states)/sizeof(states[0]);
   uint8_t curr_state = state->lastStationStatus > 0 ? state->lastStationStatus : wifi_station_get_connect_status ();  
@@ -841,12 +573,7 @@ static void enduser_setup_serve_status(struct tcp_pcb *conn)
         memset(status_buf, 0, status_len);
         status_len = c_sprintf(status_buf, s, config.ssid, ip_addr);
 
-        int buf_len = sizeof(fmt) + status_len + 10; /* 10 = (9+1), 1 byte is '\0' and 9 are reserved for length field */
-        char buf[buf_len];
-        memset(buf, 0, buf_len);
-        int output_len = c_sprintf(buf, fmt, status_len, status_buf);
-
-        enduser_setup_http_serve_header(conn, buf, output_len);
+        httpd_send(conn, http_status_200, headers, status_buf, status_len);
       }
       break;
 
@@ -854,24 +581,18 @@ static void enduser_setup_serve_status(struct tcp_pcb *conn)
       default:
       {
         const char *s = states[curr_state];
-        int status_len = c_strlen(s);
-        int buf_len = sizeof(fmt) + status_len + 10; /* 10 = (9+1), 1 byte is '\0' and 9 are reserved for length field */
-        char buf[buf_len];
-        memset(buf, 0, buf_len);
-        int output_len = c_sprintf(buf, fmt, status_len, s);
-
-        enduser_setup_http_serve_header(conn, buf, output_len);
+        httpd_send(conn, http_status_200, headers, s, c_strlen(s));
       }
       break;
     }
   }
   else
   {
-    enduser_setup_http_serve_header(conn, http_header_500, LITLEN(http_header_500));
+    httpd_send(conn, http_status_500, NULL, NULL, 0);
   }
 }
 
-static void enduser_setup_serve_status_as_json (struct tcp_pcb *http_client)
+static void enduser_setup_serve_status_as_json (httpd_conn *http_client)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_serve_status_as_json");
   
@@ -897,57 +618,33 @@ static void enduser_setup_serve_status_as_json (struct tcp_pcb *http_client)
     c_sprintf(json_payload, "{\"deviceid\":\"%06X\", \"status\":%d}", system_get_chip_id(), curr_status);
   }
      
-  const char fmt[] =
-    "HTTP/1.1 200 OK\r\n"
+  const char headers[] =
     "Cache-Control: no-cache\r\n"
-    "Connection: close\r\n"
     "Access-Control-Allow-Origin: *\r\n"
-    "Content-Type: application/json\r\n"
-    "Content-Length: %d\r\n"
-    "\r\n"
-    "%s";
-
-  int len = c_strlen(json_payload);
-  char buf[c_strlen(fmt) + NUMLEN(len) + len - 4];
-  len = c_sprintf (buf, fmt, len, json_payload);
-  enduser_setup_http_serve_header (http_client, buf, len);
+    "Content-Type: application/json\r\n";
+
+  httpd_send (http_client, http_status_200, headers, json_payload, c_strlen(json_payload));
 }
 
 
-static void enduser_setup_handle_OPTIONS (struct tcp_pcb *http_client, char *data, unsigned short data_len)
+static void enduser_setup_handle_OPTIONS (httpd_conn *http_client, const httpd_request *req)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_handle_OPTIONS");
   
   const char json[] =
-    "HTTP/1.1 200 OK\r\n"
     "Cache-Control: no-cache\r\n"
-    "Connection: close\r\n"
     "Content-Type: application/json\r\n"
-    "Content-Length: 0\r\n"
     "Access-Control-Allow-Origin: *\r\n"
     "Access-Control-Allow-Methods: GET\r\n"
-    "Access-Control-Allow-Age: 300\r\n"
-    "\r\n";
+    "Access-Control-Allow-Age: 300\r\n";
 
-  const char others[] =
-    "HTTP/1.1 200 OK\r\n"
-    "Cache-Control: no-cache\r\n"
-    "Connection: close\r\n"
-    "Content-Length: 0\r\n"  
-    "\r\n";
-  
-  int type = 0;
-  
-  if (c_strncmp(data, "GET ", 4) == 0)
+  const char *path = req->path;
+  if (c_strcmp(path, "/aplist") == 0 || c_strcmp(path, "/setwifi") == 0 || c_strcmp(path, "/status.json") == 0)
   {
-    if (c_strncmp(data + 4, "/aplist", 7) == 0 || c_strncmp(data + 4, "/setwifi?", 9) == 0 || c_strncmp(data + 4, "/status.json", 12) == 0)
-    {
-      enduser_setup_http_serve_header (http_client, json, c_strlen(json));
-      return;
-   }
+    httpd_send (http_client, http_status_200, json, NULL, 0);
+    return;
   }
-  enduser_setup_http_serve_header (http_client, others, c_strlen(others));
-  return;
+  httpd_send (http_client, http_status_200, http_no_cache, NULL, 0);
 }
 
 
@@ -963,13 +660,17 @@ static void free_scan_listeners (void)
   }
 
   scan_listener_t *l = state->scan_listeners , *next = 0;
+  state->scan_listeners = 0;
   while (l)
   {
     next = l->next;
+    if (l->conn)
+    {
+      httpd_set_user (l->conn, NULL);
+    }
     c_free (l);
     l = next;
   }
-  state->scan_listeners = 0;
 }
 
 
@@ -1010,7 +711,7 @@ static char *escape_ssid (char *dst, const char *src)
 }
 
 
-static void notify_scan_listeners (const char *payload, size_t sz)
+static void notify_scan_listeners (const char *status, const char *payload, size_t sz)
 {
   ENDUSER_SETUP_DEBUG("notify_scan_listeners"); 
 
@@ -1019,19 +720,24 @@ static void notify_scan_listeners (const char *payload, size_t sz)
     return;
   }
 
-  for (scan_listener_t *l = state->scan_listeners; l; l = l->next)
+  const char headers[] =
+    "Cache-control:no-cache\r\n"
+    "Access-Control-Allow-Origin: *\r\n"
+    "Content-type:application/json\r\n";
+
+  /* Take the list first, as a failed send closes the connection, which comes back through remove_scan_listener() */
+  scan_listener_t *l = state->scan_listeners, *next;
+  state->scan_listeners = 0;
+  for (; l; l = next)
   {
-    if (tcp_write (l->conn, payload, sz, TCP_WRITE_FLAG_COPY) != ERR_OK)
+    next = l->next;
+    httpd_set_user (l->conn, NULL);
+    if (httpd_send (l->conn, status, payload ? headers : NULL, payload, sz) != 0)
     {
       ENDUSER_SETUP_DEBUG("failed to send wifi list");
-      tcp_abort (l->conn);
     }
-    else
-      tcp_sent (l->conn, close_once_sent); /* TODO: time-out sends? */
-    l->conn = 0;
+    c_free (l);
   }
-
-  free_scan_listeners ();
 }
 
 
@@ -1052,28 +758,17 @@ static void on_scan_done (void *arg, STATUS status)
       ++num_nets;
     }
 
-    const char header_fmt[] =
-      "HTTP/1.1 200 OK\r\n"
-      "Connection:close\r\n"
-      "Cache-control:no-cache\r\n"
-      "Access-Control-Allow-Origin: *\r\n"   
-      "Content-type:application/json\r\n"
-      "Content-length:%4d\r\n"
-      "\r\n";
-    const size_t hdr_sz = sizeof (header_fmt) +1 -1; /* +expand %4d, -\0 */
-
     /* To be able to safely escape a pathological SSID, we need 2*32 bytes */
     const size_t max_entry_sz = 27 + 2*32 + 6; /* {"ssid":"","rssi":,"chan":} */
-    const size_t alloc_sz = hdr_sz + num_nets * max_entry_sz + 3;
+    const size_t alloc_sz = num_nets * max_entry_sz + 3;
     char *http = os_zalloc (alloc_sz);
     if (!http)
     {
       goto serve_500;
     }
 
-    char *p = http + hdr_sz; /* start body where we know it will be */
-    /* p[0] will be clobbered when we print the header, so fill it in last */
-    ++p;
+    char *p = http;
+    *p++ = '[';
     for (struct bss_info *wn = arg; wn; wn = wn->next.stqe_next)
     {
       if (wn != arg)
@@ -1103,234 +798,232 @@ static void on_scan_done (void *arg, STATUS status)
     }
     *p++ = ']';
 
-    size_t body_sz = (p - http) - hdr_sz;
-    c_sprintf (http, header_fmt, body_sz);
-    http[hdr_sz] = '['; /* Rewrite the \0 with the correct start of body */
+    size_t body_sz = p - http;
 
-    notify_scan_listeners (http, hdr_sz + body_sz);
-    ENDUSER_SETUP_DEBUG(http + hdr_sz);    
+    notify_scan_listeners (http_status_200, http, body_sz);
+    ENDUSER_SETUP_DEBUG(http);    
    
     c_free (http);
     return;
   }
 
 serve_500:
-  notify_scan_listeners (http_header_500, LITLEN(http_header_500));
+  notify_scan_listeners (http_status_500, NULL, 0);
 }
 
 /* ---- end WiFi AP scan support ------------------------------------------- */
 
-static err_t enduser_setup_http_recvcb(void *arg, struct tcp_pcb *http_client, struct pbuf *p, err_t err)
+/**
+ * Dispatch to a Lua route
+ *
+ * A route set with enduser_setup.route() is either a file name, which is
+ * streamed as is, or a function(method, query, body) returning the body,
+ * and optionally the content type and the status line.
+ *
+ * @return - 0 iff there is no route for the path
+ */
+static int enduser_setup_http_route(httpd_conn *http_client, const httpd_request *req)
 {
-  ENDUSER_SETUP_DEBUG("enduser_setup_http_recvcb");
+  if (routes_ref == LUA_NOREF)
+  {
+    return 0;
+  }
+
+  lua_State *L = lua_getstate();
+  int top = lua_gettop(L);
 
-  if (!state || err != ERR_OK)
+  lua_rawgeti(L, LUA_REGISTRYINDEX, routes_ref);
+  lua_pushstring(L, req->path);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1))
   {
-    if (!state)
-      ENDUSER_SETUP_DEBUG("ignoring received data while stopped");
-    tcp_abort (http_client);
-    return ERR_ABRT;
+    lua_settop(L, top);
+    return 0;
   }
 
-  if (!p) /* remote side closed, close our end too */
+  if (lua_type(L, -1) == LUA_TSTRING)
   {
-    ENDUSER_SETUP_DEBUG("connection closed");
-    scan_listener_t *l = arg; /* if it's waiting for scan, we have a ptr here */
-    if (l)
-      remove_scan_listener (l);
+    if (httpd_send_file(http_client, lua_tostring(L, -1), NULL, http_no_cache) == 1)
+    {
+      httpd_send(http_client, http_status_404, NULL, NULL, 0);
+    }
+    lua_settop(L, top);
+    return 1;
+  }
 
-    deferred_close (http_client);
-    return ERR_OK;
+  lua_pushstring(L, req->method);
+  lua_pushstring(L, req->query);
+  lua_pushlstring(L, req->body, req->body_len);
+  state->in_route = 1;
+  int err = lua_pcall(L, 3, 3, 0);
+  state->in_route = 0;
+  if (err)
+  {
+    ENDUSER_SETUP_DEBUG(lua_tostring(L, -1));
+    httpd_send(http_client, http_status_500, NULL, NULL, 0);
+    lua_settop(L, top);
+    return 1;
   }
 
-  char *data = os_zalloc (p->tot_len + 1);
-  if (!data)
-    return ERR_MEM;
+  /* outside the pcall, so the results are checked rather than raising errors */
+  size_t len = 0;
+  const char *body = lua_tolstring(L, -3, &len);
+  const char *ctype = lua_isnil(L, -2) ? "text/html" : lua_tostring(L, -2);
+  const char *status = lua_isnil(L, -1) ? http_status_200 : lua_tostring(L, -1);
+  if ((!body && !lua_isnil(L, -3)) || !ctype || !status)
+  {
+    ENDUSER_SETUP_DEBUG("route handler returned bad results");
+    httpd_send(http_client, http_status_500, NULL, NULL, 0);
+  }
+  else
+  {
+    char headers[sizeof(http_no_cache) + c_strlen(ctype) + 16];
+    c_sprintf(headers, "%sContent-Type: %s\r\n", http_no_cache, ctype);
+    httpd_send(http_client, status, headers, body, len);
+  }
+  lua_settop(L, top);
+  return 1;
+}
 
-  unsigned data_len = pbuf_copy_partial (p, data, p->tot_len, 0);
-  tcp_recved (http_client, p->tot_len);
-  pbuf_free (p);
 
-  err_t ret = ERR_OK;
+static void enduser_setup_http_request(httpd_conn *http_client, const httpd_request *req, void *arg)
+{
+  ENDUSER_SETUP_DEBUG("enduser_setup_http_request");
+
+  (void)arg;
 
 #if ENDUSER_SETUP_DEBUG_SHOW_HTTP_REQUEST
-  ENDUSER_SETUP_DEBUG(data);
+  ENDUSER_SETUP_DEBUG(req->path);
+  ENDUSER_SETUP_DEBUG(req->headers);
 #endif
 
-  if (c_strncmp(data, "GET ", 4) == 0)
+  if (c_strcmp(req->method, "OPTIONS") == 0)
   {
-    if (c_strncmp(data + 4, "/ ", 2) == 0)
+    enduser_setup_handle_OPTIONS(http_client, req);
+    return;
+  }
+
+  if (enduser_setup_http_route(http_client, req))
+  {
+    return;
+  }
+
+  if (c_strcmp(req->method, "GET") != 0)
+  {
+    httpd_send(http_client, http_status_405, NULL, NULL, 0);
+    return;
+  }
+
+  const char *path = req->path;
+  if (c_strcmp(path, "/") == 0)
+  {
+    enduser_setup_http_serve_html(http_client);
+  }
+  else if (c_strcmp(path, "/aplist") == 0)
+  {
+    /* Don't do an AP Scan while station is trying to connect to Wi-Fi */
+    if (state->connecting == 0) 
     {
-      if (enduser_setup_http_serve_html(http_client) != 0)
+      scan_listener_t *l = os_malloc (sizeof (scan_listener_t));
+      if (!l)
       {
-        ENDUSER_SETUP_ERROR("http_recvcb failed. Unable to send HTML.", ENDUSER_SETUP_ERR_UNKOWN_ERROR, ENDUSER_SETUP_ERR_NONFATAL);
+        httpd_send(http_client, http_status_500, NULL, NULL, 0);
+        ENDUSER_SETUP_ERROR_VOID("out of memory", ENDUSER_SETUP_ERR_OUT_OF_MEMORY, ENDUSER_SETUP_ERR_NONFATAL);
       }
-      else
-      {
-        goto free_out; /* streaming now in progress */
-      }
-    }
-    else if (c_strncmp(data + 4, "/aplist", 7) == 0)
-    {
-      /* Don't do an AP Scan while station is trying to connect to Wi-Fi */
-      if (state->connecting == 0) 
-      {
-        scan_listener_t *l = os_malloc (sizeof (scan_listener_t));
-        if (!l)
-        {
-          ENDUSER_SETUP_ERROR("out of memory", ENDUSER_SETUP_ERR_OUT_OF_MEMORY, ENDUSER_SETUP_ERR_NONFATAL);
-        }
 
-        bool already = (state->scan_listeners != NULL);
+      bool already = (state->scan_listeners != NULL);
 
-        tcp_arg (http_client, l);
-        /* TODO: check if also need a tcp_err() cb, or if recv() is enough */
-        l->conn = http_client;
-        l->next = state->scan_listeners;
-        state->scan_listeners = l;
+      /* The response is sent from on_scan_done(), unless the client goes away first */
+      httpd_set_user (http_client, l);
+      l->conn = http_client;
+      l->next = state->scan_listeners;
+      state->scan_listeners = l;
 
-        if (!already)
+      if (!already)
+      {
+        if (!wifi_station_scan(NULL, on_scan_done))
         {
-          if (!wifi_station_scan(NULL, on_scan_done))
-          {
-            enduser_setup_http_serve_header(http_client, http_header_500, LITLEN(http_header_500));
-            deferred_close (l->conn);
-            l->conn = 0;
-            free_scan_listeners();
-          }
+          notify_scan_listeners (http_status_500, NULL, 0);
         }
-        goto free_out; /* request queued */
-      }
-      else
-      {
-        /* Return No Content status to the caller */
-        enduser_setup_http_serve_header(http_client, http_header_204, LITLEN(http_header_204));     
       }
     }
-    else if (c_strncmp(data + 4, "/status.json", 12) == 0)
-    {
-    enduser_setup_serve_status_as_json(http_client);
-    }    
-    else if (c_strncmp(data + 4, "/status", 7) == 0)
-    {
-      enduser_setup_serve_status(http_client);
-    }
-
-    else if (c_strncmp(data + 4, "/update?", 8) == 0)
-    {
-      switch (enduser_setup_http_handle_credentials(data, data_len))
-      {
-        case 0:
-          enduser_setup_http_serve_header(http_client, http_header_302, LITLEN(http_header_302));
-          break;
-        case 1:
-          enduser_setup_http_serve_header(http_client, http_header_400, LITLEN(http_header_400));
-          break;
-        default:
-          ENDUSER_SETUP_ERROR("http_recvcb failed. Failed to handle wifi credentials.", ENDUSER_SETUP_ERR_UNKOWN_ERROR, ENDUSER_SETUP_ERR_NONFATAL);
-          break;
-      }
-    }
-    else if (c_strncmp(data + 4, "/setwifi?", 9) == 0)
-    {
-      switch (enduser_setup_http_handle_credentials(data, data_len))
-      {
-        case 0:
-          enduser_setup_serve_status_as_json(http_client);
-          break;
-        case 1:
-          enduser_setup_http_serve_header(http_client, http_header_400, LITLEN(http_header_400));
-          break;
-        default:
-          ENDUSER_SETUP_ERROR("http_recvcb failed. Failed to handle wifi credentials.", ENDUSER_SETUP_ERR_UNKOWN_ERROR, ENDUSER_SETUP_ERR_NONFATAL);
-          break;
-      }
-    }  
-    else if (c_strncmp(data + 4, "/generate_204", 13) == 0)
+    else
     {
-      /* Convince Android devices that they have internet access to avoid pesky dialogues. */
-      enduser_setup_http_serve_header(http_client, http_header_204, LITLEN(http_header_204));
+      /* Return No Content status to the caller */
+      httpd_send(http_client, http_status_204, NULL, NULL, 0);
     }
-    else
+  }
+  else if (c_strcmp(path, "/status.json") == 0)
+  {
+    enduser_setup_serve_status_as_json(http_client);
+  }    
+  else if (c_strcmp(path, "/status") == 0)
+  {
+    enduser_setup_serve_status(http_client);
+  }
+  else if (c_strcmp(path, "/update") == 0)
+  {
+    switch (enduser_setup_http_handle_credentials(req->query))
     {
-      ENDUSER_SETUP_DEBUG("serving 404");
-      enduser_setup_http_serve_header(http_client, http_header_404, LITLEN(http_header_404));
+      case 0:
+        httpd_send(http_client, http_status_302, "Location: /\r\n", NULL, 0);
+        break;
+      case 1:
+        httpd_send(http_client, http_status_400, NULL, NULL, 0);
+        break;
+      default:
+        httpd_send(http_client, http_status_500, NULL, NULL, 0);
+        ENDUSER_SETUP_ERROR_VOID("http_request failed. Failed to handle wifi credentials.", ENDUSER_SETUP_ERR_UNKOWN_ERROR, ENDUSER_SETUP_ERR_NONFATAL);
     }
   }
-  else if (c_strncmp(data, "OPTIONS ", 8) == 0)
+  else if (c_strcmp(path, "/setwifi") == 0)
   {
-     enduser_setup_handle_OPTIONS(http_client, data, data_len);
+    switch (enduser_setup_http_handle_credentials(req->query))
+    {
+      case 0:
+        enduser_setup_serve_status_as_json(http_client);
+        break;
+      case 1:
+        httpd_send(http_client, http_status_400, NULL, NULL, 0);
+        break;
+      default:
+        httpd_send(http_client, http_status_500, NULL, NULL, 0);
+        ENDUSER_SETUP_ERROR_VOID("http_request failed. Failed to handle wifi credentials.", ENDUSER_SETUP_ERR_UNKOWN_ERROR, ENDUSER_SETUP_ERR_NONFATAL);
+    }
   }  
-  else /* not GET or OPTIONS */
+  else if (c_strcmp(path, "/generate_204") == 0)
   {
-    enduser_setup_http_serve_header(http_client, http_header_405, LITLEN(http_header_405));
+    /* Convince Android devices that they have internet access to avoid pesky dialogues. */
+    httpd_send(http_client, http_status_204, NULL, NULL, 0);
+  }
+  else
+  {
+    ENDUSER_SETUP_DEBUG("serving 404");
+    httpd_send(http_client, http_status_404, NULL, NULL, 0);
   }
-
-  deferred_close (http_client);
-
-free_out:
-  os_free (data);
-  return ret;
 }
 
-static err_t enduser_setup_http_connectcb(void *arg, struct tcp_pcb *pcb, err_t err)
-{
-  ENDUSER_SETUP_DEBUG("enduser_setup_http_connectcb");
 
-  if (!state)
+/* Drops a pending /aplist response when its client goes away */
+static void enduser_setup_http_close(httpd_conn *http_client, void *arg)
+{
+  (void)arg;
+  scan_listener_t *l = httpd_get_user (http_client);
+  if (l)
   {
-    ENDUSER_SETUP_DEBUG("connect callback but no state?!");
-    tcp_abort (pcb);
-    return ERR_ABRT;
+    remove_scan_listener (l);
   }
-
-  tcp_accepted (state->http_pcb);
-  tcp_recv (pcb, enduser_setup_http_recvcb);
-  tcp_nagle_disable (pcb);
-  return ERR_OK;
 }
 
 
 static int enduser_setup_http_start(void)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_http_start");
-  struct tcp_pcb *pcb = tcp_new ();
-  if (pcb == NULL)
-  {
-    ENDUSER_SETUP_ERROR("http_start failed. Memory allocation failed (http_pcb == NULL).", ENDUSER_SETUP_ERR_OUT_OF_MEMORY, ENDUSER_SETUP_ERR_FATAL);
-  }
 
-  if (tcp_bind (pcb, IP_ADDR_ANY, 80) != ERR_OK)
-  {
-    ENDUSER_SETUP_ERROR("http_start bind failed", ENDUSER_SETUP_ERR_SOCKET_ALREADY_OPEN, ENDUSER_SETUP_ERR_FATAL);
-  }
-
-  state->http_pcb = tcp_listen (pcb);
-  if (!state->http_pcb)
-  {
-    tcp_abort(pcb); /* original wasn't freed for us */
-    ENDUSER_SETUP_ERROR("http_start listen failed", ENDUSER_SETUP_ERR_SOCKET_ALREADY_OPEN, ENDUSER_SETUP_ERR_FATAL);
-  }
-
-  tcp_accept (state->http_pcb, enduser_setup_http_connectcb);
-
-  /* TODO: check lwip tcp timeouts */
-#if 0
-  err = espconn_regist_time(state->espconn_http_tcp, 2, 0);
-  if (err == ESPCONN_ARG)
-  {
-    ENDUSER_SETUP_ERROR("http_start failed. Unable to set TCP timeout.", ENDUSER_SETUP_ERR_CONNECTION_NOT_FOUND, ENDUSER_SETUP_ERR_NONFATAL | ENDUSER_SETUP_ERR_NO_RETURN);
-  }
-#endif
-
-  int err = enduser_setup_http_load_payload();
-  if (err == 1)
-  {
-    ENDUSER_SETUP_DEBUG("enduser_setup_http_start info. Loaded backup HTML.");
-  }
-  else if (err == 2)
+  state->httpd = httpd_start (80, ENDUSER_SETUP_HTTP_MAX_CONNS, enduser_setup_http_request, enduser_setup_http_close, NULL);
+  if (!state->httpd)
   {
-    ENDUSER_SETUP_ERROR("http_start failed. Unable to allocate memory for HTTP payload.", ENDUSER_SETUP_ERR_OUT_OF_MEMORY, ENDUSER_SETUP_ERR_FATAL);
+    ENDUSER_SETUP_ERROR("http_start failed. Unable to listen on port 80.", ENDUSER_SETUP_ERR_SOCKET_ALREADY_OPEN, ENDUSER_SETUP_ERR_FATAL);
   }
 
   return 0;
@@ -1341,10 +1034,10 @@ static void enduser_setup_http_stop(void)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_http_stop");
 
-  if (state && state->http_pcb)
+  if (state && state->httpd)
   {
-    tcp_close (state->http_pcb); /* cannot fail for listening sockets */
-    state->http_pcb = 0;
+    httpd_stop (state->httpd);
+    state->httpd = 0;
   }
 }
 
@@ -1549,8 +1242,6 @@ static void enduser_setup_free(void)
     c_free(state->espconn_dns_udp);
   }
 
-  c_free(state->http_payload_data);
-
   free_scan_listeners ();
 
   c_free(state);
@@ -1760,6 +1451,14 @@ static int enduser_setup_stop(lua_State* L)
 {
   ENDUSER_SETUP_DEBUG("enduser_setup_stop");
 
+  if (state != NULL && state->in_route)
+  {
+    /* Called from a route, the HTTP server can't be taken down underneath it */
+    os_timer_setfn(&(state->shutdown_timer), enduser_setup_stop_callback, NULL);
+    os_timer_arm(&(state->shutdown_timer), 1, FALSE);
+    return 0;
+  }
+
   if (!manual)
   {
     enduser_setup_ap_stop();
@@ -1778,8 +1477,34 @@ static int enduser_setup_stop(lua_State* L)
 }
 
 
+/**
+ * enduser_setup.route(path, handler)
+ *
+ * The routes outlive start() and stop(), so they can be set up front.
+ */
+static int enduser_setup_route(lua_State *L)
+{
+  luaL_checkstring(L, 1);
+  int t = lua_type(L, 2);
+  luaL_argcheck(L, t == LUA_TNONE || t == LUA_TNIL || t == LUA_TSTRING || t == LUA_TFUNCTION || t == LUA_TLIGHTFUNCTION,
+                2, "function or file name expected");
+  lua_settop(L, 2);
+
+  if (routes_ref == LUA_NOREF)
+  {
+    lua_newtable(L);
+    routes_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, routes_ref);
+  lua_insert(L, 1);
+  lua_rawset(L, 1);
+  return 0;
+}
+
+
 static const LUA_REG_TYPE enduser_setup_map[] = {
   { LSTRKEY( "manual" ), LFUNCVAL( enduser_setup_manual )},
+  { LSTRKEY( "route" ), LFUNCVAL( enduser_setup_route )},
   { LSTRKEY( "start" ), LFUNCVAL( enduser_setup_start )},
   { LSTRKEY( "stop" ),  LFUNCVAL( enduser_setup_stop  )},
   { LNILKEY, LNILVAL}
@@ -10,6 +10,7 @@
 #include "c_string.h"
 #include "gpio.h"
 #include "hw_timer.h"
+#include "callback.h"
 
 #define PULLUP PLATFORM_GPIO_PULLUP
 #define FLOAT PLATFORM_GPIO_FLOAT
@@ -28,6 +29,7 @@
 #define INTERRUPT_TYPE_IS_LEVEL(x)	((x) >= GPIO_PIN_INTR_LOLEVEL)
 
 static int gpio_cb_ref[GPIO_PIN_NUM];
+static cb_source_t cb_gpio = CB_SOURCE("gpio");
 
 // This task is scheduled by the ISR and is used
 // to initiate the Lua-land gpio.trig() callback function
@@ -70,13 +72,16 @@ static void gpio_intr_callback_task (task_param_t param, uint8 priority)
       uint16_t diff = (seen ^ pin_counter[pin].seen);
       // Needs another callback if seen changed but not if the top bit is set
       needs_callback = diff <= 0x7fff && diff > 0;
+      // the latency is measured from the stamp passed to this callback
+      uint32_t stamp = then;
       if (needs_callback) {
         // Fake this for next time (this only happens if another interrupt happens since
         // we loaded the 'seen' variable.
         then = system_get_time() & 0x7fffffff;
       }
 
-      lua_call(L, 3, 0);
+      // then only keeps the lower 31 bits of the time stamp
+      cb_call(L, &cb_gpio, 3, stamp | (system_get_time() & 0x80000000));
     } 
 
     if (INTERRUPT_TYPE_IS_LEVEL(pin_int_type[pin])) {
@@ -2,13 +2,16 @@
 #include "lauxlib.h"
 #include "lmem.h"
 #include "platform.h"
+#include "rom.h"
 #include "user_interface.h"
 #include "c_types.h"
 #include "c_string.h"
 #include "gpio.h"
 #include "hw_timer.h"
 #include "pin_map.h"
+#include "vfs.h"
 #include "driver/gpio16.h"
+#include "bytearr.h"
 
 #define TIMER_OWNER 'P'
 
@@ -47,6 +50,45 @@ static int active_pulser_ref;
 static pulse_t *active_pulser;
 static task_handle_t tasknumber;
 
+// Compiled sequences: a flat list of 16 bit durations (in microseconds),
+// where edge n drives the precomputed masks of state n % nstates.
+#define SEQ_MAX_STATES  8
+#define SEQ_JITTER_RING 32
+#define SEQ_FILE_CHUNK  256     // edges per half of the file refill buffer
+#define SEQ_SPIN_US     20      // closer edges are busy-waited in the ISR
+#define SEQ_LEAD_US     8       // wake up this much before an edge and spin
+
+typedef struct {
+  uint32_t gpio_set;
+  uint32_t gpio_clr;
+} pulse_state_t;
+
+typedef struct {
+  pulse_state_t state[SEQ_MAX_STATES];
+  uint8_t nstates;
+  volatile uint8_t state_pos;
+  volatile uint8_t underrun;
+  uint32_t edge_count;
+  volatile uint32_t edge_pos;
+  const uint8_t *edges;             // resident little endian durations, or NULL
+  int src_ref;                      // string holding the durations, if used in place
+  int fd;                           // file source
+  uint8_t *fbuf;                    // 2 * SEQ_FILE_CHUNK durations for file source
+  volatile uint32_t fill_pos;       // edges loaded into fbuf so far
+  uint32_t cycles_per_us;
+  volatile uint32_t planned;        // CCOUNT of the next edge
+  // jitter of actual versus planned edge time, in CPU cycles
+  volatile int32_t jit_min;
+  volatile int32_t jit_max;
+  volatile uint32_t jit_sum;
+  volatile uint32_t jit_count;
+  volatile int32_t jit_ring[SEQ_JITTER_RING];
+  int cb_ref;
+} pulse_seq_t;
+
+static int active_seq_ref = LUA_NOREF;
+static pulse_seq_t *active_seq;
+
 static int gpio_pulse_push_state(lua_State *L, pulse_t *pulser) {
   uint32_t now;
   uint32_t expected_end_time;
@@ -398,7 +440,7 @@ static void ICACHE_RAM_ATTR gpio_pulse_timeout(os_param_t p) {
 static int gpio_pulse_start(lua_State *L) {
   pulse_t *pulser = luaL_checkudata(L, 1, "gpio.pulse");
 
-  if (active_pulser) {
+  if (active_pulser || active_seq) {
     return luaL_error(L, "pulse operation already in progress");
   }
 
@@ -446,11 +488,351 @@ static int gpio_pulse_start(lua_State *L) {
   return 0;
 }
 
+static void fill_state_from_table(lua_State *L, pulse_state_t *state) {
+  if (lua_type(L, -1) != LUA_TTABLE) {
+    luaL_error(L, "All states must be tables");
+  }
+
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    int pin = luaL_checkint(L, -2);
+    int value = luaL_checkint(L, -1);
+
+    if (pin < 0 || pin >= GPIO_PIN_NUM) {
+      luaL_error(L, "pin number %d must be in range 0 .. %d", pin, GPIO_PIN_NUM - 1);
+    }
+    if (value) {
+      state->gpio_set |= BIT(pin_num[pin]);
+    } else {
+      state->gpio_clr |= BIT(pin_num[pin]);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+static pulse_seq_t *gpio_pulse_seq_new(lua_State *L, size_t extra) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  size_t nstates = luaL_getn(L, 1);
+  if (nstates < 1 || nstates > SEQ_MAX_STATES) {
+    luaL_error(L, "between 1 and %d states required", SEQ_MAX_STATES);
+  }
+
+  pulse_seq_t *seq = (pulse_seq_t *) lua_newuserdata(L, sizeof(pulse_seq_t) + extra);
+  memset(seq, 0, sizeof(pulse_seq_t) + extra);
+  seq->cb_ref = LUA_NOREF;
+  seq->src_ref = LUA_NOREF;
+  seq->fd = 0;
+  luaL_getmetatable(L, "gpio.pulse.seq");
+  lua_setmetatable(L, -2);
+
+  seq->nstates = nstates;
+  size_t i;
+  for (i = 0; i < nstates; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    fill_state_from_table(L, seq->state + i);
+  }
+  return seq;
+}
+
+// Lua: seq = gpio.pulse.compile(states, durations)
+// durations is a table of microsecond values, or a string / bytearr of 16 bit little endian values
+static int gpio_pulse_compile(lua_State *L) {
+  const uint8_t *data = NULL;
+  size_t len = 0;
+
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    size_t count = luaL_getn(L, 2);
+    pulse_seq_t *seq = gpio_pulse_seq_new(L, count * 2);
+    uint8_t *edges = (uint8_t *) (seq + 1);
+    size_t i;
+    for (i = 0; i < count; i++) {
+      lua_rawgeti(L, 2, i + 1);
+      int delay = luaL_checkint(L, -1);
+      lua_pop(L, 1);
+      if (delay < 0 || delay > 0xffff) {
+        return luaL_error(L, "duration of %d must be in the range 0 .. 65535 microseconds", delay);
+      }
+      edges[2 * i] = delay & 0xff;
+      edges[2 * i + 1] = delay >> 8;
+    }
+    seq->edges = edges;
+    seq->edge_count = count;
+    return 1;
+  }
+
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    data = (const uint8_t *) lua_tolstring(L, 2, &len);
+    // strings never change, so one in RAM is used in place and kept alive by
+    // the sequence; the ISR cannot read one from flash while flash is written
+    if ((uint32_t) data < INTERNAL_FLASH_MAPPED_ADDRESS) {
+      pulse_seq_t *seq = gpio_pulse_seq_new(L, 0);
+      lua_pushvalue(L, 2);
+      seq->src_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+      seq->edges = data;
+      seq->edge_count = len / 2;
+      return 1;
+    }
+  }
+#ifdef LUA_USE_MODULES_BYTEARR
+  else {
+    data = bytearr_data(L, 2, &len);
+  }
+#endif
+  if (!data) {
+    return luaL_argerror(L, 2, "table, string or bytearr expected");
+  }
+
+  // a bytearr can be resized or freed by Lua, so the ISR gets a copy
+  pulse_seq_t *seq = gpio_pulse_seq_new(L, len & ~1);
+  uint8_t *edges = (uint8_t *) (seq + 1);
+  memcpy(edges, data, len & ~1);
+  seq->edges = edges;
+  seq->edge_count = len / 2;
+  return 1;
+}
+
+// Lua: seq = gpio.pulse.fcompile(states, filename)
+// the file holds 16 bit little endian durations and is streamed while running
+static int gpio_pulse_fcompile(lua_State *L) {
+  const char *fname = luaL_checkstring(L, 2);
+
+  int fd = vfs_open(fname, "r");
+  if (!fd) {
+    return luaL_error(L, "file does not exist");
+  }
+  uint32_t size = vfs_size(fd);
+
+  pulse_seq_t *seq = gpio_pulse_seq_new(L, 4 * SEQ_FILE_CHUNK);
+  seq->fd = fd;
+  seq->fbuf = (uint8_t *) (seq + 1);
+  seq->edge_count = size / 2;
+  return 1;
+}
+
+static void gpio_pulse_seq_refill(pulse_seq_t *seq) {
+  // a half may be reloaded once the reader has moved past all of it
+  while (seq->fill_pos < seq->edge_count && seq->fill_pos <= seq->edge_pos + SEQ_FILE_CHUNK) {
+    uint8_t *dst = seq->fbuf + 2 * (seq->fill_pos % (2 * SEQ_FILE_CHUNK));
+    if (vfs_read(seq->fd, dst, 2 * SEQ_FILE_CHUNK) <= 0) {
+      break;
+    }
+    seq->fill_pos += SEQ_FILE_CHUNK;
+  }
+}
+
+static inline uint32_t ICACHE_RAM_ATTR gpio_pulse_seq_duration(pulse_seq_t *seq, uint32_t pos) {
+  const uint8_t *p;
+  if (seq->edges) {
+    p = seq->edges + 2 * pos;
+  } else {
+    p = seq->fbuf + 2 * (pos % (2 * SEQ_FILE_CHUNK));
+  }
+  return p[0] | (p[1] << 8);
+}
+
+static void ICACHE_RAM_ATTR gpio_pulse_seq_timeout(os_param_t p) {
+  (void) p;
+  pulse_seq_t *seq = active_seq;
+
+  if (!seq) {
+    platform_hw_timer_close(TIMER_OWNER);
+    return;
+  }
+
+  for (;;) {
+    uint32_t pos = seq->edge_pos;
+
+    if (pos >= seq->edge_count || (!seq->edges && pos >= seq->fill_pos)) {
+      seq->underrun = pos < seq->edge_count;
+      platform_hw_timer_close(TIMER_OWNER);
+      task_post_low(tasknumber, (task_param_t)0);
+      return;
+    }
+
+    // spin out the remainder up to the planned edge
+    while ((int32_t) (xthal_get_ccount() - seq->planned) < 0)
+      ;
+    int32_t jitter = xthal_get_ccount() - seq->planned;
+
+    pulse_state_t *state = seq->state + seq->state_pos;
+    if (state->gpio_set & 0x10000) {
+      gpio16_output_set(1);
+    }
+    GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, state->gpio_set);
+    GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, state->gpio_clr);
+    if (state->gpio_clr & 0x10000) {
+      gpio16_output_set(0);
+    }
+
+    if (jitter < seq->jit_min || seq->jit_count == 0) {
+      seq->jit_min = jitter;
+    }
+    if (jitter > seq->jit_max || seq->jit_count == 0) {
+      seq->jit_max = jitter;
+    }
+    seq->jit_sum += jitter;
+    seq->jit_ring[seq->jit_count % SEQ_JITTER_RING] = jitter;
+    seq->jit_count++;
+
+    if (++seq->state_pos >= seq->nstates) {
+      seq->state_pos = 0;
+    }
+    seq->planned += gpio_pulse_seq_duration(seq, pos) * seq->cycles_per_us;
+    seq->edge_pos = pos + 1;
+
+    if (!seq->edges && (seq->edge_pos % SEQ_FILE_CHUNK) == 0) {
+      // a half of the file buffer has been consumed
+      task_post_low(tasknumber, (task_param_t)1);
+    }
+
+    int32_t left = (int32_t) (seq->planned - xthal_get_ccount()) / (int32_t) seq->cycles_per_us;
+    if (left >= SEQ_SPIN_US) {
+      platform_hw_timer_arm_us(TIMER_OWNER, left - SEQ_LEAD_US);
+      return;
+    }
+  }
+}
+
+static int gpio_pulse_seq_start(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.seq");
+
+  if (active_pulser || active_seq) {
+    return luaL_error(L, "pulse operation already in progress");
+  }
+  if (lua_type(L, 2) == LUA_TFUNCTION || lua_type(L, 2) == LUA_TLIGHTFUNCTION) {
+    lua_pushvalue(L, 2);
+  } else {
+    return luaL_error( L, "missing callback" );
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, seq->cb_ref);
+  seq->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  seq->edge_pos = 0;
+  seq->state_pos = 0;
+  seq->underrun = 0;
+  seq->jit_count = 0;
+  seq->jit_sum = 0;
+  seq->cycles_per_us = system_get_cpu_freq();
+  if (seq->fd) {
+    vfs_lseek(seq->fd, 0, VFS_SEEK_SET);
+    seq->fill_pos = 0;
+    gpio_pulse_seq_refill(seq);
+  }
+
+  active_seq = seq;
+  lua_pushvalue(L, 1);
+  active_seq_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  if (!platform_hw_timer_init(TIMER_OWNER, FRC1_SOURCE, FALSE)) {
+    active_seq = NULL;
+    luaL_unref(L, LUA_REGISTRYINDEX, active_seq_ref);
+    active_seq_ref = LUA_NOREF;
+    return luaL_error(L, "Unable to initialize timer");
+  }
+  platform_hw_timer_set_func(TIMER_OWNER, gpio_pulse_seq_timeout, 0);
+
+  seq->planned = xthal_get_ccount() + SEQ_LEAD_US * seq->cycles_per_us;
+  gpio_pulse_seq_timeout(0);
+
+  return 0;
+}
+
+static void gpio_pulse_seq_finish(lua_State *L) {
+  active_seq = NULL;
+  int seq_ref = active_seq_ref;
+  active_seq_ref = LUA_NOREF;
+  luaL_unref(L, LUA_REGISTRYINDEX, seq_ref);
+}
+
+static int gpio_pulse_seq_cancel(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.seq");
+
+  if (active_seq != seq) {
+    return 0;
+  }
+  platform_hw_timer_close(TIMER_OWNER);
+  lua_pushinteger(L, seq->edge_pos);
+  gpio_pulse_seq_finish(L);
+  return 1;
+}
+
+// Lua: pos, count = seq:getstate()
+static int gpio_pulse_seq_getstate(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.seq");
+
+  lua_pushinteger(L, seq->edge_pos);
+  lua_pushinteger(L, seq->edge_count);
+  return 2;
+}
+
+// Lua: stats = seq:jitter()
+// all times are in nanoseconds relative to the planned edge time
+static int gpio_pulse_seq_jitter(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.seq");
+  uint32_t mhz = seq->cycles_per_us ? seq->cycles_per_us : system_get_cpu_freq();
+  uint32_t count = seq->jit_count;
+
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, count);
+  lua_setfield(L, -2, "count");
+  if (count == 0) {
+    return 1;
+  }
+  lua_pushinteger(L, seq->jit_min * 1000 / (int32_t) mhz);
+  lua_setfield(L, -2, "min");
+  lua_pushinteger(L, seq->jit_max * 1000 / (int32_t) mhz);
+  lua_setfield(L, -2, "max");
+  lua_pushinteger(L, (uint32_t) ((uint64_t) seq->jit_sum * 1000 / mhz / count));
+  lua_setfield(L, -2, "mean");
+
+  // most recent edges, oldest first
+  uint32_t n = count < SEQ_JITTER_RING ? count : SEQ_JITTER_RING;
+  uint32_t i;
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_pushinteger(L, seq->jit_ring[(count - n + i) % SEQ_JITTER_RING] * 1000 / (int32_t) mhz);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "recent");
+  return 1;
+}
+
+static int gpio_pulse_seq_delete(lua_State *L) {
+  pulse_seq_t *seq = luaL_checkudata(L, 1, "gpio.pulse.seq");
+
+  if (seq == active_seq) {
+    return 0;
+  }
+  if (seq->fd) {
+    vfs_close(seq->fd);
+    seq->fd = 0;
+  }
+  luaL_unref(L, LUA_REGISTRYINDEX, seq->cb_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, seq->src_ref);
+  seq->src_ref = LUA_NOREF;
+  return 0;
+}
+
 static void gpio_pulse_task(os_param_t param, uint8_t prio) 
 {
-  (void) param;
   (void) prio;
 
+  if (active_seq) {
+    pulse_seq_t *seq = active_seq;
+    if (param == 1) {
+      gpio_pulse_seq_refill(seq);
+      return;
+    }
+    lua_State *L = lua_getstate();
+    lua_rawgeti(L, LUA_REGISTRYINDEX, seq->cb_ref);
+    lua_pushinteger(L, seq->edge_pos);
+    lua_pushboolean(L, !seq->underrun);
+    gpio_pulse_seq_finish(L);
+    lua_call(L, 2, 0);
+    return;
+  }
+
   if (active_pulser) {
     lua_State *L = lua_getstate();
     // Invoke the callback
@@ -467,6 +849,16 @@ static void gpio_pulse_task(os_param_t param, uint8_t prio)
   }
 }
 
+static const LUA_REG_TYPE pulse_seq_map[] = {
+  { LSTRKEY( "start" ),               LFUNCVAL( gpio_pulse_seq_start ) },
+  { LSTRKEY( "cancel" ),              LFUNCVAL( gpio_pulse_seq_cancel ) },
+  { LSTRKEY( "getstate" ),            LFUNCVAL( gpio_pulse_seq_getstate ) },
+  { LSTRKEY( "jitter" ),              LFUNCVAL( gpio_pulse_seq_jitter ) },
+  { LSTRKEY( "__gc" ),                LFUNCVAL( gpio_pulse_seq_delete ) },
+  { LSTRKEY( "__index" ),             LROVAL( pulse_seq_map ) },
+  { LNILKEY, LNILVAL }
+};
+
 static const LUA_REG_TYPE pulse_map[] = {
   { LSTRKEY( "getstate" ),            LFUNCVAL( gpio_pulse_getstate ) },
   { LSTRKEY( "stop" ),                LFUNCVAL( gpio_pulse_stop ) },
@@ -482,6 +874,8 @@ static const LUA_REG_TYPE pulse_map[] = {
 const LUA_REG_TYPE gpio_pulse_map[] =
 {
   { LSTRKEY( "build" ),               LFUNCVAL( gpio_pulse_build ) },
+  { LSTRKEY( "compile" ),             LFUNCVAL( gpio_pulse_compile ) },
+  { LSTRKEY( "fcompile" ),            LFUNCVAL( gpio_pulse_fcompile ) },
   { LSTRKEY( "__index" ),             LROVAL( gpio_pulse_map ) },
   { LNILKEY, LNILVAL }
 };
@@ -489,6 +883,7 @@ const LUA_REG_TYPE gpio_pulse_map[] =
 int gpio_pulse_init(lua_State *L)
 {
   luaL_rometatable(L, "gpio.pulse", (void *)pulse_map);
+  luaL_rometatable(L, "gpio.pulse.seq", (void *)pulse_seq_map);
   tasknumber = task_get_id(gpio_pulse_task);
   return 0;
 }
@@ -139,6 +139,85 @@ static int i2c_read( lua_State *L )
   return 1;
 }
 
+// Lua: read = i2c.transfer( id, address, [wdata], [rlen] )
+// wdata can be either a string, a table of 8-bit numbers or nil
+static int i2c_transfer( lua_State *L )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+  int address = luaL_checkinteger( L, 2 );
+  int rlen = luaL_optinteger( L, 4, 0 );
+  const char *wdata = NULL;
+  char *rdata = NULL;
+  size_t wlen = 0, i;
+  luaL_Buffer wb;
+  int numdata, res;
+
+  MOD_CHECK_ID( i2c, id );
+  if ( address < 0 || address > 127 || rlen < 0 )
+    return luaL_error( L, "wrong arg range" );
+
+  if( lua_istable( L, 3 ) )
+  {
+    luaL_buffinit( L, &wb );
+    wlen = lua_objlen( L, 3 );
+    for( i = 0; i < wlen; i ++ )
+    {
+      lua_rawgeti( L, 3, i + 1 );
+      numdata = ( int )luaL_checkinteger( L, -1 );
+      lua_pop( L, 1 );
+      if( numdata < 0 || numdata > 255 )
+        return luaL_error( L, "wrong arg range" );
+      luaL_addchar( &wb, ( char )numdata );
+    }
+    luaL_pushresult( &wb );
+    lua_replace( L, 3 );
+  }
+  if( !lua_isnoneornil( L, 3 ) )
+    wdata = luaL_checklstring( L, 3, &wlen );
+
+  if( rlen > 0 )
+    rdata = ( char * )lua_newuserdata( L, rlen );
+
+  res = platform_i2c_transfer( id, (u16)address, (const u8 *)wdata, wlen, (u8 *)rdata, rlen );
+  if( res != PLATFORM_OK )
+  {
+    lua_pushnil( L );
+    return 1;
+  }
+
+  lua_pushlstring( L, rdata ? rdata : "", rlen );
+  return 1;
+}
+
+// Lua: stats = i2c.stats( id, [reset] )
+static int i2c_stats( lua_State *L )
+{
+  unsigned id = luaL_checkinteger( L, 1 );
+  int reset = lua_toboolean( L, 2 );
+  platform_i2c_stats_t st;
+
+  MOD_CHECK_ID( i2c, id );
+  platform_i2c_get_stats( id, &st, reset );
+
+  lua_createtable( L, 0, 7 );
+  // cycle counts are in 80 MHz units, so speed = bits * 80e6 / cycles
+  lua_pushinteger( L, st.bit_cycles ? (u32)( (uint64_t)st.bits * 80000000 / st.bit_cycles ) : 0 );
+  lua_setfield( L, -2, "speed" );
+  lua_pushinteger( L, st.starts );
+  lua_setfield( L, -2, "starts" );
+  lua_pushinteger( L, st.bytes );
+  lua_setfield( L, -2, "bytes" );
+  lua_pushinteger( L, st.bits );
+  lua_setfield( L, -2, "bits" );
+  lua_pushinteger( L, st.nacks );
+  lua_setfield( L, -2, "nacks" );
+  lua_pushinteger( L, st.timeouts );
+  lua_setfield( L, -2, "timeouts" );
+  lua_pushinteger( L, st.stretch_cycles / 80 );
+  lua_setfield( L, -2, "stretch_us" );
+  return 1;
+}
+
 // Module function map
 static const LUA_REG_TYPE i2c_map[] = {
   { LSTRKEY( "setup" ),       LFUNCVAL( i2c_setup ) },
@@ -147,7 +226,10 @@ static const LUA_REG_TYPE i2c_map[] = {
   { LSTRKEY( "address" ),     LFUNCVAL( i2c_address ) },
   { LSTRKEY( "write" ),       LFUNCVAL( i2c_write ) },
   { LSTRKEY( "read" ),        LFUNCVAL( i2c_read ) },
- //{ LSTRKEY( "FAST" ),       LNUMVAL( PLATFORM_I2C_SPEED_FAST ) },
+  { LSTRKEY( "transfer" ),    LFUNCVAL( i2c_transfer ) },
+  { LSTRKEY( "stats" ),       LFUNCVAL( i2c_stats ) },
+  { LSTRKEY( "FASTPLUS" ),    LNUMVAL( PLATFORM_I2C_SPEED_FASTPLUS ) },
+  { LSTRKEY( "FAST" ),        LNUMVAL( PLATFORM_I2C_SPEED_FAST ) },
   { LSTRKEY( "SLOW" ),        LNUMVAL( PLATFORM_I2C_SPEED_SLOW ) },
   { LSTRKEY( "TRANSMITTER" ), LNUMVAL( PLATFORM_I2C_DIRECTION_TRANSMITTER ) },
   { LSTRKEY( "RECEIVER" ),    LNUMVAL( PLATFORM_I2C_DIRECTION_RECEIVER ) },
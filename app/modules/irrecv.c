@@ -1,132 +1,254 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "platform.h"
+#include "rom.h"
 #include "irproto.h"
 #include "c_stdlib.h"
+#include "c_string.h"
+#include "user_interface.h"
 #include "task/task.h"
 
-static task_handle_t callback_stub;
-static uint32_t dup_mask = 0;	// set bit to 1 when pin is bind
+/*
+ * The GPIO interrupt only timestamps the edges (CCOUNT, with bit 0 replaced
+ * by the line level after the edge) into a per-pin ring. Frames are put
+ * together and decoded in a task, where a silence of IRRECV_GAP_US ends a
+ * frame, so that nothing is lost to a slow decoder or a busy Lua callback.
+ */
 
-#define pin_bit(pin) ( 1<<GPIO_ID_PIN(pin_num[pin]) )
-#define pin_has_set(val, pin) ( ((val) & pin_bit(pin)) != 0 )
-#define pin_set( val, pin ) ( (val) | pin_bit(pin) )
+// Edges buffered per pin, a power of 2
+#define IRRECV_RING_LEN 256
+#define IRRECV_RING_MASK (IRRECV_RING_LEN - 1)
+
+// Longest frame, in marks and spaces. Sony 20 bit frames need 41 and RC5/6
+// never more than 45; the rest is there for learning unknown remotes.
+#define IRRECV_MAX_PULSES 255
+
+// Silence which ends a frame
+#define IRRECV_GAP_US 10000
+
+// Pseudo protocols
+#define IRRECV_ANY 0
+#define IRRECV_RAW 255
+
+typedef struct {
+  uint32_t edges;
+  uint32_t frames;
+  uint32_t decoded;
+  uint32_t overruns;              // edges dropped as the ring was full
+  uint32_t failures;              // frames which were broken or not understood
+} irrecv_stats;
 
 typedef struct {
-  int                 state;		// 当前状态
-  uint32              prev_pulse_time;  // 上一个edge到达时间
-  int	              callback;		// 回调函数
-  irproto             proto;		// ir协议
-  uint32_t            protodata;	// 读取到的数据，最多32b
-  // flag: bitmap for multi usage
-  // bit[5..0] = valid data size for protodata
-  // bit[6] = level for prevent pulse
-  // bit[7] = level for initial pulse
-  // bit[8] = 1 for protodata is ready to callback
-  uint32_t            flag; 
+  volatile uint32_t head;         // advanced by the ISR
+  volatile uint32_t tail;         // advanced by the task
+  uint32_t ring[IRRECV_RING_LEN];
+  irrecv_stats stats;
+  uint32_t seen_overruns;
+  int callback;
+  uint8_t protocol;
+  uint8_t level;                  // line level after the last edge taken from the ring
+  uint8_t active;                 // a frame is being received
+  uint8_t broken;                 // an edge of this frame was lost
+  uint32_t last;                  // CCOUNT of the last edge taken from the ring
+  uint16_t n;
+  uint16_t pulse[IRRECV_MAX_PULSES];
 } ir_pin_reader, *ir_pin_reader_pointer;
 
-static ir_pin_reader_pointer pin_reader[GPIO_PIN_NUM];
-
-#define LEVEL_INIT_BIT 8
-#define LEVEL_PREV_BIT 8
-
-#define FLAG_VALID_BIT 5
-#define FLAG_PREVLV_BIT 6
-#define FLAG_INITLV_BIT 7
-#define FLAG_READY_BIT 8
-
-#define get_prev_level( reader ) (((reader)->flag & (1<<FLAG_PREVLV_BIT))>>FLAG_PREVLV_BIT)
-#define set_prev_level( reader, level ) (reader)->flag = (level) ? ((reader)->flag | (1<<FLAG_PREVLV_BIT)) : ((reader)->flag & ~(1<<FLAG_PREVLV_BIT))
-
-#define set_init_level( reader, level ) (reader)->flag = (level) ? ((reader)->flag | (1<<FLAG_INITLV_BIT)) : ((reader)->flag & ~(1<<FLAG_INITLV_BIT))
-#define reset_init_level( reader ) set_prev_level( reader, (reader)->flag & (1<<FLAG_INITLV_BIT) )
-
-#define get_proto_validbit( reader ) ( (reader)->flag & ((1<<(FLAG_VALID_BIT+1))-1) )
-#define set_proto_validbit( reader, bitlen ) (reader)->flag = ((reader)->flag & ~((1<<(FLAG_VALID_BIT+1))-1)) | ((1<<(FLAG_VALID_BIT+1))-1) & (bitlen)
-#define get_proto_dataready( reader ) (((reader)->flag & (1<<FLAG_READY_BIT))>>FLAG_READY_BIT)
-#define set_proto_dataready( reader, ready ) (reader)->flag = (ready) ? ((reader)->flag | (1<<FLAG_READY_BIT)) : ((reader)->flag & ~(1<<FLAG_READY_BIT))
-
-static uint32 ICACHE_FLASH_ATTR gpio_intr_handler( uint32 mask ){
-  if( mask & dup_mask ){
-    GPIO_REG_WRITE( GPIO_STATUS_W1TC_ADDRESS, dup_mask );
-    uint32 now = system_get_time();
-    uint32_t protodata;
-    int8_t writebits;
-    int8_t protoready;
-    int do_callback = 0;
- 
-    for( int pin=0; mask > 0; mask >>= 1, ++pin ) {
-      if( mask & 1 ){
-	int io = pin_num_inv[pin];
-	uint32 level = platform_gpio_read( io );
-	ir_pin_reader_pointer reader = pin_reader[io];
-	protodata = reader->protodata;
-	writebits = get_proto_validbit(reader);
-	protoready = 0;
-
-	// 开始读取协议
-	reader->state = reader->proto(
-				      reader->state,
-				      IRPROTO_LEVEL_PARAM( level, get_prev_level(reader) ),
-				      now-reader->prev_pulse_time,
-				      &protodata,
-				      &writebits,
-				      &protoready);
-	// assert( writebits <= 8 )
-	reader->prev_pulse_time = now;
-	reader->protodata = protodata;
-	set_proto_validbit(reader, writebits);
-	set_proto_dataready( reader, protoready );
-	do_callback = do_callback || protoready;
+// indexed by GPIO number, for the ISR
+static ir_pin_reader_pointer gpio_reader[GPIO_PIN_NUM];
+static uint32_t hooked = 0;	// GPIO bits owned by this module
+static volatile uint8_t posted = 0;
+static task_handle_t irrecv_task_id;
+static os_timer_t gap_timer;
+
+#define pin_bit(pin) ( 1<<GPIO_ID_PIN(pin_num[pin]) )
+
+static uint32 ICACHE_RAM_ATTR irrecv_intr_handler( uint32 mask )
+{
+  uint32 now = xthal_get_ccount();
+  uint32 in = GPIO_REG_READ( GPIO_IN_ADDRESS );
+  uint32 hit = mask & hooked;
+  int gpio;
+
+  GPIO_REG_WRITE( GPIO_STATUS_W1TC_ADDRESS, hit );
+  for( gpio = 0; hit; ++gpio, hit >>= 1 ){
+    if( hit & 1 ){
+      ir_pin_reader_pointer reader = gpio_reader[gpio];
+      uint32 head = reader->head;
+      if( head - reader->tail >= IRRECV_RING_LEN )
+        reader->stats.overruns++;
+      else{
+        reader->ring[head & IRRECV_RING_MASK] = (now & ~1) | ((in >> gpio) & 1);
+        reader->head = head + 1;
       }
     }
+  }
+  if( !posted )
+    posted = task_post_medium( irrecv_task_id, (task_param_t)0 );
 
-    if( do_callback ){
-      task_post_medium( callback_stub, (task_param_t)0 );
-    }
+  return mask & ~hooked;
+}
+
+static int push_code( lua_State *L, uint32_t code, int nbytes ){
+  int narg;
+  for( narg = 0; narg < nbytes; ++narg, code >>= 8 ){
+    lua_pushinteger(L, code & 0xff);
   }
-  return mask & (~dup_mask);
+  return narg;
 }
 
-static void perform_ondata_callback( lua_State *L, ir_pin_reader_pointer reader ){
-  uint32_t v = reader->protodata;
-  uint32_t len = get_proto_validbit(reader);
-  int narg = 0;
-  if( len > 0 ){
+// The frame is complete; decode it and hand it to Lua. The callback may
+// unbind the pin, so the reader must not be touched after this returns.
+static void frame_end( lua_State *L, ir_pin_reader_pointer reader ){
+  uint32_t code;
+  int proto, nbytes = -1, narg = 0, i;
+
+  reader->active = 0;
+  reader->stats.frames++;
+  // a frame ends with a mark, so an even count means that an edge was lost
+  if( reader->broken || !(reader->n & 1) ){
+    reader->stats.failures++;
+    return;
+  }
+
+  if( reader->protocol == IRRECV_RAW ){
     lua_rawgeti(L, LUA_REGISTRYINDEX, reader->callback);
-    for( narg = 0 ; len > 0; len -= 8, v >>= 8, ++narg ){
-      lua_pushinteger(L, v & 0xff);
+    lua_createtable(L, reader->n, 0);
+    for( i = 0; i < reader->n; ++i ){
+      lua_pushinteger(L, reader->pulse[i]);
+      lua_rawseti(L, -2, i + 1);
     }
-    lua_call(L, narg, 0);
+    reader->stats.decoded++;
+    lua_call(L, 1, 0);
+    return;
   }
+
+  if( reader->protocol == IRRECV_ANY ){
+    for( proto = 1; proto < IRPROTO_MAX && nbytes < 0; ++proto ){
+      nbytes = irproto_decode_map[proto]( reader->pulse, reader->n, &code );
+    }
+    --proto;
+  }
+  else{
+    proto = reader->protocol;
+    nbytes = irproto_decode_map[proto]( reader->pulse, reader->n, &code );
+  }
+
+  if( nbytes < 0 ){
+    reader->stats.failures++;
+    return;
+  }
+  reader->stats.decoded++;
+  // nothing to report for a repeat frame
+  if( nbytes == 0 ) return;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, reader->callback);
+  if( reader->protocol == IRRECV_ANY ){
+    lua_pushinteger(L, proto);
+    narg++;
+  }
+  narg += push_code(L, code, nbytes);
+  lua_call(L, narg, 0);
 }
 
-// callback the lua function for the pin which protodata is ready 
-static void irrecv_ondata(task_param_t param, uint8 priority)
-{
-  uint32_t n;
-  int pin;
-  lua_State *L = lua_getstate();
-  for( n = dup_mask, pin = 0; n > 0; ++pin, n >>= 1 ){
-    if( n & 1 ){
-      int io = pin_num_inv[pin];
-      ir_pin_reader_pointer reader = pin_reader[io];
-      if( get_proto_dataready(reader) ){
-	perform_ondata_callback(L, reader);
+// Takes the edges out of the ring and turns them into mark and space
+// durations. Returns 0 if the reader went away under a callback.
+static int drain( lua_State *L, int gpio ){
+  ir_pin_reader_pointer reader = gpio_reader[gpio];
+  uint32 mhz = system_get_cpu_freq();
+
+  while( reader->tail != reader->head ){
+    uint32 edge = reader->ring[reader->tail & IRRECV_RING_MASK];
+    uint32 usec = (edge - reader->last) / mhz;
+    uint8_t level = edge & 1;
+
+    reader->tail++;
+    reader->last = edge;
+    reader->stats.edges++;
+
+    if( reader->active && usec >= IRRECV_GAP_US ){
+      frame_end(L, reader);
+      if( gpio_reader[gpio] != reader ) return 0;
+    }
+    if( level == reader->level ){
+      // the opposite edge was lost
+      reader->broken = 1;
+      continue;
+    }
+    reader->level = level;
+
+    if( !reader->active ){
+      // the receivers are active low, so a frame starts with a falling edge
+      if( level == 0 ){
+        reader->active = 1;
+        reader->broken = 0;
+        reader->n = 0;
       }
     }
+    else if( reader->n < IRRECV_MAX_PULSES ){
+      reader->pulse[reader->n++] = usec > 0xffff ? 0xffff : usec;
+    }
+    else reader->broken = 1;
   }
+
+  if( reader->seen_overruns != reader->stats.overruns ){
+    reader->seen_overruns = reader->stats.overruns;
+    reader->broken = 1;
+  }
+  return 1;
+}
+
+// Drains all the rings, and ends the frames which have gone quiet if called
+// from the timer. The timer is kept running as long as a frame is open.
+static void irrecv_process( int from_timer ){
+  lua_State *L = lua_getstate();
+  uint32 mhz = system_get_cpu_freq();
+  int gpio, pending = 0;
+
+  posted = 0;
+  for( gpio = 0; gpio < GPIO_PIN_NUM; ++gpio ){
+    ir_pin_reader_pointer reader = gpio_reader[gpio];
+    if( !reader || !drain(L, gpio) ) continue;
+
+    if( reader->active && from_timer
+        && (xthal_get_ccount() - reader->last) / mhz >= IRRECV_GAP_US ){
+      frame_end(L, reader);
+      if( gpio_reader[gpio] != reader ) continue;
+    }
+    pending |= reader->active;
+  }
+
+  os_timer_disarm(&gap_timer);
+  if( pending ){
+    os_timer_arm(&gap_timer, IRRECV_GAP_US / 1000 + 1, 0);
+  }
+}
+
+static void irrecv_task( task_param_t param, uint8 priority )
+{
+  irrecv_process(0);
+}
+
+static void irrecv_gap_timeout( void *arg )
+{
+  irrecv_process(1);
+}
+
+static int check_pin( lua_State *L, int index ){
+  const int pin = luaL_checkinteger(L, index);
+  // pin 0 is GPIO16, which cannot interrupt
+  luaL_argcheck(L, 0 < pin && pin < GPIO_PIN_NUM, index, "invalid pin index");
+  return pin;
 }
 
-// irrecv.bind( pin, protocol, callback_fun( n ) end )
+// irrecv.bind( pin, protocol, callback_fun( ... ) end )
 static int ICACHE_FLASH_ATTR irrecv_bind( lua_State *L ){
-  const uint8_t pin = luaL_checkinteger(L, 1);
-  luaL_argcheck(L, 0 <= pin && pin < GPIO_PIN_NUM, 1, "invalid pin index");
+  const int pin = check_pin(L, 1);
+  const int gpio = GPIO_ID_PIN(pin_num[pin]);
 
   const int type = luaL_checkinteger( L, 2 );
-  luaL_argcheck(L, 0 < type && type < IRPROTO_MAX, 2, "invalid protocol");
-    
+  luaL_argcheck(L, (0 <= type && type < IRPROTO_MAX) || type == IRRECV_RAW, 2, "invalid protocol");
+
   int callback = LUA_NOREF;
   if( lua_type(L, 3) == LUA_TFUNCTION
       || lua_type(L, 3) == LUA_TLIGHTFUNCTION ){
@@ -134,63 +256,101 @@ static int ICACHE_FLASH_ATTR irrecv_bind( lua_State *L ){
     callback = luaL_ref(L, LUA_REGISTRYINDEX);
   }
   else luaL_argcheck(L, 0, 3, "invalid callback type");
-  
-  ir_pin_reader_pointer reader;
-  if( pin_has_set( dup_mask, pin ) ){
-    reader = pin_reader[pin];
-
-    // replace the callback
-    if( reader->callback != LUA_NOREF ){
-      luaL_unref(L, LUA_REGISTRYINDEX, reader->callback);
-    }
 
-    reader->state = IRPROTO_STATE_ERROR;
-    reader->prev_pulse_time = 0;
+  ir_pin_reader_pointer reader = gpio_reader[gpio];
+  if( reader ){
+    // replace the callback, the frame being received is decoded with the new protocol
+    luaL_unref(L, LUA_REGISTRYINDEX, reader->callback);
     reader->callback = callback;
-    reset_init_level( reader );
-    set_proto_dataready(reader, 0);
-    set_proto_validbit(reader, 0);
-    reader->protodata = 0;
-    reader->proto = ir_recv_nec; /* TODO: 按type修改 */
+    reader->protocol = type;
+    return 0;
   }
-  else{
-    // set pin function
-    platform_gpio_mode(pin, PLATFORM_GPIO_INPUT, PLATFORM_GPIO_FLOAT );
-    platform_gpio_intr_init( pin, GPIO_PIN_INTR_ANYEDGE );
 
-    reader = c_malloc( sizeof( ir_pin_reader ) );
-    reader->state = IRPROTO_STATE_ERROR;
-    reader->prev_pulse_time = 0;
-    reader->callback = callback;
-    uint32 level = platform_gpio_read( pin );
-    set_init_level( reader, level );
-    reset_init_level( reader );
-    set_proto_dataready( reader, 0 );
-    set_proto_validbit( reader, 0 );
-    reader->protodata = 0;
-    reader->proto = ir_recv_nec;
-    pin_reader[pin] = reader;
-
-    // update hook mask
-    dup_mask = pin_set(dup_mask, pin);
-    platform_gpio_register_intr_hook(dup_mask, gpio_intr_handler);
+  reader = c_zalloc( sizeof( ir_pin_reader ) );
+  if( !reader ){
+    luaL_unref(L, LUA_REGISTRYINDEX, callback);
+    return luaL_error(L, "out of memory");
+  }
+  reader->callback = callback;
+  reader->protocol = type;
+
+  // set pin function
+  platform_gpio_mode(pin, PLATFORM_GPIO_INPUT, PLATFORM_GPIO_FLOAT );
+  reader->level = platform_gpio_read( pin );
+  reader->last = xthal_get_ccount();
+  gpio_reader[gpio] = reader;
+
+  // update hook mask
+  hooked |= pin_bit(pin);
+  platform_gpio_register_intr_hook(hooked, irrecv_intr_handler);
+  platform_gpio_intr_init( pin, GPIO_PIN_INTR_ANYEDGE );
+  return 0;
+}
+
+// irrecv.unbind( pin )
+static int ICACHE_FLASH_ATTR irrecv_unbind( lua_State *L ){
+  const int pin = check_pin(L, 1);
+  const int gpio = GPIO_ID_PIN(pin_num[pin]);
+  ir_pin_reader_pointer reader = gpio_reader[gpio];
+
+  if( !reader ) return 0;
+
+  platform_gpio_intr_init( pin, GPIO_PIN_INTR_DISABLE );
+  hooked &= ~pin_bit(pin);
+  platform_gpio_register_intr_hook(hooked, irrecv_intr_handler);
+  gpio_reader[gpio] = NULL;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, reader->callback);
+  c_free(reader);
+  return 0;
+}
+
+// irrecv.stats( pin, reset ) => edges, frames, decoded, overruns, failures
+static int ICACHE_FLASH_ATTR irrecv_getstats( lua_State *L ){
+  const int pin = check_pin(L, 1);
+  ir_pin_reader_pointer reader = gpio_reader[GPIO_ID_PIN(pin_num[pin])];
+  irrecv_stats s;
+
+  luaL_argcheck(L, reader, 1, "pin not bound");
+  ETS_GPIO_INTR_DISABLE();
+  s = reader->stats;
+  if( lua_toboolean(L, 2) ){
+    c_memset(&reader->stats, 0, sizeof(reader->stats));
+    reader->seen_overruns = 0;
   }
+  ETS_GPIO_INTR_ENABLE();
+
+  lua_pushinteger(L, s.edges);
+  lua_pushinteger(L, s.frames);
+  lua_pushinteger(L, s.decoded);
+  lua_pushinteger(L, s.overruns);
+  lua_pushinteger(L, s.failures);
+  return 5;
 }
 
 // Module function map
 static const LUA_REG_TYPE irrecv_map[] = {
   // for module function
   { LSTRKEY( "bind" ), LFUNCVAL( irrecv_bind ) },
+  { LSTRKEY( "unbind" ), LFUNCVAL( irrecv_unbind ) },
+  { LSTRKEY( "stats" ), LFUNCVAL( irrecv_getstats ) },
   // for module constant
   { LSTRKEY( "NEC" ), LNUMVAL( IRPROTO_NEC ) },
+  { LSTRKEY( "RC5" ), LNUMVAL( IRPROTO_RC5 ) },
+  { LSTRKEY( "RC6" ), LNUMVAL( IRPROTO_RC6 ) },
+  { LSTRKEY( "SONY" ), LNUMVAL( IRPROTO_SONY ) },
+  { LSTRKEY( "SAMSUNG" ), LNUMVAL( IRPROTO_SAMSUNG ) },
+  { LSTRKEY( "ANY" ), LNUMVAL( IRRECV_ANY ) },
+  { LSTRKEY( "RAW" ), LNUMVAL( IRRECV_RAW ) },
   // ---------
   { LNILKEY, LNILVAL }
 };
 
 int luaopen_irrecv( lua_State *L ){
   // TODO: Make sure that the GPIO system is initialized
-  os_bzero( pin_reader, sizeof(ir_pin_reader_pointer) * GPIO_PIN_NUM );
-  callback_stub = task_get_id( irrecv_ondata );
+  os_bzero( gpio_reader, sizeof(ir_pin_reader_pointer) * GPIO_PIN_NUM );
+  irrecv_task_id = task_get_id( irrecv_task );
+  os_timer_setfn(&gap_timer, irrecv_gap_timeout, NULL);
   return 0;
 }
 
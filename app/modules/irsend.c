@@ -41,7 +41,7 @@ static int ICACHE_FLASH_ATTR irsend_write( lua_State *L )
   if( lua_type(L, 2) == LUA_TNUMBER ){
     mode = luaL_checkinteger(L, 2);
   }
-  luaL_argcheck(L, 0 < mode && mode < IRPROTO_MAX, 2, "invalid mode");
+  luaL_argcheck(L, 0 < mode && mode < IRPROTO_MAX && irproto_encode_map[mode], 2, "invalid mode");
 
   irsender s = irproto_encode_map[mode];
   int r = s(code);
@@ -50,6 +50,29 @@ static int ICACHE_FLASH_ATTR irsend_write( lua_State *L )
   return 1;
 }
 
+// irsend.raw( durations, hz=38000 )
+// durations is a table of mark and space lengths in usec, as irrecv.RAW gives
+static int ICACHE_FLASH_ATTR irsend_raw( lua_State *L )
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  uint32 hz = luaL_optinteger(L, 2, 38000);
+  int n = lua_objlen(L, 1), i;
+  luaL_argcheck(L, n > 0, 1, "empty");
+
+  uint16_t *d = c_malloc( n * sizeof(uint16_t) );
+  if( !d ) return luaL_error(L, "out of memory");
+  for( i = 0; i < n; ++i ){
+    lua_rawgeti(L, 1, i + 1);
+    d[i] = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  }
+  int r = ir_send_raw( hz, d, n );
+  c_free(d);
+  lua_pushinteger( L, r );
+
+  return 1;
+}
+
 // see app/driver/uart.c:73
 // If call the uart_config function directly, a pulse will be found. 
 // Because the bit UART_TXD_INV is not set when write the UART_CONF0 reg.
@@ -151,8 +174,10 @@ int luaopen_irsend( lua_State *L )
 static const LUA_REG_TYPE irsend_map[] = {
   // for module constants
   { LSTRKEY("NEC"), LNUMVAL(IRPROTO_NEC) },
+  { LSTRKEY("SAMSUNG"), LNUMVAL(IRPROTO_SAMSUNG) },
   // for module function
   { LSTRKEY("send"), LFUNCVAL(irsend_write) },
+  { LSTRKEY("raw"), LFUNCVAL(irsend_raw) },
   { LSTRKEY("setup"), LFUNCVAL(irsend_setup) }, 
   // --------
   {LNILKEY, LNILVAL}
@@ -5,6 +5,7 @@
 
 #include "c_string.h"
 #include "c_stdlib.h"
+#include "c_stdio.h"
 
 #include "c_types.h"
 #include "mem.h"
@@ -12,11 +13,282 @@
 #include "nodemcu_mdns.h"
 #include "user_interface.h"
 
+#define MDNS_TYPE_A       1
+#define MDNS_TYPE_PTR     12
+#define MDNS_TYPE_TXT     16
+#define MDNS_TYPE_SRV     33
+
+#define RESOLVE_TRIES     3
+#define BROWSE_TIME_MS    2000
+#define QUERY_INTERVAL_MS 1000
+
+typedef struct mdns_request {
+  struct mdns_request *next;
+  os_timer_t timer;
+  int cb_ref;
+  uint8_t browse;
+  uint8_t tries;
+  uint32_t left;              // ms until a browse is complete
+  char name[NODEMCU_MDNS_NAME_LEN];
+} mdns_request_t;
+
+static mdns_request_t *requests;
+
+static void mdns_answered(void);
+
+// Unlinks and frees a request, leaving the callback reference to the caller
+static void request_free(mdns_request_t *req)
+{
+  mdns_request_t **pp;
+
+  for (pp = &requests; *pp; pp = &(*pp)->next) {
+    if (*pp == req) {
+      *pp = req->next;
+      break;
+    }
+  }
+  os_timer_disarm(&req->timer);
+  c_free(req);
+}
+
+// Pushes the callback of a finished request, which is then freed
+static lua_State *request_finish(mdns_request_t *req)
+{
+  lua_State *L = lua_getstate();
+  int ref = req->cb_ref;
+
+  request_free(req);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  return L;
+}
+
+static void resolve_finish(mdns_request_t *req, const struct nodemcu_mdns_rr *rr)
+{
+  lua_State *L = request_finish(req);
+
+  if (rr) {
+    char ip[16];
+    c_sprintf(ip, "%d.%d.%d.%d", rr->data[0], rr->data[1], rr->data[2], rr->data[3]);
+    lua_pushstring(L, ip);
+  } else {
+    lua_pushnil(L);
+  }
+  lua_call(L, 1, 0);
+}
+
+static void push_txt(lua_State *L, const struct nodemcu_mdns_rr *rr)
+{
+  const uint8_t *p = rr->data, *end = rr->data + rr->len;
+
+  lua_newtable(L);
+  while (p < end && p + 1 + *p <= end) {
+    const char *s = (const char *) p + 1, *eq = (const char *) memchr(s, '=', *p);
+    if (eq) {
+      lua_pushlstring(L, s, eq - s);
+      lua_pushlstring(L, eq + 1, s + *p - eq - 1);
+      lua_rawset(L, -3);
+    } else if (*p) {
+      lua_pushlstring(L, s, *p);
+      lua_pushboolean(L, 1);
+      lua_rawset(L, -3);
+    }
+    p += 1 + *p;
+  }
+}
+
+static void browse_finish(mdns_request_t *req)
+{
+  const struct nodemcu_mdns_rr *ptr = NULL, *rr;
+  char service[NODEMCU_MDNS_NAME_LEN];
+  size_t slen = c_strlen(req->name);
+  int n = 0;
+
+  c_strcpy(service, req->name);
+  lua_State *L = request_finish(req);
+
+  lua_newtable(L);
+  while ((ptr = nodemcu_mdns_lookup(service, MDNS_TYPE_PTR, ptr)) != NULL) {
+    const char *instance = (const char *) ptr->data;
+    size_t ilen = c_strlen(instance);
+
+    lua_newtable(L);
+    // the instance name without the service type
+    if (ilen > slen + 1 && instance[ilen - slen - 1] == '.') {
+      lua_pushlstring(L, instance, ilen - slen - 1);
+    } else {
+      lua_pushstring(L, instance);
+    }
+    lua_setfield(L, -2, "name");
+    if ((rr = nodemcu_mdns_lookup(instance, MDNS_TYPE_SRV, NULL)) != NULL) {
+      const char *host = (const char *) rr->data;
+      lua_pushstring(L, host);
+      lua_setfield(L, -2, "host");
+      lua_pushinteger(L, rr->port);
+      lua_setfield(L, -2, "port");
+      if ((rr = nodemcu_mdns_lookup(host, MDNS_TYPE_A, NULL)) != NULL) {
+        char ip[16];
+        c_sprintf(ip, "%d.%d.%d.%d", rr->data[0], rr->data[1], rr->data[2], rr->data[3]);
+        lua_pushstring(L, ip);
+        lua_setfield(L, -2, "ip");
+      }
+    }
+    if ((rr = nodemcu_mdns_lookup(instance, MDNS_TYPE_TXT, NULL)) != NULL) {
+      push_txt(L, rr);
+      lua_setfield(L, -2, "txt");
+    }
+    lua_rawseti(L, -2, ++n);
+  }
+  lua_call(L, 1, 0);
+}
+
+static void request_tick(void *arg)
+{
+  mdns_request_t *req = (mdns_request_t *) arg;
+  const struct nodemcu_mdns_rr *ptr = NULL, *rr;
+  uint32_t step;
+
+  if (!req->browse) {
+    if ((rr = nodemcu_mdns_lookup(req->name, MDNS_TYPE_A, NULL)) != NULL) {
+      resolve_finish(req, rr);
+    } else if (req->tries++ < RESOLVE_TRIES && nodemcu_mdns_query(req->name, MDNS_TYPE_A, mdns_answered)) {
+      os_timer_arm(&req->timer, QUERY_INTERVAL_MS, 0);
+    } else {
+      resolve_finish(req, NULL);
+    }
+    return;
+  }
+
+  if (!req->left) {
+    browse_finish(req);
+    return;
+  }
+  nodemcu_mdns_query(req->name, MDNS_TYPE_PTR, mdns_answered);
+  // ask for whatever the responders left out of their answers
+  while ((ptr = nodemcu_mdns_lookup(req->name, MDNS_TYPE_PTR, ptr)) != NULL) {
+    const char *instance = (const char *) ptr->data;
+    if ((rr = nodemcu_mdns_lookup(instance, MDNS_TYPE_SRV, NULL)) == NULL) {
+      nodemcu_mdns_query(instance, MDNS_TYPE_SRV, mdns_answered);
+    } else if (!nodemcu_mdns_lookup((const char *) rr->data, MDNS_TYPE_A, NULL)) {
+      nodemcu_mdns_query((const char *) rr->data, MDNS_TYPE_A, mdns_answered);
+    }
+  }
+  step = req->left < QUERY_INTERVAL_MS ? req->left : QUERY_INTERVAL_MS;
+  req->left -= step;
+  os_timer_arm(&req->timer, step, 0);
+}
+
+// New answers are in the cache, which may complete a resolve
+static void mdns_answered(void)
+{
+  mdns_request_t *req;
+  const struct nodemcu_mdns_rr *rr;
+
+again:
+  for (req = requests; req; req = req->next) {
+    if (!req->browse && (rr = nodemcu_mdns_lookup(req->name, MDNS_TYPE_A, NULL)) != NULL) {
+      // the callback may start or cancel requests
+      resolve_finish(req, rr);
+      goto again;
+    }
+  }
+}
+
+static int check_network(lua_State *L)
+{
+  struct ip_info ipconfig;
+
+  uint8_t mode = wifi_get_opmode();
+
+  if (!wifi_get_ip_info((mode == 2) ? SOFTAP_IF : STATION_IF, &ipconfig) || !ipconfig.ip.addr) {
+    return luaL_error(L, "No network connection");
+  }
+  return 0;
+}
+
+static mdns_request_t *request_new(lua_State *L, int cb_idx)
+{
+  mdns_request_t *req;
+
+  if (lua_type(L, cb_idx) != LUA_TFUNCTION && lua_type(L, cb_idx) != LUA_TLIGHTFUNCTION)
+    luaL_typerror(L, cb_idx, "function");
+  check_network(L);
+
+  req = (mdns_request_t *) c_zalloc(sizeof(mdns_request_t));
+  if (!req)
+    luaL_error(L, "out of memory");
+  lua_pushvalue(L, cb_idx);
+  req->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  os_timer_setfn(&req->timer, (os_timer_func_t *) request_tick, req);
+  req->next = requests;
+  requests = req;
+  return req;
+}
+
+//
+// mdns.resolve(hostname, function(ip) end)
+//
+static int mdns_resolve(lua_State *L)
+{
+  size_t len;
+  const char *name = luaL_checklstring(L, 1, &len);
+  int local = c_strchr(name, '.') == NULL;
+
+  luaL_argcheck(L, len && len + (local ? 6 : 0) < NODEMCU_MDNS_NAME_LEN, 1, "bad name");
+  mdns_request_t *req = request_new(L, 2);
+
+  c_strcpy(req->name, name);
+  if (local)
+    c_strcat(req->name, ".local");
+
+  if (nodemcu_mdns_lookup(req->name, MDNS_TYPE_A, NULL)) {
+    // answered from the cache, but never before mdns.resolve returns
+    os_timer_arm(&req->timer, 1, 0);
+    return 0;
+  }
+  req->tries = 1;
+  if (!nodemcu_mdns_query(req->name, MDNS_TYPE_A, mdns_answered)) {
+    luaL_unref(L, LUA_REGISTRYINDEX, req->cb_ref);
+    request_free(req);
+    return luaL_error(L, "Unable to send query");
+  }
+  os_timer_arm(&req->timer, QUERY_INTERVAL_MS, 0);
+  return 0;
+}
+
+//
+// mdns.browse(service, function(instances) end [, time])
+//
+static int mdns_browse(lua_State *L)
+{
+  size_t len;
+  const char *service = luaL_checklstring(L, 1, &len);
+  int full = c_strchr(service, '.') != NULL;
+  uint32_t ms = luaL_optinteger(L, 3, BROWSE_TIME_MS);
+
+  luaL_argcheck(L, len && len + (full ? 0 : 13) < NODEMCU_MDNS_NAME_LEN, 1, "bad service");
+  luaL_argcheck(L, ms >= QUERY_INTERVAL_MS && ms <= 60000, 3, "out of range");
+  mdns_request_t *req = request_new(L, 2);
+
+  if (full)
+    c_strcpy(req->name, service);
+  else
+    c_sprintf(req->name, "_%s._tcp.local", service);
+  req->browse = 1;
+  req->left = ms;
+  request_tick(req);
+  return 0;
+}
+
 //
 // mdns.close()
 // 
 static int mdns_close(lua_State *L)
 {
+  while (requests) {
+    luaL_unref(L, LUA_REGISTRYINDEX, requests->cb_ref);
+    request_free(requests);
+  }
   nodemcu_mdns_close();
   return 0;
 }
@@ -62,25 +334,12 @@ static int mdns_register(lua_State *L)
     }
   }
 
+  check_network(L);
 
-  struct ip_info ipconfig;
-
-  uint8_t mode = wifi_get_opmode();
-
-  if (!wifi_get_ip_info((mode == 2) ? SOFTAP_IF : STATION_IF, &ipconfig) || !ipconfig.ip.addr) {
-    return luaL_error(L, "No network connection");
-  }
-
-  // Close up the old session (if any). This cannot fail
-  // so no chance of losing the memory in 'result'
-  
-  mdns_close(L);
-
-  // Save the result as it appears that nodemcu_mdns_init needs
-  // to have the data valid while it is running.
+  // This replaces the old registration (if any), but leaves
+  // pending resolve and browse requests alone.
 
   if (!nodemcu_mdns_init(&info)) {
-    mdns_close(L);
     return luaL_error(L, "Unable to start mDns daemon");
   }
 
@@ -90,6 +349,8 @@ static int mdns_register(lua_State *L)
 // Module function map
 static const LUA_REG_TYPE mdns_map[] = {
   { LSTRKEY("register"),  LFUNCVAL(mdns_register)  },
+  { LSTRKEY("resolve"),   LFUNCVAL(mdns_resolve)   },
+  { LSTRKEY("browse"),    LFUNCVAL(mdns_browse)    },
   { LSTRKEY("close"),     LFUNCVAL(mdns_close)     },
   { LNILKEY, LNILVAL }
 };
@@ -16,6 +16,7 @@
 #include "msg_queue.h"
 
 #include "user_interface.h"
+#include "callback.h"
 
 #define MQTT_BUF_SIZE 1024
 #define MQTT_DEFAULT_KEEPALIVE 60
@@ -25,6 +26,8 @@
 #define MQTT_SEND_TIMEOUT			5
 #define MQTT_CONNECT_TIMEOUT  5
 
+static cb_source_t cb_mqtt = CB_SOURCE("mqtt");
+
 typedef enum {
   MQTT_INIT,
   MQTT_CONNECT_SENT,
@@ -136,7 +139,7 @@ static void mqtt_socket_disconnected(void *arg)    // tcp only
   }
 
   if(call_back){
-    lua_call(L, 1, 0);
+    cb_call(L, &cb_mqtt, 1, 0);
   }
 
   NODE_DBG("leave mqtt_socket_disconnected.\n");
@@ -206,9 +209,9 @@ static void deliver_publish(lmqtt_userdata * mud, uint8_t* message, int length)
   }
   if(event_data.data && (event_data.data_length > 0)){
     lua_pushlstring(L, event_data.data, event_data.data_length);
-    lua_call(L, 3, 0);
+    cb_call(L, &cb_mqtt, 3, 0);
   } else {
-    lua_call(L, 2, 0);
+    cb_call(L, &cb_mqtt, 2, 0);
   }
   NODE_DBG("leave deliver_publish.\n");
 }
@@ -226,7 +229,7 @@ static void mqtt_connack_fail(lmqtt_userdata * mud, int reason_code)
   lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_connect_fail_ref);
   lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);  // pass the userdata(client) to callback func in lua
   lua_pushinteger(L, reason_code);
-  lua_call(L, 2, 0);
+  cb_call(L, &cb_mqtt, 2, 0);
 }
 
 static sint8 mqtt_send_if_possible(struct espconn *pesp_conn)
@@ -349,7 +352,7 @@ READPACKET:
           break;
         lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_connect_ref);
         lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);  // pass the userdata(client) to callback func in lua
-        lua_call(L, 1, 0);
+        cb_call(L, &cb_mqtt, 1, 0);
         break;
       }
       break;
@@ -380,7 +383,7 @@ READPACKET:
               break;
             lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_suback_ref);
             lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);
-            lua_call(L, 1, 0);
+            cb_call(L, &cb_mqtt, 1, 0);
           }
           break;
         case MQTT_MSG_TYPE_UNSUBACK:
@@ -394,7 +397,7 @@ READPACKET:
               break;
             lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_unsuback_ref);
             lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);
-            lua_call(L, 1, 0);
+            cb_call(L, &cb_mqtt, 1, 0);
           }
           break;
         case MQTT_MSG_TYPE_PUBLISH:
@@ -423,7 +426,7 @@ READPACKET:
               break;
             lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_puback_ref);
             lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);  // pass the userdata to callback func in lua
-            lua_call(L, 1, 0);
+            cb_call(L, &cb_mqtt, 1, 0);
           }
 
           break;
@@ -457,7 +460,7 @@ READPACKET:
               break;
             lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_puback_ref);
             lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);  // pass the userdata to callback func in lua
-            lua_call(L, 1, 0);
+            cb_call(L, &cb_mqtt, 1, 0);
           }
           break;
         case MQTT_MSG_TYPE_PINGREQ:
@@ -528,7 +531,7 @@ static void mqtt_socket_sent(void *arg)
       lua_State *L = lua_getstate();
       lua_rawgeti(L, LUA_REGISTRYINDEX, mud->cb_puback_ref);
       lua_rawgeti(L, LUA_REGISTRYINDEX, mud->self_ref);  // pass the userdata to callback func in lua
-      lua_call(L, 1, 0);
+      cb_call(L, &cb_mqtt, 1, 0);
     }
   } else if(node && node->msg_type == MQTT_MSG_TYPE_PUBACK) {
     msg_destroy(msg_dequeue(&(mud->mqtt_state.pending_msg_q)));
@@ -17,6 +17,8 @@
 #include "lwip/igmp.h"
 #include "lwip/tcp.h"
 #include "lwip/udp.h"
+#include "lwip/memp.h"
+#include "callback.h"
 
 #if defined(CLIENT_SSL_ENABLE) && defined(LUA_USE_MODULES_NET) && defined(LUA_USE_MODULES_TLS)
 #define TLS_MODULE_PRESENT
@@ -27,6 +29,7 @@ typedef enum net_type {
   TYPE_TCP_CLIENT,
   TYPE_UDP_SOCKET
 } net_type;
+static cb_source_t cb_net = CB_SOURCE("net");
 
 typedef const char net_table_name[14];
 
@@ -140,7 +143,7 @@ static void net_err_cb(void *arg, err_t err) {
     lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
     lua_pushinteger(L, err);
-    lua_call(L, 2, 0);
+    cb_call(L, &cb_net, 2, 0);
   }
   if (ud->client.wait_dns == 0) {
     lua_gc(L, LUA_GCSTOP, 0);
@@ -161,7 +164,7 @@ static err_t net_connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err) {
   if (ud->self_ref != LUA_NOREF && ud->client.cb_connect_ref != LUA_NOREF) {
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_connect_ref);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
-    lua_call(L, 1, 0);
+    cb_call(L, &cb_net, 1, 0);
   }
   return ERR_OK;
 }
@@ -184,7 +187,7 @@ static void net_dns_cb(const char *name, ip_addr_t *ipaddr, void *arg) {
     } else {
       lua_pushnil(L);
     }
-    lua_call(L, 2, 0);
+    cb_call(L, &cb_net, 2, 0);
   }
   ud->client.wait_dns --;
   if (ud->pcb && ud->type == TYPE_TCP_CLIENT && ud->tcp_pcb->state == CLOSED) {
@@ -222,7 +225,7 @@ static void net_recv_cb(lnet_userdata *ud, struct pbuf *p, ip_addr_t *addr, u16_
       lua_pushinteger(L, port);
       lua_pushstring(L, iptmp);
     }
-    lua_call(L, num_args, 0);
+    cb_call(L, &cb_net, num_args, 0);
     pp = pp->next;
   }
   pbuf_free(p);
@@ -257,7 +260,7 @@ static err_t net_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len) {
   lua_State *L = lua_getstate();
   lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
   lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
-  lua_call(L, 1, 0);
+  cb_call(L, &cb_net, 1, 0);
   return ERR_OK;
 }
 
@@ -282,7 +285,7 @@ static err_t net_accept_cb(void *arg, struct tcp_pcb *newpcb, err_t err) {
   nud->tcp_pcb->keep_cnt = 1;
   tcp_accepted(ud->tcp_pcb);
 
-  lua_call(L, 1, 0);
+  cb_call(L, &cb_net, 1, 0);
 
   return net_connected_cb(nud, nud->tcp_pcb, ERR_OK);
 }
@@ -585,7 +588,7 @@ int net_send( lua_State *L ) {
     if (ud->client.cb_sent_ref != LUA_NOREF) {
       lua_rawgeti(L, LUA_REGISTRYINDEX, ud->client.cb_sent_ref);
       lua_rawgeti(L, LUA_REGISTRYINDEX, ud->self_ref);
-      lua_call(L, 1, 0);
+      cb_call(L, &cb_net, 1, 0);
     }
   } else if (ud->type == TYPE_TCP_CLIENT) {
     err = tcp_write(ud->tcp_pcb, data, datalen, TCP_WRITE_FLAG_COPY);
@@ -867,6 +870,37 @@ static int net_multicastLeave( lua_State* L ) {
 	return net_multicastJoinLeave(L,0);
 }
 
+#if MEMP_PREALLOC
+// Lua: net.stats([reset])
+static int net_stats( lua_State *L ) {
+  struct memp_pool_stats st;
+  const char *name;
+  int reset = lua_toboolean(L, 1);
+  int i;
+
+  lua_newtable(L);
+  for (i = 0; i < MEMP_MAX; i++) {
+    if (!(name = memp_pool_stats(i, &st, reset)))
+      continue;
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, st.size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, st.num);
+    lua_setfield(L, -2, "num");
+    lua_pushinteger(L, st.used);
+    lua_setfield(L, -2, "used");
+    lua_pushinteger(L, st.max);
+    lua_setfield(L, -2, "max");
+    lua_pushinteger(L, st.fallback);
+    lua_setfield(L, -2, "fallback");
+    lua_pushinteger(L, st.failed);
+    lua_setfield(L, -2, "failed");
+    lua_setfield(L, -2, name);
+  }
+  return 1;
+}
+#endif
+
 #pragma mark - DNS
 
 static void net_dns_static_cb(const char *name, ip_addr_t *ipaddr, void *callback_arg) {
@@ -887,7 +921,7 @@ static void net_dns_static_cb(const char *name, ip_addr_t *ipaddr, void *callbac
   } else {
     lua_pushnil(L);
   }
-  lua_call(L, 2, 0);
+  cb_call(L, &cb_net, 2, 0);
 
   luaL_unref(L, LUA_REGISTRYINDEX, cb_ref);
 }
@@ -1023,6 +1057,9 @@ static const LUA_REG_TYPE net_map[] = {
   { LSTRKEY( "createUDPSocket" ),  LFUNCVAL( net_createUDPSocket ) },
   { LSTRKEY( "multicastJoin"),     LFUNCVAL( net_multicastJoin ) },
   { LSTRKEY( "multicastLeave"),    LFUNCVAL( net_multicastLeave ) },
+#if MEMP_PREALLOC
+  { LSTRKEY( "stats" ),            LFUNCVAL( net_stats ) },
+#endif
   { LSTRKEY( "dns" ),              LROVAL( net_dns_map ) },
 #ifdef TLS_MODULE_PRESENT
   { LSTRKEY( "cert" ),             LROVAL( tls_cert_map ) },
@@ -14,6 +14,9 @@
 #include "lopcodes.h"
 #include "lstring.h"
 #include "lundump.h"
+#ifdef LUA_FLASH_STORE
+#include "lflash.h"
+#endif
 
 #include "platform.h"
 #include "lrodefs.h"
@@ -27,6 +30,8 @@
 #include "user_version.h"
 #include "rom.h"
 #include "task/task.h"
+#include "heap_profile.h"
+#include "callback.h"
 
 #define CPU80MHZ 80
 #define CPU160MHZ 160
@@ -163,6 +168,121 @@ static int node_heap( lua_State* L )
   return 1;
 }
 
+#ifdef HEAP_PROFILE
+// Lua: sites, frag = heapstats([reset])
+static int node_heapstats( lua_State* L )
+{
+  heap_profile_site_t site;
+  heap_profile_frag_t frag;
+  unsigned i;
+  int n = 0;
+  int reset = lua_toboolean(L, 1);
+
+  // scan before building any tables, so that they don't fill the holes
+  heap_profile_fragmentation(&frag);
+
+  lua_newtable(L);
+  for (i = 0; i <= HEAP_PROFILE_SITES; i++) {
+    if (!heap_profile_get_site(i, &site))
+      continue;
+    lua_createtable(L, 0, 6);
+    if (site.line)
+      lua_pushfstring(L, "%s:%d", site.name, site.line);
+    else
+      lua_pushstring(L, site.name);
+    lua_setfield(L, -2, "site");
+    lua_pushboolean(L, site.lua);
+    lua_setfield(L, -2, "lua");
+    lua_pushinteger(L, site.live);
+    lua_setfield(L, -2, "live");
+    lua_pushinteger(L, site.peak);
+    lua_setfield(L, -2, "peak");
+    lua_pushinteger(L, site.blocks);
+    lua_setfield(L, -2, "blocks");
+    lua_pushinteger(L, site.allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_rawseti(L, -2, ++n);
+  }
+
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, frag.free);
+  lua_setfield(L, -2, "free");
+  lua_pushinteger(L, frag.largest);
+  lua_setfield(L, -2, "largest");
+  lua_pushinteger(L, frag.blocks);
+  lua_setfield(L, -2, "blocks");
+  lua_pushinteger(L, frag.tracked);
+  lua_setfield(L, -2, "tracked");
+  lua_pushinteger(L, frag.untracked);
+  lua_setfield(L, -2, "untracked");
+  lua_createtable(L, 0, HEAP_PROFILE_HIST);
+  for (i = 0; i < HEAP_PROFILE_HIST; i++) {
+    lua_pushinteger(L, frag.hist[i]);
+    lua_rawseti(L, -2, HEAP_PROFILE_MINBLOCK << i);
+  }
+  lua_setfield(L, -2, "hist");
+
+  if (reset)
+    heap_profile_reset();
+  return 2;
+}
+#endif
+
+static void push_cbhist( lua_State* L, const uint16_t *hist )
+{
+  unsigned i;
+
+  // keyed by the lower limit of each bucket in us
+  lua_createtable(L, 0, CB_HIST_BUCKETS);
+  for (i = 0; i < CB_HIST_BUCKETS; i++) {
+    lua_pushinteger(L, hist[i]);
+    lua_rawseti(L, -2, i ? CB_HIST_BASE << (i - 1) : 0);
+  }
+}
+
+// Lua: stats = cbstats([reset])
+static int node_cbstats( lua_State* L )
+{
+  cb_source_t *src;
+  int reset = lua_toboolean(L, 1);
+
+  lua_newtable(L);
+  for (src = cb_sources(); src; src = src->next) {
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, src->calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushinteger(L, src->overruns);
+    lua_setfield(L, -2, "overruns");
+    lua_pushinteger(L, src->max_run);
+    lua_setfield(L, -2, "maxrun");
+    lua_pushinteger(L, src->max_late);
+    lua_setfield(L, -2, "maxlate");
+    push_cbhist(L, src->run);
+    lua_setfield(L, -2, "run");
+    push_cbhist(L, src->late);
+    lua_setfield(L, -2, "late");
+    lua_setfield(L, -2, src->name);
+  }
+
+  if (reset)
+    cb_reset();
+  return 1;
+}
+
+// Lua: old = cbbudget([us])
+static int node_cbbudget( lua_State* L )
+{
+  uint32_t old = cb_get_budget();
+
+  if (!lua_isnoneornil(L, 1)) {
+    lua_Integer us = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, us >= 0, 1, "must be >= 0");
+    cb_set_budget(us);
+  }
+  lua_pushinteger(L, old);
+  return 1;
+}
+
 extern lua_Load gLoad;
 extern bool user_process_input(bool force);
 // Lua: input("string")
@@ -588,6 +708,11 @@ static const LUA_REG_TYPE node_map[] =
   { LSTRKEY( "flashid" ), LFUNCVAL( node_flashid ) },
   { LSTRKEY( "flashsize" ), LFUNCVAL( node_flashsize) },
   { LSTRKEY( "heap" ), LFUNCVAL( node_heap ) },
+#ifdef HEAP_PROFILE
+  { LSTRKEY( "heapstats" ), LFUNCVAL( node_heapstats ) },
+#endif
+  { LSTRKEY( "cbstats" ), LFUNCVAL( node_cbstats ) },
+  { LSTRKEY( "cbbudget" ), LFUNCVAL( node_cbbudget ) },
   { LSTRKEY( "input" ), LFUNCVAL( node_input ) },
   { LSTRKEY( "output" ), LFUNCVAL( node_output ) },
 // Moved to adc module, use adc.readvdd33()
@@ -607,6 +732,10 @@ static const LUA_REG_TYPE node_map[] =
 #ifdef DEVELOPMENT_TOOLS
   { LSTRKEY( "osprint" ), LFUNCVAL( node_osprint ) },
 #endif
+#ifdef LUA_FLASH_STORE
+  { LSTRKEY( "flashreload" ), LFUNCVAL( luaN_flashreload ) },
+  { LSTRKEY( "flashindex" ), LFUNCVAL( luaN_flashindex ) },
+#endif
 
 // Combined to dsleep(us, option)
 // { LSTRKEY( "dsleepsetoption" ), LFUNCVAL( node_deepsleep_setoption) },
@@ -5,6 +5,14 @@
 #include "platform.h"
 #include "c_types.h"
 
+static int fade_ref[NUM_PWM];
+
+static void fade_unref( lua_State *L, unsigned id )
+{
+  luaL_unref( L, LUA_REGISTRYINDEX, fade_ref[id] );
+  fade_ref[id] = LUA_NOREF;
+}
+
 // Lua: realfrequency = setup( id, frequency, duty )
 static int lpwm_setup( lua_State* L )
 {
@@ -38,6 +46,7 @@ static int lpwm_close( lua_State* L )
   id = luaL_checkinteger( L, 1 );
   MOD_CHECK_ID( pwm, id );
   platform_pwm_close( id );
+  fade_unref( L, id );
   return 0;  
 }
 
@@ -61,6 +70,7 @@ static int lpwm_stop( lua_State* L )
   id = luaL_checkinteger( L, 1 );
   MOD_CHECK_ID( pwm, id );
   platform_pwm_stop( id );
+  fade_unref( L, id );    // stopping cancels a fade
   return 0;  
 }
 
@@ -105,6 +115,7 @@ static int lpwm_setduty( lua_State* L )
   if ( duty > NORMAL_PWM_DEPTH )
     return luaL_error( L, "wrong arg range" );
   duty = platform_pwm_set_duty( id, (u32)duty );
+  fade_unref( L, id );    // setting the duty cancels a fade
   lua_pushinteger( L, duty );
   return 1;
 }
@@ -122,8 +133,77 @@ static int lpwm_getduty( lua_State* L )
   return 1;
 }
 
+// Lua: realphase = setphase( id, phase )
+static int lpwm_setphase( lua_State* L )
+{
+  unsigned id;
+  s32 phase;  // signed to error-check for negative values
+
+  id = luaL_checkinteger( L, 1 );
+  MOD_CHECK_ID( pwm, id );
+  phase = luaL_checkinteger( L, 2 );
+  if ( phase < 0 || phase > NORMAL_PWM_DEPTH )
+    return luaL_error( L, "wrong arg range" );
+  phase = platform_pwm_set_phase( id, (u32)phase );
+  lua_pushinteger( L, phase );
+  return 1;
+}
+
+static void lpwm_fade_done( uint8 id )
+{
+  lua_State *L = lua_getstate();
+
+  if ( id >= NUM_PWM || fade_ref[id] == LUA_NOREF )
+    return;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, fade_ref[id] );
+  fade_unref( L, id );
+  lua_pushinteger( L, id );
+  lua_call( L, 1, 0 );
+}
+
+// Lua: fade( id, duty, ms[, curve][, callback] )
+static int lpwm_fade( lua_State* L )
+{
+  unsigned id;
+  s32 duty, ms;  // signed to error-check for negative values
+  int curve = PWM_FADE_LINEAR;
+  int cb = 4;
+
+  id = luaL_checkinteger( L, 1 );
+  MOD_CHECK_ID( pwm, id );
+  duty = luaL_checkinteger( L, 2 );
+  if ( duty < 0 || duty > NORMAL_PWM_DEPTH )
+    return luaL_error( L, "wrong arg range" );
+  ms = luaL_checkinteger( L, 3 );
+  // the driver counts in microseconds
+  if ( ms < 0 || ms > 4294967 )
+    return luaL_error( L, "wrong arg range" );
+  if ( lua_isnumber( L, 4 ) ) {
+    curve = lua_tointeger( L, 4 );
+    if ( curve < PWM_FADE_LINEAR || curve > PWM_FADE_EASE_IN_OUT )
+      return luaL_error( L, "wrong arg range" );
+    cb = 5;
+  }
+
+  fade_unref( L, id );
+  if ( lua_type( L, cb ) == LUA_TFUNCTION || lua_type( L, cb ) == LUA_TLIGHTFUNCTION ) {
+    lua_pushvalue( L, cb );
+    fade_ref[id] = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  if ( !platform_pwm_fade( id, (u32)duty, (u32)ms, curve ) ) {
+    fade_unref( L, id );
+    return luaL_error( L, "Unable to start PWM output" );
+  }
+  return 0;
+}
+
 int lpwm_open( lua_State *L ) {
+  unsigned i;
+
+  for ( i = 0; i < NUM_PWM; i++ )
+    fade_ref[i] = LUA_NOREF;
   platform_pwm_init();
+  pwm_fade_set_cb( lpwm_fade_done );
   return 0;
 }
 
@@ -137,6 +217,12 @@ static const LUA_REG_TYPE pwm_map[] = {
   { LSTRKEY( "getclock" ), LFUNCVAL( lpwm_getclock ) },
   { LSTRKEY( "setduty" ),  LFUNCVAL( lpwm_setduty ) },
   { LSTRKEY( "getduty" ),  LFUNCVAL( lpwm_getduty ) },
+  { LSTRKEY( "setphase" ), LFUNCVAL( lpwm_setphase ) },
+  { LSTRKEY( "fade" ),     LFUNCVAL( lpwm_fade ) },
+  { LSTRKEY( "LINEAR" ),      LNUMVAL( PWM_FADE_LINEAR ) },
+  { LSTRKEY( "EASE_IN" ),     LNUMVAL( PWM_FADE_EASE_IN ) },
+  { LSTRKEY( "EASE_OUT" ),    LNUMVAL( PWM_FADE_EASE_OUT ) },
+  { LSTRKEY( "EASE_IN_OUT" ), LNUMVAL( PWM_FADE_EASE_IN_OUT ) },
   { LNILKEY, LNILVAL }
 };
 
@@ -3,15 +3,162 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "user_modules.h"
+#include "platform.h"
 #include "rtc/rtctime.h"
 #define RTCTIME_SLEEP_ALIGNED rtctime_deep_sleep_until_aligned_us
+#ifdef RTCFIFO_FLASH_LOG
+static uint32_t rtcfifo_spill (void);
+#define RTC_FIFO_SPILL rtcfifo_spill
+#endif
 #include "rtc/rtcfifo.h"
 
-// rtcfifo.prepare ([{sensor_count=n, interval_us=m, storage_begin=x, storage_end=y}])
+#ifdef RTCFIFO_FLASH_LOG
+/*
+ * Flash log
+ *
+ * When the RTC FIFO fills up, its whole content is moved to a circular log
+ * of fixed size records in a region reserved in the firmware image. The log
+ * is written sequentially, and a sector is erased only as the log enters it,
+ * dropping the oldest samples once the log has wrapped around, so that all
+ * sectors see the same number of erase cycles. Its head, tail and count are
+ * kept in RTC memory alongside the FIFO, and like the FIFO it is lost when
+ * the power is.
+ */
+#if (RTCFIFO_FLASH_LOG % INTERNAL_FLASH_SECTOR_SIZE) != 0 || RTCFIFO_FLASH_LOG < 2 * INTERNAL_FLASH_SECTOR_SIZE
+#error "RTCFIFO_FLASH_LOG must be a multiple of the flash sector size, and at least two sectors"
+#endif
+
+/* Reserves the log in the firmware image; accessed through the linker symbol only */
+const char rtcfifo_flash_log_space[RTCFIFO_FLASH_LOG]
+  __attribute__((used, aligned(INTERNAL_FLASH_SECTOR_SIZE), section(".rtcfifo.reserved"))) = { 0 };
+extern const char rtcfifo_flash_log_reserved[];
+
+#define LOG_RECORD_SIZE 12
+#define LOG_PER_SECTOR  (INTERNAL_FLASH_SECTOR_SIZE / LOG_RECORD_SIZE)
+#define LOG_CAPACITY    (RTCFIFO_FLASH_LOG / INTERNAL_FLASH_SECTOR_SIZE * LOG_PER_SECTOR)
+
+static uint32_t log_addr (uint32_t index)
+{
+  return platform_flash_mapped2phys ((uint32_t)rtcfifo_flash_log_reserved) +
+         index / LOG_PER_SECTOR * INTERNAL_FLASH_SECTOR_SIZE +
+         index % LOG_PER_SECTOR * LOG_RECORD_SIZE;
+}
+
+static uint32_t log_count (void)
+{
+  return rtc_mem_read (RTC_SPILLCOUNT_POS);
+}
+
+static int log_read (uint32_t offs, sample_t *s)
+{
+  uint32_t rec[LOG_RECORD_SIZE / 4];
+  uint32_t index = (rtc_mem_read (RTC_SPILLHEAD_POS) + offs) % LOG_CAPACITY;
+
+  if (platform_s_flash_read (rec, log_addr (index), LOG_RECORD_SIZE) != LOG_RECORD_SIZE)
+    return 0;
+  s->timestamp = rec[0];
+  s->value = rtc_fifo_sign_extend (rec[1] & RTC_FIFO_VALUE_MASK);
+  s->decimals = rec[1] >> 29;
+  s->tag = rec[2];
+  return 1;
+}
+
+static void log_drop (uint32_t num)
+{
+  uint32_t count = log_count ();
+
+  if (num > count)
+    num = count;
+  rtc_mem_write (RTC_SPILLHEAD_POS, (rtc_mem_read (RTC_SPILLHEAD_POS) + num) % LOG_CAPACITY);
+  rtc_mem_write (RTC_SPILLCOUNT_POS, count - num);
+}
+
+// Moves the RTC FIFO to the end of the log, returns the number of samples moved
+static uint32_t rtcfifo_spill (void)
+{
+  uint32_t head = rtc_mem_read (RTC_SPILLHEAD_POS);
+  uint32_t tail = rtc_mem_read (RTC_SPILLTAIL_POS);
+  uint32_t count = log_count ();
+  uint32_t rec[LOG_RECORD_SIZE / 4];
+  uint32_t moved = 0;
+  sample_t s;
+
+  while (rtc_fifo_peek_sample (&s, 0))
+  {
+    if (tail % LOG_PER_SECTOR == 0)
+    {
+      if (count && head / LOG_PER_SECTOR == tail / LOG_PER_SECTOR)
+      { // wrapped around, drop the oldest sector
+        count -= LOG_PER_SECTOR - head % LOG_PER_SECTOR;
+        head = (tail + LOG_PER_SECTOR) % LOG_CAPACITY;
+      }
+      if (platform_flash_erase_sector (log_addr (tail) / INTERNAL_FLASH_SECTOR_SIZE) != PLATFORM_OK)
+        break;
+    }
+    rec[0] = s.timestamp;
+    rec[1] = (s.decimals << 29) | (s.value & RTC_FIFO_VALUE_MASK);
+    rec[2] = s.tag;
+    if (platform_s_flash_write (rec, log_addr (tail), LOG_RECORD_SIZE) != LOG_RECORD_SIZE)
+      break;
+    rtc_fifo_pop_sample (&s);
+    tail = (tail + 1) % LOG_CAPACITY;
+    count++;
+    moved++;
+  }
+
+  rtc_mem_write (RTC_SPILLHEAD_POS, head);
+  rtc_mem_write (RTC_SPILLTAIL_POS, tail);
+  rtc_mem_write (RTC_SPILLCOUNT_POS, count);
+  return moved;
+}
+#else
+static uint32_t log_count (void)
+{
+  return 0;
+}
+#endif
+
+// The log holds the older samples, so it is read first
+static int fifo_pop (sample_t *s)
+{
+#ifdef RTCFIFO_FLASH_LOG
+  if (log_count ())
+  {
+    int ok = log_read (0, s);
+    log_drop (1);
+    if (ok)
+      return 1;
+  }
+#endif
+  return rtc_fifo_pop_sample (s);
+}
+
+static int fifo_peek (sample_t *s, uint32_t offs)
+{
+  uint32_t in_log = log_count ();
+#ifdef RTCFIFO_FLASH_LOG
+  if (offs < in_log)
+    return log_read (offs, s);
+#endif
+  return rtc_fifo_peek_sample (s, offs - in_log);
+}
+
+static void fifo_drop (uint32_t num)
+{
+  uint32_t in_log = log_count ();
+#ifdef RTCFIFO_FLASH_LOG
+  log_drop (num);
+#endif
+  if (num > in_log)
+    rtc_fifo_drop_samples (num - in_log);
+}
+
+// rtcfifo.prepare ([{sensor_count=n, interval_us=m, storage_begin=x, storage_end=y, packed=b}])
 static int rtcfifo_prepare (lua_State *L)
 {
   uint32_t sensor_count = RTC_DEFAULT_TAGCOUNT;
   uint32_t interval_us = 0;
+  uint32_t format = RTC_FIFO_FORMAT_PACKED;
   int first = -1, last = -1;
 
   if (lua_istable (L, 1))
@@ -36,14 +183,22 @@ static int rtcfifo_prepare (lua_State *L)
     if (lua_isnumber (L, -1))
       last = lua_tonumber (L, -1);
     lua_pop (L, 1);
+
+    lua_getfield (L, 1, "packed");
+    if (!lua_isnil (L, -1) && !lua_toboolean (L, -1))
+      format = RTC_FIFO_FORMAT_FIXED;
+    lua_pop (L, 1);
   }
   else if (!lua_isnone (L, 1))
     return luaL_error (L, "expected table as arg #1");
 
-  rtc_fifo_prepare (0, interval_us, sensor_count);
+  if (sensor_count < 1 || sensor_count > RTC_FIFO_MAX_TAGS)
+    return luaL_error (L, "sensor_count must be 1-%d", RTC_FIFO_MAX_TAGS);
+
+  rtc_fifo_prepare_format (0, interval_us, sensor_count, format);
 
   if (first != -1 && last != -1)
-    rtc_fifo_put_loc (first, last, sensor_count);
+    rtc_fifo_init (first, last, sensor_count);
 
   return 0;
 }
@@ -89,7 +244,7 @@ static int rtcfifo_put (lua_State *L)
 static int extract_sample (lua_State *L, const sample_t *s)
 {
   lua_pushnumber (L, s->timestamp);
-  lua_pushnumber (L, s->value);
+  lua_pushnumber (L, (int32_t)s->value);
   lua_pushnumber (L, s->decimals);
   union {
     uint32_t u;
@@ -109,7 +264,7 @@ static int rtcfifo_pop (lua_State *L)
   check_fifo_magic (L);
 
   sample_t s;
-  if (!rtc_fifo_pop_sample (&s))
+  if (!fifo_pop (&s))
     return 0;
   else
     return extract_sample (L, &s);
@@ -125,7 +280,7 @@ static int rtcfifo_peek (lua_State *L)
   uint32_t offs = 0;
   if (lua_isnumber (L, 1))
     offs = lua_tonumber (L, 1);
-  if (!rtc_fifo_peek_sample (&s, offs))
+  if (!fifo_peek (&s, offs))
     return 0;
   else
     return extract_sample (L, &s);
@@ -137,18 +292,20 @@ static int rtcfifo_drop (lua_State *L)
 {
   check_fifo_magic (L);
 
-  rtc_fifo_drop_samples (luaL_checknumber (L, 1));
+  fifo_drop (luaL_checknumber (L, 1));
   return 0;
 }
 
 
-// num = rtcfifo.count ()
+// num, in_flash = rtcfifo.count ()
 static int rtcfifo_count (lua_State *L)
 {
   check_fifo_magic (L);
 
-  lua_pushnumber (L, rtc_fifo_get_count ());
-  return 1;
+  uint32_t in_log = log_count ();
+  lua_pushnumber (L, rtc_fifo_get_count () + in_log);
+  lua_pushnumber (L, in_log);
+  return 2;
 }
 
 
@@ -46,6 +46,8 @@
 
 #ifdef LUA_USE_MODULES_RTCTIME
 #include "rtc/rtctime.h"
+#include "rtc/rtcaccess.h"
+#include "lwip/igmp.h"
 #endif
 
 #define max(a,b) ((a < b) ? b : a)
@@ -144,10 +146,6 @@ static uint8_t using_offset;
 static uint8_t the_offset;
 static uint8_t pending_LI;
 static int32_t next_midnight;
-static uint64_t pll_increment;
-
-#define PLL_A   (1 << (32 - 11))
-#define PLL_B   (1 << (32 - 11 - 2))
 
 static void on_timeout(void *arg);
 static void on_long_timeout(void *arg);
@@ -220,6 +218,141 @@ static void get_zero_base_timeofday(struct rtc_timeval *tv) {
   tv->tv_sec = now / 1000000;
   tv->tv_usec = now % 1000000;
 }
+
+/*
+ * Clock discipline
+ *
+ * Each offset measured, from an NTP server or from a LAN time master, is
+ * removed by slewing the clock at up to 500ppm rather than stepping it, so
+ * the largest offset that is slewed takes about 400s. Whatever offset is
+ * found at the next measurement, less what a still running slew has yet to
+ * remove, is then down to the frequency error, and a part of it corrects
+ * the frequency (an FLL). The
+ * part grows with the interval, as offsets over short intervals are mostly
+ * jitter. The frequency and the time of the last update are kept in RTC
+ * memory, so the discipline carries on across deep sleep.
+ */
+#define RTC_SNTP_BASE          26
+#define RTC_SNTP_MAGIC         0x534e5450   // "SNTP"
+#define RTC_SNTP_MAGIC_POS     (RTC_SNTP_BASE+0)
+#define RTC_SNTP_FREQ_POS      (RTC_SNTP_BASE+1)
+#define RTC_SNTP_LASTUPDATE_POS (RTC_SNTP_BASE+2)
+
+#define CLK_STEP_US     200000    // larger offsets are stepped
+#define CLK_MAX_FREQ    2147484   // 500ppm, in 1/2^32
+#define CLK_MIN_SLEW_MS 1000
+#define CLK_FLL_MIN     4         // seconds between updates to measure the frequency
+#define CLK_FLL_SPAN    256       // intervals shorter than this get a smaller gain
+#define FRAC_TO_PPB(f)  ((int32_t) (((int64_t) (f) * 1000000000) >> 32))
+
+typedef struct {
+  int64_t offset_us;
+  int64_t jitter2;        // running mean of the squared change in offset, us^2
+  int64_t wander2;        // running mean of the squared change in frequency, ppb^2
+  int32_t freq_err;       // last frequency error measured, in 1/2^32
+  uint32_t interval;
+  uint32_t updates;
+  uint32_t steps;
+} clock_stats_t;
+
+static clock_stats_t clk;
+static os_timer_t slew_timer;
+static int32_t slew_rate;     // added to the frequency while slewing, 0 when done
+static int64_t slew_end_us;
+
+static int32_t clamp_freq(int64_t f) {
+  return f > CLK_MAX_FREQ ? CLK_MAX_FREQ : f < -CLK_MAX_FREQ ? -CLK_MAX_FREQ : f;
+}
+
+static int32_t clock_freq(void) {
+  return rtc_mem_read(RTC_SNTP_MAGIC_POS) == RTC_SNTP_MAGIC ? (int32_t) rtc_mem_read(RTC_SNTP_FREQ_POS) : 0;
+}
+
+static void on_slew_done(void *arg) {
+  (void)arg;
+  slew_rate = 0;
+  rtctime_adjust_rate(clock_freq());
+}
+
+static uint32_t isqrt64(uint64_t v) {
+  uint64_t r = 0, bit = 1ull << 62;
+
+  while (bit > v)
+    bit >>= 2;
+  while (bit) {
+    if (v >= r + bit) {
+      v -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return r;
+}
+
+// delta is the offset of the clock from the reference, in 1/2^32 s, and
+// tv the corrected time, should the clock have to be stepped
+static void clock_update(int64_t delta, const struct rtc_timeval *tv) {
+  struct rtc_timeval now;
+  int32_t freq = clock_freq();
+  uint32_t last = rtc_mem_read(RTC_SNTP_LASTUPDATE_POS);
+  int64_t offset_us = (delta >> 32) * 1000000 + (((delta & 0xffffffff) * 1000000) >> 32);
+  bool step = offset_us > CLK_STEP_US || offset_us < -CLK_STEP_US;
+  int64_t now_us, pending = 0;
+
+  rtctime_gettimeofday(&now);
+  os_timer_disarm(&slew_timer);
+  now_us = (int64_t) now.tv_sec * 1000000 + now.tv_usec;
+
+  // the part of the last offset that the slew has not yet removed is no
+  // frequency error
+  if (slew_rate && slew_end_us > now_us)
+    pending = (int64_t) slew_rate * (slew_end_us - now_us) / 1000000;
+  slew_rate = 0;
+
+  clk.interval = 0;
+  if (rtc_mem_read(RTC_SNTP_MAGIC_POS) == RTC_SNTP_MAGIC && now.tv_sec > last)
+    clk.interval = now.tv_sec - last;
+  if (clk.interval >= CLK_FLL_MIN) {
+    int64_t err = clamp_freq((delta - pending) / clk.interval);
+    uint32_t span = max(clk.interval, CLK_FLL_SPAN);
+    int32_t adj = err * clk.interval / (2 * span);
+    int32_t adj_ppb = FRAC_TO_PPB(adj);
+
+    freq = clamp_freq((int64_t) freq + adj);
+    clk.freq_err = err;
+    clk.wander2 += ((int64_t) adj_ppb * adj_ppb - clk.wander2) / 4;
+  }
+
+  if (step) {
+    rtctime_settimeofday(tv);
+    rtctime_adjust_rate(freq);
+    now = *tv;
+    clk.steps++;
+  } else {
+    // slew at no more than the largest frequency correction
+    int64_t mag = delta < 0 ? -delta : delta;
+    uint32_t ms = (mag * 1000) / CLK_MAX_FREQ;
+    if (ms < CLK_MIN_SLEW_MS)
+      ms = CLK_MIN_SLEW_MS;
+    slew_rate = delta * 1000 / ms;
+    slew_end_us = now_us + (int64_t) ms * 1000;
+    rtctime_adjust_rate(freq + slew_rate);
+    os_timer_arm(&slew_timer, ms, 0);
+
+    if (clk.updates) {
+      int64_t d = offset_us - clk.offset_us;
+      clk.jitter2 += (d * d - clk.jitter2) / 4;
+    }
+  }
+  clk.offset_us = offset_us;
+  clk.updates++;
+
+  rtc_mem_write(RTC_SNTP_FREQ_POS, freq);
+  rtc_mem_write(RTC_SNTP_LASTUPDATE_POS, now.tv_sec);
+  rtc_mem_write(RTC_SNTP_MAGIC_POS, RTC_SNTP_MAGIC);
+}
 #endif
 
 static void sntp_handle_result(lua_State *L) {
@@ -251,17 +384,7 @@ static void sntp_handle_result(lua_State *L) {
     tv.tv_usec -= 1000000;
     tv.tv_sec++;
   }
-  if (state->is_on_timeout && state->best.delta > SUS_TO_FRAC(-200000) && state->best.delta < SUS_TO_FRAC(200000)) {
-    // Adjust rate
-    // f is frequency -- f should be 1 << 32 for nominal
-    sntp_dbg("delta=%d, increment=%d, ", (int32_t) state->best.delta, (int32_t) pll_increment);
-    int64_t f = ((state->best.delta * PLL_A) >> 32) + pll_increment;
-    pll_increment += (state->best.delta * PLL_B) >> 32;
-    sntp_dbg("f=%d, increment=%d\n", (int32_t) f, (int32_t) pll_increment);
-    rtctime_adjust_rate((int32_t) f);
-  } else {
-    rtctime_settimeofday (&tv);
-  }
+  clock_update(state->best.delta, &tv);
 #endif
 
   if (have_cb)
@@ -834,6 +957,244 @@ error:
   return luaL_error (L, errmsg);
 }
 
+#ifdef LUA_USE_MODULES_RTCTIME
+// Lua: sntp.stats()
+static int sntp_stats(lua_State *L)
+{
+  lua_createtable(L, 0, 8);
+  lua_pushinteger(L, clk.offset_us);
+  lua_setfield(L, -2, "offset_us");
+  lua_pushinteger(L, isqrt64(clk.jitter2));
+  lua_setfield(L, -2, "jitter_us");
+  lua_pushinteger(L, FRAC_TO_PPB(clock_freq()));
+  lua_setfield(L, -2, "freq_ppb");
+  lua_pushinteger(L, FRAC_TO_PPB(clk.freq_err));
+  lua_setfield(L, -2, "freq_err_ppb");
+  lua_pushinteger(L, isqrt64(clk.wander2));
+  lua_setfield(L, -2, "wander_ppb");
+  lua_pushinteger(L, clk.interval);
+  lua_setfield(L, -2, "interval");
+  lua_pushinteger(L, clk.updates);
+  lua_setfield(L, -2, "updates");
+  lua_pushinteger(L, clk.steps);
+  lua_setfield(L, -2, "steps");
+  return 1;
+}
+
+/*
+ * LAN time distribution
+ *
+ * A master sends a SYNC to a multicast group at a regular interval, takes
+ * its time right after handing it to the network, and sends that time in a
+ * FOLLOW_UP. Listeners take the time a SYNC arrives, and the difference to
+ * the time in its FOLLOW_UP goes to the clock discipline like an NTP offset.
+ * The time in flight is not accounted for; on a local network it is a small
+ * fraction of a millisecond.
+ */
+#define LAN_PORT        12300
+#define LAN_GROUP       "239.255.12.30"
+#define LAN_MAGIC       0x4e4d5453    // "NMTS"
+#define LAN_SYNC        1
+#define LAN_FOLLOW_UP   2
+
+typedef struct {
+  uint32_t magic;
+  uint8_t type;
+  uint8_t leap;
+  uint16_t seq;
+  uint32_t sec;
+  uint32_t usec;
+} lan_msg_t;
+
+typedef struct {
+  struct udp_pcb *pcb;
+  ip_addr_t group;
+  uint16_t port;
+  uint16_t seq;
+  uint8_t master;
+  uint8_t have_sync;
+  os_timer_t timer;
+  int cb_ref;
+  ip_addr_t from;             // sender of the last SYNC
+  struct rtc_timeval rx;      // and when it arrived
+} lan_state_t;
+
+static lan_state_t *lan;
+
+static void lan_send(uint8_t type, const struct rtc_timeval *tv)
+{
+  struct pbuf *p = pbuf_alloc (PBUF_TRANSPORT, sizeof (lan_msg_t), PBUF_RAM);
+  if (!p)
+    return;
+
+  lan_msg_t msg;
+  msg.magic = htonl (LAN_MAGIC);
+  msg.type = type;
+  msg.leap = pending_LI;
+  msg.seq = htons (lan->seq);
+  msg.sec = htonl (tv->tv_sec);
+  msg.usec = htonl (tv->tv_usec);
+  os_memcpy (p->payload, &msg, sizeof (msg));
+  udp_sendto (lan->pcb, p, &lan->group, lan->port);
+  pbuf_free (p);
+}
+
+static void on_lan_timer(void *arg)
+{
+  (void)arg;
+  struct rtc_timeval tv;
+
+  if (!rtctime_have_time ())
+    return;
+
+  lan->seq++;
+  rtctime_gettimeofday (&tv);
+  lan_send (LAN_SYNC, &tv);
+  rtctime_gettimeofday (&tv);
+  lan_send (LAN_FOLLOW_UP, &tv);
+}
+
+static void on_lan_recv (void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr, uint16_t port)
+{
+  (void)arg;
+  (void)port;
+  struct rtc_timeval now;
+  lan_msg_t msg;
+
+  // take the time first, it is what matters for a SYNC
+  rtctime_gettimeofday (&now);
+
+  if (!p)
+    return;
+  if (!lan || lan->pcb != pcb || lan->master || p->len < sizeof (msg)) {
+    pbuf_free (p);
+    return;
+  }
+  os_memcpy (&msg, p->payload, sizeof (msg));
+  pbuf_free (p);
+  if (ntohl (msg.magic) != LAN_MAGIC)
+    return;
+
+  if (msg.type == LAN_SYNC) {
+    lan->seq = ntohs (msg.seq);
+    lan->from = *addr;
+    lan->rx = now;
+    lan->have_sync = 1;
+    return;
+  }
+  if (msg.type != LAN_FOLLOW_UP || !lan->have_sync ||
+      ntohs (msg.seq) != lan->seq || lan->from.addr != addr->addr)
+    return;
+  lan->have_sync = 0;
+  if (msg.leap)
+    pending_LI = msg.leap;
+
+  // offset at the arrival of the SYNC, and the time now by the master's clock
+  struct rtc_timeval tv;
+  int32_t dsec = ntohl (msg.sec) - lan->rx.tv_sec;
+  int32_t dusec = (int32_t) ntohl (msg.usec) - (int32_t) lan->rx.tv_usec;
+  int64_t delta = (((int64_t) dsec) << 32) + SUS_TO_FRAC(dusec);
+  int64_t elapsed = (int64_t) (now.tv_sec - lan->rx.tv_sec) * 1000000 + now.tv_usec - lan->rx.tv_usec;
+  uint64_t us = (uint64_t) ntohl (msg.sec) * 1000000 + ntohl (msg.usec) + elapsed;
+  tv.tv_sec = us / 1000000;
+  tv.tv_usec = us % 1000000;
+
+  clock_update (delta, &tv);
+
+  if (lan->cb_ref != LUA_NOREF) {
+    lua_State *L = lua_getstate ();
+    lua_rawgeti (L, LUA_REGISTRYINDEX, lan->cb_ref);
+    lua_pushnumber (L, tv.tv_sec);
+    lua_pushnumber (L, tv.tv_usec);
+    lua_pushstring (L, ipaddr_ntoa (addr));
+    lua_newtable (L);
+    lua_pushnumber (L, clk.offset_us);
+    lua_setfield (L, -2, "offset_us");
+    lua_pushnumber (L, pending_LI);
+    lua_setfield (L, -2, "pending_leap");
+    lua_call (L, 4, 0);
+  }
+}
+
+static void lan_stop(lua_State *L)
+{
+  if (!lan)
+    return;
+  os_timer_disarm (&lan->timer);
+  if (!lan->master)
+    igmp_leavegroup (IP_ADDR_ANY, &lan->group);
+  udp_remove (lan->pcb);
+  luaL_unref (L, LUA_REGISTRYINDEX, lan->cb_ref);
+  c_free (lan);
+  lan = NULL;
+}
+
+static void lan_start(lua_State *L, bool master, int group_arg)
+{
+  const char *group = luaL_optstring (L, group_arg, LAN_GROUP);
+  int port = luaL_optinteger (L, group_arg + 1, LAN_PORT);
+  ip_addr_t addr;
+
+  if (!ipaddr_aton (group, &addr) || !ip_addr_ismulticast (&addr))
+    luaL_argerror (L, group_arg, "multicast address expected");
+
+  lan_stop (L);
+  lan = (lan_state_t *) c_zalloc (sizeof (lan_state_t));
+  if (!lan)
+    luaL_error (L, "out of memory");
+  lan->cb_ref = LUA_NOREF;
+  lan->master = master;
+  lan->group = addr;
+  lan->port = port;
+  lan->pcb = udp_new ();
+  if (!lan->pcb || udp_bind (lan->pcb, IP_ADDR_ANY, master ? 0 : port) != ERR_OK) {
+    if (lan->pcb)
+      udp_remove (lan->pcb);
+    c_free (lan);
+    lan = NULL;
+    luaL_error (L, "no port available");
+  }
+  if (!master) {
+    igmp_joingroup (IP_ADDR_ANY, &lan->group);
+    udp_recv (lan->pcb, on_lan_recv, NULL);
+  }
+}
+
+// Lua: sntp.lanmaster([interval[, group[, port]]])
+static int sntp_lanmaster(lua_State *L)
+{
+  int interval = luaL_optinteger (L, 1, 10);
+
+  luaL_argcheck (L, interval > 0 && interval <= 3600, 1, "1 to 3600 seconds");
+  lan_start (L, TRUE, 2);
+  os_timer_setfn (&lan->timer, on_lan_timer, NULL);
+  os_timer_arm (&lan->timer, interval * 1000, 1);
+  return 0;
+}
+
+// Lua: sntp.lanlisten([callback[, group[, port]]])
+static int sntp_lanlisten(lua_State *L)
+{
+  bool have_cb = lua_type (L, 1) == LUA_TFUNCTION || lua_type (L, 1) == LUA_TLIGHTFUNCTION;
+
+  if (!have_cb && !lua_isnoneornil (L, 1))
+    luaL_argerror (L, 1, "function expected");
+  lan_start (L, FALSE, 2);
+  if (have_cb) {
+    lua_pushvalue (L, 1);
+    lan->cb_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  }
+  return 0;
+}
+
+// Lua: sntp.lanstop()
+static int sntp_lanstop(lua_State *L)
+{
+  lan_stop (L);
+  return 0;
+}
+#endif
+
 static void sntp_task(os_param_t param, uint8_t prio) 
 {
   (void) param;
@@ -856,6 +1217,14 @@ static int sntp_open(lua_State *L)
 
   tasknumber = task_get_id(sntp_task);
 
+#ifdef LUA_USE_MODULES_RTCTIME
+  // a slew may have been cut short by a restart
+  os_timer_setfn(&slew_timer, on_slew_done, NULL);
+  if (rtctime_have_time()) {
+    rtctime_adjust_rate(clock_freq());
+  }
+#endif
+
   return 0;
 }
 
@@ -867,6 +1236,10 @@ static const LUA_REG_TYPE sntp_map[] = {
 #ifdef LUA_USE_MODULES_RTCTIME
   { LSTRKEY("setoffset"),  LFUNCVAL(sntp_setoffset)  },
   { LSTRKEY("getoffset"),  LFUNCVAL(sntp_getoffset)  },
+  { LSTRKEY("stats"),  LFUNCVAL(sntp_stats)  },
+  { LSTRKEY("lanmaster"),  LFUNCVAL(sntp_lanmaster)  },
+  { LSTRKEY("lanlisten"),  LFUNCVAL(sntp_lanlisten)  },
+  { LSTRKEY("lanstop"),  LFUNCVAL(sntp_lanstop)  },
 #endif
   { LNILKEY, LNILVAL }
 };
@@ -4,6 +4,9 @@
 #include "lauxlib.h"
 #include "platform.h"
 
+#include "c_stdlib.h"
+#include "c_string.h"
+
 #include "driver/spi.h"
 
 #define SPI_HALFDUPLEX 0
@@ -302,6 +305,203 @@ static int spi_transaction( lua_State *L )
 }
 
 
+// A batch of descriptors submitted from Lua, allocated as one block:
+// header, descriptor array, receive buffers.
+typedef struct {
+  int cb_ref;         // Lua callback
+  int anchor_ref;     // table keeping the transmitted strings alive
+  uint16_t ndesc;
+  spi_trans_desc_t desc[];
+} spi_batch_t;
+
+static void spi_batch_done( spi_trans_desc_t *last )
+{
+  spi_batch_t *batch = (spi_batch_t *)last->arg;
+  lua_State *L = lua_getstate();
+  uint16_t i;
+
+  luaL_unref( L, LUA_REGISTRYINDEX, batch->anchor_ref );
+
+  if (batch->cb_ref != LUA_NOREF) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, batch->cb_ref );
+    luaL_unref( L, LUA_REGISTRYINDEX, batch->cb_ref );
+
+    lua_createtable( L, batch->ndesc, 0 );
+    for (i = 0; i < batch->ndesc; i++) {
+      spi_trans_desc_t *desc = &batch->desc[i];
+      if (desc->rx) {
+        lua_pushlstring( L, (const char *)desc->rx, desc->len );
+        lua_rawseti( L, -2, i + 1 );
+      }
+    }
+    c_free( batch );
+    lua_call( L, 1, 0 );
+  } else {
+    c_free( batch );
+  }
+}
+
+static int spi_field_int( lua_State *L, int idx, const char *key, int def )
+{
+  int val;
+
+  lua_getfield( L, idx, key );
+  val = luaL_optinteger( L, -1, def );
+  lua_pop( L, 1 );
+  return val;
+}
+
+// Lua: spi.queue( id, descriptors[, callback] )
+// descriptors is an array of strings (plain writes) or tables with the fields
+// cmd, cmd_bitlen, addr, addr_bitlen, dummy_bitlen, data, read, cs, cs_keep
+static int spi_queue( lua_State *L )
+{
+  int id = luaL_checkinteger( L, 1 );
+  size_t ndesc, rxlen = 0, i;
+  spi_batch_t *batch;
+  uint8_t *rxbuf;
+
+  MOD_CHECK_ID( spi, id );
+  luaL_argcheck( L, id == SPI_HSPI, 1, "only HSPI supports queued transactions" );
+  luaL_checktype( L, 2, LUA_TTABLE );
+  ndesc = lua_objlen( L, 2 );
+  luaL_argcheck( L, ndesc > 0 && ndesc <= 0xffff, 2, "out of range" );
+  if (!lua_isnoneornil( L, 3 ))
+    luaL_checkanyfunction( L, 3 );
+
+  // first pass: validate and size the receive buffers
+  for (i = 1; i <= ndesc; i++) {
+    lua_rawgeti( L, 2, i );
+    if (lua_istable( L, -1 )) {
+      size_t datalen = 0;
+      int readlen;
+
+      lua_getfield( L, -1, "data" );
+      if (!lua_isnil( L, -1 ))
+        luaL_checklstring( L, -1, &datalen );
+      lua_pop( L, 1 );
+
+      readlen = spi_field_int( L, -1, "read", 0 );
+      if (readlen < 0 || (datalen > 0 && readlen > 0 && (size_t)readlen != datalen))
+        return luaL_error( L, "descriptor %d: read length mismatch", i );
+      int cmd_bitlen   = spi_field_int( L, -1, "cmd_bitlen", 0 );
+      int addr_bitlen  = spi_field_int( L, -1, "addr_bitlen", 0 );
+      int dummy_bitlen = spi_field_int( L, -1, "dummy_bitlen", 0 );
+      if (cmd_bitlen < 0 || cmd_bitlen > 16 ||
+          addr_bitlen < 0 || addr_bitlen > 32 ||
+          dummy_bitlen < 0 || dummy_bitlen > 255)
+        return luaL_error( L, "descriptor %d: out of range", i );
+
+      lua_getfield( L, -1, "cs" );
+      if (!lua_isnil( L, -1 )) {
+        int pin = luaL_checkinteger( L, -1 );
+        if (pin < 1 || !platform_gpio_exists( pin ))
+          return luaL_error( L, "descriptor %d: invalid cs pin", i );
+      }
+      lua_pop( L, 1 );
+
+      rxlen += readlen;
+    } else if (!lua_isstring( L, -1 )) {
+      return luaL_error( L, "descriptor %d: wrong arg type", i );
+    }
+    lua_pop( L, 1 );
+  }
+
+  batch = (spi_batch_t *)c_zalloc( sizeof( spi_batch_t ) + ndesc * sizeof( spi_trans_desc_t ) + rxlen );
+  if (!batch)
+    return luaL_error( L, "out of memory" );
+  rxbuf = (uint8_t *)&batch->desc[ndesc];
+  batch->ndesc = ndesc;
+
+  // second pass: fill the descriptors, anchoring the data strings in a private table
+  lua_createtable( L, ndesc, 0 );
+  for (i = 0; i < ndesc; i++) {
+    spi_trans_desc_t *desc = &batch->desc[i];
+    const char *data = NULL;
+    size_t datalen = 0;
+
+    lua_rawgeti( L, 2, i + 1 );
+    if (lua_istable( L, -1 )) {
+      int readlen;
+
+      lua_getfield( L, -1, "data" );
+      if (!lua_isnil( L, -1 )) {
+        data = lua_tolstring( L, -1, &datalen );
+        lua_rawseti( L, -3, i + 1 );
+      } else {
+        lua_pop( L, 1 );
+      }
+
+      desc->cmd_bitlen   = spi_field_int( L, -1, "cmd_bitlen", 0 );
+      desc->cmd_data     = spi_field_int( L, -1, "cmd", 0 );
+      desc->addr_bitlen  = spi_field_int( L, -1, "addr_bitlen", 0 );
+      desc->addr_data    = spi_field_int( L, -1, "addr", 0 );
+      desc->dummy_bitlen = spi_field_int( L, -1, "dummy_bitlen", 0 );
+
+      readlen = spi_field_int( L, -1, "read", 0 );
+      if (readlen > 0) {
+        desc->rx = rxbuf;
+        rxbuf += readlen;
+        if (!data)
+          datalen = readlen;
+      }
+
+      lua_getfield( L, -1, "cs" );
+      if (!lua_isnil( L, -1 )) {
+        unsigned pin = lua_tointeger( L, -1 );
+        platform_gpio_write( pin, PLATFORM_GPIO_HIGH );
+        platform_gpio_mode( pin, PLATFORM_GPIO_OUTPUT, PLATFORM_GPIO_FLOAT );
+        desc->cs_mask = 1 << pin_num[pin];
+      }
+      lua_pop( L, 1 );
+
+      lua_getfield( L, -1, "cs_keep" );
+      if (lua_toboolean( L, -1 ))
+        desc->flags |= SPI_TRANS_CS_KEEP;
+      lua_pop( L, 1 );
+    } else {
+      data = lua_tolstring( L, -1, &datalen );
+      lua_pushvalue( L, -1 );
+      lua_rawseti( L, -3, i + 1 );
+    }
+    lua_pop( L, 1 );
+
+    desc->tx  = (const uint8 *)data;
+    desc->len = datalen;
+    desc->next = (i + 1 < ndesc) ? &batch->desc[i + 1] : NULL;
+  }
+  batch->anchor_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+  if (lua_isnoneornil( L, 3 )) {
+    batch->cb_ref = LUA_NOREF;
+  } else {
+    lua_pushvalue( L, 3 );
+    batch->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+
+  batch->desc[ndesc - 1].cb  = spi_batch_done;
+  batch->desc[ndesc - 1].arg = batch;
+
+  if (!spi_queue_submit( id, batch->desc )) {
+    luaL_unref( L, LUA_REGISTRYINDEX, batch->anchor_ref );
+    luaL_unref( L, LUA_REGISTRYINDEX, batch->cb_ref );
+    c_free( batch );
+    return luaL_error( L, "queue submit failed" );
+  }
+  return 0;
+}
+
+// Lua: n = spi.pending( id )
+static int spi_pending( lua_State *L )
+{
+  int id = luaL_checkinteger( L, 1 );
+
+  MOD_CHECK_ID( spi, id );
+  lua_pushinteger( L, spi_queue_pending( id ) );
+  return 1;
+}
+
+
 // Module function map
 static const LUA_REG_TYPE spi_map[] = {
   { LSTRKEY( "setup" ),       LFUNCVAL( spi_setup ) },
@@ -310,6 +510,8 @@ static const LUA_REG_TYPE spi_map[] = {
   { LSTRKEY( "set_mosi" ),    LFUNCVAL( spi_set_mosi ) },
   { LSTRKEY( "get_miso" ),    LFUNCVAL( spi_get_miso ) },
   { LSTRKEY( "transaction" ), LFUNCVAL( spi_transaction ) },
+  { LSTRKEY( "queue" ),       LFUNCVAL( spi_queue ) },
+  { LSTRKEY( "pending" ),     LFUNCVAL( spi_pending ) },
   { LSTRKEY( "MASTER" ),      LNUMVAL( PLATFORM_SPI_MASTER ) },
   { LSTRKEY( "SLAVE" ),       LNUMVAL( PLATFORM_SPI_SLAVE) },
   { LSTRKEY( "CPHA_LOW" ),    LNUMVAL( PLATFORM_SPI_CPHA_LOW) },
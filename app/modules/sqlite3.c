@@ -37,6 +37,7 @@
 #include "module.h"
 #include "lua.h"
 #include "lauxlib.h"
+#include "user_interface.h"
 
 #if LUA_VERSION_NUM > 501
 /*
@@ -198,6 +199,12 @@ struct sdb_vm {
     char has_values;        /* true when step succeeds */
 
     char temp;              /* temporary vm used in db:rows */
+
+    /* stepping statistics, see dbvm_stats */
+    unsigned steps;         /* calls to sqlite3_step */
+    unsigned rows;          /* steps that returned a row */
+    uint32_t step_us;       /* time spent in sqlite3_step */
+    uint32_t max_step_us;   /* longest single step */
 };
 
 /* called with db,sql text on the lua stack */
@@ -212,6 +219,8 @@ static sdb_vm *newvm(lua_State *L, sdb *db) {
     svm->has_values = 0;
     svm->vm = NULL;
     svm->temp = 0;
+    svm->steps = svm->rows = 0;
+    svm->step_us = svm->max_step_us = 0;
 
     /* add an entry on the database table: svm -> db to keep db live while svm is live */
     lua_pushlightuserdata(L, db);     /* db sql svm_ud db_lud -- */
@@ -245,7 +254,36 @@ static int cleanupvm(lua_State *L, sdb_vm *svm) {
 }
 
 static int stepvm(lua_State *L, sdb_vm *svm) {
-    return sqlite3_step(svm->vm);
+    uint32_t start = system_get_time(), elapsed;
+    int result = sqlite3_step(svm->vm);
+
+    elapsed = system_get_time() - start;
+    svm->steps++;
+    if (result == SQLITE_ROW)
+        svm->rows++;
+    svm->step_us += elapsed;
+    if (elapsed > svm->max_step_us)
+        svm->max_step_us = elapsed;
+    return result;
+}
+
+/* called once a vm stops returning rows: resets it for reuse, or finalizes
+** it if temporary, and raises any error reported by sqlite */
+static void donevm(lua_State *L, sdb_vm *svm, int result) {
+    if (svm->temp) {
+        /* finalize and check for errors */
+        result = sqlite3_finalize(svm->vm);
+        svm->vm = NULL;
+        cleanupvm(L, svm);
+    }
+    else if (result == SQLITE_DONE) {
+        result = sqlite3_reset(svm->vm);
+    }
+
+    if (result != SQLITE_OK) {
+        lua_pushstring(L, sqlite3_errmsg(svm->db->db));
+        lua_error(L);
+    }
 }
 
 static sdb_vm *lsqlite_getvm(lua_State *L, int index) {
@@ -308,6 +346,39 @@ static int dbvm_reset(lua_State *L) {
     return 1;
 }
 
+/*
+** Params: vm, reset
+** returns: table of stepping statistics and sqlite3_stmt_status counters
+*/
+static int dbvm_stats(lua_State *L) {
+    sdb_vm *svm = lsqlite_checkvm(L, 1);
+    int reset = lua_toboolean(L, 2);
+
+    lua_createtable(L, 0, 8);
+    lua_pushinteger(L, svm->steps);
+    lua_setfield(L, -2, "steps");
+    lua_pushinteger(L, svm->rows);
+    lua_setfield(L, -2, "rows");
+    lua_pushinteger(L, svm->step_us);
+    lua_setfield(L, -2, "time");
+    lua_pushinteger(L, svm->max_step_us);
+    lua_setfield(L, -2, "maxtime");
+    lua_pushinteger(L, sqlite3_stmt_status(svm->vm, SQLITE_STMTSTATUS_FULLSCAN_STEP, reset));
+    lua_setfield(L, -2, "fullscan");
+    lua_pushinteger(L, sqlite3_stmt_status(svm->vm, SQLITE_STMTSTATUS_SORT, reset));
+    lua_setfield(L, -2, "sort");
+    lua_pushinteger(L, sqlite3_stmt_status(svm->vm, SQLITE_STMTSTATUS_AUTOINDEX, reset));
+    lua_setfield(L, -2, "autoindex");
+    lua_pushinteger(L, sqlite3_stmt_status(svm->vm, SQLITE_STMTSTATUS_VM_STEP, reset));
+    lua_setfield(L, -2, "vmstep");
+
+    if (reset) {
+        svm->steps = svm->rows = 0;
+        svm->step_us = svm->max_step_us = 0;
+    }
+    return 1;
+}
+
 static void dbvm_check_contents(lua_State *L, sdb_vm *svm) {
     if (!svm->has_values) {
         luaL_error(L, "misuse of function");
@@ -608,36 +679,39 @@ static int dbvm_bind_values(lua_State *L) {
     return 1;
 }
 
-static int dbvm_bind_names(lua_State *L) {
-    sdb_vm *svm = lsqlite_checkvm(L, 1);
-    sqlite3_stmt *vm = svm->vm;
+/* binds every parameter of vm from the table at lindex, by name for :name
+** and $name parameters and by position otherwise */
+static int dbvm_bind_table(lua_State *L, sqlite3_stmt *vm, int lindex) {
     int count = sqlite3_bind_parameter_count(vm);
     const char *name;
     int result, n;
-    luaL_checktype(L, 2, LUA_TTABLE);
 
     for (n = 1; n <= count; ++n) {
         name = sqlite3_bind_parameter_name(vm, n);
         if (name && (name[0] == ':' || name[0] == '$')) {
             lua_pushstring(L, ++name);
-            lua_gettable(L, 2);
+            lua_gettable(L, lindex);
             result = dbvm_bind_index(L, vm, n, -1);
             lua_pop(L, 1);
         }
         else {
             lua_pushinteger(L, n);
-            lua_gettable(L, 2);
+            lua_gettable(L, lindex);
             result = dbvm_bind_index(L, vm, n, -1);
             lua_pop(L, 1);
         }
 
-        if (result != SQLITE_OK) {
-            lua_pushinteger(L, result);
-            return 1;
-        }
+        if (result != SQLITE_OK)
+            return result;
     }
+    return SQLITE_OK;
+}
 
-    lua_pushinteger(L, SQLITE_OK);
+static int dbvm_bind_names(lua_State *L) {
+    sdb_vm *svm = lsqlite_checkvm(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    lua_pushinteger(L, dbvm_bind_table(L, svm->vm, 2));
     return 1;
 }
 
@@ -1882,6 +1956,114 @@ static int db_exec(lua_State *L) {
     return 1;
 }
 
+/* runs vm once per row of the table at index 2; vm userdata at index 1 */
+static int db_executemany_rows(lua_State *L) {
+    sdb_vm *svm = (sdb_vm*)lua_touserdata(L, 1);
+    sqlite3_stmt *vm = svm->vm;
+    int rows = lua_objlen(L, 2);
+    int result = SQLITE_OK;
+    int n;
+
+    for (n = 1; n <= rows; ++n) {
+        lua_rawgeti(L, 2, n);
+        if (!lua_istable(L, -1))
+            luaL_error(L, "row %d is not a table", n);
+        sqlite3_reset(vm);
+        result = dbvm_bind_table(L, vm, lua_gettop(L));
+        lua_pop(L, 1);
+
+        if (result == SQLITE_OK) {
+            while ((result = stepvm(L, svm)) == SQLITE_ROW)
+                ;
+            if (result == SQLITE_DONE)
+                result = SQLITE_OK;
+        }
+        if (result != SQLITE_OK)
+            break;
+    }
+    sqlite3_reset(vm);
+    svm->has_values = 0;
+
+    lua_pushinteger(L, result);
+    lua_pushinteger(L, n - 1);
+    return 2;
+}
+
+/*
+** Params: db, vm or sql, rows
+** returns: code, number of rows executed
+**
+** Binds and steps the statement for each row (a table, bound as by
+** bind_names). Unless a transaction is already open the whole batch runs in
+** one, which is rolled back if any row fails.
+*/
+static int db_executemany(lua_State *L) {
+    sdb *db = lsqlite_checkdb(L, 1);
+    sdb_vm *svm;
+    int autocommit, status, result, rows;
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        lua_settop(L, 3);
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2); /* db,sql is on top of stack for call to newvm */
+        svm = newvm(L, db);
+        svm->temp = 1;
+        if (sqlite3_prepare_v2(db->db, lua_tostring(L, 2), -1, &svm->vm, NULL) != SQLITE_OK) {
+            lua_pushinteger(L, sqlite3_errcode(db->db));
+            lua_pushinteger(L, 0);
+            cleanupvm(L, svm);
+            return 2;
+        }
+        lua_replace(L, 2);
+    }
+    else {
+        svm = lsqlite_checkvm(L, 2);
+        luaL_argcheck(L, svm->db == db, 2, "statement belongs to another database");
+    }
+    lua_settop(L, 3);
+
+    autocommit = sqlite3_get_autocommit(db->db);
+    if (autocommit && (result = sqlite3_exec(db->db, "BEGIN", NULL, NULL, NULL)) != SQLITE_OK) {
+        rows = 0;
+    }
+    else {
+        lua_pushcfunction(L, db_executemany_rows);
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, 3);
+        status = lua_pcall(L, 2, 2, 0);
+
+        if (status != 0) {
+            if (autocommit)
+                sqlite3_exec(db->db, "ROLLBACK", NULL, NULL, NULL);
+            if (svm->temp) {
+                sqlite3_finalize(svm->vm);
+                svm->vm = NULL;
+                cleanupvm(L, svm);
+            }
+            lua_error(L);
+        }
+
+        result = lua_tointeger(L, -2);
+        rows = lua_tointeger(L, -1);
+        if (autocommit) {
+            if (result == SQLITE_OK)
+                result = sqlite3_exec(db->db, "COMMIT", NULL, NULL, NULL);
+            if (result != SQLITE_OK)
+                sqlite3_exec(db->db, "ROLLBACK", NULL, NULL, NULL);
+        }
+    }
+
+    if (svm->temp) {
+        sqlite3_finalize(svm->vm);
+        svm->vm = NULL;
+        cleanupvm(L, svm);
+    }
+    lua_pushinteger(L, result);
+    lua_pushinteger(L, rows);
+    return 2;
+}
+
 /*
 ** Params: db, sql
 ** returns: code, compiled length or error message
@@ -1947,20 +2129,7 @@ static int db_do_next_row(lua_State *L, int packed) {
         }
     }
 
-    if (svm->temp) {
-        /* finalize and check for errors */
-        result = sqlite3_finalize(vm);
-        svm->vm = NULL;
-        cleanupvm(L, svm);
-    }
-    else if (result == SQLITE_DONE) {
-        result = sqlite3_reset(vm);
-    }
-
-    if (result != SQLITE_OK) {
-        lua_pushstring(L, sqlite3_errmsg(svm->db->db));
-        lua_error(L);
-    }
+    donevm(L, svm, result);
     return 0;
 }
 
@@ -1997,6 +2166,38 @@ static int dbvm_urows(lua_State *L) {
     return dbvm_do_rows(L, db_next_row);
 }
 
+/*
+** Params: vm, n
+** returns: flat array holding the columns of up to n rows one after the
+** other, number of rows fetched (less than n once the statement is done)
+*/
+static int dbvm_fetchmany(lua_State *L) {
+    sdb_vm *svm = lsqlite_checkvm(L, 1);
+    int n = luaL_checkint(L, 2);
+    sqlite3_stmt *vm = svm->vm;
+    int columns = sqlite3_column_count(vm);
+    int result = SQLITE_ROW;
+    int rows = 0, i, k = 0;
+    luaL_argcheck(L, n > 0, 2, "must be positive");
+
+    /* presize for a modest batch, larger ones grow as needed */
+    lua_createtable(L, (n < 32 ? n : 32) * columns, 0);
+    while (rows < n && (result = stepvm(L, svm)) == SQLITE_ROW) {
+        for (i = 0; i < columns; ++i) {
+            vm_push_column(L, vm, i);
+            lua_rawseti(L, -2, ++k);
+        }
+        rows++;
+    }
+    svm->has_values = result == SQLITE_ROW ? 1 : 0;
+    svm->columns = sqlite3_data_count(vm);
+
+    if (result != SQLITE_ROW)
+        donevm(L, svm, result);
+    lua_pushinteger(L, rows);
+    return 2;
+}
+
 static int db_do_rows(lua_State *L, int(*f)(lua_State *)) {
     sdb *db = lsqlite_checkdb(L, 1);
     const char *sql = luaL_checkstring(L, 2);
@@ -2245,6 +2446,7 @@ static const LUA_REG_TYPE dblib[] = {
 
     { LSTRKEY( "exec" ),                LFUNCVAL ( db_exec )                 },
     { LSTRKEY( "execute" ),             LFUNCVAL ( db_exec )                 },
+    { LSTRKEY( "executemany" ),         LFUNCVAL ( db_executemany )          },
     { LSTRKEY( "close" ),               LFUNCVAL ( db_close )                },
     { LSTRKEY( "close_vm" ),            LFUNCVAL ( db_close_vm )             },
     { LSTRKEY( "get_ptr" ),             LFUNCVAL ( db_get_ptr )              },
@@ -2261,6 +2463,7 @@ static const LUA_REG_TYPE vmlib[] = {
 
     { LSTRKEY( "step" ),                LFUNCVAL ( dbvm_step )               },
     { LSTRKEY( "reset" ),               LFUNCVAL ( dbvm_reset )              },
+    { LSTRKEY( "stats" ),               LFUNCVAL ( dbvm_stats )              },
     { LSTRKEY( "finalize" ),            LFUNCVAL ( dbvm_finalize )           },
 
     { LSTRKEY( "columns" ),             LFUNCVAL ( dbvm_columns )            },
@@ -2288,6 +2491,7 @@ static const LUA_REG_TYPE vmlib[] = {
     { LSTRKEY( "rows" ),                LFUNCVAL ( dbvm_rows )               },
     { LSTRKEY( "urows" ),               LFUNCVAL ( dbvm_urows )              },
     { LSTRKEY( "nrows" ),               LFUNCVAL ( dbvm_nrows )              },
+    { LSTRKEY( "fetchmany" ),           LFUNCVAL ( dbvm_fetchmany )          },
 
     { LSTRKEY( "last_insert_rowid" ),   LFUNCVAL ( dbvm_last_insert_rowid )  },
 
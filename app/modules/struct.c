@@ -38,6 +38,7 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "bytearr.h"
 
 
 /* basic integer type */
@@ -170,11 +171,10 @@ static void controloptions (lua_State *L, int opt, const char **fmt,
 }
 
 
-static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
-                        int size) {
+static void encodeinteger (lua_State *L, char *buff, int arg, int endian,
+                           int size) {
   lua_Number n = luaL_checknumber(L, arg);
   Uinttype value;
-  char buff[MAXINTSIZE];
   if (n < 0)
     value = (Uinttype)(Inttype)n;
   else
@@ -193,6 +193,13 @@ static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
       value >>= 8;
     }
   }
+}
+
+
+static void putinteger (lua_State *L, luaL_Buffer *b, int arg, int endian,
+                        int size) {
+  char buff[MAXINTSIZE];
+  encodeinteger(L, buff, arg, endian, size);
   luaL_addlstring(b, buff, size);
 }
 
@@ -296,11 +303,20 @@ static lua_Number getinteger (const char *buff, int endian,
 }
 
 
+/*
+** data to unpack from, a string or a bytearr
+*/
+static const char *checkdata (lua_State *L, int arg, size_t *ld) {
+  const char *data = (const char *)bytearr_data(L, arg, ld);
+  return data ? data : luaL_checklstring(L, arg, ld);
+}
+
+
 static int b_unpack (lua_State *L) {
   Header h;
   const char *fmt = luaL_checkstring(L, 1);
   size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
+  const char *data = checkdata(L, 2, &ld);
   size_t pos = luaL_optinteger(L, 3, 1) - 1;
   defaultoptions(&h);
   lua_settop(L, 2);
@@ -390,15 +406,291 @@ static int b_size (lua_State *L) {
 
 
 
+/*
+** {======================================================
+** Compiled formats
+**
+** struct.compile() parses a format once into a table of fields at fixed
+** offsets, so a packer only has to convert the values. Only formats of a
+** fixed size can be compiled.
+** =======================================================
+*/
+
+typedef struct Field {
+  char opt;
+  char endian;
+  unsigned short size;
+  size_t offset;
+} Field;
+
+
+typedef struct Packer {
+  size_t size;
+  int nfields;
+  Field field[1];
+} Packer;
+
+
+/*
+** parses 'fmt', filling in 'field' if not NULL; returns the number of fields
+*/
+static int compilefmt (lua_State *L, const char *fmt, Field *field,
+                       size_t *total) {
+  Header h;
+  size_t pos = 0;
+  int n = 0;
+  defaultoptions(&h);
+  while (*fmt) {
+    int opt = *fmt++;
+    size_t size = optsize(L, opt, &fmt);
+    pos += gettoalign(pos, &h, opt, size);
+    switch (opt) {
+      case 'b': case 'B': case 'h': case 'H':
+      case 'l': case 'L': case 'T': case 'i': case 'I':
+#ifndef LUA_NUMBER_INTEGRAL
+      case 'f': case 'd':
+#endif
+      case 'c': {
+        if (size == 0)
+          luaL_argerror(L, 1, "option 'c0' has no fixed size");
+        if (size > USHRT_MAX)
+          luaL_argerror(L, 1, "field too large");
+        if (field) {
+          field[n].opt = opt;
+          field[n].endian = h.endian;
+          field[n].size = size;
+          field[n].offset = pos;
+        }
+        n++;
+        break;
+      }
+      case 'x': {
+        break;
+      }
+      case 's': {
+        luaL_argerror(L, 1, "option 's' has no fixed size");
+        break;
+      }
+      default: controloptions(L, opt, &fmt, &h);
+    }
+    pos += size;
+  }
+  *total = pos;
+  return n;
+}
+
+
+static void packfield (lua_State *L, const Field *f, char *out, int arg) {
+  out += f->offset;
+  switch (f->opt) {
+#ifndef LUA_NUMBER_INTEGRAL
+    case 'f': {
+      float v = (float)luaL_checknumber(L, arg);
+      correctbytes((char *)&v, sizeof(v), f->endian);
+      memcpy(out, &v, sizeof(v));
+      break;
+    }
+    case 'd': {
+      double v = luaL_checknumber(L, arg);
+      correctbytes((char *)&v, sizeof(v), f->endian);
+      memcpy(out, &v, sizeof(v));
+      break;
+    }
+#endif
+    case 'c': {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      luaL_argcheck(L, l >= f->size, arg, "string too short");
+      memcpy(out, s, f->size);
+      break;
+    }
+    default:  /* integer types */
+      encodeinteger(L, out, arg, f->endian, f->size);
+  }
+}
+
+
+static void unpackfield (lua_State *L, const Field *f, const char *data) {
+  data += f->offset;
+  switch (f->opt) {
+#ifndef LUA_NUMBER_INTEGRAL
+    case 'f': {
+      float v;
+      memcpy(&v, data, sizeof(v));
+      correctbytes((char *)&v, sizeof(v), f->endian);
+      lua_pushnumber(L, v);
+      break;
+    }
+    case 'd': {
+      double v;
+      memcpy(&v, data, sizeof(v));
+      correctbytes((char *)&v, sizeof(v), f->endian);
+      lua_pushnumber(L, v);
+      break;
+    }
+#endif
+    case 'c': {
+      lua_pushlstring(L, data, f->size);
+      break;
+    }
+    default:  /* integer types */
+      lua_pushnumber(L, getinteger(data, f->endian, islower(f->opt), f->size));
+  }
+}
+
+
+static void packrecord (lua_State *L, const Packer *p, char *out, int arg) {
+  int i;
+  luaL_argcheck(L, lua_gettop(L) - arg + 1 >= p->nfields, arg,
+                "not enough values");
+  memset(out, 0, p->size);  /* padding */
+  for (i = 0; i < p->nfields; i++)
+    packfield(L, &p->field[i], out, arg + i);
+}
+
+
+/* returns the 0-based position given by the optional 1-based 'arg' */
+static size_t checkpos (lua_State *L, int arg) {
+  lua_Integer pos = luaL_optinteger(L, arg, 1);
+  luaL_argcheck(L, pos >= 1, arg, "position must be positive");
+  return pos - 1;
+}
+
+
+#define checkpacker(L)	((Packer *)luaL_checkudata(L, 1, "struct.packer"))
+
+
+/* Lua: packer:pack(v1, v2, ...) */
+static int p_pack (lua_State *L) {
+  Packer *p = checkpacker(L);
+  char buff[64];
+  char *out = buff;
+  if (p->size > sizeof(buff)) {
+    out = (char *)lua_newuserdata(L, p->size);
+    lua_insert(L, 2);  /* keep the values at the top */
+    packrecord(L, p, out, 3);
+  }
+  else
+    packrecord(L, p, out, 2);
+  lua_pushlstring(L, out, p->size);
+  return 1;
+}
+
+
+/* Lua: packer:packinto(bytearr, pos, v1, v2, ...) */
+static int p_packinto (lua_State *L) {
+  Packer *p = checkpacker(L);
+  size_t pos = checkpos(L, 3);
+  char *out = (char *)bytearr_reserve(L, 2, pos + p->size);
+  luaL_argcheck(L, out != NULL, 2, "writable bytearr expected");
+  packrecord(L, p, out + pos, 4);
+  lua_pushinteger(L, pos + p->size + 1);
+  return 1;
+}
+
+
+/* Lua: packer:unpack(data[, pos]) */
+static int p_unpack (lua_State *L) {
+  Packer *p = checkpacker(L);
+  size_t ld;
+  const char *data = checkdata(L, 2, &ld);
+  size_t pos = checkpos(L, 3);
+  int i;
+  luaL_argcheck(L, pos <= ld && p->size <= ld - pos, 2, "data string too short");
+  luaL_checkstack(L, p->nfields + 1, "too many results");
+  for (i = 0; i < p->nfields; i++)
+    unpackfield(L, &p->field[i], data + pos);
+  lua_pushinteger(L, pos + p->size + 1);
+  return p->nfields + 1;
+}
+
+
+/*
+** Lua: packer:unpackmany(data[, count[, pos]])
+** unpacks 'count' records, by default as many as there are, into a table
+** holding an array of the values of each field
+*/
+static int p_unpackmany (lua_State *L) {
+  Packer *p = checkpacker(L);
+  size_t ld;
+  const char *data = checkdata(L, 2, &ld);
+  size_t pos = checkpos(L, 4);
+  size_t count, r;
+  int i;
+  luaL_argcheck(L, pos <= ld, 4, "position out of range");
+  if (p->size == 0)
+    count = luaL_optinteger(L, 3, 0);
+  else
+    count = luaL_optinteger(L, 3, (ld - pos) / p->size);
+  luaL_argcheck(L, p->size == 0 || count <= (ld - pos) / p->size, 2,
+                "data string too short");
+  lua_createtable(L, p->nfields, 0);
+  for (i = 0; i < p->nfields; i++) {
+    const char *rec = data + pos;
+    lua_createtable(L, count, 0);
+    for (r = 1; r <= count; r++, rec += p->size) {
+      unpackfield(L, &p->field[i], rec);
+      lua_rawseti(L, -2, r);
+    }
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushinteger(L, pos + count * p->size + 1);
+  return 2;
+}
+
+
+/* Lua: packer:size() */
+static int p_size (lua_State *L) {
+  Packer *p = checkpacker(L);
+  lua_pushinteger(L, p->size);
+  return 1;
+}
+
+
+/* Lua: struct.compile(fmt) */
+static int b_compile (lua_State *L) {
+  const char *fmt = luaL_checkstring(L, 1);
+  size_t total;
+  int n = compilefmt(L, fmt, NULL, &total);
+  Packer *p = (Packer *)lua_newuserdata(L, sizeof(Packer) +
+                                        (n > 0 ? n - 1 : 0) * sizeof(Field));
+  p->nfields = compilefmt(L, fmt, p->field, &p->size);
+  luaL_getmetatable(L, "struct.packer");
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+static const LUA_REG_TYPE packer_map[] = {
+  {LSTRKEY("pack"), LFUNCVAL(p_pack)},
+  {LSTRKEY("packinto"), LFUNCVAL(p_packinto)},
+  {LSTRKEY("unpack"), LFUNCVAL(p_unpack)},
+  {LSTRKEY("unpackmany"), LFUNCVAL(p_unpackmany)},
+  {LSTRKEY("size"), LFUNCVAL(p_size)},
+  {LSTRKEY("__index"), LROVAL(packer_map)},
+  {LNILKEY, LNILVAL}
+};
+
+
 static const LUA_REG_TYPE thislib[] = {
   {LSTRKEY("pack"), LFUNCVAL(b_pack)},
   {LSTRKEY("unpack"), LFUNCVAL(b_unpack)},
   {LSTRKEY("size"), LFUNCVAL(b_size)},
+  {LSTRKEY("compile"), LFUNCVAL(b_compile)},
   {LNILKEY, LNILVAL}
 };
 
 
-NODEMCU_MODULE(STRUCT, "struct", thislib, NULL);
+LUALIB_API int struct_open (lua_State *L) {
+  luaL_rometatable(L, "struct.packer", (void *)packer_map);
+  return 1;
+}
+
+
+NODEMCU_MODULE(STRUCT, "struct", thislib, struct_open);
 
 /******************************************************************************
 * Copyright (C) 2010-2012 Lua.org, PUC-Rio.  All rights reserved.
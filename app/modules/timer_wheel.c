@@ -0,0 +1,432 @@
+/*
+ * Hierarchical timer wheel
+ *
+ * Timers are kept in four levels of 64 slots. A level 0 slot spans 1024 us,
+ * and each slot of a higher level spans a whole turn of the level below, so
+ * that the wheel reaches about 4.7 hours ahead. A timer goes into the lowest
+ * level whose current turn contains its expiry, and moves down (cascades)
+ * when the wheel reaches its slot. Bitmaps of the occupied slots make
+ * finding the next event cheap without ticking through empty slots.
+ *
+ * The wheel is driven by one SDK timer, which has ms resolution. It wakes
+ * about a millisecond before the next expiry, and the remainder is waited on
+ * the FRC1 hardware timer, unless another module owns it. The hardware timer
+ * is held only for that final wait, and released on every wakeup before any
+ * timer fires, so that callbacks can start modules which need FRC1 themselves.
+ */
+#include "timer_wheel.h"
+#include "platform.h"
+#include "hw_timer.h"
+#include "c_stdlib.h"
+#include "c_string.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "task/task.h"
+
+#define TW_LEVELS   4
+#define TW_SLOTS    64
+#define TW_SHIFT(l) (10 + 6 * (l))
+#define TW_BIT(i)   ((uint64_t)1 << (i))
+
+#define TW_HW_US    2000      // waits shorter than this go to the hardware timer
+#define TW_MIN_US   10        // shortest wait of the hardware timer
+#define TW_MAX_MS   60000     // longest wait on the SDK timer
+#define TW_BURST    16        // timers fired before yielding to other tasks
+
+static const os_param_t TW_HW_OWNER = 0x74776865; // "twhe"
+
+typedef struct {
+  tw_timer_t *slot[TW_LEVELS][TW_SLOTS];
+  uint64_t used[TW_LEVELS];
+  uint64_t base;              // the wheel has cascaded up to here
+  uint32_t count;
+} wheel_t;
+
+typedef struct {
+  uint64_t when;
+  tw_timer_t *timer;          // for level 0
+  unsigned level, idx;
+} event_t;
+
+static wheel_t *wheel;
+static os_timer_t drv_timer;
+static task_handle_t drv_task;
+static uint8_t hw_owned, running, frozen;
+static uint64_t frozen_at;
+static uint32_t slack;
+static tw_stats_t stats;
+static uint32_t last_time, time_high;
+
+uint64_t tw_now( void )
+{
+  uint32_t t = system_get_time();
+
+  if (t < last_time)
+    time_high++;
+  last_time = t;
+  return ((uint64_t)time_high << 32) | t;
+}
+
+// time stands still for the wheel while it is frozen
+static uint64_t wheel_now( void )
+{
+  return frozen ? frozen_at : tw_now();
+}
+
+static uint64_t interval_us( const tw_timer_t *t )
+{
+  return (t->flags & TW_MS) ? (uint64_t)t->interval * 1000 : t->interval;
+}
+
+static void place( tw_timer_t *t )
+{
+  uint64_t e = t->expiry > wheel->base ? t->expiry : wheel->base;
+  unsigned l, idx;
+  tw_timer_t **head;
+
+  for (l = 0; l < TW_LEVELS - 1; l++)
+    if ((e >> TW_SHIFT(l + 1)) == (wheel->base >> TW_SHIFT(l + 1)))
+      break;
+  // the top level is a ring; anything beyond it waits in its last slot
+  if (l == TW_LEVELS - 1 && (e >> TW_SHIFT(l)) - (wheel->base >> TW_SHIFT(l)) >= TW_SLOTS)
+    e = ((wheel->base >> TW_SHIFT(l)) + TW_SLOTS - 1) << TW_SHIFT(l);
+  idx = (e >> TW_SHIFT(l)) & (TW_SLOTS - 1);
+
+  head = &wheel->slot[l][idx];
+  t->next = *head;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+  t->pos = l * TW_SLOTS + idx;
+  wheel->used[l] |= TW_BIT(idx);
+  wheel->count++;
+}
+
+static void detach( tw_timer_t *t )
+{
+  unsigned l = t->pos / TW_SLOTS, idx = t->pos % TW_SLOTS;
+
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->pprev = NULL;
+  if (!wheel->slot[l][idx])
+    wheel->used[l] &= ~TW_BIT(idx);
+  wheel->count--;
+}
+
+// Finds the earliest expiry, or else the next slot that has to cascade
+static bool next_event( event_t *ev )
+{
+  tw_timer_t *t;
+  uint64_t cur, used;
+  unsigned l, k;
+
+  if (wheel->used[0]) {
+    ev->level = 0;
+    ev->timer = wheel->slot[0][__builtin_ctzll(wheel->used[0])];
+    for (t = ev->timer->next; t; t = t->next)
+      if (t->expiry < ev->timer->expiry)
+        ev->timer = t;
+    ev->when = ev->timer->expiry;
+    return true;
+  }
+  for (l = 1; l < TW_LEVELS; l++) {
+    if (!(used = wheel->used[l]))
+      continue;
+    cur = wheel->base >> TW_SHIFT(l);
+    if (l < TW_LEVELS - 1) {
+      // occupied slots all lie ahead of cur in the current turn
+      ev->idx = __builtin_ctzll(used);
+      cur = (cur & ~(uint64_t)(TW_SLOTS - 1)) + ev->idx;
+    } else {
+      k = (cur + 1) & (TW_SLOTS - 1);
+      if (k)
+        used = (used >> k) | (used << (TW_SLOTS - k));
+      cur += 1 + __builtin_ctzll(used);
+      ev->idx = cur & (TW_SLOTS - 1);
+    }
+    ev->level = l;
+    ev->when = cur << TW_SHIFT(l);
+    return true;
+  }
+  return false;
+}
+
+static void cascade( const event_t *ev )
+{
+  tw_timer_t *t;
+
+  wheel->base = ev->when;
+  while ((t = wheel->slot[ev->level][ev->idx])) {
+    detach(t);
+    place(t);
+  }
+}
+
+static void fire( tw_timer_t *t, uint64_t now )
+{
+  uint32_t due = (uint32_t)t->expiry;
+  uint64_t interval;
+
+  detach(t);
+  stats.fired++;
+  if (t->expiry > now) {
+    stats.coalesced++;
+  } else {
+    uint64_t late = now - t->expiry;
+    if (late >= TW_LATE_US)
+      stats.late++;
+    if (late > stats.max_late)
+      stats.max_late = late > 0xffffffff ? 0xffffffff : late;
+  }
+  if (t->flags & TW_REPEAT) {
+    interval = interval_us(t);
+    t->expiry += interval;
+    // skip missed periods rather than firing them all at once
+    if (t->expiry + interval <= now)
+      t->expiry = now + interval;
+    place(t);
+  }
+  t->fn(t, due);
+}
+
+static void ICACHE_RAM_ATTR hw_cb( os_param_t arg )
+{
+  task_post_high(drv_task, 1);
+}
+
+static bool claim_hw( void )
+{
+  if (!hw_owned) {
+    if (!platform_hw_timer_init(TW_HW_OWNER, FRC1_SOURCE, FALSE))
+      return false;
+    platform_hw_timer_set_func(TW_HW_OWNER, hw_cb, 0);
+    hw_owned = 1;
+  }
+  return true;
+}
+
+static void release_hw( void )
+{
+  if (hw_owned) {
+    platform_hw_timer_close(TW_HW_OWNER);
+    hw_owned = 0;
+  }
+}
+
+static void schedule( void )
+{
+  event_t ev;
+  int64_t delta;
+  uint32_t ms;
+
+  if (running || frozen)
+    return;
+  os_timer_disarm(&drv_timer);
+  if (!next_event(&ev)) {
+    release_hw();
+    return;
+  }
+  delta = (int64_t)(ev.when - tw_now());
+  if (delta < TW_MIN_US) {
+    task_post_high(drv_task, 0);
+    return;
+  }
+  if (ev.level == 0 && delta < TW_HW_US && claim_hw()) {
+    platform_hw_timer_arm_us(TW_HW_OWNER, delta);
+    return;
+  }
+  release_hw();
+  if (ev.level == 0 && delta >= TW_HW_US)
+    ms = (delta - TW_HW_US / 2) / 1000;   // wake early, wait the rest on FRC1
+  else
+    ms = (delta + 999) / 1000;
+  os_timer_arm(&drv_timer, ms < TW_MAX_MS ? ms : TW_MAX_MS, 0);
+}
+
+static void run( void )
+{
+  event_t ev;
+  uint64_t now;
+  int64_t delta;
+  unsigned n = 0;
+
+  if (frozen)
+    return;
+  running = 1;
+  stats.wakeups++;
+  release_hw();
+  while (next_event(&ev)) {
+    now = tw_now();
+    delta = (int64_t)(ev.when - now);
+    if (ev.level) {
+      if (delta >= TW_MIN_US)
+        break;
+      cascade(&ev);
+      continue;
+    }
+    if (delta > (int64_t)slack) {
+      if (delta >= TW_MIN_US)
+        break;
+      os_delay_us(delta);   // too short for the hardware timer
+      now = ev.when;
+    }
+    if (n++ == TW_BURST) {
+      running = 0;
+      task_post_high(drv_task, 0);
+      return;
+    }
+    fire(ev.timer, now);
+  }
+  running = 0;
+  schedule();
+}
+
+static void drv_timer_cb( void *arg )
+{
+  run();
+}
+
+static void drv_task_cb( task_param_t param, uint8 prio )
+{
+  if (param)
+    stats.hw++;
+  run();
+}
+
+static bool wheel_init( void )
+{
+  if (!(wheel = (wheel_t *)c_zalloc(sizeof(wheel_t))))
+    return false;
+  drv_task = task_get_id(drv_task_cb);
+  os_timer_disarm(&drv_timer);
+  os_timer_setfn(&drv_timer, drv_timer_cb, NULL);
+  return true;
+}
+
+void tw_init( tw_timer_t *t, tw_fn_t fn )
+{
+  c_memset(t, 0, sizeof(*t));
+  t->fn = fn;
+}
+
+bool tw_arm( tw_timer_t *t, uint32_t interval, uint8_t flags )
+{
+  uint64_t now;
+
+  if (!wheel && !wheel_init())
+    return false;
+  if (t->pprev)
+    detach(t);
+  now = wheel_now();
+  if (!wheel->count)
+    wheel->base = now;
+  t->interval = interval;
+  t->flags = flags & (TW_REPEAT | TW_MS);
+  t->expiry = now + interval_us(t);
+  place(t);
+  schedule();
+  return true;
+}
+
+// The SDK timer is left to run out, a wakeup with nothing to do is cheaper
+// than looking for the next event on every cancel.
+void tw_disarm( tw_timer_t *t )
+{
+  if (t->pprev)
+    detach(t);
+  t->flags &= ~TW_SUSPENDED;
+}
+
+bool tw_suspend( tw_timer_t *t )
+{
+  uint64_t now;
+
+  if (!t->pprev)
+    return false;
+  detach(t);
+  now = wheel_now();
+  t->expiry = t->expiry > now ? t->expiry - now : 0;
+  t->flags |= TW_SUSPENDED;
+  return true;
+}
+
+bool tw_resume( tw_timer_t *t )
+{
+  uint64_t now;
+
+  if (!(t->flags & TW_SUSPENDED))
+    return false;
+  t->flags &= ~TW_SUSPENDED;
+  now = wheel_now();
+  if (!wheel->count)
+    wheel->base = now;
+  t->expiry += now;
+  place(t);
+  schedule();
+  return true;
+}
+
+// The SDK timer is suspended by swtmr_suspend(NULL) anyway; this keeps the
+// hardware timer from firing meanwhile, and shifts all expiries by the time
+// spent suspended on thawing, so that timers keep their remaining time and
+// their due times leave the suspension out.
+void tw_freeze( void )
+{
+  if (frozen)
+    return;
+  frozen = 1;
+  frozen_at = tw_now();
+  release_hw();
+}
+
+void tw_thaw( void )
+{
+  tw_timer_t *list = NULL, *t;
+  uint64_t span;
+  unsigned l, idx;
+
+  if (!frozen)
+    return;
+  frozen = 0;
+  if (!wheel)
+    return;
+  span = tw_now() - frozen_at;
+  for (l = 0; l < TW_LEVELS; l++)
+    for (idx = 0; idx < TW_SLOTS; idx++)
+      while ((t = wheel->slot[l][idx])) {
+        detach(t);
+        t->next = list;
+        list = t;
+      }
+  wheel->base += span;
+  while ((t = list)) {
+    list = t->next;
+    t->expiry += span;
+    place(t);
+  }
+  schedule();
+}
+
+void tw_set_slack( uint32_t us )
+{
+  slack = us;
+}
+
+uint32_t tw_get_slack( void )
+{
+  return slack;
+}
+
+void tw_get_stats( tw_stats_t *s )
+{
+  *s = stats;
+  s->timers = wheel ? wheel->count : 0;
+}
+
+void tw_reset_stats( void )
+{
+  c_memset(&stats, 0, sizeof(stats));
+}
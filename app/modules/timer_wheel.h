@@ -0,0 +1,67 @@
+#ifndef APP_MODULES_TIMER_WHEEL_H_
+#define APP_MODULES_TIMER_WHEEL_H_
+
+#include "c_types.h"
+
+/*
+ * A hierarchical timer wheel that multiplexes any number of timers onto a
+ * single SDK timer, with the FRC1 hardware timer used for the last few
+ * milliseconds before an expiry where it is available. Arming and cancelling
+ * a timer are O(1), and timers run in task context.
+ */
+
+#define TW_REPEAT     0x01      // rearm with the same interval after each expiry
+#define TW_MS         0x02      // the interval is in ms rather than us
+#define TW_SUSPENDED  0x80      // expiry holds the time that was left
+
+typedef struct tw_timer tw_timer_t;
+// due is the system_get_time() at which the timer expired
+typedef void (*tw_fn_t)( tw_timer_t *t, uint32_t due );
+
+struct tw_timer {
+  tw_timer_t *next, **pprev;  // pprev is NULL while the timer is not armed
+  uint64_t expiry;
+  uint32_t interval;
+  tw_fn_t fn;
+  uint8_t flags;
+  uint8_t pos;                // level and slot
+};
+
+typedef struct {
+  uint32_t timers;            // armed
+  uint32_t fired;
+  uint32_t wakeups;
+  uint32_t hw;                // wakeups from the hardware timer
+  uint32_t coalesced;         // fired early, together with an earlier timer
+  uint32_t late;              // fired at least TW_LATE_US after expiry
+  uint32_t max_late;          // us
+} tw_stats_t;
+
+#define TW_LATE_US 1000
+
+void tw_init( tw_timer_t *t, tw_fn_t fn );
+// Returns false if the wheel could not be allocated
+bool tw_arm( tw_timer_t *t, uint32_t interval, uint8_t flags );
+void tw_disarm( tw_timer_t *t );
+#define tw_armed(t)     ((t)->pprev != NULL)
+
+bool tw_suspend( tw_timer_t *t );
+bool tw_resume( tw_timer_t *t );
+#define tw_suspended(t) (((t)->flags & TW_SUSPENDED) != 0)
+
+// Around swtmr_suspend(NULL) and swtmr_resume(NULL): no timer fires while
+// frozen, and thawing delays them all by the time spent frozen
+void tw_freeze( void );
+void tw_thaw( void );
+
+// Timers due within slack us of each other are fired on the same wakeup
+void tw_set_slack( uint32_t us );
+uint32_t tw_get_slack( void );
+
+void tw_get_stats( tw_stats_t *stats );
+void tw_reset_stats( void );
+
+// system_get_time() extended to 64 bits
+uint64_t tw_now( void );
+
+#endif
@@ -615,6 +615,43 @@ static int tls_cert_verify(lua_State *L)
   return 1;
 }
 
+// Lua: tls.setMaxFragmentLength(length)
+static int tls_set_max_fragment_length(lua_State *L) {
+  int len = luaL_checkint( L, 1 );
+  luaL_argcheck(L, len >= 0 && len <= 4096 &&
+                espconn_secure_set_max_fragment_length(ESPCONN_CLIENT, len),
+                1, "must be 0, 512, 1024, 2048 or 4096");
+  return 0;
+}
+
+// Lua: tls.bufstats() -> { { ip =, port =, inbuf =, outbuf =, mfl = }, ... }
+static int tls_bufstats(lua_State *L) {
+  espconn_secure_buffer info[linkMax];
+  uint8 n = espconn_secure_get_buffer_info(info, linkMax);
+  char temp[20];
+  int i;
+
+  lua_createtable(L, n, 0);
+  for (i = 0; i < n; i++) {
+    lua_createtable(L, 0, 5);
+    if (info[i].pespconn && info[i].pespconn->proto.tcp) {
+      c_sprintf(temp, IPSTR, IP2STR( &(info[i].pespconn->proto.tcp->remote_ip) ) );
+      lua_pushstring(L, temp);
+      lua_setfield(L, -2, "ip");
+      lua_pushinteger(L, info[i].pespconn->proto.tcp->remote_port);
+      lua_setfield(L, -2, "port");
+    }
+    lua_pushinteger(L, info[i].in_size);
+    lua_setfield(L, -2, "inbuf");
+    lua_pushinteger(L, info[i].out_size);
+    lua_setfield(L, -2, "outbuf");
+    lua_pushinteger(L, info[i].max_frag_len);
+    lua_setfield(L, -2, "mfl");
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
 #if defined(MBEDTLS_DEBUG_C)
 static int tls_set_debug_threshold(lua_State *L) {
   mbedtls_debug_set_threshold(luaL_checkint( L, 1 ));
@@ -645,6 +682,8 @@ const LUA_REG_TYPE tls_cert_map[] = {
 
 static const LUA_REG_TYPE tls_map[] = {
   { LSTRKEY( "createConnection" ), LFUNCVAL( tls_socket_create ) },
+  { LSTRKEY( "setMaxFragmentLength" ), LFUNCVAL( tls_set_max_fragment_length ) },
+  { LSTRKEY( "bufstats" ),         LFUNCVAL( tls_bufstats ) },
 #if defined(MBEDTLS_DEBUG_C)
   { LSTRKEY( "setDebug" ),         LFUNCVAL( tls_set_debug_threshold ) },
 #endif
@@ -46,6 +46,15 @@ tmr.softwd(int)
 	any other value starts the timer, when the
 	countdown reaches zero, the device restarts
 	the timer units are seconds
+t:register_us(interval, mode, function)
+	as register, with the interval in us
+tmr.slack(us)
+	timers due within us of each other fire together
+tmr.stats([reset])
+	ret: table of timer wheel counters
+
+All timers are multiplexed onto a single SDK timer by the
+timer wheel in timer_wheel.c.
 */
 
 #include "module.h"
@@ -54,6 +63,8 @@ tmr.softwd(int)
 #include "c_types.h"
 #include "user_interface.h"
 #include "swTimer/swTimer.h"
+#include "callback.h"
+#include "timer_wheel.h"
 
 #define TIMER_MODE_OFF 3
 #define TIMER_MODE_SINGLE 0
@@ -71,11 +82,16 @@ tmr.softwd(int)
 static const uint32 MAX_TIMEOUT=MAX_TIMEOUT_DEF;
 static const char* MAX_TIMEOUT_ERR_STR = "Range: 1-"STRINGIFY(MAX_TIMEOUT_DEF);
 
+// shorter auto-repeat intervals would keep the task queue from draining
+#define MIN_TIMEOUT_US 100
+static const char* MIN_TIMEOUT_US_ERR_STR = "must be >= "STRINGIFY(MIN_TIMEOUT_US);
+
 typedef struct{
-	os_timer_t os;
+	tw_timer_t tw;
 	sint32_t lua_ref, self_ref;
 	uint32_t interval;
 	uint8_t mode;
+	uint8_t unit;	// TW_MS, or 0 for register_us timers
 }timer_struct_t;
 typedef timer_struct_t* timer_t;
 
@@ -95,9 +111,10 @@ static uint64_t last_rtc_time_us=0;
 static sint32_t soft_watchdog  = -1;
 static timer_struct_t alarm_timers[NUM_TMR];
 static os_timer_t rtc_timer;
+static cb_source_t cb_tmr = CB_SOURCE("tmr");
 
-static void alarm_timer_common(void* arg){
-	timer_t tmr = (timer_t)arg;
+static void alarm_timer_common(tw_timer_t* tw, uint32_t due){
+	timer_t tmr = (timer_t)tw;
 	lua_State* L = lua_getstate();
 	if(tmr->lua_ref == LUA_NOREF)
 		return;
@@ -120,7 +137,7 @@ static void alarm_timer_common(void* arg){
 		luaL_unref(L, LUA_REGISTRYINDEX, tmr->self_ref);
 		tmr->self_ref = LUA_NOREF;
 	}
-	lua_call(L, 1, 0);
+	cb_call(L, &cb_tmr, 1, due);
 }
 
 // Lua: tmr.delay( us )
@@ -160,31 +177,55 @@ static timer_t tmr_get( lua_State *L, int stack ) {
 	return 0;
 }
 
-// Lua: tmr.register( id / ref, interval, mode, function )
-static int tmr_register(lua_State* L){
+static void tmr_arm(lua_State* L, timer_t tmr){
+	uint8_t flags = tmr->unit;
+	if((tmr->mode & ~TIMER_IDLE_FLAG) == TIMER_MODE_AUTO)
+		flags |= TW_REPEAT;
+	if(!tw_arm(&tmr->tw, tmr->interval, flags))
+		luaL_error(L, "not enough memory");
+}
+
+static void tmr_check_interval(lua_State* L, uint8_t unit, sint32_t interval){
+	if(unit == TW_MS)
+		luaL_argcheck(L, (interval > 0 && (uint32_t)interval <= MAX_TIMEOUT), 2, MAX_TIMEOUT_ERR_STR);
+	else
+		luaL_argcheck(L, interval >= MIN_TIMEOUT_US, 2, MIN_TIMEOUT_US_ERR_STR);
+}
+
+static int tmr_register_common(lua_State* L, uint8_t unit){
 	timer_t tmr = tmr_get(L, 1);
 
-	uint32_t interval = luaL_checkinteger(L, 2);
+	sint32_t interval = luaL_checkinteger(L, 2);
 	uint8_t mode = luaL_checkinteger(L, 3);
 
-	luaL_argcheck(L, (interval > 0 && interval <= MAX_TIMEOUT), 2, MAX_TIMEOUT_ERR_STR);
+	tmr_check_interval(L, unit, interval);
 	luaL_argcheck(L, (mode == TIMER_MODE_SINGLE || mode == TIMER_MODE_SEMI || mode == TIMER_MODE_AUTO), 3, "Invalid mode");
 	luaL_argcheck(L, (lua_type(L, 4) == LUA_TFUNCTION || lua_type(L, 4) == LUA_TLIGHTFUNCTION), 4, "Must be function");
 	//get the lua function reference
 	lua_pushvalue(L, 4);
 	sint32_t ref = luaL_ref(L, LUA_REGISTRYINDEX);
 	if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF)
-		os_timer_disarm(&tmr->os);
+		tw_disarm(&tmr->tw);
 	//there was a bug in this part, the second part of the following condition was missing
 	if(tmr->lua_ref != LUA_NOREF && tmr->lua_ref != ref)
 		luaL_unref(L, LUA_REGISTRYINDEX, tmr->lua_ref);
 	tmr->lua_ref = ref;
 	tmr->mode = mode|TIMER_IDLE_FLAG;
 	tmr->interval = interval;
-	os_timer_setfn(&tmr->os, alarm_timer_common, tmr);
+	tmr->unit = unit;
 	return 0;  
 }
 
+// Lua: tmr.register( id / ref, interval, mode, function )
+static int tmr_register(lua_State* L){
+	return tmr_register_common(L, TW_MS);
+}
+
+// Lua: t:register_us( interval, mode, function )
+static int tmr_register_us(lua_State* L){
+	return tmr_register_common(L, 0);
+}
+
 // Lua: tmr.start( id / ref )
 static int tmr_start(lua_State* L){
 	timer_t tmr = tmr_get(L, 1);
@@ -198,8 +239,8 @@ static int tmr_start(lua_State* L){
 	if(!(tmr->mode&TIMER_IDLE_FLAG)){
 		lua_pushboolean(L, 0);
 	}else{
+		tmr_arm(L, tmr);
 		tmr->mode &= ~TIMER_IDLE_FLAG;
-		os_timer_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
 		lua_pushboolean(L, 1);
 	}
 	return 1;
@@ -223,7 +264,7 @@ static int tmr_stop(lua_State* L){
 	//we return false if the timer is idle (of not registered)
 	if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF){
 		tmr->mode |= TIMER_IDLE_FLAG;
-		os_timer_disarm(&tmr->os);
+		tw_disarm(&tmr->tw);
 		lua_pushboolean(L, 1);
 	}else{
 		lua_pushboolean(L, 0);
@@ -236,37 +277,23 @@ static int tmr_stop(lua_State* L){
 static int tmr_suspend(lua_State* L){
   timer_t tmr = tmr_get(L, 1);
 
-  if((tmr->mode & TIMER_IDLE_FLAG) == 1){
-    return luaL_error(L, "timer not armed");
-  }
-
-  int retval = swtmr_suspend(&tmr->os);
-
-  if(retval != SWTMR_OK){
-    return luaL_error(L, swtmr_errorcode2str(retval));
+  if(tw_suspended(&tmr->tw)){
+    return luaL_error(L, swtmr_errorcode2str(SWTMR_SUSPEND_TIMER_ALREADY_SUSPENDED));
   }
-  else{
-    lua_pushboolean(L, true);
+  if(!tw_suspend(&tmr->tw)){
+    return luaL_error(L, "timer not armed");
   }
-
+  lua_pushboolean(L, true);
   return 1;
 }
 
 static int tmr_resume(lua_State* L){
   timer_t tmr = tmr_get(L, 1);
 
-  if(swtmr_suspended_test(&tmr->os) == FALSE){
+  if(!tw_resume(&tmr->tw)){
     return luaL_error(L, "timer not suspended");
   }
-
-  int retval = swtmr_resume(&tmr->os);
-
-  if(retval != SWTMR_OK){
-    return luaL_error(L, swtmr_errorcode2str(retval));
-  }
-  else{
   lua_pushboolean(L, true);
-  }
   return 1;
 }
 
@@ -278,6 +305,7 @@ static int tmr_suspend_all (lua_State *L)
     return luaL_error(L, swtmr_errorcode2str(retval));
   }
   else{
+    tw_freeze();
     lua_pushboolean(L, true);
   }
   return 1;
@@ -286,6 +314,7 @@ static int tmr_suspend_all (lua_State *L)
 static int tmr_resume_all (lua_State *L)
 {
   sint32 retval = swtmr_resume(NULL);
+  tw_thaw();
   if(retval!=SWTMR_OK){
     return luaL_error(L, swtmr_errorcode2str(retval));
   }
@@ -308,7 +337,7 @@ static int tmr_unregister(lua_State* L){
 	}
 
 	if(!(tmr->mode & TIMER_IDLE_FLAG) && tmr->mode != TIMER_MODE_OFF)
-		os_timer_disarm(&tmr->os);
+		tw_disarm(&tmr->tw);
 	if(tmr->lua_ref != LUA_NOREF)
 		luaL_unref(L, LUA_REGISTRYINDEX, tmr->lua_ref);
 	tmr->lua_ref = LUA_NOREF;
@@ -320,14 +349,12 @@ static int tmr_unregister(lua_State* L){
 static int tmr_interval(lua_State* L){
 	timer_t tmr = tmr_get(L, 1);
 
-	uint32_t interval = luaL_checkinteger(L, 2);
-	luaL_argcheck(L, (interval > 0 && interval <= MAX_TIMEOUT), 2, MAX_TIMEOUT_ERR_STR);
+	sint32_t interval = luaL_checkinteger(L, 2);
+	tmr_check_interval(L, tmr->mode == TIMER_MODE_OFF ? TW_MS : tmr->unit, interval);
 	if(tmr->mode != TIMER_MODE_OFF){	
 		tmr->interval = interval;
-		if(!(tmr->mode&TIMER_IDLE_FLAG)){
-			os_timer_disarm(&tmr->os);
-			os_timer_arm(&tmr->os, tmr->interval, tmr->mode==TIMER_MODE_AUTO);
-		}
+		if(!(tmr->mode&TIMER_IDLE_FLAG))
+			tmr_arm(L, tmr);
 	}
 	return 0;
 }
@@ -344,7 +371,7 @@ static int tmr_state(lua_State* L){
   lua_pushboolean(L, (tmr->mode & TIMER_IDLE_FLAG) == 0);
   lua_pushinteger(L, tmr->mode & (~TIMER_IDLE_FLAG));
 #ifdef ENABLE_TIMER_SUSPEND
-  lua_pushboolean(L, swtmr_suspended_test(&tmr->os));
+  lua_pushboolean(L, tw_suspended(&tmr->tw));
 #else
   lua_pushnil(L);
 #endif
@@ -423,7 +450,43 @@ static int tmr_create( lua_State *L ) {
 	ud->lua_ref = LUA_NOREF;
 	ud->self_ref = LUA_NOREF;
 	ud->mode = TIMER_MODE_OFF;
-	os_timer_disarm(&ud->os);
+	tw_init(&ud->tw, alarm_timer_common);
+	return 1;
+}
+
+// Lua: tmr.slack( [us] )
+static int tmr_slack( lua_State *L ) {
+	uint32_t old = tw_get_slack();
+	if(!lua_isnoneornil(L, 1)){
+		sint32_t us = luaL_checkinteger(L, 1);
+		luaL_argcheck(L, us >= 0, 1, "must be >= 0");
+		tw_set_slack(us);
+	}
+	lua_pushinteger(L, old);
+	return 1;
+}
+
+// Lua: tmr.stats( [reset] )
+static int tmr_stats( lua_State *L ) {
+	tw_stats_t st;
+	tw_get_stats(&st);
+	lua_createtable(L, 0, 7);
+	lua_pushinteger(L, st.timers);
+	lua_setfield(L, -2, "timers");
+	lua_pushinteger(L, st.fired);
+	lua_setfield(L, -2, "fired");
+	lua_pushinteger(L, st.wakeups);
+	lua_setfield(L, -2, "wakeups");
+	lua_pushinteger(L, st.hw);
+	lua_setfield(L, -2, "hw");
+	lua_pushinteger(L, st.coalesced);
+	lua_setfield(L, -2, "coalesced");
+	lua_pushinteger(L, st.late);
+	lua_setfield(L, -2, "late");
+	lua_pushinteger(L, st.max_late);
+	lua_setfield(L, -2, "maxlate");
+	if(lua_toboolean(L, 1))
+		tw_reset_stats();
 	return 1;
 }
 
@@ -448,6 +511,7 @@ static void tmr_printTimerlist(lua_State* L){
 
 static const LUA_REG_TYPE tmr_dyn_map[] = {
 	{ LSTRKEY( "register" ),    LFUNCVAL( tmr_register ) },
+	{ LSTRKEY( "register_us" ), LFUNCVAL( tmr_register_us ) },
 	{ LSTRKEY( "alarm" ),       LFUNCVAL( tmr_alarm ) },
 	{ LSTRKEY( "start" ),       LFUNCVAL( tmr_start ) },
 	{ LSTRKEY( "stop" ),        LFUNCVAL( tmr_stop ) },
@@ -492,6 +556,8 @@ static const LUA_REG_TYPE tmr_map[] = {
 	{ LSTRKEY( "state" ),        LFUNCVAL( tmr_state ) },
 	{ LSTRKEY( "interval" ),     LFUNCVAL( tmr_interval ) },
 	{ LSTRKEY( "create" ),       LFUNCVAL( tmr_create ) },
+	{ LSTRKEY( "slack" ),        LFUNCVAL( tmr_slack ) },
+	{ LSTRKEY( "stats" ),        LFUNCVAL( tmr_stats ) },
 #if defined(ENABLE_TIMER_SUSPEND) && defined(SWTMR_DEBUG)
   { LSTRKEY( "debug" ),       LROVAL( tmr_dbg_map ) },
 #endif
@@ -510,8 +576,7 @@ int luaopen_tmr( lua_State *L ){
 		alarm_timers[i].lua_ref = LUA_NOREF;
 		alarm_timers[i].self_ref = LUA_REFNIL;
 		alarm_timers[i].mode = TIMER_MODE_OFF;
-		//improve boot speed by using ets_timer_disarm instead of os_timer_disarm to avoid timer registry maintenance call.
-		ets_timer_disarm(&alarm_timers[i].os);
+		tw_init(&alarm_timers[i].tw, alarm_timer_common);
 	}
 	last_rtc_time=system_get_rtc_time(); // Right now is time 0
 	last_rtc_time_us=0;
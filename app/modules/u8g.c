@@ -3,6 +3,8 @@
 #include "module.h"
 #include "lauxlib.h"
 #include "lmem.h"
+#include "c_string.h"
+#include "user_interface.h"
 
 #include "u8g.h"
 #include "u8g_glue.h"
@@ -614,6 +616,7 @@ static int lu8g_firstPage( lua_State *L )
     if ((lud = get_lud( L )) == NULL)
         return 0;
 
+    lud->frame_start = system_get_time();
     u8g_FirstPage( LU8G );
 
     return 0;
@@ -627,11 +630,180 @@ static int lu8g_nextPage( lua_State *L )
     if ((lud = get_lud( L )) == NULL)
         return 0;
 
-    lua_pushboolean( L, u8g_NextPage( LU8G ) );
+    uint32_t start = system_get_time();
+    uint8_t more = u8g_NextPage( LU8G );
+    if (!more) {
+        uint32_t now = system_get_time();
+        if (lud->fb)
+            lud->flush_us = now - start;
+        lud->frame_us = now - lud->frame_start;
+    }
+    lua_pushboolean( L, more );
+
+    return 1;
+}
+
+// Column address of x = 0 for controllers with the SSD1306 command set, which
+// lets a full buffer flush send only the changed columns. -1 for all others.
+static int8_t lu8g_column_offset( const char *device )
+{
+    if (c_strncmp( device, "ssd1306_64x48", 13 ) == 0)
+        return 32;
+    if (c_strncmp( device, "ssd1306_", 8 ) == 0 || c_strncmp( device, "ssd1309_", 8 ) == 0)
+        return 0;
+    if (c_strncmp( device, "sh1106_", 7 ) == 0)
+        return 2;
+    return -1;
+}
+
+// u8glib implements rotation and scaling as devices wrapping the display
+extern u8g_dev_t u8g_dev_rot, u8g_dev_scale;
+
+// take rotation and scaling off the device, outermost first
+static uint8_t lu8g_unwrap( u8g_t *u8g, u8g_dev_t **wrap )
+{
+    uint8_t n = 0;
+
+    while (n < 2 && (u8g->dev == &u8g_dev_rot || u8g->dev == &u8g_dev_scale)) {
+        wrap[n++] = u8g->dev;
+        u8g->dev = (u8g_dev_t *)u8g->dev->dev_mem;
+    }
+    return n;
+}
+
+// put back what lu8g_unwrap took off, around the current device
+static void lu8g_rewrap( u8g_t *u8g, u8g_dev_t **wrap, uint8_t n )
+{
+    while (n--) {
+        wrap[n]->dev_mem = u8g->dev;
+        u8g->dev = wrap[n];
+    }
+    u8g_UpdateDimension( u8g );
+}
+
+static void lu8g_free_fb( lua_State *L, lu8g_userdata_t *lud )
+{
+    lu8g_fb_t *fb = lud->fb;
+    u8g_dev_t *wrap[2];
+    uint8_t nwrap = lu8g_unwrap( LU8G, wrap );
+
+    LU8G->dev = fb->target;
+    lud->fb = NULL;
+    luaM_freemem( L, fb, fb->size );
+    lu8g_rewrap( LU8G, wrap, nwrap );
+}
+
+// helper function: retrieve userdata argument which must be in full buffer mode
+static lu8g_fb_t *get_fb( lua_State *L, lu8g_userdata_t *lud )
+{
+    if (!lud->fb)
+        luaL_error( L, "full buffer mode not enabled" );
+    return lud->fb;
+}
+
+// Lua: u8g.setFullBuffer( self, enable )
+static int lu8g_setFullBuffer( lua_State *L )
+{
+    lu8g_userdata_t *lud;
+
+    if ((lud = get_lud( L )) == NULL)
+        return 0;
+
+    int enable = lua_toboolean( L, 2 );
+    if (!enable) {
+        if (lud->fb)
+            lu8g_free_fb( L, lud );
+        return 0;
+    }
+    if (lud->fb)
+        return 0;
+
+    // the framebuffer replaces the display device underneath any rotation or scaling
+    u8g_dev_t *wrap[2];
+    uint8_t nwrap = lu8g_unwrap( LU8G, wrap );
+
+    u8g_dev_t *target = LU8G->dev;
+    u8g_pb_t *pb = (u8g_pb_t *)(target->dev_mem);
+    if (lud->cb_ref != LUA_NOREF || u8g_GetMode( LU8G ) != U8G_MODE_BW || pb->p.page_height != 8) {
+        lu8g_rewrap( LU8G, wrap, nwrap );
+        return luaL_error( L, "full buffer not supported by this display" );
+    }
+
+    unsigned pages = (pb->p.total_height + 7) / 8;
+    size_t fbsize = pages * pb->width;
+    size_t size = sizeof( lu8g_fb_t ) + 2 * pages * sizeof( u8g_uint_t ) + 2 * fbsize;
+    lu8g_fb_t *fb = (lu8g_fb_t *)luaM_malloc( L, size );
+
+    fb->dev.dev_fn  = u8g_dev_fullbuf_fn;
+    fb->dev.dev_mem = fb;
+    fb->dev.com_fn  = target->com_fn;
+    fb->target   = target;
+    fb->dirty_x0 = (u8g_uint_t *)(fb + 1);
+    fb->dirty_x1 = fb->dirty_x0 + pages;
+    fb->buf      = (uint8_t *)(fb->dirty_x1 + pages);
+    fb->shadow   = fb->buf + fbsize;
+    fb->size     = size;
+    fb->bytes    = 0;
+    fb->pages    = pages;
+    fb->col_offset = lud->col_offset;
+    fb->force    = 1;   // first flush sends everything
+    c_memset( fb->shadow, 0, fbsize );
+    c_memset( fb->dirty_x1, 0, pages * sizeof( u8g_uint_t ) );
+    c_memset( fb->dirty_x0, 0xff, pages * sizeof( u8g_uint_t ) );
+    lu8g_fb_clear( fb );
+
+    lud->fb = fb;
+    LU8G->dev = &fb->dev;
+    lu8g_rewrap( LU8G, wrap, nwrap );
+
+    return 0;
+}
+
+// Lua: u8g.clearBuffer( self )
+static int lu8g_clearBuffer( lua_State *L )
+{
+    lu8g_userdata_t *lud;
+
+    if ((lud = get_lud( L )) == NULL)
+        return 0;
+
+    lu8g_fb_clear( get_fb( L, lud ) );
+
+    return 0;
+}
+
+// Lua: bytes = u8g.flush( self )
+static int lu8g_flush( lua_State *L )
+{
+    lu8g_userdata_t *lud;
+
+    if ((lud = get_lud( L )) == NULL)
+        return 0;
+
+    lu8g_fb_t *fb = get_fb( L, lud );
+    uint32_t start = system_get_time();
+    lu8g_fb_flush( LU8G, fb );
+    lud->flush_us = system_get_time() - start;
+    lua_pushinteger( L, fb->bytes );
 
     return 1;
 }
 
+// Lua: frame_us, flush_us, bytes = u8g.getStats( self )
+static int lu8g_getStats( lua_State *L )
+{
+    lu8g_userdata_t *lud;
+
+    if ((lud = get_lud( L )) == NULL)
+        return 0;
+
+    lua_pushinteger( L, lud->frame_us );
+    lua_pushinteger( L, lud->flush_us );
+    lua_pushinteger( L, lud->fb ? lud->fb->bytes : 0 );
+
+    return 3;
+}
+
 // Lua: u8g.sleepOn( self )
 static int lu8g_sleepOn( lua_State *L )
 {
@@ -777,6 +949,9 @@ static int lu8g_close_display( lua_State *L )
     if ((lud = get_lud( L )) == NULL)
         return 0;
 
+    if (lud->fb)
+        lu8g_free_fb( L, lud );
+
     if (lud->cb_ref != LUA_NOREF) {
         // this is the fb_rle device
         u8g_dev_t *fb_dev = LU8G->dev;
@@ -810,7 +985,9 @@ static int lu8g_close_display( lua_State *L )
             return luaL_error( L, "i2c address required" );             \
                                                                         \
         lu8g_userdata_t *lud = (lu8g_userdata_t *) lua_newuserdata( L, sizeof( lu8g_userdata_t ) ); \
+        c_memset( lud, 0, sizeof( lu8g_userdata_t ) );                  \
         lud->cb_ref = LUA_NOREF;                                        \
+        lud->col_offset = lu8g_column_offset( #device );                \
                                                                         \
         lud->i2c_addr = (uint8_t)addr;                                  \
         lud->use_delay = del > 0 ? 1 : 0;                               \
@@ -844,7 +1021,9 @@ U8G_DISPLAY_TABLE_I2C
         unsigned del = luaL_optinteger( L, 4, 0 );                      \
                                                                         \
         lu8g_userdata_t *lud = (lu8g_userdata_t *) lua_newuserdata( L, sizeof( lu8g_userdata_t ) ); \
+        c_memset( lud, 0, sizeof( lu8g_userdata_t ) );                  \
         lud->cb_ref = LUA_NOREF;                                        \
+        lud->col_offset = lu8g_column_offset( #device );                \
                                                                         \
         lud->use_delay = del > 0 ? 1 : 0;                               \
                                                                         \
@@ -895,6 +1074,8 @@ static int lu8g_fb_rle( lua_State *L ) {
     fb_dev->com_fn = u8g_com_esp8266_fbrle_fn;
 
     lud = (lu8g_userdata_t *) lua_newuserdata( L, sizeof( lu8g_userdata_t ) );
+    c_memset( lud, 0, sizeof( lu8g_userdata_t ) );
+    lud->col_offset = -1;
     lua_pushvalue( L, 1 );  // copy argument (func) to the top of stack
     lud->cb_ref = luaL_ref( L, LUA_REGISTRYINDEX );
 
@@ -913,6 +1094,7 @@ static int lu8g_fb_rle( lua_State *L ) {
 // Module function map
 static const LUA_REG_TYPE lu8g_display_map[] = {
   { LSTRKEY( "begin" ),                        LFUNCVAL( lu8g_begin ) },
+  { LSTRKEY( "clearBuffer" ),                  LFUNCVAL( lu8g_clearBuffer ) },
   { LSTRKEY( "drawBitmap" ),                   LFUNCVAL( lu8g_drawBitmap ) },
   { LSTRKEY( "drawBox" ),                      LFUNCVAL( lu8g_drawBox ) },
   { LSTRKEY( "drawCircle" ),                   LFUNCVAL( lu8g_drawCircle ) },
@@ -933,12 +1115,14 @@ static const LUA_REG_TYPE lu8g_display_map[] = {
   { LSTRKEY( "drawVLine" ),                    LFUNCVAL( lu8g_drawVLine ) },
   { LSTRKEY( "drawXBM" ),                      LFUNCVAL( lu8g_drawXBM ) },
   { LSTRKEY( "firstPage" ),                    LFUNCVAL( lu8g_firstPage ) },
+  { LSTRKEY( "flush" ),                        LFUNCVAL( lu8g_flush ) },
   { LSTRKEY( "getColorIndex" ),                LFUNCVAL( lu8g_getColorIndex ) },
   { LSTRKEY( "getFontAscent" ),                LFUNCVAL( lu8g_getFontAscent ) },
   { LSTRKEY( "getFontDescent" ),               LFUNCVAL( lu8g_getFontDescent ) },
   { LSTRKEY( "getFontLineSpacing" ),           LFUNCVAL( lu8g_getFontLineSpacing ) },
   { LSTRKEY( "getHeight" ),                    LFUNCVAL( lu8g_getHeight ) },
   { LSTRKEY( "getMode" ),                      LFUNCVAL( lu8g_getMode ) },
+  { LSTRKEY( "getStats" ),                     LFUNCVAL( lu8g_getStats ) },
   { LSTRKEY( "getStrWidth" ),                  LFUNCVAL( lu8g_getStrWidth ) },
   { LSTRKEY( "getWidth" ),                     LFUNCVAL( lu8g_getWidth ) },
   { LSTRKEY( "nextPage" ),                     LFUNCVAL( lu8g_nextPage ) },
@@ -955,6 +1139,7 @@ static const LUA_REG_TYPE lu8g_display_map[] = {
   { LSTRKEY( "setFontRefHeightAll" ),          LFUNCVAL( lu8g_setFontRefHeightAll ) },
   { LSTRKEY( "setFontRefHeightExtendedText" ), LFUNCVAL( lu8g_setFontRefHeightExtendedText ) },
   { LSTRKEY( "setFontRefHeightText" ),         LFUNCVAL( lu8g_setFontRefHeightText ) },
+  { LSTRKEY( "setFullBuffer" ),                LFUNCVAL( lu8g_setFullBuffer ) },
   { LSTRKEY( "setRot90" ),                     LFUNCVAL( lu8g_setRot90 ) },
   { LSTRKEY( "setRot180" ),                    LFUNCVAL( lu8g_setRot180 ) },
   { LSTRKEY( "setRot270" ),                    LFUNCVAL( lu8g_setRot270 ) },
@@ -6,6 +6,7 @@
 #include "platform.h"
 
 #include "c_stdlib.h"
+#include "c_string.h"
 
 #include "u8g.h"
 #include "u8g_glue.h"
@@ -345,3 +346,212 @@ uint8_t u8g_com_esp8266_fbrle_fn(u8g_t *u8g, uint8_t msg, uint8_t arg_val, void
     }
     return 1;
 }
+
+
+// ***************************************************************************
+// Full framebuffer device
+//
+// Drawing is forwarded to the display's own device with its page buffer
+// pointed into the framebuffer, so that any BW page layout is handled. The
+// columns touched per page are recorded and compared against a copy of what
+// was last sent, so a flush only transfers what actually changed.
+//
+static void fb_mark(lu8g_fb_t *fb, int page, int x0, int x1)
+{
+    u8g_pb_t *pb = (u8g_pb_t *)(fb->target->dev_mem);
+
+    if (page < 0 || page >= fb->pages)
+        return;
+    if (x0 < 0)
+        x0 = 0;
+    if (x1 >= pb->width)
+        x1 = pb->width - 1;
+    if (x0 > x1)
+        return;
+    if (x0 < fb->dirty_x0[page])
+        fb->dirty_x0[page] = x0;
+    if (x1 > fb->dirty_x1[page])
+        fb->dirty_x1[page] = x1;
+}
+
+static void fb_page_call(u8g_t *u8g, lu8g_fb_t *fb, int page, uint8_t msg, u8g_dev_arg_pixel_t *arg)
+{
+    u8g_pb_t *pb = (u8g_pb_t *)(fb->target->dev_mem);
+    u8g_dev_arg_pixel_t a = *arg;   // modified by the device
+    uint8_t *buf = pb->buf;
+
+    if (page < 0 || page >= fb->pages)
+        return;
+    pb->buf = fb->buf + page * pb->width;
+    pb->p.page = page;
+    pb->p.page_y0 = page * pb->p.page_height;
+    pb->p.page_y1 = pb->p.page_y0 + pb->p.page_height - 1;
+    if (pb->p.page_y1 >= pb->p.total_height)
+        pb->p.page_y1 = pb->p.total_height - 1;
+    u8g_call_dev_fn(u8g, fb->target, msg, &a);
+    pb->buf = buf;
+}
+
+static void fb_set_pixels(u8g_t *u8g, lu8g_fb_t *fb, uint8_t msg, u8g_dev_arg_pixel_t *arg)
+{
+    int x = arg->x, y = arg->y;
+    int page = y >> 3;
+
+    if (msg == U8G_DEV_MSG_SET_PIXEL) {
+        fb_mark(fb, page, x, x);
+        fb_page_call(u8g, fb, page, msg, arg);
+        return;
+    }
+    // 8 pixels may extend into the next or previous page
+    switch (arg->dir) {
+    case 0:
+        fb_mark(fb, page, x, x + 7);
+        fb_page_call(u8g, fb, page, msg, arg);
+        break;
+    case 1:
+        fb_mark(fb, page, x, x);
+        fb_page_call(u8g, fb, page, msg, arg);
+        if ((y & 7) != 0) {
+            fb_mark(fb, page + 1, x, x);
+            fb_page_call(u8g, fb, page + 1, msg, arg);
+        }
+        break;
+    case 2:
+        fb_mark(fb, page, x - 7, x);
+        fb_page_call(u8g, fb, page, msg, arg);
+        break;
+    default:
+        fb_mark(fb, page, x, x);
+        fb_page_call(u8g, fb, page, msg, arg);
+        if ((y & 7) != 7) {
+            fb_mark(fb, page - 1, x, x);
+            fb_page_call(u8g, fb, page - 1, msg, arg);
+        }
+        break;
+    }
+}
+
+void lu8g_fb_clear(lu8g_fb_t *fb)
+{
+    u8g_pb_t *pb = (u8g_pb_t *)(fb->target->dev_mem);
+    int page;
+
+    c_memset(fb->buf, 0, fb->pages * pb->width);
+    for (page = 0; page < fb->pages; page++)
+        fb_mark(fb, page, 0, pb->width - 1);
+}
+
+// Sends columns x0..x1 of a page straight to an SSD13xx style controller
+static void fb_send_columns(u8g_t *u8g, lu8g_fb_t *fb, int page, int x0, int x1)
+{
+    u8g_dev_t *dev = fb->target;
+    u8g_pb_t *pb = (u8g_pb_t *)(dev->dev_mem);
+    int col = x0 + fb->col_offset;
+
+    u8g_SetChipSelect(u8g, dev, 1);
+    u8g_SetAddress(u8g, dev, 0);            /* instruction mode */
+    u8g_WriteByte(u8g, dev, 0x0b0 | page);  /* select page */
+    u8g_WriteByte(u8g, dev, 0x010 | (col >> 4));
+    u8g_WriteByte(u8g, dev, 0x000 | (col & 0x0f));
+    u8g_SetAddress(u8g, dev, 1);            /* data mode */
+    u8g_WriteSequence(u8g, dev, x1 - x0 + 1, fb->buf + page * pb->width + x0);
+    u8g_SetChipSelect(u8g, dev, 0);
+}
+
+// Sends a whole page through the device's own page buffer, which it clears
+static void fb_send_page(u8g_t *u8g, lu8g_fb_t *fb, int page)
+{
+    u8g_dev_t *dev = fb->target;
+    u8g_pb_t *pb = (u8g_pb_t *)(dev->dev_mem);
+
+    c_memcpy(pb->buf, fb->buf + page * pb->width, pb->width);
+    pb->p.page = page;
+    pb->p.page_y0 = page * pb->p.page_height;
+    pb->p.page_y1 = pb->p.page_y0 + pb->p.page_height - 1;
+    if (pb->p.page_y1 >= pb->p.total_height)
+        pb->p.page_y1 = pb->p.total_height - 1;
+    u8g_call_dev_fn(u8g, dev, U8G_DEV_MSG_PAGE_NEXT, NULL);
+}
+
+uint32_t lu8g_fb_flush(u8g_t *u8g, lu8g_fb_t *fb)
+{
+    u8g_pb_t *pb = (u8g_pb_t *)(fb->target->dev_mem);
+    int width = pb->width;
+    int page, x0, x1;
+
+    fb->bytes = 0;
+    for (page = 0; page < fb->pages; page++) {
+        uint8_t *cur = fb->buf + page * width;
+        uint8_t *old = fb->shadow + page * width;
+
+        x0 = fb->dirty_x0[page];
+        x1 = fb->dirty_x1[page];
+        fb->dirty_x0[page] = width - 1;
+        fb->dirty_x1[page] = 0;
+        if (fb->force) {
+            x0 = 0;
+            x1 = width - 1;
+        } else if (x0 > x1) {
+            continue;
+        } else if (fb->col_offset >= 0) {
+            while (x0 <= x1 && cur[x0] == old[x0])
+                x0++;
+            while (x1 >= x0 && cur[x1] == old[x1])
+                x1--;
+            if (x0 > x1)
+                continue;
+        } else if (c_memcmp(cur, old, width) == 0) {
+            continue;
+        }
+
+        if (fb->col_offset >= 0) {
+            fb_send_columns(u8g, fb, page, x0, x1);
+        } else {
+            x0 = 0;
+            x1 = width - 1;
+            fb_send_page(u8g, fb, page);
+        }
+        c_memcpy(old + x0, cur + x0, x1 - x0 + 1);
+        fb->bytes += x1 - x0 + 1;
+    }
+    fb->force = 0;
+
+    return fb->bytes;
+}
+
+uint8_t u8g_dev_fullbuf_fn(u8g_t *u8g, u8g_dev_t *dev, uint8_t msg, void *arg)
+{
+    lu8g_fb_t *fb = (lu8g_fb_t *)(dev->dev_mem);
+    u8g_pb_t *pb = (u8g_pb_t *)(fb->target->dev_mem);
+
+    switch(msg)
+    {
+    case U8G_DEV_MSG_SET_PIXEL:
+    case U8G_DEV_MSG_SET_8PIXEL:
+        fb_set_pixels(u8g, fb, msg, (u8g_dev_arg_pixel_t *)arg);
+        return 1;
+    case U8G_DEV_MSG_PAGE_FIRST:
+        // the picture loop redraws everything in a single pass
+        lu8g_fb_clear(fb);
+        return 1;
+    case U8G_DEV_MSG_PAGE_NEXT:
+        lu8g_fb_flush(u8g, fb);
+        return 0;
+#ifdef U8G_DEV_MSG_IS_BBX_INTERSECTION
+    case U8G_DEV_MSG_IS_BBX_INTERSECTION:
+        return 1;
+#endif
+    case U8G_DEV_MSG_GET_PAGE_BOX:
+        {
+            u8g_box_t *box = (u8g_box_t *)arg;
+            box->x0 = 0;
+            box->y0 = 0;
+            box->x1 = pb->width - 1;
+            box->y1 = pb->p.total_height - 1;
+        }
+        return 1;
+    }
+
+    // init, sleep, contrast, dimensions and mode are handled by the display
+    return u8g_call_dev_fn(u8g, fb->target, msg, arg);
+}
@@ -4,12 +4,34 @@
 
 #include "u8g.h"
 
+// Full framebuffer, wrapping the display's own page based device
+struct _lu8g_fb_t
+{
+    u8g_dev_t dev;              // installed as the u8g device
+    u8g_dev_t *target;          // the display's own device
+    uint8_t *buf;               // one page after the other, in the device's page layout
+    uint8_t *shadow;            // what the display is currently showing
+    u8g_uint_t *dirty_x0;       // changed columns per page, x0 > x1 when clean
+    u8g_uint_t *dirty_x1;
+    size_t size;                // of this allocation
+    uint32_t bytes;             // sent by the last flush
+    uint8_t pages;
+    int8_t col_offset;          // controller column of x = 0, or -1 if only whole pages can be sent
+    uint8_t force;              // display contents unknown, send everything
+};
+typedef struct _lu8g_fb_t lu8g_fb_t;
+
 struct _lu8g_userdata_t
 {
     u8g_t u8g;
     uint8_t i2c_addr;
     uint8_t use_delay;
     int cb_ref;
+    lu8g_fb_t *fb;
+    int8_t col_offset;          // for lu8g_fb_t, see lu8g_column_offset()
+    uint32_t frame_start;       // system time at firstPage()
+    uint32_t frame_us;          // firstPage() until nextPage() returned false
+    uint32_t flush_us;
 };
 typedef struct _lu8g_userdata_t lu8g_userdata_t;
 
@@ -18,5 +40,9 @@ typedef struct _lu8g_userdata_t lu8g_userdata_t;
 
 uint8_t u8g_com_esp8266_fbrle_fn(u8g_t *u8g, uint8_t msg, uint8_t arg_val, void *arg_ptr);
 uint8_t u8g_dev_gen_fb_fn(u8g_t *u8g, u8g_dev_t *dev, uint8_t msg, void *arg);
+uint8_t u8g_dev_fullbuf_fn(u8g_t *u8g, u8g_dev_t *dev, uint8_t msg, void *arg);
+
+void lu8g_fb_clear(lu8g_fb_t *fb);
+uint32_t lu8g_fb_flush(u8g_t *u8g, lu8g_fb_t *fb);
 
 #endif
@@ -7,8 +7,10 @@
 #include "c_types.h"
 #include "c_string.h"
 #include "rom.h"
+#include "callback.h"
 
 static int uart_receive_rf = LUA_NOREF;
+static cb_source_t cb_uart = CB_SOURCE("uart");
 bool run_input = true;
 bool uart_on_data_cb(const char *buf, size_t len){
   if(!buf || len==0)
@@ -20,7 +22,7 @@ bool uart_on_data_cb(const char *buf, size_t len){
     return false;
   lua_rawgeti(L, LUA_REGISTRYINDEX, uart_receive_rf);
   lua_pushlstring(L, buf, len);
-  lua_call(L, 1, 0);
+  cb_call(L, &cb_uart, 1, 0);
   return !run_input;
 }
 
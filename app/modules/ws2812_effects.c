@@ -48,9 +48,10 @@ typedef struct {
   uint32_t mode_delay;
   uint32_t counter_mode_call;
   uint32_t counter_mode_step;
-  uint8_t mode_color_index;
+  uint16_t mode_color_index;
   uint8_t speed;
   uint8_t brightness;
+  uint8_t brightness_lut[256];
   os_timer_t os_t;
   uint8_t running;
   uint8_t effect_type;
@@ -131,21 +132,25 @@ static int ws2812_set_pixel(int pixel, uint32_t color) {
 /*
 * Returns a new, random color wheel index with a minimum distance of 42 from pos.
 */
-static uint8_t get_random_wheel_index(uint8_t pos)
+static uint16_t get_random_wheel_index(uint16_t pos)
 {
-  uint8_t r = 0;
-  uint8_t x = 0;
-  uint8_t y = 0;
-  uint8_t d = 0;
-
-  while(d < 42) {
-    r = rand() % 360;
-    x = abs(pos - r);
-    y = 360 - x;
-    d = min(x, y);
-  }
+  // an offset of 42 to 318 keeps the distance either way at 42 or more
+  return (pos + 42 + rand() % (360 - 2 * 42 + 1)) % 360;
+}
+
+
+/*
+* Scaling by the brightness is a table lookup rather than a division
+* for every color of every pixel.
+*/
+static void set_brightness_lut(uint8_t brightness)
+{
+  int i;
 
-  return r;
+  state->brightness = brightness;
+  for (i = 0; i < 256; i++) {
+    state->brightness_lut[i] = i * brightness / 255;
+  }
 }
 
 //-----------------
@@ -169,7 +174,7 @@ static int ws2812_effects_init(lua_State *L) {
   // initialize
   state->speed = SPEED_DEFAULT;
   state->mode_delay = DELAY_DEFAULT;
-  state->brightness = BRIGHTNESS_DEFAULT;
+  set_brightness_lut(BRIGHTNESS_DEFAULT);
   state->buffer = buffer;
 
   state->buffer_ref = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -235,7 +240,7 @@ static int ws2812_effects_set_brightness(lua_State* L) {
   uint8_t brightness = luaL_checkint(L, 1);
   luaL_argcheck(L, state != NULL, 1, LIBRARY_NOT_INITIALIZED_ERROR_MSG);
   luaL_argcheck(L, brightness >= 0 && brightness < 256, 1, "should be a 0-255");
-  state->brightness = brightness;
+  set_brightness_lut(brightness);
   return 0;
 }
 
@@ -254,11 +259,11 @@ static int ws2812_effects_fill_buffer(uint32_t color) {
   int i;
   uint8_t * p = &buffer->values[0];
   for(i = 0; i < buffer->size; i++) {
-    *p++ = g * state->brightness / 255;
-    *p++ = r * state->brightness / 255;
-    *p++ = b * state->brightness / 255;
+    *p++ = state->brightness_lut[g];
+    *p++ = state->brightness_lut[r];
+    *p++ = state->brightness_lut[b];
     if (buffer->colorsPerLed == 4) {
-      *p++ = w * state->brightness / 255;
+      *p++ = state->brightness_lut[w];
     }
   }
 
@@ -385,9 +390,9 @@ static int ws2812_effects_gradient(const char *gradient_spec, size_t length1) {
       // convert to RGB
       uint32_t grb = hsv2grb(h, s, v);
 
-      *p++ = ((grb & 0x00FF0000) >> 16) * state->brightness / 255;
-      *p++ = ((grb & 0x0000FF00) >> 8)  * state->brightness / 255;
-      *p++ = (grb & 0x000000FF) * state->brightness / 255;
+      *p++ = state->brightness_lut[(grb & 0x00FF0000) >> 16];
+      *p++ = state->brightness_lut[(grb & 0x0000FF00) >> 8];
+      *p++ = state->brightness_lut[grb & 0x000000FF];
 
       for (j = 3; j < buffer->colorsPerLed; j++) {
         *p++ = 0;
@@ -444,9 +449,9 @@ static int ws2812_effects_gradient_rgb(const char *buffer1, size_t length1) {
     int steps = numPixels - 1;
 
     for(i = 0; i < numPixels; i++) {
-      *p++ = (g1 + ((g2-g1) * i / steps)) * state->brightness / 255;
-      *p++ = (r1 + ((r2-r1) * i / steps)) * state->brightness / 255;
-      *p++ = (b1 + ((b2-b1) * i / steps)) * state->brightness / 255;
+      *p++ = state->brightness_lut[g1 + ((g2-g1) * i / steps)];
+      *p++ = state->brightness_lut[r1 + ((r2-r1) * i / steps)];
+      *p++ = state->brightness_lut[b1 + ((b2-b1) * i / steps)];
       for (j = 3; j < buffer->colorsPerLed; j++)
       {
         *p++ = 0;
@@ -467,9 +472,9 @@ static int ws2812_effects_mode_random_color() {
   ws2812_buffer * buffer = state->buffer;
 
   uint32_t color = color_wheel(state->mode_color_index);
-  uint8_t r = ((color & 0x00FF0000) >> 16) * state->brightness / 255;
-  uint8_t g = ((color & 0x0000FF00) >>  8) * state->brightness / 255;
-  uint8_t b = ((color & 0x000000FF) >>  0) * state->brightness / 255;
+  uint8_t r = state->brightness_lut[(color & 0x00FF0000) >> 16];
+  uint8_t g = state->brightness_lut[(color & 0x0000FF00) >>  8];
+  uint8_t b = state->brightness_lut[(color & 0x000000FF) >>  0];
 
   // Fill buffer
   int i,j;
@@ -494,17 +499,17 @@ static int ws2812_effects_mode_rainbow() {
   ws2812_buffer * buffer = state->buffer;
 
   uint32_t color = color_wheel(state->counter_mode_step);
-  uint8_t r = (color & 0x00FF0000) >> 16;
-  uint8_t g = (color & 0x0000FF00) >>  8;
-  uint8_t b = (color & 0x000000FF) >>  0;
+  uint8_t r = state->brightness_lut[(color & 0x00FF0000) >> 16];
+  uint8_t g = state->brightness_lut[(color & 0x0000FF00) >>  8];
+  uint8_t b = state->brightness_lut[(color & 0x000000FF) >>  0];
 
   // Fill buffer
   int i,j;
   uint8_t * p = &buffer->values[0];
   for(i = 0; i < buffer->size; i++) {
-    *p++ = g * state->brightness / 255;
-    *p++ = r * state->brightness / 255;
-    *p++ = b * state->brightness / 255;
+    *p++ = g;
+    *p++ = r;
+    *p++ = b;
     for (j = 3; j < buffer->colorsPerLed; j++)
     {
       *p++ = 0;
@@ -524,13 +529,18 @@ static int ws2812_effects_mode_rainbow_cycle(int repeat_count) {
   ws2812_buffer * buffer = state->buffer;
 
   int i,j;
+  // (i * 360 / size * repeat_count) % 360, stepped along without
+  // dividing for every pixel
+  int wheel_index = 0, rem = 0;
   uint8_t * p = &buffer->values[0];
   for(i = 0; i < buffer->size; i++) {
-    uint16_t wheel_index = (i * 360 / buffer->size * repeat_count) % 360;
     uint32_t color = color_wheel(wheel_index);
-    uint8_t r = ((color & 0x00FF0000) >> 16) * state->brightness / 255;
-    uint8_t g = ((color & 0x0000FF00) >>  8) * state->brightness / 255;
-    uint8_t b = ((color & 0x000000FF) >>  0) * state->brightness / 255;
+    for (rem += 360; rem >= buffer->size; rem -= buffer->size) {
+      wheel_index = (wheel_index + repeat_count) % 360;
+    }
+    uint8_t r = state->brightness_lut[(color & 0x00FF0000) >> 16];
+    uint8_t g = state->brightness_lut[(color & 0x0000FF00) >>  8];
+    uint8_t b = state->brightness_lut[(color & 0x000000FF) >>  0];
     *p++ = g;
     *p++ = r;
     *p++ = b;
@@ -567,9 +577,9 @@ static int ws2812_effects_mode_flicker_int(uint8_t max_flicker) {
     if(g1<0) g1=0;
     if(r1<0) r1=0;
     if(b1<0) b1=0;
-    *p++ = g1 * state->brightness / 255;
-    *p++ = r1 * state->brightness / 255;
-    *p++ = b1 * state->brightness / 255;
+    *p++ = state->brightness_lut[g1];
+    *p++ = state->brightness_lut[r1];
+    *p++ = state->brightness_lut[b1];
     for (j = 3; j < buffer->colorsPerLed; j++) {
       *p++ = 0;
     }
@@ -584,13 +594,13 @@ static int ws2812_effects_mode_flicker_int(uint8_t max_flicker) {
 static int ws2812_effects_mode_halloween() {
   ws2812_buffer * buffer = state->buffer;
 
-  int g1 = 50 * state->brightness / 255;
-  int r1 = 255 * state->brightness / 255;
-  int b1 = 0 * state->brightness / 255;
+  int g1 = state->brightness_lut[50];
+  int r1 = state->brightness_lut[255];
+  int b1 = state->brightness_lut[0];
 
-  int g2 = 0 * state->brightness / 255;
-  int r2 = 255 * state->brightness / 255;
-  int b2 = 130 * state->brightness / 255;
+  int g2 = state->brightness_lut[0];
+  int r2 = state->brightness_lut[255];
+  int b2 = state->brightness_lut[130];
 
 
   // Fill buffer
@@ -614,13 +624,13 @@ static int ws2812_effects_mode_halloween() {
 static int ws2812_effects_mode_circus_combustus() {
   ws2812_buffer * buffer = state->buffer;
 
-  int g1 = 0 * state->brightness / 255;
-  int r1 = 255 * state->brightness / 255;
-  int b1 = 0 * state->brightness / 255;
+  int g1 = state->brightness_lut[0];
+  int r1 = state->brightness_lut[255];
+  int b1 = state->brightness_lut[0];
 
-  int g2 = 255 * state->brightness / 255;
-  int r2 = 255 * state->brightness / 255;
-  int b2 = 255 * state->brightness / 255;
+  int g2 = state->brightness_lut[255];
+  int r2 = state->brightness_lut[255];
+  int b2 = state->brightness_lut[255];
 
   // Fill buffer
   int i,j;
@@ -696,9 +706,9 @@ static int ws2812_effects_mode_color_wipe() {
   }
   else
   {
-    uint8_t px_r = state->color[1] * state->brightness / 255;
-    uint8_t px_g = state->color[0] * state->brightness / 255;
-    uint8_t px_b = state->color[2] * state->brightness / 255;
+    uint8_t px_r = state->brightness_lut[state->color[1]];
+    uint8_t px_g = state->brightness_lut[state->color[0]];
+    uint8_t px_b = state->brightness_lut[state->color[2]];
     buffer->values[led_index] = px_g;
     buffer->values[led_index + 1] = px_r;
     buffer->values[led_index + 2] = px_b;
@@ -130,6 +130,18 @@ static const char mem_debug_file[] ICACHE_RODATA_ATTR = __FILE__;
 #define MDNS_HOST_TIME            120
 #define MDNS_SERVICE_TIME         3600
 
+/* TTLs of the records we answer with */
+#define MDNS_SD_TTL               3600
+#define MDNS_RR_TTL               300
+
+/* A record is not multicast again within this time (RFC 6762 section 6) */
+#define MDNS_RATE_LIMIT_US        1000000
+
+/** Number of records the query cache holds */
+#ifndef MDNS_CACHE_ENTRIES
+#define MDNS_CACHE_ENTRIES        12
+#endif
+
 /** MDNS name length with "." at the beginning and end of name*/
 #ifndef MDNS_LENGTH_ADD
 #define MDNS_LENGTH_ADD           2
@@ -214,6 +226,44 @@ static struct ip_addr multicast_addr;
 static uint8 register_flag = 0;
 static uint8 mdns_flag = 0;
 static u8_t *mdns_payload;
+static char *host_name_with_suffix = NULL;
+static char *instance_name = NULL;
+
+/* Responses are encoded once per registration, and only the transaction ID
+ * and the interface address are filled in when one is sent. */
+enum {
+  MDNS_RESP_SD_PTR,           /* the service type, for DNS-SD enumeration */
+  MDNS_RESP_SERVICE,          /* PTR, TXT, SRV and A of the service */
+  MDNS_RESP_HOST_A,           /* A record of the host name */
+  MDNS_RESP_SD_NONE,          /* NSEC only answers for the names we own */
+  MDNS_RESP_SERVICE_NONE,
+  MDNS_RESP_HOST_NONE,
+  MDNS_RESP_INSTANCE_NONE,
+  MDNS_RESP_COUNT
+};
+
+struct mdns_resp {
+  u8_t *data;
+  u16_t len;
+  u16_t addr_offset;          /* of the address in the A record, 0 if none */
+  u32_t sent_at;              /* when it was last multicast */
+  u8_t sent;
+};
+
+/* [kind][unicast], the two differ in TTL and cache flush bits */
+static struct mdns_resp resp_cache[MDNS_RESP_COUNT][2];
+
+/* Records from the querier's known-answer list */
+#define KNOWN_SD_PTR              0x01
+#define KNOWN_SERVICE_PTR         0x02
+#define KNOWN_INSTANCE_SRV        0x04
+#define KNOWN_INSTANCE_TXT        0x08
+#define KNOWN_HOST_A              0x10
+
+/* Client side */
+static struct nodemcu_mdns_rr *mdns_cache = NULL;
+static nodemcu_mdns_answer_fn answer_fn = NULL;
+static u32_t clock_last, clock_high;
 
 /**
  * Compare the "dotted" name "query" with the encoded name "response"
@@ -317,12 +367,14 @@ static err_t send_packet(struct pbuf *p, struct ip_addr *dst_addr, u16_t dst_por
   if (addr_ptr) {
     if (wifi_get_opmode() == 0x02) {
       if (!ap_netif) {
-	return;
+	pbuf_free(p);
+	return ERR_IF;
       }
       memcpy(addr_ptr, &ap_netif->ip_addr, sizeof(ap_netif->ip_addr));
     } else {
       if (!sta_netif) {
-	return;
+	pbuf_free(p);
+	return ERR_IF;
       }
       memcpy(addr_ptr, &sta_netif->ip_addr, sizeof(sta_netif->ip_addr));
     }
@@ -351,14 +403,13 @@ static err_t send_packet(struct pbuf *p, struct ip_addr *dst_addr, u16_t dst_por
   return err;
 }
 /**
- * Send a mDNS packet for the service type
+ * Build a mDNS packet for the service type
  *
- * @param id transaction ID in the DNS query packet
- * @return ERR_OK if packet is sent; an err_t indicating the problem otherwise
+ * @param max_ttl upper limit of the TTL
+ * @return the packet, or NULL if out of memory
  */
-static err_t ICACHE_FLASH_ATTR
-mdns_send_service_type(u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
-	err_t err;
+static struct pbuf * ICACHE_FLASH_ATTR
+mdns_build_service_type(int max_ttl) {
 	struct mdns_hdr *hdr;
 	struct mdns_answer ans;
 	struct mdns_a_rr a_rr;
@@ -368,7 +419,6 @@ mdns_send_service_type(u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
 	const char *pHostname;
 	struct netif * sta_netif = NULL;
 	struct netif * ap_netif = NULL;
-	int max_ttl = dst_addr ? 10 : 7200;
 	char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
 	u8_t n;
 	u16_t length = 0;
@@ -380,7 +430,6 @@ mdns_send_service_type(u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
 		/* fill dns header */
 		hdr = (struct mdns_hdr*) p->payload;
 		os_memset(hdr, 0, SIZEOF_DNS_HDR);
-		hdr->id = htons(id);
 		hdr->flags1 = DNS_FLAG1_RESPONSE;
 
 		pHostname = DNS_SD_SERVICE;
@@ -405,7 +454,7 @@ mdns_send_service_type(u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
 
 		ans.type = htons(DNS_RRTYPE_PTR);
 		ans.class = htons(DNS_RRCLASS_IN);
-		ans.ttl = htonl(min(max_ttl, 3600));
+		ans.ttl = htonl(min(max_ttl, MDNS_SD_TTL));
 		ans.len = htons(os_strlen(service_name_with_suffix) + 1 +1 );
 		length = 0;
 
@@ -432,26 +481,21 @@ mdns_send_service_type(u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
 
 		/* resize pbuf to the exact dns query */
 		pbuf_realloc(p, (query + length) - ((char*) (p->payload)));
-
-		err = send_packet(p, dst_addr, dst_port, 0);
-
-	} else {
-		err = ERR_MEM;
 	}
 
-	return err;
+	return p;
 }
 
 /**
- * Send a mDNS service answer packet.
+ * Build a mDNS service answer packet.
  *
- * @param name service name to query
- * @param id transaction ID in the DNS query packet
- * @return ERR_OK if packet is sent; an err_t indicating the problem otherwise
+ * @param info the registration
+ * @param unicast whether the answer goes to a single querier
+ * @param addr_offset set to the offset of the address in the A record
+ * @return the packet, or NULL if it could not be built
  */
-static err_t ICACHE_FLASH_ATTR
-mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
-	err_t err;
+static struct pbuf * ICACHE_FLASH_ATTR
+mdns_build_service(struct nodemcu_mdns_info *info, int unicast, u16_t *addr_offset) {
 	struct mdns_hdr *hdr;
 	struct mdns_answer ans;
 	struct mdns_service serv;
@@ -461,7 +505,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 	char *query_end;
 	const char *pHostname;
 	const char *name = info->host_name;
-	int max_ttl = dst_addr ? 10 : 7200;
+	int max_ttl = unicast ? 10 : 7200;
 	u8_t n;
 	u8_t i = 0;
 	u16_t length = 0;
@@ -469,7 +513,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 	struct netif * sta_netif = NULL;
 	struct netif * ap_netif = NULL;
 	char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
-	u16_t dns_class = dst_addr ? DNS_RRCLASS_IN : DNS_RRCLASS_FLUSH_IN;
+	u16_t dns_class = unicast ? DNS_RRCLASS_IN : DNS_RRCLASS_FLUSH_IN;
 	/* if here, we have either a new query or a retry on a previous query to process */
 	p = pbuf_alloc(PBUF_TRANSPORT,
 			SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
@@ -478,7 +522,6 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 		/* fill dns header */
 		hdr = (struct mdns_hdr*) p->payload;
 		os_memset(hdr, 0, SIZEOF_DNS_HDR);
-		hdr->id = htons(id);
 		hdr->flags1 = DNS_FLAG1_RESPONSE;
 		hdr->numanswers = htons(4);
 		hdr->numextrarr = htons(1);
@@ -513,7 +556,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 
 		ans.type = htons(DNS_RRTYPE_PTR);
 		ans.class = htons(DNS_RRCLASS_IN);
-		ans.ttl = htonl(min(max_ttl, 300));
+		ans.ttl = htonl(min(max_ttl, MDNS_RR_TTL));
 		length = os_strlen(ms_info->host_desc) + MDNS_LENGTH_ADD + 1;
 		ans.len = htons(length);
 		length = 0;
@@ -547,7 +590,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 		/* fill the answer */
 		ans.type = htons(DNS_RRTYPE_TXT);
 		ans.class = htons(dns_class);
-		ans.ttl = htonl(min(max_ttl, 300));
+		ans.ttl = htonl(min(max_ttl, MDNS_RR_TTL));
 //		length = os_strlen(TXT_DATA) + MDNS_LENGTH_ADD + 1;
 		const char *attributes[12];
 		int attr_count = 0;
@@ -586,7 +629,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 	        if (query_end <= end_of_packet) {
 		  MDNS_DBG("Too much data to send\n");
 		  pbuf_free(p);
-		  return ERR_MEM;
+		  return NULL;
 		}
 		//MDNS_DBG("Query=%x, query_end=%x, end_ofpacket=%x, length=%x\n", query, query_end, end_of_packet, length);
 
@@ -617,7 +660,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 
 		ans.type = htons(DNS_RRTYPE_SRV);
 		ans.class = htons(dns_class);
-		ans.ttl = htonl(min(max_ttl, 300));
+		ans.ttl = htonl(min(max_ttl, MDNS_RR_TTL));
 		c_strlcpy(tmpBuf,ms_info->host_name, sizeof(tmpBuf));
 		c_strlcat(tmpBuf, ".", sizeof(tmpBuf));
 		c_strlcat(tmpBuf, MDNS_LOCAL, sizeof(tmpBuf));
@@ -660,7 +703,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 
 		ans.type = htons(DNS_RRTYPE_A);
 		ans.class = htons(dns_class);
-		ans.ttl = htonl(min(max_ttl, 300));
+		ans.ttl = htonl(min(max_ttl, MDNS_RR_TTL));
 		ans.len = htons(DNS_IP_ADDR_LEN);
 
 		MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
@@ -675,7 +718,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 		/* set the local IP address */
 		a_rr.src = 0;
 		MEMCPY( query, &a_rr, SIZEOF_MDNS_A_RR);
-		u8_t *addr_ptr = query + ((char *) &a_rr.src - (char *) &a_rr);
+		*addr_offset = query + ((char *) &a_rr.src - (char *) &a_rr) - (char *) hdr;
 		/* resize the query */
 		query = query + SIZEOF_MDNS_A_RR;
 
@@ -685,7 +728,7 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 
 		ans.type = htons(DNS_RRTYPE_NSEC);
 		ans.class = htons(dns_class);
-		ans.ttl = htonl(min(max_ttl, 300));
+		ans.ttl = htonl(min(max_ttl, MDNS_RR_TTL));
 		ans.len = htons(5);
 
 		MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
@@ -706,21 +749,11 @@ mdns_send_service(struct nodemcu_mdns_info *info, u16_t id, struct ip_addr *dst_
 
 		/* resize pbuf to the exact dns query */
 		pbuf_realloc(p, (query) - ((char*) (p->payload)));
-
-		err = send_packet(p, dst_addr, dst_port, addr_ptr);
-
-		if (!dst_addr) {
-		  // this is being sent multicast...
-		  // so reset the timer
-		  os_timer_disarm(&mdns_timer);
-		  os_timer_arm(&mdns_timer, 1000 * 280, 1);
-		}
 	} else {
 		MDNS_DBG("ERR_MEM \n");
-		err = ERR_MEM;
 	}
 
-	return err;
+	return p;
 }
 
 static char *append_nsec_record(char *query, u32_t actual_rr, int max_ttl) {
@@ -728,7 +761,7 @@ static char *append_nsec_record(char *query, u32_t actual_rr, int max_ttl) {
 
   ans.type = htons(DNS_RRTYPE_NSEC);
   ans.class = htons(DNS_RRCLASS_IN);
-  ans.ttl = htonl(min(max_ttl, 300));
+  ans.ttl = htonl(min(max_ttl, MDNS_RR_TTL));
   ans.len = htons(9);
 
   MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
@@ -766,13 +799,12 @@ static char *append_nsec_record(char *query, u32_t actual_rr, int max_ttl) {
 }
 
 /**
- * This sends an empty response -- this is used when we doin't have an RR to send
+ * This builds an empty response -- this is used when we doin't have an RR to send
  * but the name exists
  */
 
-static void 
-mdns_send_no_rr(struct mdns_hdr *req, const char *name, u32_t actual_rr, struct ip_addr *dst_addr, u16_t dst_port) {
-  int max_ttl = dst_addr ? 10 : 7200;
+static struct pbuf *
+mdns_build_no_rr(const char *name, u32_t actual_rr, int max_ttl) {
   struct pbuf *p;
   p = pbuf_alloc(PBUF_TRANSPORT,
 		  SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
@@ -781,7 +813,6 @@ mdns_send_no_rr(struct mdns_hdr *req, const char *name, u32_t actual_rr, struct
     /* fill dns header */
     struct mdns_hdr *hdr = (struct mdns_hdr*) p->payload;
     os_memset(hdr, 0, SIZEOF_DNS_HDR);
-    hdr->id = req->id;
     hdr->flags1 = DNS_FLAG1_RESPONSE;
     hdr->numextrarr = htons(1);
     char *query = (char*) hdr + SIZEOF_DNS_HDR;
@@ -796,19 +827,20 @@ mdns_send_no_rr(struct mdns_hdr *req, const char *name, u32_t actual_rr, struct
 
       // Set the length code correctly
       pbuf_realloc(p, query - ((char*) (p->payload)));
-
-      send_packet(p, dst_addr, dst_port, NULL);
+    } else {
+      pbuf_free(p);
+      p = NULL;
     }
   }
+  return p;
 }
 
 /**
- * This sends a single A record and the NSEC record as additional
+ * This builds a single A record and the NSEC record as additional
  */
 
-static void 
-mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr, u16_t dst_port) {
-  int max_ttl = dst_addr ? 10 : 7200;
+static struct pbuf *
+mdns_build_a_rr(const char *name, int max_ttl, u16_t *addr_offset) {
   struct pbuf *p;
   p = pbuf_alloc(PBUF_TRANSPORT,
 		  SIZEOF_DNS_HDR + MDNS_MAX_NAME_LENGTH * 2 + SIZEOF_DNS_QUERY, PBUF_RAM);
@@ -817,7 +849,6 @@ mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr,
     /* fill dns header */
     struct mdns_hdr *hdr = (struct mdns_hdr*) p->payload;
     os_memset(hdr, 0, SIZEOF_DNS_HDR);
-    hdr->id = req->id;
     hdr->flags1 = DNS_FLAG1_RESPONSE;
     hdr->numanswers = htons(1);
     hdr->numextrarr = htons(1);
@@ -833,12 +864,12 @@ mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr,
 
       ans.type = htons(DNS_RRTYPE_A);
       ans.class = htons(DNS_RRCLASS_IN);
-      ans.ttl = htonl(min(max_ttl, 300));
+      ans.ttl = htonl(min(max_ttl, MDNS_RR_TTL));
       ans.len = htons(4);
 
       MEMCPY( query, &ans, SIZEOF_DNS_ANSWER);
       query = query + SIZEOF_DNS_ANSWER;
-      char *addr_ptr = query;
+      *addr_offset = query - (char *) hdr;
       query += 4;
 
       // Now add the NSEC record
@@ -848,10 +879,359 @@ mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr,
 
       // Set the length code correctly
       pbuf_realloc(p, query - ((char*) (p->payload)));
+    } else {
+      pbuf_free(p);
+      p = NULL;
+    }
+  }
+  return p;
+}
+
+static struct netif *
+mdns_netif(void) {
+  return (struct netif *) eagle_lwip_getif(wifi_get_opmode() == 0x02 ? 0x01 : 0x00);
+}
+
+static struct pbuf *
+mdns_build(int kind, int unicast, u16_t *addr_offset) {
+  int max_ttl = unicast ? 10 : 7200;
+
+  *addr_offset = 0;
+  switch (kind) {
+  case MDNS_RESP_SD_PTR:
+    return mdns_build_service_type(max_ttl);
+  case MDNS_RESP_SERVICE:
+    return mdns_build_service(ms_info, unicast, addr_offset);
+  case MDNS_RESP_HOST_A:
+    return mdns_build_a_rr(host_name_with_suffix, max_ttl, addr_offset);
+  case MDNS_RESP_SD_NONE:
+    return mdns_build_no_rr(DNS_SD_SERVICE, DNS_RRTYPE_PTR, max_ttl);
+  case MDNS_RESP_SERVICE_NONE:
+    return mdns_build_no_rr(service_name_with_suffix, DNS_RRTYPE_PTR, max_ttl);
+  case MDNS_RESP_HOST_NONE:
+    return mdns_build_no_rr(host_name_with_suffix, DNS_RRTYPE_A, max_ttl);
+  case MDNS_RESP_INSTANCE_NONE:
+    return mdns_build_no_rr(instance_name, (DNS_RRTYPE_TXT << 8) + DNS_RRTYPE_SRV, max_ttl);
+  }
+  return NULL;
+}
+
+static void
+mdns_flush_responses(void) {
+  int i;
+  struct mdns_resp *r = &resp_cache[0][0];
+
+  for (i = 0; i < MDNS_RESP_COUNT * 2; i++, r++) {
+    if (r->data) {
+      os_free(r->data);
+    }
+  }
+  memset(resp_cache, 0, sizeof(resp_cache));
+}
+
+/**
+ * Send one of the responses, encoding it first if this is the first time
+ * it is needed.
+ *
+ * @param kind MDNS_RESP_*
+ * @param id transaction ID of the query, in network order
+ * @return ERR_OK if packet is sent; an err_t indicating the problem otherwise
+ */
+static err_t ICACHE_FLASH_ATTR
+mdns_respond(int kind, u16_t id, struct ip_addr *dst_addr, u16_t dst_port) {
+  struct mdns_resp *r = &resp_cache[kind][dst_addr != NULL];
+  struct pbuf *p;
+  u32_t now = system_get_time();
 
-      send_packet(p, dst_addr, dst_port, addr_ptr);
+  if (!dst_addr && r->sent && now - r->sent_at < MDNS_RATE_LIMIT_US) {
+    return ERR_OK;
+  }
+
+  if (!r->data) {
+    p = mdns_build(kind, dst_addr != NULL, &r->addr_offset);
+    if (!p) {
+      return ERR_MEM;
+    }
+    r->data = (u8_t *) os_malloc(p->len);
+    if (!r->data) {
+      pbuf_free(p);
+      return ERR_MEM;
     }
+    r->len = p->len;
+    memcpy(r->data, p->payload, r->len);
+    pbuf_free(p);
+  }
+
+  p = pbuf_alloc(PBUF_TRANSPORT, r->len, PBUF_RAM);
+  if (!p) {
+    return ERR_MEM;
   }
+  memcpy(p->payload, r->data, r->len);
+  ((struct mdns_hdr *) p->payload)->id = id;
+
+  if (!dst_addr) {
+    r->sent = 1;
+    r->sent_at = now;
+    if (kind == MDNS_RESP_SERVICE) {
+      // this is being sent multicast...
+      // so reset the timer
+      os_timer_disarm(&mdns_timer);
+      os_timer_arm(&mdns_timer, 1000 * 280, 1);
+    }
+  }
+
+  return send_packet(p, dst_addr, dst_port, r->addr_offset ? (u8_t *) p->payload + r->addr_offset : NULL);
+}
+
+/**
+ * Known-answer suppression (RFC 6762 section 7.1). Looks through the answer
+ * section of a query for our own records that the querier already holds
+ * with at least half of their TTL left.
+ *
+ * @param ptr first byte after the questions
+ * @return a mask of KNOWN_*
+ */
+static u8_t ICACHE_FLASH_ATTR
+mdns_known_answers(struct mdns_hdr *hdr, u8_t *ptr, u8_t *end) {
+  u16_t nanswers = ntohs(hdr->numanswers);
+  struct netif *netif = mdns_netif();
+  u8_t known = 0;
+  u16_t i;
+
+  for (i = 0; i < nanswers && ptr < end; i++) {
+    struct mdns_answer ans;
+    int namelen = mdns_namelen(ptr, end - ptr);
+
+    if (namelen < 0 || ptr + namelen + SIZEOF_DNS_ANSWER > end) {
+      break;
+    }
+    memcpy(&ans, ptr + namelen, SIZEOF_DNS_ANSWER);
+    u8_t *rdata = ptr + namelen + SIZEOF_DNS_ANSWER;
+    u16_t rdlen = ntohs(ans.len);
+    u32_t ttl = ntohl(ans.ttl);
+    if (rdata + rdlen > end) {
+      break;
+    }
+
+    switch (ntohs(ans.type)) {
+    case DNS_RRTYPE_PTR:
+      if (ttl >= MDNS_SD_TTL / 2 &&
+	  mdns_compare_name((unsigned char *) DNS_SD_SERVICE, ptr, (unsigned char *) hdr) == 0 &&
+	  mdns_compare_name((unsigned char *) service_name_with_suffix, rdata, (unsigned char *) hdr) == 0) {
+	known |= KNOWN_SD_PTR;
+      } else if (ttl >= MDNS_RR_TTL / 2 &&
+	  mdns_compare_name((unsigned char *) service_name_with_suffix, ptr, (unsigned char *) hdr) == 0 &&
+	  mdns_compare_name((unsigned char *) instance_name, rdata, (unsigned char *) hdr) == 0) {
+	known |= KNOWN_SERVICE_PTR;
+      }
+      break;
+    case DNS_RRTYPE_SRV:
+    case DNS_RRTYPE_TXT:
+      if (ttl >= MDNS_RR_TTL / 2 &&
+	  mdns_compare_name((unsigned char *) instance_name, ptr, (unsigned char *) hdr) == 0) {
+	known |= ntohs(ans.type) == DNS_RRTYPE_SRV ? KNOWN_INSTANCE_SRV : KNOWN_INSTANCE_TXT;
+      }
+      break;
+    case DNS_RRTYPE_A:
+      if (ttl >= MDNS_RR_TTL / 2 && rdlen == DNS_IP_ADDR_LEN && netif &&
+	  memcmp(rdata, &netif->ip_addr, DNS_IP_ADDR_LEN) == 0 &&
+	  mdns_compare_name((unsigned char *) host_name_with_suffix, ptr, (unsigned char *) hdr) == 0) {
+	known |= KNOWN_HOST_A;
+      }
+      break;
+    }
+    ptr = rdata + rdlen;
+  }
+
+  return known;
+}
+
+/* Seconds since boot, for the expiry of cached records */
+static u32_t
+mdns_clock(void) {
+  u32_t t = system_get_time();
+
+  if (t < clock_last) {
+    clock_high++;
+  }
+  clock_last = t;
+  return (((uint64) clock_high << 32) | t) / 1000000;
+}
+
+static int
+mdns_name_equal(const char *a, const char *b) {
+  while (*a && (*a | 0x20) == (*b | 0x20)) {
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+/**
+ * Decode a possibly compressed name into the dotted form.
+ *
+ * @return the number of bytes the name takes up at ptr, or -1 if it is
+ *         malformed or does not fit into out
+ */
+static int
+mdns_decode_name(const u8_t *pktbase, const u8_t *ptr, const u8_t *end, char *out, int outlen) {
+  const u8_t *p = ptr;
+  int used = -1, len = 0, jumps = 0;
+
+  while (p < end) {
+    u8_t n = *p;
+
+    if ((n & 0xc0) == 0xc0) {
+      if (p + 1 >= end || ++jumps > 10) {
+	return -1;
+      }
+      if (used < 0) {
+	used = p + 2 - ptr;
+      }
+      p = pktbase + (((n & 0x3f) << 8) | p[1]);
+    } else if (n & 0xc0) {
+      return -1;
+    } else if (n == 0) {
+      if (used < 0) {
+	used = p + 1 - ptr;
+      }
+      out[len ? len - 1 : 0] = 0;
+      return used;
+    } else {
+      if (p + 1 + n > end || len + n + 1 > outlen) {
+	return -1;
+      }
+      memcpy(out + len, p + 1, n);
+      len += n;
+      out[len++] = '.';
+      p += n + 1;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Add a record to the query cache. The same record refreshes its entry; a
+ * record with the cache flush bit replaces the older ones of its name and
+ * type. Otherwise the entry that expires first makes room.
+ *
+ * @return 1 if the cache changed
+ */
+static int
+mdns_cache_add(const struct nodemcu_mdns_rr *rr, int flush, u32_t ttl) {
+  struct nodemcu_mdns_rr *e, *slot = NULL;
+  u32_t now = mdns_clock();
+  int i;
+
+  for (i = 0, e = mdns_cache; i < MDNS_CACHE_ENTRIES; i++, e++) {
+    if (e->expires <= now) {
+      e->name[0] = 0;
+    }
+    if (!e->name[0] || e->type != rr->type || !mdns_name_equal(e->name, rr->name)) {
+      continue;
+    }
+    if (e->len == rr->len && e->port == rr->port && memcmp(e->data, rr->data, rr->len) == 0) {
+      slot = e;
+      break;
+    }
+    if (flush) {
+      e->name[0] = 0;
+    }
+  }
+
+  if (!ttl) {
+    // a goodbye packet
+    if (slot) {
+      slot->name[0] = 0;
+    }
+    return 0;
+  }
+
+  if (!slot) {
+    slot = mdns_cache;
+    for (i = 0, e = mdns_cache; i < MDNS_CACHE_ENTRIES; i++, e++) {
+      if (!e->name[0]) {
+	slot = e;
+	break;
+      }
+      if (e->expires < slot->expires) {
+	slot = e;
+      }
+    }
+    *slot = *rr;
+  }
+  slot->ttl = ttl;
+  slot->expires = now + ttl;
+  return 1;
+}
+
+/**
+ * Put the answers of a response into the query cache.
+ *
+ * @return 1 if the cache changed
+ */
+static int ICACHE_FLASH_ATTR
+mdns_cache_response(struct mdns_hdr *hdr, u8_t *ptr, u8_t *end) {
+  u16_t nrr = ntohs(hdr->numanswers) + ntohs(hdr->numauthrr) + ntohs(hdr->numextrarr);
+  struct nodemcu_mdns_rr rr;
+  int changed = 0;
+  u16_t i;
+
+  for (i = 0; i < nrr && ptr < end; i++) {
+    struct mdns_answer ans;
+    int namelen = mdns_decode_name((u8_t *) hdr, ptr, end, rr.name, sizeof(rr.name));
+
+    if (namelen < 0 || ptr + namelen + SIZEOF_DNS_ANSWER > end) {
+      break;
+    }
+    memcpy(&ans, ptr + namelen, SIZEOF_DNS_ANSWER);
+    u8_t *rdata = ptr + namelen + SIZEOF_DNS_ANSWER;
+    u16_t rdlen = ntohs(ans.len);
+    if (rdata + rdlen > end) {
+      break;
+    }
+    ptr = rdata + rdlen;
+
+    rr.type = ntohs(ans.type);
+    rr.port = 0;
+    switch (rr.type) {
+    case DNS_RRTYPE_A:
+      if (rdlen != DNS_IP_ADDR_LEN) {
+	continue;
+      }
+      memcpy(rr.data, rdata, DNS_IP_ADDR_LEN);
+      rr.len = DNS_IP_ADDR_LEN;
+      break;
+    case DNS_RRTYPE_PTR:
+      if (mdns_decode_name((u8_t *) hdr, rdata, ptr, (char *) rr.data, sizeof(rr.data)) < 0 || !rr.data[0]) {
+	continue;
+      }
+      rr.len = strlen((char *) rr.data) + 1;
+      break;
+    case DNS_RRTYPE_SRV:
+      if (rdlen <= SIZEOF_MDNS_SERVICE ||
+	  mdns_decode_name((u8_t *) hdr, rdata + SIZEOF_MDNS_SERVICE, ptr, (char *) rr.data, sizeof(rr.data)) < 0) {
+	continue;
+      }
+      rr.port = (rdata[4] << 8) | rdata[5];
+      rr.len = strlen((char *) rr.data) + 1;
+      break;
+    case DNS_RRTYPE_TXT:
+      if (rdlen > sizeof(rr.data)) {
+	continue;
+      }
+      memcpy(rr.data, rdata, rdlen);
+      rr.len = rdlen;
+      break;
+    default:
+      continue;
+    }
+
+    changed |= mdns_cache_add(&rr, ntohs(ans.class) & 0x8000, ntohl(ans.ttl));
+  }
+
+  return changed;
 }
 
 /**
@@ -862,12 +1242,11 @@ mdns_send_a_rr(struct mdns_hdr *req, const char *name, struct ip_addr *dst_addr,
 static void ICACHE_FLASH_ATTR
 mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 		u16_t port) {
-	u16_t i;
 	struct mdns_hdr *hdr;
 	u8_t nquestions;
+	int answered = 0;
 	LWIP_UNUSED_ARG(arg);
 	LWIP_UNUSED_ARG(pcb);
-	struct nodemcu_mdns_info *info = (struct nodemcu_mdns_info *)arg;
 	/* is the dns message too big ? */
 	if (p->tot_len > DNS_MSG_SIZE) {
 		LWIP_DEBUGF(DNS_DEBUG, ("dns_recv: pbuf too big\n"));
@@ -883,19 +1262,38 @@ mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 	}
 	/* copy dns payload inside static buffer for processing */
 	if (pbuf_copy_partial(p, mdns_payload, p->tot_len, 0) == p->tot_len) {
-		/* The ID in the DNS header should be our entry into the name table. */
 		hdr = (struct mdns_hdr*) mdns_payload;
 
-		i = htons(hdr->id);
-
 		nquestions = htons(hdr->numquestions);
-		//nanswers   = htons(hdr->numanswers);
-		/* if we have a question send an answer if necessary */
 		u8_t qno;
 		u8_t *qptr = (u8_t *) (hdr + 1);
 		u8_t *qend = mdns_payload + p->tot_len;
+
+		/* find the answers that follow the questions */
+		u8_t *aptr = qptr;
+		for (qno = 0; qno < nquestions && aptr < qend; qno++) {
+		  int namelen = mdns_namelen(aptr, qend - aptr);
+		  if (namelen < 0) {
+		    goto memerr1;
+		  }
+		  aptr += namelen + SIZEOF_DNS_QUERY;
+		}
+
+		if (hdr->flags1 & 0x80) {
+		  /* a response, which may hold answers to our own queries */
+		  if (mdns_cache && aptr < qend) {
+		    answered = mdns_cache_response(hdr, aptr, qend);
+		  }
+		  goto memerr1;
+		}
+		if (!ms_info) {
+		  goto memerr1;
+		}
+
+		u8_t known = mdns_known_answers(hdr, aptr, qend);
+
+		/* if we have a question send an answer if necessary */
 		for (qno = 0; qno < nquestions && qptr < qend; qno++) {
-		  char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
 		  struct mdns_query qry;
 
 		  int namelen = mdns_namelen(qptr, qend - qptr);
@@ -908,58 +1306,51 @@ mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 		    addr = NULL;
 		  }
 
-		  u32_t actual_rr = 0;
-
-		  const char *no_rr_name = NULL;
+		  int kind = -1;
+		  int any = qry_type == DNS_RRTYPE_ANY;
 
 		  /* MDNS_DS_DOES_NAME_CHECK */
 		  /* Check if the name in the "question" part match with the name of the MDNS DS service. */
 		  if (mdns_compare_name((unsigned char *) DNS_SD_SERVICE,
 				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
-		    if (qry_type == DNS_RRTYPE_PTR || qry_type == DNS_RRTYPE_ANY) {
-		      mdns_send_service_type(i, addr, port);
+		    if (qry_type == DNS_RRTYPE_PTR || any) {
+		      if (!(known & KNOWN_SD_PTR)) {
+			kind = MDNS_RESP_SD_PTR;
+		      }
 		    } else {
-		      no_rr_name = DNS_SD_SERVICE;
-		      actual_rr = DNS_RRTYPE_PTR;
+		      kind = MDNS_RESP_SD_NONE;
 		    }
 		  } else if (mdns_compare_name((unsigned char *) service_name_with_suffix,
 				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
-		    if (qry_type == DNS_RRTYPE_PTR || qry_type == DNS_RRTYPE_ANY) {
-		      mdns_send_service(info, i, addr, port);
+		    if (qry_type == DNS_RRTYPE_PTR || any) {
+		      if (!(known & KNOWN_SERVICE_PTR)) {
+			kind = MDNS_RESP_SERVICE;
+		      }
 		    } else {
-		      no_rr_name = service_name_with_suffix;
-		      actual_rr = DNS_RRTYPE_PTR;
+		      kind = MDNS_RESP_SERVICE_NONE;
 		    }
-		  } else {
-		    c_strlcpy(tmpBuf,ms_info->host_name, sizeof(tmpBuf));
-		    c_strlcat(tmpBuf, ".", sizeof(tmpBuf));
-		    c_strlcat(tmpBuf, MDNS_LOCAL, sizeof(tmpBuf));
-		    no_rr_name = tmpBuf;
-
-		    if (mdns_compare_name((unsigned char *) tmpBuf,
+		  } else if (mdns_compare_name((unsigned char *) host_name_with_suffix,
 				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
-		      if (qry_type == DNS_RRTYPE_A || qry_type == DNS_RRTYPE_ANY) {
-			mdns_send_a_rr(hdr, tmpBuf, addr, port);
-		      } else {
-			actual_rr = DNS_RRTYPE_A;
+		    if (qry_type == DNS_RRTYPE_A || any) {
+		      if (!(known & KNOWN_HOST_A)) {
+			kind = MDNS_RESP_HOST_A;
 		      }
 		    } else {
-		      c_strlcpy(tmpBuf,ms_info->host_desc, sizeof(tmpBuf));
-		      c_strlcat(tmpBuf, ".", sizeof(tmpBuf));
-		      c_strlcat(tmpBuf, service_name_with_suffix, sizeof(tmpBuf));
-		      if (mdns_compare_name((unsigned char *) tmpBuf,
+		      kind = MDNS_RESP_HOST_NONE;
+		    }
+		  } else if (mdns_compare_name((unsigned char *) instance_name,
 				  (unsigned char *) qptr, (unsigned char *) hdr) == 0) {
-			if (qry_type == DNS_RRTYPE_TXT || qry_type == DNS_RRTYPE_SRV || qry_type == DNS_RRTYPE_ANY) {
-			  mdns_send_service(info, i, addr, port);
-			} else {
-			  actual_rr = (DNS_RRTYPE_TXT << 8) + DNS_RRTYPE_SRV;
-			}
-		      }
+		    u8_t wanted = (qry_type == DNS_RRTYPE_SRV || any ? KNOWN_INSTANCE_SRV : 0) |
+				  (qry_type == DNS_RRTYPE_TXT || any ? KNOWN_INSTANCE_TXT : 0);
+		    if (!wanted) {
+		      kind = MDNS_RESP_INSTANCE_NONE;
+		    } else if ((known & wanted) != wanted) {
+		      kind = MDNS_RESP_SERVICE;
 		    }
 		  }
 
-		  if (actual_rr) {
-		    mdns_send_no_rr(hdr, no_rr_name, actual_rr, addr, port);
+		  if (kind >= 0) {
+		    mdns_respond(kind, hdr->id, addr, port);
 		  }
 
 		  qptr += namelen + sizeof(qry);		// Now points to next question
@@ -968,6 +1359,10 @@ mdns_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *addr,
 memerr1:
 	/* free pbuf */
 	pbuf_free(p);
+	/* last, as the callback may close everything down */
+	if (answered && answer_fn) {
+		answer_fn();
+	}
 	return;
 }
 
@@ -976,14 +1371,8 @@ mdns_free_info(struct nodemcu_mdns_info *info) {
   os_free((void *) info);
 }
 
-/**
- * close the UDP pcb .
- */
-void ICACHE_FLASH_ATTR
-nodemcu_mdns_close(void)
-{
-  os_timer_disarm(&mdns_timer);
-
+static void
+mdns_socket_close(void) {
   if (mdns_pcb != NULL) {
     udp_remove(mdns_pcb);
   }
@@ -992,8 +1381,94 @@ nodemcu_mdns_close(void)
   }
   mdns_payload = NULL;
   mdns_pcb = NULL;
+}
+
+/**
+ * Set up the UDP pcb, shared by the responder and the client.
+ *
+ * returns TRUE if it worked, FALSE if it failed.
+ */
+static bool ICACHE_FLASH_ATTR
+mdns_socket_open(void) {
+  if (mdns_pcb) {
+    return TRUE;
+  }
+  multicast_addr.addr = DNS_MULTICAST_ADDRESS;
+
+  mdns_payload = (u8_t *) os_malloc(DNS_MSG_SIZE);
+  if (!mdns_payload) {
+    MDNS_DBG("Alloc fail\n");
+    return FALSE;
+  }
+
+  /* initialize mDNS */
+  mdns_pcb = udp_new();
+
+  if (!mdns_pcb) {
+    goto fail;
+  }
+  /* join to the multicast address 224.0.0.251 */
+  if(wifi_get_opmode() & 0x01) {
+    struct netif *sta_netif = (struct netif *)eagle_lwip_getif(0x00);
+    if (sta_netif && sta_netif->ip_addr.addr && igmp_joingroup(&sta_netif->ip_addr, &multicast_addr) != ERR_OK) {
+      MDNS_DBG("sta udp_join_multigrup failed!\n");
+      goto fail;
+    };
+  }
+  if(wifi_get_opmode() & 0x02) {
+    struct netif *ap_netif = (struct netif *)eagle_lwip_getif(0x01);
+    if (ap_netif && ap_netif->ip_addr.addr && igmp_joingroup(&ap_netif->ip_addr, &multicast_addr) != ERR_OK) {
+      MDNS_DBG("ap udp_join_multigrup failed!\n");
+      goto fail;
+    };
+  }
+  register_flag = 1;
+  /* join to any IP address at the port 5353 */
+  if (udp_bind(mdns_pcb, IP_ADDR_ANY, DNS_MDNS_PORT) != ERR_OK) {
+	  MDNS_DBG("udp_bind failed!\n");
+	  goto fail;
+  };
+
+  /*loopback function for the multicast(224.0.0.251) messages received at port 5353*/
+  udp_recv(mdns_pcb, mdns_recv, NULL);
+  mdns_flag = 1;
+  return TRUE;
+
+fail:
+  mdns_socket_close();
+  return FALSE;
+}
+
+/* Stop answering for the current registration */
+static void
+mdns_unregister(void) {
+  os_timer_disarm(&mdns_timer);
+  mdns_flush_responses();
   mdns_free_info(ms_info);
   ms_info = NULL;
+  if (host_name_with_suffix) {
+    os_free(host_name_with_suffix);
+  }
+  host_name_with_suffix = NULL;
+  if (instance_name) {
+    os_free(instance_name);
+  }
+  instance_name = NULL;
+}
+
+/**
+ * close the UDP pcb .
+ */
+void ICACHE_FLASH_ATTR
+nodemcu_mdns_close(void)
+{
+  mdns_unregister();
+  mdns_socket_close();
+  if (mdns_cache) {
+    os_free(mdns_cache);
+  }
+  mdns_cache = NULL;
+  answer_fn = NULL;
 }
 
 static void ICACHE_FLASH_ATTR
@@ -1006,6 +1481,21 @@ mdns_set_servicename(const char *name) {
 	service_name_with_suffix = c_strdup(tmpBuf);
 }
 
+static void ICACHE_FLASH_ATTR
+mdns_set_names(const struct nodemcu_mdns_info *info) {
+	char tmpBuf[PUCK_DATASHEET_SIZE + PUCK_SERVICE_LENGTH];
+
+	c_strlcpy(tmpBuf, info->host_name, sizeof(tmpBuf));
+	c_strlcat(tmpBuf, ".", sizeof(tmpBuf));
+	c_strlcat(tmpBuf, MDNS_LOCAL, sizeof(tmpBuf));
+	host_name_with_suffix = c_strdup(tmpBuf);
+
+	c_strlcpy(tmpBuf, info->host_desc, sizeof(tmpBuf));
+	c_strlcat(tmpBuf, ".", sizeof(tmpBuf));
+	c_strlcat(tmpBuf, service_name_with_suffix, sizeof(tmpBuf));
+	instance_name = c_strdup(tmpBuf);
+}
+
 static u8_t reg_counter;
 
 static void
@@ -1015,9 +1505,9 @@ mdns_reg_handler_restart(void) {
 
 static void ICACHE_FLASH_ATTR
 mdns_reg(struct nodemcu_mdns_info *info) {
-  mdns_send_service(info,0,0,0);
+  mdns_respond(MDNS_RESP_SERVICE, 0, NULL, 0);
   if (reg_counter++ > 10) {
-    mdns_send_service_type(0,0,0);
+    mdns_respond(MDNS_RESP_SD_PTR, 0, NULL, 0);
     reg_counter = 0;
   }
 }
@@ -1058,71 +1548,38 @@ mdns_dup_info(const struct nodemcu_mdns_info *info) {
 
 /**
  * Initialize the resolver: set up the UDP pcb and configure the default server
- * (NEW IP).
+ * (NEW IP). Any previous registration is replaced.
  * 
  * returns TRUE if it worked, FALSE if it failed.
  */
 bool ICACHE_FLASH_ATTR
 nodemcu_mdns_init(struct nodemcu_mdns_info *info) {
-  /* initialize default DNS server address */
-  multicast_addr.addr = DNS_MULTICAST_ADDRESS;
-  struct ip_info ipconfig;
-  mdns_free_info(ms_info);
+  mdns_unregister();
   ms_info = mdns_dup_info(info);		// Save the passed block. We need all the data forever
 
   if (!ms_info) {
     return FALSE;
   }
 
-  if (mdns_payload) {
-    os_free(mdns_payload);
-  }
-  mdns_payload = (u8_t *) os_malloc(DNS_MSG_SIZE);
-  if (!mdns_payload) {
-    MDNS_DBG("Alloc fail\n");
-    return FALSE;
-  }
-
   LWIP_DEBUGF(DNS_DEBUG, ("dns_init: initializing\n"));
 
   mdns_set_servicename(ms_info->service_name);
+  mdns_set_names(ms_info);
+  if (!service_name_with_suffix || !host_name_with_suffix || !instance_name) {
+    mdns_unregister();
+    return FALSE;
+  }
 
   // get the host name as instrumentName_serialNumber for MDNS
   // set the name of the service, the same as host name
   MDNS_DBG("host_name = %s\n", ms_info->host_name);
   MDNS_DBG("server_name = %s\n", service_name_with_suffix);
 
-  /* initialize mDNS */
-  mdns_pcb = udp_new();
-
-  if (!mdns_pcb) {
+  if (!mdns_socket_open()) {
+    mdns_unregister();
     return FALSE;
   }
-  /* join to the multicast address 224.0.0.251 */
-  if(wifi_get_opmode() & 0x01) {
-    struct netif *sta_netif = (struct netif *)eagle_lwip_getif(0x00);
-    if (sta_netif && sta_netif->ip_addr.addr && igmp_joingroup(&sta_netif->ip_addr, &multicast_addr) != ERR_OK) {
-      MDNS_DBG("sta udp_join_multigrup failed!\n");
-      return FALSE;
-    };
-  }
-  if(wifi_get_opmode() & 0x02) {
-    struct netif *ap_netif = (struct netif *)eagle_lwip_getif(0x01);
-    if (ap_netif && ap_netif->ip_addr.addr && igmp_joingroup(&ap_netif->ip_addr, &multicast_addr) != ERR_OK) {
-      MDNS_DBG("ap udp_join_multigrup failed!\n");
-      return FALSE;
-    };
-  }
-  register_flag = 1;
-  /* join to any IP address at the port 5353 */
-  if (udp_bind(mdns_pcb, IP_ADDR_ANY, DNS_MDNS_PORT) != ERR_OK) {
-	  MDNS_DBG("udp_bind failed!\n");
-	  return FALSE;
-  };
 
-  /*loopback function for the multicast(224.0.0.251) messages received at port 5353*/
-  udp_recv(mdns_pcb, mdns_recv, ms_info);
-  mdns_flag = 1;
   /*
    * Register the name of the instrument
    */
@@ -1138,4 +1595,92 @@ nodemcu_mdns_init(struct nodemcu_mdns_info *info) {
   return TRUE;
 }
 
+/**
+ * Send a query. Known answers for shared (PTR) records are included, so
+ * that responders do not repeat what is in the cache.
+ *
+ * returns TRUE if the query was sent
+ */
+bool ICACHE_FLASH_ATTR
+nodemcu_mdns_query(const char *name, uint16 type, nodemcu_mdns_answer_fn fn) {
+  if (!mdns_cache) {
+    mdns_cache = (struct nodemcu_mdns_rr *) os_zalloc(sizeof(*mdns_cache) * MDNS_CACHE_ENTRIES);
+    if (!mdns_cache) {
+      return FALSE;
+    }
+  }
+  if (!mdns_socket_open()) {
+    return FALSE;
+  }
+  answer_fn = fn;
+
+  int len = strlen(name);
+  if (len + 2 + SIZEOF_DNS_QUERY > DNS_MSG_SIZE - SIZEOF_DNS_HDR) {
+    return FALSE;
+  }
+  struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, DNS_MSG_SIZE, PBUF_RAM);
+  if (!p) {
+    return FALSE;
+  }
+  LWIP_ASSERT("pbuf must be in one piece", p->next == NULL);
+  struct mdns_hdr *hdr = (struct mdns_hdr*) p->payload;
+  os_memset(hdr, 0, SIZEOF_DNS_HDR);
+  hdr->numquestions = htons(1);
+  char *query = (char *) copy_and_encode_name((unsigned char *) (hdr + 1), name);
+  char *query_end = (char *) p->payload + p->tot_len;
+
+  struct mdns_query qry;
+  qry.type = htons(type);
+  qry.class = htons(DNS_RRCLASS_IN);
+  MEMCPY(query, &qry, SIZEOF_DNS_QUERY);
+  query += SIZEOF_DNS_QUERY;
+
+  if (type == DNS_RRTYPE_PTR) {
+    const struct nodemcu_mdns_rr *rr = NULL;
+    u32_t now = mdns_clock();
+    u16_t nanswers = 0;
+
+    while ((rr = nodemcu_mdns_lookup(name, type, rr)) != NULL) {
+      if (rr->expires - now < rr->ttl / 2) {
+	continue;
+      }
+      if (query_end - query < 2 + SIZEOF_DNS_ANSWER + rr->len + 1) {
+	break;
+      }
+      struct mdns_answer ans;
+      ans.type = htons(DNS_RRTYPE_PTR);
+      ans.class = htons(DNS_RRCLASS_IN);
+      ans.ttl = htonl(rr->expires - now);
+      ans.len = htons(rr->len + 1);
+      *query++ = DNS_OFFSET_FLAG;
+      *query++ = DNS_DEFAULT_OFFSET;
+      MEMCPY(query, &ans, SIZEOF_DNS_ANSWER);
+      query = (char *) copy_and_encode_name((unsigned char *) query + SIZEOF_DNS_ANSWER, (const char *) rr->data);
+      nanswers++;
+    }
+    hdr->numanswers = htons(nanswers);
+  }
+
+  pbuf_realloc(p, query - ((char*) (p->payload)));
+
+  return send_packet(p, NULL, 0, NULL) == ERR_OK;
+}
+
+const struct nodemcu_mdns_rr * ICACHE_FLASH_ATTR
+nodemcu_mdns_lookup(const char *name, uint16 type, const struct nodemcu_mdns_rr *prev) {
+  const struct nodemcu_mdns_rr *rr;
+  u32_t now;
+
+  if (!mdns_cache) {
+    return NULL;
+  }
+  now = mdns_clock();
+  for (rr = prev ? prev + 1 : mdns_cache; rr < mdns_cache + MDNS_CACHE_ENTRIES; rr++) {
+    if (rr->name[0] && rr->expires > now && rr->type == type && mdns_name_equal(rr->name, name)) {
+      return rr;
+    }
+  }
+  return NULL;
+}
+
 #endif /* LWIP_MDNS */
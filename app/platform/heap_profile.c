@@ -0,0 +1,277 @@
+/*
+ * Heap allocation profiler
+ *
+ * With HEAP_PROFILE defined the os_* and c_* allocation macros route through
+ * here, and every live block is recorded in a hash table keyed by its address
+ * together with the call site (C file and line, or Lua chunk and line) that
+ * allocated it. Per site counters of live bytes, blocks, peak and number of
+ * allocations are kept in a second, small hash table.
+ *
+ * Blocks allocated elsewhere (e.g. inside the SDK libraries) and freed through
+ * here are simply passed on. Blocks allocated here and freed behind our back
+ * leave a stale entry, which is dropped once the address is handed out again.
+ */
+#include "user_config.h"
+
+#ifdef HEAP_PROFILE
+
+#include "c_types.h"
+#include "c_string.h"
+#include "mem.h"
+#include "user_interface.h"
+#include "heap_profile.h"
+
+#define BLOCK_MASK  (HEAP_PROFILE_BLOCKS - 1)
+#define SITE_MASK   (HEAP_PROFILE_SITES - 1)
+#define SITE_OTHER  HEAP_PROFILE_SITES      // charged once the site table is full
+
+// Upper limit on the number of free blocks the fragmentation scan will hold
+#define FRAG_SCAN_MAX 128
+
+typedef struct {
+  void *ptr;
+  uint32_t size : 24;
+  uint32_t site : 8;
+} block_t;
+
+typedef struct {
+  const char *key;                  // file name in flash, or Lua chunk source
+  heap_profile_site_t s;
+} site_t;
+
+static block_t blocks[HEAP_PROFILE_BLOCKS];
+static site_t sites[HEAP_PROFILE_SITES + 1] = {
+  [SITE_OTHER] = { "", { "(other)" } }
+};
+static uint32_t nblocks, nsites, untracked;
+
+static unsigned block_hash( const void *p )
+{
+  uint32_t a = (uint32_t)p >> 3;
+  return (a ^ (a >> 9)) & BLOCK_MASK;
+}
+
+// Copies the last path component, reading bytewise as the name may be in flash
+static void site_name( char *dst, const char *src )
+{
+  const char *p;
+  int i;
+
+  if (*src == '@' || *src == '=')
+    src++;
+  for (p = src; *p; p++)
+    if (*p == '/')
+      src = p + 1;
+  for (i = 0; i < HEAP_PROFILE_NAMELEN - 1 && src[i]; i++)
+    dst[i] = src[i];
+  dst[i] = 0;
+}
+
+// Note that a Lua chunk is keyed by the address of its source string, so a
+// chunk loaded into the memory of a collected one may inherit its entries.
+static unsigned site_find( const char *key, unsigned line, uint8_t lua )
+{
+  unsigned i = (((uint32_t)key >> 2) + line * 31) & SITE_MASK;
+  unsigned n;
+
+  if (line > 0xffff)
+    line = 0xffff;
+  for (n = 0; n < HEAP_PROFILE_SITES; n++, i = (i + 1) & SITE_MASK) {
+    site_t *s = &sites[i];
+    if (s->key == key && s->s.line == line)
+      return i;
+    if (!s->key) {
+      // keep one slot free so that a failing search terminates
+      if (nsites >= HEAP_PROFILE_SITES - 1)
+        break;
+      s->key = key;
+      s->s.line = line;
+      s->s.lua = lua;
+      site_name(s->s.name, key);
+      nsites++;
+      return i;
+    }
+  }
+  return SITE_OTHER;
+}
+
+// Backward shift deletion keeps the linear probe chains intact without tombstones
+static void block_remove( unsigned i )
+{
+  unsigned j = i, k;
+
+  for (;;) {
+    blocks[i].ptr = NULL;
+    for (;;) {
+      j = (j + 1) & BLOCK_MASK;
+      if (!blocks[j].ptr)
+        return;
+      k = block_hash(blocks[j].ptr);
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+        continue;   // still reachable from its home slot
+      break;
+    }
+    blocks[i] = blocks[j];
+    i = j;
+  }
+}
+
+static void untrack( void *p )
+{
+  unsigned i;
+
+  for (i = block_hash(p); blocks[i].ptr; i = (i + 1) & BLOCK_MASK) {
+    if (blocks[i].ptr == p) {
+      heap_profile_site_t *s = &sites[blocks[i].site].s;
+      s->live -= blocks[i].size;
+      s->blocks--;
+      block_remove(i);
+      nblocks--;
+      return;
+    }
+  }
+}
+
+static void track( void *p, size_t size, unsigned site )
+{
+  heap_profile_site_t *s = &sites[site].s;
+  unsigned i;
+
+  untrack(p);   // a stale entry, if the block was freed behind our back
+  s->allocs++;
+  if (nblocks >= HEAP_PROFILE_BLOCKS - 1) {
+    untracked++;
+    return;
+  }
+  for (i = block_hash(p); blocks[i].ptr; i = (i + 1) & BLOCK_MASK)
+    ;
+  blocks[i].ptr = p;
+  blocks[i].size = size;
+  blocks[i].site = site;
+  nblocks++;
+  s->live += size;
+  s->blocks++;
+  if (s->live > s->peak)
+    s->peak = s->live;
+}
+
+static void *site_realloc( void *ptr, size_t size, unsigned site, const char *file, unsigned line )
+{
+  void *p;
+
+  if (size == 0) {
+    heap_profile_free(ptr);
+    return NULL;
+  }
+  p = pvPortRealloc(ptr, size, file, line);
+  if (p) {
+    if (ptr)
+      untrack(ptr);
+    track(p, size, site);
+  }
+  return p;
+}
+
+void *heap_profile_alloc( size_t size, bool zero, const char *file, unsigned line )
+{
+  void *p = zero ? pvPortZalloc(size, file, line) : pvPortMalloc(size, file, line);
+
+  if (p)
+    track(p, size, site_find(file, line, 0));
+  return p;
+}
+
+void *heap_profile_realloc( void *ptr, size_t size, const char *file, unsigned line )
+{
+  return site_realloc(ptr, size, site_find(file, line, 0), file, line);
+}
+
+void *heap_profile_lua_realloc( void *ptr, size_t size, const char *source, unsigned line )
+{
+  return site_realloc(ptr, size, site_find(source, line, 1), "", line);
+}
+
+void heap_profile_free( void *ptr )
+{
+  if (ptr)
+    untrack(ptr);
+  vPortFree(ptr, "", 0);
+}
+
+int heap_profile_get_site( unsigned idx, heap_profile_site_t *site )
+{
+  if (idx > SITE_OTHER || !sites[idx].key || !sites[idx].s.peak)
+    return 0;
+  *site = sites[idx].s;
+  return 1;
+}
+
+void heap_profile_reset( void )
+{
+  unsigned i;
+
+  for (i = 0; i <= SITE_OTHER; i++) {
+    sites[i].s.peak = sites[i].s.live;
+    sites[i].s.allocs = 0;
+  }
+  untracked = 0;
+}
+
+// Finds the largest block that can currently be allocated, by bisection
+static uint32_t largest_block( void )
+{
+  uint32_t lo = HEAP_PROFILE_MINBLOCK, hi = system_get_free_heap_size(), mid;
+  void *p;
+
+  if (hi < lo || !(p = pvPortMalloc(lo, "", 0)))
+    return 0;
+  vPortFree(p, "", 0);
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if ((p = pvPortMalloc(mid, "", 0))) {
+      vPortFree(p, "", 0);
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+/*
+ * The SDK allocator offers no way to walk its free list, so the free blocks
+ * are enumerated by repeatedly claiming the largest one that is left. The
+ * claimed blocks are chained through their first word and released again
+ * at the end; nothing else can allocate in between as this runs in a task.
+ */
+void heap_profile_fragmentation( heap_profile_frag_t *frag )
+{
+  void *chain = NULL, *p;
+  uint32_t size, n;
+  unsigned bucket;
+
+  c_memset(frag, 0, sizeof(*frag));
+  frag->free = system_get_free_heap_size();
+  frag->tracked = nblocks;
+  frag->untracked = untracked;
+
+  while (frag->blocks < FRAG_SCAN_MAX && (size = largest_block()) != 0) {
+    if (!(p = pvPortMalloc(size, "", 0)))
+      break;
+    *(void **)p = chain;
+    chain = p;
+    if (!frag->largest)
+      frag->largest = size;
+    frag->blocks++;
+    for (bucket = 0, n = size / (2 * HEAP_PROFILE_MINBLOCK); n && bucket < HEAP_PROFILE_HIST - 1; n >>= 1)
+      bucket++;
+    frag->hist[bucket]++;
+  }
+  while (chain) {
+    p = *(void **)chain;
+    vPortFree(chain, "", 0);
+    chain = p;
+  }
+}
+
+#endif
@@ -600,6 +600,26 @@ uint32_t platform_pwm_set_duty( unsigned pin, uint32_t duty )
   return pwms_duty[pin];
 }
 
+// Set the PWM phase, i.e. the delay of the high time into the period
+uint32_t platform_pwm_set_phase( unsigned pin, uint32_t phase )
+{
+  if ( pin >= NUM_PWM || !pwm_exist(pin) )
+    return 0;
+  pwm_set_phase(DUTY(phase), pin);
+  pwm_start();
+  return NORMAL_DUTY(pwm_get_phase(pin));
+}
+
+// Fade the PWM duty, which is then reported and restored by start() as the
+// target duty
+bool platform_pwm_fade( unsigned pin, uint32_t duty, uint32_t ms, unsigned curve )
+{
+  if ( pin >= NUM_PWM || !pwm_exist(pin) )
+    return FALSE;
+  pwms_duty[pin] = duty;
+  return pwm_fade(DUTY(duty), ms, curve, pin);
+}
+
 uint32_t platform_pwm_setup( unsigned pin, uint32_t frequency, unsigned duty )
 {
   uint32_t clock;
@@ -735,8 +755,9 @@ uint32_t platform_i2c_setup( unsigned id, uint8_t sda, uint8_t scl, uint32_t spe
   platform_gpio_mode(sda, PLATFORM_GPIO_INPUT, PLATFORM_GPIO_PULLUP);   // inside this func call platform_pwm_close
   platform_gpio_mode(scl, PLATFORM_GPIO_INPUT, PLATFORM_GPIO_PULLUP);    // disable gpio interrupt first
 
+  speed = i2c_master_set_speed(speed);
   i2c_master_gpio_init(sda, scl);
-  return PLATFORM_I2C_SPEED_SLOW;
+  return speed;
 }
 
 void platform_i2c_send_start( unsigned id ){
@@ -772,6 +793,50 @@ int platform_i2c_recv_byte( unsigned id, int ack ){
   return r;
 }
 
+int platform_i2c_transfer( unsigned id, uint16_t address, const uint8_t *wdata, size_t wlen, uint8_t *rdata, size_t rlen ){
+  size_t i;
+  int ok = 1;
+
+  if (wlen > 0 || rlen == 0) {
+    platform_i2c_send_start( id );
+    ok = platform_i2c_send_address( id, address, PLATFORM_I2C_DIRECTION_TRANSMITTER );
+    for (i = 0; ok && i < wlen; i++)
+      ok = platform_i2c_send_byte( id, wdata[i] );
+  }
+  if (ok && rlen > 0) {
+    // repeated start when a write phase preceded
+    platform_i2c_send_start( id );
+    ok = platform_i2c_send_address( id, address, PLATFORM_I2C_DIRECTION_RECEIVER );
+    for (i = 0; ok && i < rlen; i++)
+      rdata[i] = platform_i2c_recv_byte( id, i < rlen - 1 );
+  }
+  platform_i2c_send_stop( id );
+
+  return ok ? PLATFORM_OK : PLATFORM_ERR;
+}
+
+int platform_i2c_read_reg( unsigned id, uint16_t address, uint8_t reg, uint8_t *data, size_t len ){
+  return platform_i2c_transfer( id, address, &reg, 1, data, len );
+}
+
+int platform_i2c_write_reg( unsigned id, uint16_t address, uint8_t reg, const uint8_t *data, size_t len ){
+  size_t i;
+  int ok;
+
+  platform_i2c_send_start( id );
+  ok = platform_i2c_send_address( id, address, PLATFORM_I2C_DIRECTION_TRANSMITTER ) &&
+       platform_i2c_send_byte( id, reg );
+  for (i = 0; ok && i < len; i++)
+    ok = platform_i2c_send_byte( id, data[i] );
+  platform_i2c_send_stop( id );
+
+  return ok ? PLATFORM_OK : PLATFORM_ERR;
+}
+
+void platform_i2c_get_stats( unsigned id, platform_i2c_stats_t *stats, int reset ){
+  i2c_master_get_stats( stats, reset );
+}
+
 // *****************************************************************************
 // SPI platform interface
 uint32_t platform_spi_setup( uint8_t id, int mode, unsigned cpol, unsigned cpha, uint32_t clock_div )
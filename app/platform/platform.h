@@ -8,6 +8,7 @@
 #include "c_types.h"
 #include "driver/pwm.h"
 #include "driver/uart.h"
+#include "driver/i2c_master.h"
 #include "task/task.h"
 
 // Error / status codes
@@ -184,6 +185,8 @@ uint32_t platform_pwm_set_clock( unsigned id, uint32_t data );
 uint32_t platform_pwm_get_clock( unsigned id );
 uint32_t platform_pwm_set_duty( unsigned id, uint32_t data );
 uint32_t platform_pwm_get_duty( unsigned id );
+uint32_t platform_pwm_set_phase( unsigned id, uint32_t phase );
+bool platform_pwm_fade( unsigned id, uint32_t duty, uint32_t ms, unsigned curve );
 
 
 // *****************************************************************************
@@ -235,7 +238,8 @@ void platform_sigma_delta_set_target( uint8_t target );
 enum
 {
   PLATFORM_I2C_SPEED_SLOW = 100000,
-  PLATFORM_I2C_SPEED_FAST = 400000
+  PLATFORM_I2C_SPEED_FAST = 400000,
+  PLATFORM_I2C_SPEED_FASTPLUS = 1000000
 };
 
 // I2C direction
@@ -256,6 +260,13 @@ void platform_i2c_send_stop( unsigned id );
 int platform_i2c_send_address( unsigned id, uint16_t address, int direction );
 int platform_i2c_send_byte( unsigned id, uint8_t data );
 int platform_i2c_recv_byte( unsigned id, int ack );
+// Complete transfer: write phase, repeated start, read phase, stop. Either phase may be empty.
+int platform_i2c_transfer( unsigned id, uint16_t address, const uint8_t *wdata, size_t wlen, uint8_t *rdata, size_t rlen );
+// Register access as used by most sensors
+int platform_i2c_read_reg( unsigned id, uint16_t address, uint8_t reg, uint8_t *data, size_t len );
+int platform_i2c_write_reg( unsigned id, uint16_t address, uint8_t reg, const uint8_t *data, size_t len );
+typedef i2c_master_stats_t platform_i2c_stats_t;
+void platform_i2c_get_stats( unsigned id, platform_i2c_stats_t *stats, int reset );
 
 // *****************************************************************************
 // Ethernet specific functions
@@ -8,4 +8,19 @@ void *pvPortRealloc (void *p, size_t n, const char *, unsigned);
 
 #include_next "mem.h"
 
+#include "heap_profile.h"
+
+#ifdef HEAP_PROFILE
+#undef os_free
+#undef os_malloc
+#undef os_zalloc
+#undef os_calloc
+#undef os_realloc
+#define os_free(p)        heap_profile_free(p)
+#define os_malloc(s)      heap_profile_alloc((s), false, HEAP_PROFILE_SITE)
+#define os_zalloc(s)      heap_profile_alloc((s), true, HEAP_PROFILE_SITE)
+#define os_calloc(l, s)   heap_profile_alloc((l) * (s), true, HEAP_PROFILE_SITE)
+#define os_realloc(p, s)  heap_profile_realloc((p), (s), HEAP_PROFILE_SITE)
+#endif
+
 #endif
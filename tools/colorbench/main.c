@@ -0,0 +1,150 @@
+#include <time.h>
+#include "color_utils.h"
+
+#define LEDS     300
+#define RUN_NS   300000000LL
+
+// The conversions as they were, with a division per channel
+static uint32_t ref_hsv2grb(uint16_t hue, uint8_t sat, uint8_t val)
+{
+  uint16_t H_accent = (hue % 360) / 60;
+  uint16_t bottom = ((255 - sat) * val)>>8;
+  uint16_t top = val;
+  uint8_t rising  = ((top-bottom)  *(hue%60   )  )  /  60  +  bottom;
+  uint8_t falling = ((top-bottom)  *(60-hue%60)  )  /  60  +  bottom;
+  uint8_t r = 0, g = 0, b = 0;
+
+  switch(H_accent) {
+  case 0: r = top;     g = rising;  b = bottom;  break;
+  case 1: r = falling; g = top;     b = bottom;  break;
+  case 2: r = bottom;  g = top;     b = rising;  break;
+  case 3: r = bottom;  g = falling; b = top;     break;
+  case 4: r = rising;  g = bottom;  b = top;     break;
+  case 5: r = top;     g = bottom;  b = falling; break;
+  }
+  return (g << 16) | (r << 8) | b;
+}
+
+static uint32_t ref_grb2hsv(uint8_t g, uint8_t r, uint8_t b)
+{
+  uint8_t m = r < g ? (r < b ? r : b) : (g < b ? g : b);
+  uint8_t M = r > g ? (r > b ? r : b) : (g > b ? g : b);
+  uint8_t delta = M - m;
+  int hue = 0, saturation = 0;
+
+  if (delta == 0) {
+    hue = -1;
+  } else {
+    int h;
+    if (r == M)
+      h = ((g-b)*60) / delta;
+    else if (g == M)
+      h = ((b-r)*60) / delta + 120;
+    else
+      h = ((r-g)*60) / delta + 240;
+    if (h < 0)
+      h += 360;
+    hue = h;
+    saturation = (256*delta-8) / M;
+  }
+  return (hue << 16) | (saturation << 8) | M;
+}
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static volatile uint32_t sink;
+static volatile uint8_t level = 128;
+
+static void report(const char *name, long long pixels, long long ns)
+{
+  printf("%-28s %8.2f Mpixels/s\n", name, pixels * 1000.0 / ns);
+}
+
+#define BENCH(name, body) do {                            \
+    long long start = now_ns(), pixels = 0, ns;           \
+    do {                                                  \
+      body;                                               \
+      pixels += LEDS;                                     \
+    } while ((ns = now_ns() - start) < RUN_NS);           \
+    report(name, pixels, ns);                             \
+  } while (0)
+
+static int check(void)
+{
+  int hue, sat, val, g, r, b, bad = 0;
+
+  for (hue = 0; hue <= 360; hue++)
+    for (sat = 0; sat < 256; sat++)
+      for (val = 0; val < 256; val++)
+        if (hsv2grb(hue, sat, val) != ref_hsv2grb(hue, sat, val))
+          bad++;
+  for (g = 0; g < 256; g++)
+    for (r = 0; r < 256; r++)
+      for (b = 0; b < 256; b++)
+        if (grb2hsv(g, r, b) != ref_grb2hsv(g, r, b))
+          bad++;
+  return bad;
+}
+
+int main(void)
+{
+  static uint8_t hsv[LEDS * 3], grb[LEDS * 3];
+  static cu_correction plain, dithered;
+  int i, bad;
+
+  if ((bad = check()) != 0) {
+    printf("%d conversions differ from the reference\n", bad);
+    return 1;
+  }
+  printf("conversions match the reference\n");
+
+  for (i = 0; i < LEDS; i++) {
+    hsv[i * 3] = i * 256 / LEDS;
+    hsv[i * 3 + 1] = 255 - i % 64;
+    hsv[i * 3 + 2] = 64 + i % 192;
+  }
+  cu_correction_init(&plain, 220, 128, 0);
+  cu_correction_init(&dithered, 220, 128, 1);
+
+  BENCH("hsv2grb (reference)", {
+    for (i = 0; i < LEDS; i++)
+      sink += ref_hsv2grb(hsv[i * 3] * 45 >> 5, hsv[i * 3 + 1], hsv[i * 3 + 2]);
+  });
+  BENCH("hsv2grb", {
+    for (i = 0; i < LEDS; i++)
+      sink += hsv2grb(hsv[i * 3] * 45 >> 5, hsv[i * 3 + 1], hsv[i * 3 + 2]);
+  });
+  BENCH("hsv2grb_buffer", {
+    hsv2grb_buffer(grb, 3, hsv, LEDS);
+    sink += grb[0];
+  });
+  BENCH("grb2hsv (reference)", {
+    for (i = 0; i < LEDS; i++)
+      sink += ref_grb2hsv(hsv[i * 3], hsv[i * 3 + 1], hsv[i * 3 + 2]);
+  });
+  BENCH("grb2hsv", {
+    for (i = 0; i < LEDS; i++)
+      sink += grb2hsv(hsv[i * 3], hsv[i * 3 + 1], hsv[i * 3 + 2]);
+  });
+  BENCH("brightness (divide)", {
+    uint8_t brightness = level;
+    for (i = 0; i < LEDS * 3; i++)
+      grb[i] = hsv[i] * brightness / 255;
+    sink += grb[0];
+  });
+  BENCH("cu_correct", {
+    cu_correct(&plain, grb, hsv, LEDS, 3);
+    sink += grb[0];
+  });
+  BENCH("cu_correct (dithered)", {
+    cu_correct(&dithered, grb, hsv, LEDS, 3);
+    sink += grb[0];
+  });
+
+  return 0;
+}